@@ -13,9 +13,25 @@
 #define ASSET_INDEXER_QUEUE_NAME "cbird_asset_indexer_queue"
 #define ASSET_INDEX_WORKER_QUEUE_NAME "cbird_asset_index_worker_queue"
 
+// How far loading images may run ahead of indexing them.  At most this many images, holding
+// at most this many bytes of decoded pixels between them, are in the engine at once.
+#define ASSET_INDEX_MAX_IN_FLIGHT 4
+#define ASSET_INDEX_BYTE_BUDGET (128 * 1024 * 1024)
+
+// Number of assets to check for existing documents in one trip to the engine.
+#define ASSET_INDEX_LOOKUP_BATCH 256
+
 @implementation PhotoIndexer
 {
     NSOperationQueue * m_indexOpQueue;
+    CBIRIngestQueue * m_ingestQueue;
+    
+    // The producer waits on this while paused.
+    NSCondition * m_pauseCondition;
+    BOOL m_paused;
+    
+    // Guarded by @synchronized(self), completions report progress from the engine's threads.
+    CGFloat m_progress;
 }
 
 @synthesize delegate = _delegate;
@@ -30,35 +46,56 @@
         m_indexOpQueue = [[NSOperationQueue alloc] init];
         m_indexOpQueue.maxConcurrentOperationCount = 1;
         m_indexOpQueue.underlyingQueue = index_queue;
+        m_ingestQueue = [[CBIRIngestQueue alloc] initWithMaxDepth:ASSET_INDEX_MAX_IN_FLIGHT byteBudget:ASSET_INDEX_BYTE_BUDGET];
+        m_pauseCondition = [[NSCondition alloc] init];
     }
     return self;
 }
 
 -(BOOL)isRunning
 {
-    return !m_indexOpQueue.suspended;
+    [m_pauseCondition lock];
+    BOOL paused = m_paused;
+    [m_pauseCondition unlock];
+    return !paused;
 }
 
 -(void)pause
 {
+    [m_pauseCondition lock];
+    m_paused = YES;
+    [m_pauseCondition unlock];
     [m_indexOpQueue setSuspended:YES];
 }
 
 -(void)resume
 {
+    [m_pauseCondition lock];
+    m_paused = NO;
+    [m_pauseCondition broadcast];
+    [m_pauseCondition unlock];
     m_indexOpQueue.suspended = NO;
 }
 
+-(void)waitWhilePaused
+{
+    [m_pauseCondition lock];
+    while ( m_paused ) {
+        [m_pauseCondition wait];
+    }
+    [m_pauseCondition unlock];
+}
+
 -(void) dealloc
 {
     [m_indexOpQueue cancelAllOperations];
+    [self resume];
     [m_indexOpQueue waitUntilAllOperationsAreFinished];
+    [m_ingestQueue waitUntilEmpty];
 }
 
 -(void)fetchAndIndexAssetsWithOptions:(nullable PHFetchOptions *)options
 {
-    
-    __block id<PhotoIndexerDelegate> blockDelegate = self.delegate;
     if ( !options ) {
         options = [PHFetchOptions new];
     }
@@ -69,103 +106,154 @@
     PHFetchResult<PHAsset *> * result = [PHAsset fetchAssetsWithOptions:options];
     
     // Start the progress at 10% just to get started.
-    __block CGFloat progress = 0.10;
-    [blockDelegate progressUpdated:progress filteredImage:nil];
+    @synchronized ( self ) {
+        m_progress = 0.10;
+    }
+    [self.delegate progressUpdated:0.10 filteredImage:nil];
     
     // Determine how much is left to get to 100% and the percentage of
     // completion for each document (progressStep).
     NSUInteger total = result.count;
-    CGFloat progressLeft = 1.0 - progress;
+    CGFloat progressLeft = 1.0 - 0.10;
     CGFloat progressStep = progressLeft / total;
     
-    for ( NSUInteger i = 0; i < total; i++ ) {
+    // A single producer walks the library, loading images and handing them to the ingest queue, which blocks
+    // it whenever the engine falls behind.  Nothing is queued up front, however big the library is.
+    NSBlockOperation * producer = [[NSBlockOperation alloc] init];
+    __weak NSBlockOperation * weakProducer = producer;
+    
+    [producer addExecutionBlock:^{
+        
+        for ( NSUInteger first = 0; first < total && !weakProducer.isCancelled; first += ASSET_INDEX_LOOKUP_BATCH ) {
+            @autoreleasepool {
+                
+                NSRange range = NSMakeRange(first, MIN(ASSET_INDEX_LOOKUP_BATCH, total - first));
+                NSArray<PHAsset *> * assets = [result objectsAtIndexes:[NSIndexSet indexSetWithIndexesInRange:range]];
+                
+                // Find out which assets are already indexed in one trip to the engine, rather than one per asset.
+                NSMutableArray<NSString *> * localIDs = [[NSMutableArray alloc] initWithCapacity:assets.count];
+                for ( PHAsset * asset in assets ) {
+                    [localIDs addObject:asset.localIdentifier];
+                }
+                NSDictionary<NSString *, CBLDocument *> * existing = [[CBIRDatabaseEngine sharedEngine] getDocuments:localIDs];
+                
+                for ( PHAsset * asset in assets ) {
+                    
+                    [self waitWhilePaused];
+                    if ( weakProducer.isCancelled ) {
+                        break;
+                    }
+                    
+                    // TODO: Change logic to check if this object is indexed.
+                    BOOL exists = (existing[asset.localIdentifier] != nil);
+                    
+                    if ( exists ) {
+                        [self advanceProgress:progressStep filteredImage:nil];
+                    } else {
+                        [self indexAsset:asset progressStep:progressStep];
+                    }
+                }
+            }
+        }
+    }];
+    
+    [m_indexOpQueue addOperation:producer];
+}
 
-        void (^indexBlock)(void) = ^void() {
-            
-            PHAsset * asset = [result objectAtIndex:i];
+-(void)indexAsset:(PHAsset *)asset progressStep:(CGFloat)progressStep
+{
+    __block BOOL submitted = NO;
+    
+    // The indexing process runs on an anonymous GCD queue on an unknown background thread, which
+    // does use an auto release pool.  However, since we're loading potentially many images, each
+    // fairly large, will not return back to the GCD runloop in order such that the pool will be
+    // drained.  This explicit usage of an auto release pool ensures clean up of image objects
+    // as soon as we're done indexing each one.  See Apple's documentation memory management with
+    // GCD queues for more information.
+    // https://developer.apple.com/library/ios/documentation/General/Conceptual/ConcurrencyProgrammingGuide/OperationQueues/OperationQueues.html
+    @autoreleasepool
+    {
+        
+        CGSize size;
+        size.width = asset.pixelWidth;
+        size.height = asset.pixelHeight;
+        
+        // Extract the local asset ID to name the document with.
+        NSString * localID = asset.localIdentifier;
+        
+        PHImageManagerDataResponseHandler imageDataCallback = ^void(NSData *imageData, NSString *dataUTI, UIImageOrientation orientation, NSDictionary *info)
+        {
+            NSError * error = info[PHImageErrorKey];
             
-            // TODO: Change logic to check if this object is indexed.
-            BOOL exists = ([[CBIRDatabaseEngine sharedEngine] getDocument:asset.localIdentifier] != nil);
-            __block CBIRIndexResult * indexResult = nil;
+            if ( error ) {
+                NSLog(@"imageData callback. error: %@", error);
+                return;
+            }
             
-            if ( !exists )
-            {
-                // The indexing process runs on an anonymous GCD queue on an unknown background thread, which
-                // does use an auto release pool.  However, since we're loading potentially many images, each
-                // fairly large, will not return back to the GCD runloop in order such that the pool will be
-                // drained.  This explicit usage of an auto release pool ensures clean up of image objects
-                // as soon as we're done indexing each one.  See Apple's documentation memory management with
-                // GCD queues for more information.
-                // https://developer.apple.com/library/ios/documentation/General/Conceptual/ConcurrencyProgrammingGuide/OperationQueues/OperationQueues.html
-                @autoreleasepool
-                {
-                    
-                    CGSize size;
-                    size.width = asset.pixelWidth;
-                    size.height = asset.pixelHeight;
+            if ( imageData ) {
+                
+                CIImage * img = [self writeAssetToTmp:asset date:imageData];
+                
+                if ( img ) {
+                
+                    // Add it to a new document object.
+                    // TODO: Change this CBIRDocument class to something that makes more sense.
+                    // For instance, something that can be used for output as well as input.
+                    // Consider it CBIRDatabaseTransaction <- IndexImageTransaction.
+                    // The goal is to have a common method to represent persistent ID's.
+                    CBIRDocument * doc = [[CBIRDocument alloc] initWithCIImage:img persistentID:localID type:PH_ASSET];
                     
-                    // Extract the local asset ID to name the document with.
-                    NSString * localID = asset.localIdentifier;
+                    // Index it.  Don't wait for it, move on to loading the next image unless the queue is full.
+                    // The decoded pixels are what the image will cost while it's in flight.
+                    NSUInteger cost = (NSUInteger)(size.width * size.height * 4);
                     
-                    PHImageManagerDataResponseHandler imageDataCallback = ^void(NSData *imageData, NSString *dataUTI, UIImageOrientation orientation, NSDictionary *info)
-                    {
-                        NSError * error = info[PHImageErrorKey];
+                    NSDate * before = [NSDate date];
+                    [m_ingestQueue addDocument:doc cost:cost completion:^(CBIRIndexResult * indexResult) {
                         
-                        if ( error ) {
-                            NSLog(@"imageData callback. error: %@", error);
-                            return;
-                        }
+                        NSDate * after = [NSDate date];
+                        NSLog(@"indexing time: %f s", after.timeIntervalSince1970 - before.timeIntervalSince1970);
                         
-                        if ( imageData ) {
-                            
-                            CIImage * img = [self writeAssetToTmp:asset date:imageData];
-                            
-                            if ( img ) {
-                            
-                                // Add it to a new document object.
-                                // TODO: Change this CBIRDocument class to something that makes more sense.
-                                // For instance, something that can be used for output as well as input.
-                                // Consider it CBIRDatabaseTransaction <- IndexImageTransaction.
-                                // The goal is to have a common method to represent persistent ID's.
-                                CBIRDocument * doc = [[CBIRDocument alloc] initWithCIImage:img persistentID:localID type:PH_ASSET];
-                                
-                                // Index it.
-                                NSDate * before = [NSDate date];
-                                [[CBIRDatabaseEngine sharedEngine] indexImage:doc];
-
-                                NSDate * after = [NSDate date];
-                                NSLog(@"indexing time: %f s", after.timeIntervalSince1970 - before.timeIntervalSince1970);
-                                
-                                // remove the temporary file that we wrote.
-                                NSError * err = nil;
-                                BOOL removed = [[NSFileManager defaultManager] removeItemAtURL:img.url error:&err];
-                                if ( !removed ) {
-                                    NSLog(@"remove fails: %@", err);
-                                }
-                            }
+                        // remove the temporary file that we wrote.
+                        NSError * err = nil;
+                        BOOL removed = [[NSFileManager defaultManager] removeItemAtURL:img.url error:&err];
+                        if ( !removed ) {
+                            NSLog(@"remove fails: %@", err);
                         }
                         
-                    };
-                    
-                    // Retrieve the image data using a synchronous callback that won't hit the network.
-                    PHImageRequestOptions * opts = [[PHImageRequestOptions alloc] init];
-                    opts.synchronous = YES;
-                    opts.networkAccessAllowed = NO;
+                        // We should also pass an update state to the communicate
+                        // failure or completion of the indexer process.
+                        [self advanceProgress:progressStep filteredImage:indexResult.filteredImage];
+                        NSLog(@"processing complete.");
+                    }];
                     
-                    [[PHImageManager defaultManager] requestImageDataForAsset:asset options:opts resultHandler:imageDataCallback];
+                    submitted = YES;
                 }
-                
             }
             
-            // We should also pass an update state to the communicate
-            // failure or completion of the indexer process.
-            [self.delegate progressUpdated:(progress += progressStep) filteredImage:indexResult.filteredImage];
-            NSLog(@"processing complete.");
         };
         
-        [m_indexOpQueue addOperationWithBlock:indexBlock];
+        // Retrieve the image data using a synchronous callback that won't hit the network.
+        PHImageRequestOptions * opts = [[PHImageRequestOptions alloc] init];
+        opts.synchronous = YES;
+        opts.networkAccessAllowed = NO;
+        
+        [[PHImageManager defaultManager] requestImageDataForAsset:asset options:opts resultHandler:imageDataCallback];
+    }
+    
+    // Assets that couldn't be loaded still count towards the progress.
+    if ( !submitted ) {
+        [self advanceProgress:progressStep filteredImage:nil];
+    }
+}
+
+-(void)advanceProgress:(CGFloat)progressStep filteredImage:(UIImage *)filteredImage
+{
+    CGFloat progress = 0;
+    @synchronized ( self ) {
+        progress = (m_progress += progressStep);
     }
     
+    [self.delegate progressUpdated:progress filteredImage:filteredImage];
 }
 
 // Copy the image from the private storage into temporary storage.
@@ -149,6 +149,9 @@
                                          withFeature:feature
                                          andDelegate:self];
     
+    // Show each photo once, even when several of its faces match.
+    m_faceQuery.distinctImages = YES;
+    
     [[CBIRDatabaseEngine sharedEngine] execQuery:m_faceQuery];
 }
 
@@ -166,8 +169,11 @@
             // Load some images from the results.
             for ( NSUInteger i = 0; i < 10; i++ ) {
                 FaceDataResult * result = [m_faceQuery dequeueResult];
-                if ( result ) {
-                    [m_faceResultImages addObject:[UIImage imageWithData:result.faceJPEGData]];
+                
+                // The face crop is only read from the database here, for the results we actually show.
+                UIImage * faceImage = [UIImage imageWithData:result.faceJPEGData];
+                if ( faceImage ) {
+                    [m_faceResultImages addObject:faceImage];
                 }
             }
             
@@ -179,6 +185,29 @@
     });
 }
 
+-(void)resultsUpdated:(NSArray *)results progress:(float)progress
+{
+    // Read the face crops here, on the query's thread, so that the main queue only has to show them.
+    NSMutableArray * images = [[NSMutableArray alloc] init];
+    for ( FaceDataResult * result in results ) {
+        UIImage * faceImage = [UIImage imageWithData:result.faceJPEGData];
+        if ( faceImage ) {
+            [images addObject:faceImage];
+        }
+    }
+    
+    dispatch_async(dispatch_get_main_queue(), ^{
+        
+        NSLog(@"resultsUpdated: %lu results, %.0f%% searched", (unsigned long)images.count, progress * 100);
+        
+        // The final results replace these when the query completes.
+        if ( m_faceQuery.isRunning ) {
+            m_faceResultImages = images;
+            [self.collectionView reloadData];
+        }
+    });
+}
+
 - (NSInteger)collectionView:(UICollectionView *)collectionView numberOfItemsInSection:(NSInteger)section
 {
     if ( section == 0 ) {
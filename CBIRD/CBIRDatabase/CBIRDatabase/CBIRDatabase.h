@@ -18,6 +18,7 @@ FOUNDATION_EXPORT const unsigned char CBIRDatabaseVersionString[];
 #import "CBIRDatabaseEngine.h"
 #import "CBIRIndexer.h"
 #import "CBIRDocument.h"
+#import "CBIRIngestQueue.h"
 #import "CBIRQuery.h"
 #import "ImageUtil.h"
 #import "CBIRQueryDelegate.h"
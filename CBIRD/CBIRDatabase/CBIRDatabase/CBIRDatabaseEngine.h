@@ -34,20 +34,54 @@
 // shutdown.  If called subsequently, false will be returned.
 +(BOOL) shutdown;
 
-// Index in all available images.
+// Most of the methods below come in two flavours.  The plain ones block the caller until the engine thread
+// has done the work.  The ones taking a completion handler return right away, so that callers can pipeline
+// their requests.  Completion handlers are called on one of the engine's worker threads, never on the
+// engine thread itself, so they're free to call back into the engine.  Only indexImage's may be nil.
+
+// Index in all available images.  The result tells whether the features were saved.
 -(CBIRIndexResult *)indexImage:(CBIRDocument *)imgDoc;
 
+-(void)indexImage:(CBIRDocument *)imgDoc completion:(void (^)(CBIRIndexResult * result))completion;
+
 // Register the indexer object according to its name.
 -(void)registerIndexer:(CBIRIndexer *)indexer;
 
 -(CBLDocument *)getDocument:(NSString *)persistentID;
 
+-(void)getDocument:(NSString *)persistentID completion:(void (^)(CBLDocument * document))completion;
+
+// Looks up many documents in a single trip to the engine thread.  Documents that don't exist are left out.
+-(NSDictionary<NSString *, CBLDocument *> *)getDocuments:(NSArray<NSString *> *)persistentIDs;
+
+-(void)getDocuments:(NSArray<NSString *> *)persistentIDs completion:(void (^)(NSDictionary<NSString *, CBLDocument *> * documents))completion;
+
 -(CBLDocument *)newDocument:(NSString *)newDocID;
 
+-(void)newDocument:(NSString *)newDocID completion:(void (^)(CBLDocument * document))completion;
+
+// Reads the content of the named attachment from the current revision of the given document.
+// Returns nil if either the document or the attachment doesn't exist.
+-(NSData *)getAttachment:(NSString *)attachmentName forDocument:(NSString *)persistentID;
+
 -(CBLQuery *) createAllDocsQuery;
 
+-(void) createAllDocsQueryWithCompletion:(void (^)(CBLQuery * query))completion;
+
+// Creates a query over the face index view, which holds one compact row per indexed face.
+// See kCBIRFaceIndexViewName for the row layout.
+-(CBLQuery *) createFaceIndexQuery;
+
 -(const CBIRIndexer * )getIndexer:(NSString *)indexerName;
 
+-(void)getIndexer:(NSString *)indexerName completion:(void (^)(const CBIRIndexer * indexer))completion;
+
+
+// The stored faces grouped by who they appear to be, as cluster label (NSNumber) to an NSArray of face IDs
+// (see FaceDataResult faceUUID).  A cluster keeps its label as faces are added and across launches.  The
+// clusters are kept up to date in the background, so faces indexed very recently may not be in any yet.
+// Can be called from any thread, doesn't touch the engine thread.
+-(NSDictionary *)faceClusters;
 
 // Asynchronously runs the given CBIRQuery object.  CBIRQuery shall provide asynchronous callback mechanisms.
 -(void)execQuery:(CBIRQuery *)query;
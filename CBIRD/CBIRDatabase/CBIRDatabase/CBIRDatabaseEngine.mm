@@ -0,0 +1,1323 @@
+//
+//  CBIRDatabaseEngine.m
+//  CBIRDatabase
+//
+//  Created by Joseph Carson on 9/29/15.
+//  Copyright © 2015 Joseph Carson. All rights reserved.
+//
+
+#import "CBIRDatabaseEngine.h"
+#import "CBIRDatabaseEngine_Private.h"
+#import "CBIRDocument.h"
+#import "CBIRIndexer.h"
+#import "CBIRQuery.h"
+#import "FaceIndexer.h"
+
+#import <CouchbaseLite/CouchbaseLite.h>
+
+#include <float.h>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include "FaceClusters.hpp"
+#include "FaceDescriptor.hpp"
+
+#define CBIRD_ENGINE_QUEUE_NAME "cbird_db_engine_queue"
+#define CBIR_IMAGE_DB_NAME @"cbird_image_db"
+#define CBIR_FACE_GALLERY_SNAPSHOT_NAME @"cbird_image_db.gallery"
+#define CBIR_FACE_CLUSTERS_NAME @"cbird_image_db.clusters"
+#define CBIR_FACE_GRAPH_NAME @"cbird_image_db.graph"
+#define CBIR_FACE_INDEX_NAME @"cbird_image_db.hnsw"
+
+// The face index's links per face and how hard it looks, see HnswParams.  Changing CBIR_FACE_INDEX_M throws the
+// saved index away, the other two can be changed freely.
+#define CBIR_FACE_INDEX_M 16
+#define CBIR_FACE_INDEX_EF_CONSTRUCTION 100
+#define CBIR_FACE_INDEX_EF_SEARCH 64
+
+// The face index and neighbour graph are saved with the gallery snapshot.  Save them all once this many faces have
+// gone into the index since the last save, so that a long catch-up isn't lost when no images change after it.  Also
+// saved when the engine shuts down.
+#define CBIR_FACE_INDEX_SAVE_INTERVAL 256
+
+#define CBIR_FACE_IVF_NAME @"cbird_image_db.ivf"
+
+// The IVF index is trained once there are this many live faces, any fewer are quicker to scan.  It's trained again
+// each time the live faces grow by this factor, as by then its lists hold too many to be quick to probe.  Training
+// that comes up with nothing isn't tried again until the live faces have grown by the same factor.
+#define CBIR_FACE_IVF_MIN_TRAINING_FACES 1024
+#define CBIR_FACE_IVF_RETRAIN_GROWTH 4
+
+// Two faces are linked into the same cluster when each is among the other's nearest this many neighbours.
+// The distance cap is off for now, rank alone keeps clusters tight.  Tune it once there's real data to go on.
+#define CBIR_FACE_CLUSTER_LINK_RANK 5
+#define CBIR_FACE_CLUSTER_LINK_DISTANCE FLT_MAX
+
+// Save the cluster labels once they've caught up with this many more database sequences.  They're also saved when
+// the engine shuts down.
+#define CBIR_FACE_CLUSTERS_SAVE_INTERVAL 64
+
+// Save the gallery snapshot after this many changed images.  It's also saved when the engine shuts down.
+#define CBIR_FACE_GALLERY_SAVE_INTERVAL 64
+
+// Compact the gallery once at least this many of its faces, and this percentage of them, have been removed.
+#define CBIR_FACE_GALLERY_COMPACT_MIN_REMOVED 256
+#define CBIR_FACE_GALLERY_COMPACT_PERCENT 25
+
+
+static const NSString * const kCBLOutputDocument = @"outputDocument";
+static const NSString * const kCBLOutputData = @"outputData";
+static const NSString * const kCBLAttachmentName = @"attachmentName";
+static const NSString * const kCBIRPersistentID = @"persistentID";
+static const NSString * const kCBIRIndexerName = @"indexerName";
+static const NSString * const kCBIRIndexer = @"indexer";
+static const NSString * const kCBIRIndexers = @"indexers";
+static const NSString * const kCBIRDocumentKey = @"document";
+static const NSString * const kCBIRFeatures = @"features";
+static const NSString * const kCBIRIndexResult = @"indexResult";
+static const NSString * const kCBIRPersistentIDs = @"persistentIDs";
+static const NSString * const kCBLOutputDocuments = @"outputDocuments";
+static const NSString * const kCBLQuery = @"cbl_query";
+static const NSString * const kCBLDBName = @"cbl_db_name";
+
+
+@interface CBIRDatabaseEngine(Private)
+
+-(instancetype)initPrivate;
+
+-(CBLDatabase *)databaseForName:(NSString *)name;
+
+@end
+
+CBIRDatabaseEngine * _singletonEngine;
+
+@implementation CBIRDatabaseEngine
+{
+    // All registered indexers.  An immutable NSDictionary, retained, which is swapped for a new one on every
+    // registration so that lookups from any thread are a plain load.
+    std::atomic<const void *> m_indexers;
+    
+    // Snapshots replaced by later registrations.  Kept alive for readers that may still be using them.
+    NSMutableArray * m_retiredIndexers;
+    
+    // Manager for CBL.  Don't use sharedInstance as
+    // it's only recommended to be used on the main thread.
+    CBLManager * m_cblManager;
+    
+    // Thread for database transactions.
+    NSThread * m_dbThread;
+    
+    // Signalled by m_dbThread just before it exits.
+    dispatch_semaphore_t m_dbThreadExited;
+    
+    // Whether m_dbThread takes requests, and how many it has taken but not yet run.  It stops taking them once
+    // terminated, and runs the ones it has before it exits, so that nobody waits on it forever.  Guarded by
+    // m_requestsMutex.
+    std::mutex m_requestsMutex;
+    BOOL m_acceptingRequests;
+    NSUInteger m_takenRequests;
+    
+    // View emitting one row per indexed face.  Only touched on m_dbThread.
+    CBLView * m_faceIndexView;
+    
+    // All indexed faces, ready to be searched.  Only written on m_dbThread, queries read its snapshots from anywhere.
+    cbir::FaceGallery m_faceGallery;
+    
+    // Set once the gallery has been loaded or built at startup.
+    std::atomic<bool> m_faceGalleryReady;
+    
+    // Number of images changed in the gallery since its snapshot was last saved.
+    NSUInteger m_faceGalleryUnsavedChanges;
+    
+    // Runs feature extraction, query evaluation and scoring across all cores.  Database mutations
+    // don't go here, they stay on m_dbThread so that they happen in order.
+    cbir::TaskScheduler m_scheduler;
+    
+    // Recent face searches, so that repeating one doesn't rescan the gallery.
+    cbir::FaceSearchCache m_faceSearchCache;
+    
+    // The nearest neighbours of every face, kept up to date in the background.
+    cbir::FaceNeighborGraph m_faceNeighborGraph;
+    
+    // Who the faces belong to, worked out from the graph after each of its updates.
+    cbir::FaceClusters m_faceClusters;
+    
+    // The sequence of the labels when they were last saved.  Only touched at startup, by the background update,
+    // and by join once that's done.
+    int64_t m_faceClustersSavedSequence;
+    
+    // Finds the candidates for a face query without scanning the gallery.  Kept up to date along with the graph.
+    std::unique_ptr<cbir::FaceHnswIndex> m_faceIndex;
+    
+    // The size of the face index when it was last saved.  Written on the engine thread, read by the background update.
+    std::atomic<size_t> m_faceIndexSavedSize;
+    
+    // The inverted file over the faces, for queries that probe it.  Rows go in as they're appended to the gallery,
+    // on the engine thread, and so does what training comes up with.
+    cbir::FaceIvfIndex m_faceIvfIndex;
+    
+    // Whether the IVF index is being trained, and how many times it's been cleared, so that training started on a
+    // gallery that's since been rebuilt is thrown away.  Engine thread only.
+    BOOL m_faceIvfTraining;
+    NSUInteger m_faceIvfGeneration;
+    
+    // The number of live faces when training last came up with nothing, so that it isn't retried straight away.
+    // Engine thread only.
+    size_t m_faceIvfFailedSize;
+    
+    // Whether a background update of the graph and index is running, and whether the gallery has changed since it started.
+    std::atomic<bool> m_faceIndexesUpdating;
+    std::atomic<bool> m_faceIndexesDirty;
+}
+
+- (BOOL)isRunning
+{
+    return m_dbThread.executing;
+}
+
+- (BOOL)isTerminated
+{
+    return m_dbThread.cancelled;
+}
+
++(instancetype) sharedEngine
+{
+    static dispatch_once_t once;
+    dispatch_once(&once, ^{
+        _singletonEngine = [[CBIRDatabaseEngine alloc] initPrivate];
+    });
+    
+    return _singletonEngine;
+}
+
++(BOOL) shutdown
+{
+    __block BOOL shutdownSuccess = NO;
+    if ( _singletonEngine ) {
+        static dispatch_once_t shutdownOnce;
+        dispatch_once(&shutdownOnce, ^{
+            // Blocks until the engine thread and the scheduler are done.
+            [_singletonEngine join];
+            NSLog(@"CBIRDatabaseEngine thread termination complete.");
+            
+            // Now forget the singleton instance.
+            // The dealloc call will also set the
+            _singletonEngine = nil;
+            shutdownSuccess = YES;
+            
+            NSLog(@"CBIRDatabaseEngine shutdown complete.");
+        });
+    } else {
+        NSLog(@"CBIRDatabaseEngine shutdown called, but singleton doesn't exist.");
+    }
+    
+    return shutdownSuccess;
+}
+
+/**
+ * Designated Initializer is NOT supported.
+ */
+-(instancetype)init
+{
+    [self doesNotRecognizeSelector:_cmd];
+    return nil;
+}
+
+-(instancetype)initPrivate
+{
+    self = [super init];
+    
+    if ( self ) {
+        
+        NSLog(@"initPrivate!!");
+        m_dbThreadExited = dispatch_semaphore_create(0);
+        m_acceptingRequests = YES;
+        m_takenRequests = 0;
+        m_faceGalleryReady = false;
+        m_faceIndexesUpdating = false;
+        m_faceIndexesDirty = false;
+        
+        cbir::HnswParams indexParams;
+        indexParams.m = CBIR_FACE_INDEX_M;
+        indexParams.efConstruction = CBIR_FACE_INDEX_EF_CONSTRUCTION;
+        indexParams.efSearch = CBIR_FACE_INDEX_EF_SEARCH;
+        m_faceIndex.reset(new cbir::FaceHnswIndex(indexParams));
+        m_faceIndexSavedSize = 0;
+        m_faceIvfTraining = NO;
+        m_faceIvfGeneration = 0;
+        m_faceIvfFailedSize = 0;
+        m_faceClustersSavedSequence = 0;
+        
+        // Add all built in supported indexers.
+        m_indexers = NULL;
+        m_retiredIndexers = [[NSMutableArray alloc] init];
+        [self initBuiltinIndexers];
+        
+        m_dbThread = [[NSThread alloc] initWithTarget:self selector:@selector(dBThread) object:nil];
+        [m_dbThread start];
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    NSLog(@"CBIRDatabaseEngine dealloc: terminating engine thread.");
+    [CBIRDatabaseEngine shutdown];
+    
+    const void * indexers = m_indexers.load();
+    if ( indexers ) {
+        CFRelease(indexers);
+    }
+}
+
+- (void) terminate
+{
+    NSLog(@"CBIRDatabaseEngine thread terminated set.");
+    {
+        std::lock_guard<std::mutex> lock(m_requestsMutex);
+        m_acceptingRequests = NO;
+    }
+    [m_dbThread cancel];
+    
+    // The engine thread sleeps until it's given something to do, so give it something.
+    if ( !m_dbThread.finished ) {
+        [self performSelector:@selector(wakeUp) onThread:m_dbThread withObject:nil waitUntilDone:NO];
+    }
+}
+
+-(void)wakeUp
+{
+    // Nothing to do, just makes the engine thread's run loop return so that it sees it's been cancelled.
+}
+
+// Counts a request in, unless the engine thread has stopped taking them.
+-(BOOL)takeRequest
+{
+    std::lock_guard<std::mutex> lock(m_requestsMutex);
+    if ( !m_acceptingRequests ) {
+        NSLog(@"CBIRDatabaseEngine: request refused, the engine thread has stopped.");
+        return NO;
+    }
+    m_takenRequests++;
+    return YES;
+}
+
+-(void)requestDone
+{
+    std::lock_guard<std::mutex> lock(m_requestsMutex);
+    m_takenRequests--;
+}
+
+-(NSUInteger)takenRequests
+{
+    std::lock_guard<std::mutex> lock(m_requestsMutex);
+    return m_takenRequests;
+}
+
+// Queues the block on the engine thread without waiting for it.  Requests run in the order they're queued.
+// Returns NO, without queueing it, once the engine thread has stopped taking requests.
+-(BOOL)performOnEngineThread:(dispatch_block_t)block
+{
+    if ( ![self takeRequest] ) {
+        return NO;
+    }
+    [self performSelector:@selector(runBlock:) onThread:m_dbThread withObject:block waitUntilDone:NO];
+    return YES;
+}
+
+-(void)runBlock:(dispatch_block_t)block
+{
+    block();
+    [self requestDone];
+}
+
+// Runs the selector on the engine thread and waits for it.  Returns NO, without running it, once the engine
+// thread has stopped taking requests, because it failed to start or is shutting down.
+-(BOOL)performOnEngineThreadAndWait:(SEL)selector withObject:(id)object
+{
+    // On the engine thread itself it's just a call, which is fine right up until the thread exits.
+    if ( [NSThread currentThread] == m_dbThread ) {
+        [self performSelector:selector onThread:m_dbThread withObject:object waitUntilDone:YES];
+        return YES;
+    }
+    
+    if ( ![self takeRequest] ) {
+        return NO;
+    }
+    [self performSelector:selector onThread:m_dbThread withObject:object waitUntilDone:YES];
+    [self requestDone];
+    return YES;
+}
+
+// Calls a completion handler on the scheduler, so that a slow handler never holds up the engine thread.
+-(void)complete:(dispatch_block_t)handler
+{
+    if ( handler ) {
+        m_scheduler.submit([handler]() {
+            @autoreleasepool {
+                handler();
+            }
+        });
+    }
+}
+
+// Terminates the engine and waits for it to finish.
+-(void)join
+{
+    // The graph and indexes can be caught up with next time, there's no point waiting on them.
+    m_faceNeighborGraph.stop();
+    m_faceIndex->stop();
+    m_faceIvfIndex.stop();
+    
+    // Stop taking requests, and let the engine thread finish the ones it has.  Scheduler tasks that still need
+    // it from here on are refused, and complete with a failure instead.
+    [self terminate];
+    
+    if ( [NSThread currentThread] != m_dbThread ) {
+        dispatch_semaphore_wait(m_dbThreadExited, DISPATCH_TIME_FOREVER);
+    }
+    
+    // Only now drain the scheduler, the engine thread hands it completion handlers up to the end.  Anything
+    // submitted after this runs right away.
+    m_scheduler.shutdown();
+    
+    // The background update is done with the labels by now, so whatever it hasn't saved yet can be.
+    if ( m_faceClusters.sequence() != m_faceClustersSavedSequence ) {
+        [self saveFaceClusters];
+    }
+}
+
+- (void)dBThread
+{
+    // Set up couchbase lite manager.
+    NSError * error = nil;
+    m_cblManager = [[CBLManager alloc] initWithDirectory:CBLManager.defaultDirectory options:nil error:&error];
+    
+    if ( error ) {
+        NSLog(@"CBIRDatabaseEngine: CBLManager instantiation failure: %@", error);
+        [self terminate];
+    } else {
+        // Map in the face gallery snapshot now so that the first query doesn't have to wait for it.
+        // From then on, it's kept up to date with the database changes as they happen.
+        [self loadFaceGallery];
+        [[NSNotificationCenter defaultCenter] addObserver:self
+                                                 selector:@selector(imageDatabaseChanged:)
+                                                     name:kCBLDatabaseChangeNotification
+                                                   object:[self databaseForName:CBIR_IMAGE_DB_NAME]];
+    }
+    
+    // Without an input source the run loop returns right away rather than sleeping, so give it a port
+    // that never fires.  From then on the thread sleeps until there's work for it, or it's terminated.
+    NSRunLoop * runLoop = [NSRunLoop currentRunLoop];
+    [runLoop addPort:[NSMachPort port] forMode:NSDefaultRunLoopMode];
+    
+    while ( !self.isTerminated ) {
+        @autoreleasepool {
+            [runLoop runMode:NSDefaultRunLoopMode beforeDate:[NSDate distantFuture]];
+        }
+    }
+    
+    // No more requests are taken, but some may have been taken and not run yet, or not even queued yet.
+    while ( [self takenRequests] > 0 ) {
+        @autoreleasepool {
+            [runLoop runMode:NSDefaultRunLoopMode beforeDate:[NSDate dateWithTimeIntervalSinceNow:0.01]];
+        }
+    }
+    
+    [[NSNotificationCenter defaultCenter] removeObserver:self name:kCBLDatabaseChangeNotification object:nil];
+    
+    // Whatever went into the face index before it stopped is kept too, so next time only the rest goes in.
+    if ( m_faceGalleryUnsavedChanges > 0 || m_faceIndex->size() != m_faceIndexSavedSize ) {
+        [self saveFaceGallery];
+    }
+    
+    NSLog(@"CBIRDatabaseEngine thread done.");
+    dispatch_semaphore_signal(m_dbThreadExited);
+}
+
+-(void)initBuiltinIndexers
+{
+    // Called before the engine thread starts, so there's no one to race with yet.
+    [self registerIndexerInternal:[[FaceIndexer alloc] init]];
+}
+
+-(void)registerIndexer:(CBIRIndexer *)indexer
+{
+    // Registration is serialised on the engine thread, so there's only ever one writer of the registry.
+    [self performOnEngineThreadAndWait:@selector(registerIndexerInternal:) withObject:indexer];
+}
+
+-(void)registerIndexerInternal:(CBIRIndexer *)indexer
+{
+    if ( indexer ) {
+        NSString * className = NSStringFromClass([indexer class]);
+        NSDictionary * current = [self indexers];
+        
+        if ( current[className] ) {
+            [NSException raise:@"Duplicate Indexer" format:@"CBIRIndexer of type %@ is already registered", className];
+        } else {
+            NSMutableDictionary * next = [[NSMutableDictionary alloc] initWithDictionary:current];
+            next[className] = indexer;
+            
+            // Readers load the snapshot without retaining it first, so a replaced snapshot is never freed.
+            // Registration only happens a handful of times, so that's a handful of small dictionaries.
+            NSDictionary * published = [next copy];
+            if ( current ) {
+                [m_retiredIndexers addObject:current];
+            }
+            m_indexers.store((__bridge_retained const void *)published, std::memory_order_release);
+            if ( current ) {
+                CFRelease((__bridge CFTypeRef)current);
+            }
+            
+            NSLog(@"Registering CBIRIndexer %@ : %@", className, indexer);
+        }
+        
+    }
+}
+
+// The current registry snapshot, an immutable dictionary of indexers by class name.  Safe on any thread.
+-(NSDictionary *)indexers
+{
+    return (__bridge NSDictionary *)m_indexers.load(std::memory_order_acquire);
+}
+
+-(void)getIndexer:(NSString *)indexerName completion:(void (^)(const CBIRIndexer * indexer))completion
+{
+    CBIRIndexer * indexer = [self indexers][indexerName];
+    [self complete:^{ completion(indexer); }];
+}
+
+-(const CBIRIndexer * )getIndexer:(NSString *)indexerName
+{
+    // Just a load from the current snapshot, no trip to the engine thread.
+    return [self indexers][indexerName];
+}
+
+-(CBIRIndexResult *)indexImage:(CBIRDocument *)imgDoc
+{
+    NSMutableDictionary * params = nil;
+    {
+        // Indexing is background work, whichever thread asks for it.
+        cbir::TaskScheduler::PriorityScope scope(m_scheduler, cbir::kPriorityBackground);
+        params = [self extractFeaturesFromDocument:imgDoc];
+    }
+    
+    // Only writing the features into the document happens on the engine thread.
+    if ( ![self performOnEngineThreadAndWait:@selector(indexImageInternal:) withObject:params] ) {
+        return [[CBIRIndexResult alloc] initWithResult:NO filteredImage:nil];
+    }
+    return params[kCBIRIndexResult];
+}
+
+-(void)indexImage:(CBIRDocument *)imgDoc completion:(void (^)(CBIRIndexResult * result))completion
+{
+    m_scheduler.submit([self, imgDoc, completion]() {
+        @autoreleasepool {
+            NSMutableDictionary * params = [self extractFeaturesFromDocument:imgDoc];
+            
+            BOOL queued = [self performOnEngineThread:^{
+                [self indexImageInternal:params];
+                CBIRIndexResult * result = params[kCBIRIndexResult];
+                if ( completion ) {
+                    [self complete:^{ completion(result); }];
+                }
+            }];
+            
+            // Whoever's waiting on it still hears back, or an ingest queue would wait for it forever.
+            if ( !queued && completion ) {
+                CBIRIndexResult * result = [[CBIRIndexResult alloc] initWithResult:NO filteredImage:nil];
+                [self complete:^{ completion(result); }];
+            }
+        }
+    }, cbir::kPriorityBackground);
+}
+
+// Runs every indexer's feature extraction and returns the params for indexImageInternal:.  The indexers run
+// concurrently on the scheduler, all on the same document, and the calling thread lends a hand.
+-(NSMutableDictionary *)extractFeaturesFromDocument:(CBIRDocument *)imgDoc
+{
+    NSMutableDictionary * params = [[NSMutableDictionary alloc] init];
+    NSDictionary * indexers = [self indexers];
+    NSArray * indexerNames = indexers.allKeys;
+    
+    // Extract the features off of the engine thread, so that other writes and queries don't queue up behind
+    // the image processing.  Each indexer only fills in its own slot.
+    std::vector<id> indexerFeatures(indexerNames.count);
+    cbir::parallelFor(m_scheduler, 0, indexerNames.count, 1, [&](size_t begin, size_t end) {
+        for ( size_t i = begin; i < end; i++ ) {
+            @autoreleasepool {
+                indexerFeatures[i] = [indexers[indexerNames[i]] extractFeaturesFromDocument:imgDoc];
+            }
+        }
+    });
+    
+    NSMutableDictionary * features = [[NSMutableDictionary alloc] init];
+    for ( NSUInteger i = 0; i < indexerNames.count; i++ ) {
+        if ( indexerFeatures[i] ) {
+            features[indexerNames[i]] = indexerFeatures[i];
+        }
+    }
+    
+    params[kCBIRDocumentKey] = imgDoc;
+    params[kCBIRIndexers] = indexers;
+    params[kCBIRFeatures] = features;
+    return params;
+}
+
+- (void)indexImageInternal:(NSMutableDictionary *)params
+{
+    NSLog(@"running index worker");
+    
+    CBIRDocument * imgDoc = params[kCBIRDocumentKey];
+    NSDictionary * indexers = params[kCBIRIndexers];
+    NSDictionary * features = params[kCBIRFeatures];
+    
+    CBLDocument * cblDoc = [[self databaseForName:CBIR_IMAGE_DB_NAME] documentWithID:imgDoc.persistentID];
+    BOOL saved = (cblDoc != nil);
+    
+    if ( saved && features.count > 0 ) {
+        
+        // Every indexer writes into the same revision, which is saved once.  Saving a revision per indexer
+        // would have them all branch off the same parent and conflict with each other.
+        CBLUnsavedRevision * unsavedRevision = [cblDoc newRevision];
+        for ( NSString * indexerName in features ) {
+            [indexers[indexerName] writeFeatures:features[indexerName] toRevision:unsavedRevision];
+        }
+        
+        NSError * error = nil;
+        [unsavedRevision save:&error];
+        if ( error ) {
+            NSLog(@"%s error saving index revision: %@", __FUNCTION__, error);
+            saved = NO;
+        }
+    }
+    
+    params[kCBIRIndexResult] = [[CBIRIndexResult alloc] initWithResult:saved filteredImage:nil];
+    
+    // Bring the face index up to date with the new faces now, rather than making the next query pay for it.
+    [self updateFaceIndex];
+}
+
+-(CBLDocument *)getDocument:(NSString *)persistentID
+{
+    NSMutableDictionary * params = [[NSMutableDictionary alloc] init];
+    params[kCBIRPersistentID] = persistentID;
+    
+    [self performOnEngineThreadAndWait:@selector(getDocumentInternal:) withObject:params];
+    
+    CBLDocument * outputDocument = params[kCBLOutputDocument];
+    return outputDocument;
+}
+
+-(void)getDocumentInternal:(NSMutableDictionary *)params
+{
+    NSString * persistentID = params[kCBIRPersistentID];
+    CBLDocument * doc = [[self databaseForName:CBIR_IMAGE_DB_NAME] existingDocumentWithID:persistentID];
+    params[kCBLOutputDocument] = doc;
+}
+
+-(void)getDocument:(NSString *)persistentID completion:(void (^)(CBLDocument * document))completion
+{
+    BOOL queued = [self performOnEngineThread:^{
+        NSMutableDictionary * params = [[NSMutableDictionary alloc] init];
+        params[kCBIRPersistentID] = persistentID;
+        [self getDocumentInternal:params];
+        
+        CBLDocument * doc = params[kCBLOutputDocument];
+        [self complete:^{ completion(doc); }];
+    }];
+    
+    if ( !queued ) {
+        [self complete:^{ completion(nil); }];
+    }
+}
+
+-(NSDictionary<NSString *, CBLDocument *> *)getDocuments:(NSArray<NSString *> *)persistentIDs
+{
+    NSMutableDictionary * params = [[NSMutableDictionary alloc] init];
+    params[kCBIRPersistentIDs] = persistentIDs;
+    
+    [self performOnEngineThreadAndWait:@selector(getDocumentsInternal:) withObject:params];
+    
+    return params[kCBLOutputDocuments];
+}
+
+-(void)getDocuments:(NSArray<NSString *> *)persistentIDs completion:(void (^)(NSDictionary<NSString *, CBLDocument *> * documents))completion
+{
+    BOOL queued = [self performOnEngineThread:^{
+        NSMutableDictionary * params = [[NSMutableDictionary alloc] init];
+        params[kCBIRPersistentIDs] = persistentIDs;
+        [self getDocumentsInternal:params];
+        
+        NSDictionary * docs = params[kCBLOutputDocuments];
+        [self complete:^{ completion(docs); }];
+    }];
+    
+    if ( !queued ) {
+        [self complete:^{ completion(nil); }];
+    }
+}
+
+-(void)getDocumentsInternal:(NSMutableDictionary *)params
+{
+    CBLDatabase * db = [self databaseForName:CBIR_IMAGE_DB_NAME];
+    NSMutableDictionary * docs = [[NSMutableDictionary alloc] init];
+    
+    for ( NSString * persistentID in params[kCBIRPersistentIDs] ) {
+        CBLDocument * doc = [db existingDocumentWithID:persistentID];
+        if ( doc ) {
+            docs[persistentID] = doc;
+        }
+    }
+    
+    params[kCBLOutputDocuments] = docs;
+}
+
+-(CBLDocument *)newDocument:(NSString *)newDocID
+{
+    NSMutableDictionary * params = [[NSMutableDictionary alloc] init];
+    params[kCBIRPersistentID] = newDocID;
+    
+    [self performOnEngineThreadAndWait:@selector(newDocumentInternal:) withObject:params];
+    
+    CBLDocument * outputDocument = params[kCBLOutputDocument];
+    return outputDocument;
+
+}
+
+-(void)newDocumentInternal:(NSMutableDictionary *)params
+{
+    NSString * persistentID = params[kCBIRPersistentID];
+    CBLDocument * doc = [[self databaseForName:CBIR_IMAGE_DB_NAME] documentWithID:persistentID];
+    params[kCBLOutputDocument] = doc;
+}
+
+-(void)newDocument:(NSString *)newDocID completion:(void (^)(CBLDocument * document))completion
+{
+    BOOL queued = [self performOnEngineThread:^{
+        NSMutableDictionary * params = [[NSMutableDictionary alloc] init];
+        params[kCBIRPersistentID] = newDocID;
+        [self newDocumentInternal:params];
+        
+        CBLDocument * doc = params[kCBLOutputDocument];
+        [self complete:^{ completion(doc); }];
+    }];
+    
+    if ( !queued ) {
+        [self complete:^{ completion(nil); }];
+    }
+}
+
+-(NSData *)getAttachment:(NSString *)attachmentName forDocument:(NSString *)persistentID
+{
+    NSMutableDictionary * params = [[NSMutableDictionary alloc] init];
+    params[kCBIRPersistentID] = persistentID;
+    params[kCBLAttachmentName] = attachmentName;
+    
+    [self performOnEngineThreadAndWait:@selector(getAttachmentInternal:) withObject:params];
+    
+    return params[kCBLOutputData];
+}
+
+-(void)getAttachmentInternal:(NSMutableDictionary *)params
+{
+    NSString * persistentID = params[kCBIRPersistentID];
+    NSString * attachmentName = params[kCBLAttachmentName];
+    CBLDocument * doc = [[self databaseForName:CBIR_IMAGE_DB_NAME] existingDocumentWithID:persistentID];
+    CBLAttachment * att = [[doc currentRevision] attachmentNamed:attachmentName];
+    
+    if ( att.content ) {
+        params[kCBLOutputData] = att.content;
+    }
+}
+
+-(CBLQuery *) createAllDocsQuery
+{
+    NSMutableDictionary * params = [[NSMutableDictionary alloc] init];
+    
+    [self performOnEngineThreadAndWait:@selector(createAllDocsQueryInternal:) withObject:params];
+    
+    return params[kCBLQuery];
+}
+
+-(void) createAllDocsQueryInternal:(NSMutableDictionary *)params
+{
+    params[kCBLQuery] = [[self databaseForName:CBIR_IMAGE_DB_NAME] createAllDocumentsQuery];
+}
+
+-(void) createAllDocsQueryWithCompletion:(void (^)(CBLQuery * query))completion
+{
+    BOOL queued = [self performOnEngineThread:^{
+        NSMutableDictionary * params = [[NSMutableDictionary alloc] init];
+        [self createAllDocsQueryInternal:params];
+        
+        CBLQuery * query = params[kCBLQuery];
+        [self complete:^{ completion(query); }];
+    }];
+    
+    if ( !queued ) {
+        [self complete:^{ completion(nil); }];
+    }
+}
+
+-(CBLQuery *) createFaceIndexQuery
+{
+    NSMutableDictionary * params = [[NSMutableDictionary alloc] init];
+    
+    [self performOnEngineThreadAndWait:@selector(createFaceIndexQueryInternal:) withObject:params];
+    
+    return params[kCBLQuery];
+}
+
+-(void) createFaceIndexQueryInternal:(NSMutableDictionary *)params
+{
+    params[kCBLQuery] = [[self faceIndexView] createQuery];
+}
+
+-(CBLView *)faceIndexView
+{
+    if ( !m_faceIndexView ) {
+        m_faceIndexView = [FaceIndexer faceIndexViewInDatabase:[self databaseForName:CBIR_IMAGE_DB_NAME]];
+    }
+    
+    return m_faceIndexView;
+}
+
+// Incrementally maps any documents that changed since the face index was last updated.
+-(void)updateFaceIndex
+{
+    CBLView * view = [self faceIndexView];
+    
+    if ( view.stale ) {
+        // CBL has no public call to update a view, but running an empty query updates it first.
+        CBLQuery * updateQuery = [view createQuery];
+        updateQuery.limit = 0;
+        
+        NSError * error = nil;
+        [updateQuery run:&error];
+        if ( error ) {
+            NSLog(@"%s face index update failed: %@", __FUNCTION__, error);
+        }
+    }
+}
+
+-(std::shared_ptr<const cbir::FaceGallerySnapshot>)faceGallerySnapshot
+{
+    if ( !m_faceGalleryReady ) {
+        // The gallery is loaded before the engine thread runs any requests, so this returns once it's ready, or
+        // right away if the engine thread has stopped without getting that far.
+        [self performOnEngineThreadAndWait:@selector(wakeUp) withObject:nil];
+    }
+    
+    return m_faceGallery.snapshot();
+}
+
+-(NSString *)faceGallerySnapshotPath
+{
+    return [m_cblManager.directory stringByAppendingPathComponent:CBIR_FACE_GALLERY_SNAPSHOT_NAME];
+}
+
+// Maps in the gallery snapshot, falling back to a rebuild from the face index when there's no usable
+// snapshot or it doesn't match the current database sequence.
+-(void)loadFaceGallery
+{
+    // The labels from last time.  Loaded first, as a rebuild kicks off their update.
+    if ( m_faceClusters.load([self faceClustersPath].UTF8String) ) {
+        m_faceClustersSavedSequence = m_faceClusters.sequence();
+    } else {
+        NSLog(@"%s no cluster labels to load, faces will be given new ones.", __FUNCTION__);
+    }
+    
+    NSDate * before = [NSDate date];
+    BOOL loaded = m_faceGallery.load([self faceGallerySnapshotPath].UTF8String);
+    SInt64 sequence = [self databaseForName:CBIR_IMAGE_DB_NAME].lastSequenceNumber;
+    
+    if ( loaded && m_faceGallery.sequence() == sequence ) {
+        NSLog(@"%s mapped %lu faces at sequence %lld in %f s", __FUNCTION__, m_faceGallery.size(), sequence, -[before timeIntervalSinceNow]);
+        
+        [self verifyFaceGalleryInBackground];
+        [self loadFaceIndexes];
+    } else {
+        NSLog(@"%s snapshot unusable (loaded: %d sequence: %lld expected: %lld).  Rebuilding.", __FUNCTION__, loaded, m_faceGallery.sequence(), sequence);
+        [self rebuildFaceGallery];
+    }
+    
+    m_faceGalleryReady = true;
+    [self updateFaceIndexes];
+}
+
+// Checks the descriptors of a freshly mapped gallery in the background, as reading them all would undo the point of
+// mapping them.  If they've been corrupted, the gallery is rebuilt, unless something has replaced it in the meantime.
+-(void)verifyFaceGalleryInBackground
+{
+    std::shared_ptr<const cbir::FaceGallerySnapshot> gallery = m_faceGallery.snapshot();
+    
+    m_scheduler.submit([self, gallery]() {
+        @autoreleasepool {
+            if ( gallery->verifyDescriptors() ) {
+                return;
+            }
+            
+            [self performOnEngineThread:^{
+                if ( m_faceGallery.generation() == gallery->generation() ) {
+                    NSLog(@"%s snapshot descriptors are corrupt.  Rebuilding.", __FUNCTION__);
+                    [self rebuildFaceGallery];
+                }
+            }];
+        }
+    }, cbir::kPriorityBackground);
+}
+
+// Loads the indexes and graph saved with the gallery snapshot, which should match it.  If not, the IVF index's rows
+// go back in untrained, and the rest are built in the background.
+-(void)loadFaceIndexes
+{
+    std::shared_ptr<const cbir::FaceGallerySnapshot> gallery = m_faceGallery.snapshot();
+    if ( !m_faceIvfIndex.load([self faceIvfIndexPath].UTF8String, *gallery) ) {
+        NSLog(@"%s no IVF index to load, it will be trained in the background.", __FUNCTION__);
+        for ( size_t row = 0; row < gallery->size(); row++ ) {
+            m_faceIvfIndex.append(gallery->record(row).faceID, gallery->coarseDescriptor(row));
+        }
+    }
+    if ( m_faceIndex->load([self faceIndexPath].UTF8String, *gallery) ) {
+        m_faceIndexSavedSize = m_faceIndex->size();
+    } else {
+        NSLog(@"%s no face index to load, it will be built in the background.", __FUNCTION__);
+    }
+    if ( !m_faceNeighborGraph.load([self faceGraphPath].UTF8String, gallery) ) {
+        NSLog(@"%s no neighbour graph to load, it will be built in the background.", __FUNCTION__);
+    }
+}
+
+// Catches the face index and the neighbour graph up with the latest gallery snapshot in the background.  Only
+// one update runs at a time.  Changes that come in while it runs are picked up by another pass once it's done.
+// The IVF index is always up to date, but it's retrained from here too when it's due.
+-(void)updateFaceIndexes
+{
+    [self trainFaceIvfIndexIfNeeded];
+    
+    m_faceIndexesDirty = true;
+    if ( m_faceIndexesUpdating.exchange(true) ) {
+        return;
+    }
+    
+    m_scheduler.submit([self]() {
+        while ( true ) {
+            while ( m_faceIndexesDirty.exchange(false) ) {
+                @autoreleasepool {
+                    NSDate * before = [NSDate date];
+                    std::shared_ptr<const cbir::FaceGallerySnapshot> gallery = m_faceGallery.snapshot();
+                    
+                    // The index goes first, queries lean on it more than on the graph, and the graph finds its
+                    // candidates with it.  It inserts one face at a time, so it's quick to catch up with a few
+                    // changes.  This is the only place faces go into it, the indexing path just publishes them.
+                    m_faceIndex->update(*gallery);
+                    
+                    if ( m_faceNeighborGraph.update(gallery, m_scheduler, m_faceIndex.get()) ) {
+                        NSLog(@"%s caught up with sequence %lld in %f s", __FUNCTION__, gallery->sequence(), -[before timeIntervalSinceNow]);
+                        [self updateFaceClusters];
+                    }
+                    
+                    if ( [self faceIndexNeedsSaving] ) {
+                        [self performOnEngineThread:^{
+                            if ( [self faceIndexNeedsSaving] ) {
+                                [self saveFaceGallery];
+                            }
+                        }];
+                    }
+                }
+            }
+            
+            // A change may have come in just before letting go, in which case its update returned early.
+            m_faceIndexesUpdating = false;
+            if ( !m_faceIndexesDirty || m_faceIndexesUpdating.exchange(true) ) {
+                break;
+            }
+        }
+    }, cbir::kPriorityBackground);
+}
+
+// Trains the IVF index in the background once the gallery is big enough for it, and again whenever the gallery
+// has outgrown its lists.  Engine thread only.
+-(void)trainFaceIvfIndexIfNeeded
+{
+    std::shared_ptr<const cbir::FaceGallerySnapshot> gallery = m_faceGallery.snapshot();
+    size_t trainedSize = std::max(m_faceIvfIndex.trainedSize(), m_faceIvfFailedSize);
+    
+    if ( m_faceIvfTraining || gallery->liveCount() < CBIR_FACE_IVF_MIN_TRAINING_FACES ||
+         (trainedSize > 0 && gallery->liveCount() < trainedSize * CBIR_FACE_IVF_RETRAIN_GROWTH) ) {
+        return;
+    }
+    
+    m_faceIvfTraining = YES;
+    NSUInteger generation = m_faceIvfGeneration;
+    
+    m_scheduler.submit([self, gallery, generation]() {
+        @autoreleasepool {
+            NSDate * before = [NSDate date];
+            size_t listCount = cbir::FaceIvfIndex::listCountFor(gallery->liveCount());
+            std::shared_ptr<const cbir::IvfTraining> training = m_faceIvfIndex.train(*gallery, listCount, m_scheduler);
+            if ( training ) {
+                NSLog(@"%s trained %lu lists over %lu faces in %f s", __FUNCTION__, listCount, gallery->liveCount(), -[before timeIntervalSinceNow]);
+            }
+            
+            // Installed on the engine thread, which appends the rows, so that none are appended halfway through.
+            // Everything it's appended is published by the time it gets to this.
+            [self performOnEngineThread:^{
+                if ( generation == m_faceIvfGeneration ) {
+                    if ( training ) {
+                        m_faceIvfIndex.install(*training, *m_faceGallery.snapshot());
+                    } else {
+                        m_faceIvfFailedSize = gallery->liveCount();
+                    }
+                }
+                m_faceIvfTraining = NO;
+            }];
+        }
+    }, cbir::kPriorityBackground);
+}
+
+-(NSString *)faceIvfIndexPath
+{
+    return [m_cblManager.directory stringByAppendingPathComponent:CBIR_FACE_IVF_NAME];
+}
+
+// Reclusters the faces from the neighbour graph, saving the labels every so often.  Only called by the graph update.
+-(void)updateFaceClusters
+{
+    std::vector<std::pair<size_t, size_t>> edges;
+    std::shared_ptr<const cbir::FaceGallerySnapshot> gallery = m_faceNeighborGraph.mutualEdges(CBIR_FACE_CLUSTER_LINK_RANK, CBIR_FACE_CLUSTER_LINK_DISTANCE, edges);
+    if ( !gallery ) {
+        return;
+    }
+    
+    m_faceClusters.update(*gallery, edges);
+    if ( m_faceClusters.sequence() >= m_faceClustersSavedSequence + CBIR_FACE_CLUSTERS_SAVE_INTERVAL ) {
+        [self saveFaceClusters];
+    }
+}
+
+-(void)saveFaceClusters
+{
+    int64_t sequence = m_faceClusters.sequence();
+    if ( m_faceClusters.save([self faceClustersPath].UTF8String) ) {
+        m_faceClustersSavedSequence = sequence;
+    } else {
+        NSLog(@"%s failed to save the cluster labels.", __FUNCTION__);
+    }
+}
+
+-(NSString *)faceClustersPath
+{
+    return [m_cblManager.directory stringByAppendingPathComponent:CBIR_FACE_CLUSTERS_NAME];
+}
+
+-(NSString *)faceGraphPath
+{
+    return [m_cblManager.directory stringByAppendingPathComponent:CBIR_FACE_GRAPH_NAME];
+}
+
+-(NSString *)faceIndexPath
+{
+    return [m_cblManager.directory stringByAppendingPathComponent:CBIR_FACE_INDEX_NAME];
+}
+
+// Whether the face index has started over, or grown enough, since it was last saved.
+-(BOOL)faceIndexNeedsSaving
+{
+    size_t size = m_faceIndex->size();
+    return size < m_faceIndexSavedSize || size >= m_faceIndexSavedSize + CBIR_FACE_INDEX_SAVE_INTERVAL;
+}
+
+-(NSDictionary *)faceClusters
+{
+    std::unordered_map<uint64_t, std::vector<std::string>> clusters = m_faceClusters.clusters();
+    
+    NSMutableDictionary * result = [NSMutableDictionary dictionaryWithCapacity:clusters.size()];
+    for ( std::unordered_map<uint64_t, std::vector<std::string>>::const_iterator it = clusters.begin(); it != clusters.end(); ++it ) {
+        NSMutableArray * faceIDs = [NSMutableArray arrayWithCapacity:it->second.size()];
+        for ( size_t i = 0; i < it->second.size(); i++ ) {
+            [faceIDs addObject:[NSString stringWithUTF8String:it->second[i].c_str()]];
+        }
+        result[@(it->first)] = faceIDs;
+    }
+    
+    return result;
+}
+
+// Rebuilds the gallery from the face index, then saves a fresh snapshot of it.
+-(void)rebuildFaceGallery
+{
+    NSDate * before = [NSDate date];
+    CBLDatabase * db = [self databaseForName:CBIR_IMAGE_DB_NAME];
+    SInt64 sequence = db.lastSequenceNumber;
+    m_faceGallery.clear();
+    m_faceIvfIndex.clear();
+    m_faceIvfGeneration++;
+    m_faceIvfFailedSize = 0;
+    
+    // The rebuilt gallery may reach the same sequence with different rows.
+    m_faceSearchCache.clear();
+    
+    NSError * error = nil;
+    CBLQueryEnumerator * qEnum = [[[self faceIndexView] createQuery] run:&error];
+    if ( error ) {
+        NSLog(@"%s face index query failed: %@", __FUNCTION__, error);
+        return;
+    }
+    
+    std::vector<float> descriptor(cbir::kDescriptorLength);
+    CBLRevision * revision = nil;
+    
+    for ( CBLQueryRow * row in qEnum ) {
+        @autoreleasepool {
+            
+            // Rows of an image are adjacent, so only load each revision once.
+            if ( ![revision.document.documentID isEqualToString:row.documentID] ) {
+                revision = row.document.currentRevision;
+            }
+            
+            [self appendFace:row.key1 withData:row.value fromRevision:revision descriptorBuffer:descriptor];
+        }
+    }
+    
+    m_faceGallery.setSequence(sequence);
+    m_faceGallery.publish();
+    [self saveFaceGallery];
+    [self updateFaceIndexes];
+    
+    NSLog(@"%s rebuilt %lu faces at sequence %lld in %f s", __FUNCTION__, m_faceGallery.size(), sequence, -[before timeIntervalSinceNow]);
+}
+
+// Adds a face to the gallery.  The face data holds the face rect and attachment names, as does a face index row.
+-(void)appendFace:(NSString *)faceID withData:(NSDictionary *)faceData fromRevision:(CBLRevision *)revision descriptorBuffer:(std::vector<float> &)descriptor
+{
+    size_t histoImageSize = cbir::kGridBlockCount * cbir::kHistogramBinCount * sizeof(float);
+    NSData * histoImage = [revision attachmentNamed:faceData[kCBIRHistogramImage]].content;
+    
+    if ( histoImage.length != histoImageSize ) {
+        NSLog(@"%s skipping face %@ with histogram image of %lu bytes", __FUNCTION__, faceID, (unsigned long)histoImage.length);
+        return;
+    }
+    
+    CGRect faceRect = CGRectFromString(faceData[kCBIRFaceRect]);
+    
+    cbir::FaceRecord record;
+    record.faceID = faceID.UTF8String;
+    record.imageDocumentID = revision.document.documentID.UTF8String;
+    record.thumbnailName = [faceData[kCBIRSourceFaceImage] UTF8String] ?: "";
+    record.rect[0] = faceRect.origin.x;
+    record.rect[1] = faceRect.origin.y;
+    record.rect[2] = faceRect.size.width;
+    record.rect[3] = faceRect.size.height;
+    
+    cbir::compactHistogramImage((const float *)histoImage.bytes, descriptor.data());
+    m_faceGallery.append(record, descriptor.data());
+    
+    float coarse[cbir::kCoarseDescriptorLength];
+    cbir::coarsenDescriptor(descriptor.data(), coarse);
+    m_faceIvfIndex.append(record.faceID, coarse);
+}
+
+-(BOOL)saveFaceGallery
+{
+    std::shared_ptr<const cbir::FaceGallerySnapshot> gallery = m_faceGallery.snapshot();
+    size_t indexSize = m_faceIndex->size();
+    if ( gallery->save([self faceGallerySnapshotPath].UTF8String) ) {
+        m_faceGalleryUnsavedChanges = 0;
+        
+        // From the same snapshot, so that they load together.
+        if ( !m_faceIvfIndex.save([self faceIvfIndexPath].UTF8String, *gallery) ) {
+            NSLog(@"%s failed to save the IVF index.", __FUNCTION__);
+        }
+        if ( m_faceIndex->save([self faceIndexPath].UTF8String, *gallery) ) {
+            m_faceIndexSavedSize = indexSize;
+        } else {
+            NSLog(@"%s failed to save the face index.", __FUNCTION__);
+        }
+        if ( !m_faceNeighborGraph.save([self faceGraphPath].UTF8String, *gallery) ) {
+            NSLog(@"%s failed to save the neighbour graph.", __FUNCTION__);
+        }
+        return YES;
+    }
+    
+    NSLog(@"%s failed to save the gallery snapshot.", __FUNCTION__);
+    return NO;
+}
+
+// Removed faces stay in the gallery, and in the indexes and graph, until it's saved and loaded back in, as saving
+// leaves them out.  Do that once there are enough of them to slow scans down.  The gallery starts a new generation,
+// so anything still working on the old one gives up or finds nothing to do, and the rest pick up the new one.
+-(void)compactFaceGalleryIfNeeded
+{
+    std::shared_ptr<const cbir::FaceGallerySnapshot> gallery = m_faceGallery.snapshot();
+    size_t removed = gallery->size() - gallery->liveCount();
+    if ( removed < CBIR_FACE_GALLERY_COMPACT_MIN_REMOVED || removed * 100 < gallery->size() * CBIR_FACE_GALLERY_COMPACT_PERCENT ) {
+        return;
+    }
+    
+    NSDate * before = [NSDate date];
+    if ( ![self saveFaceGallery] ) {
+        return;
+    }
+    
+    SInt64 sequence = m_faceGallery.sequence();
+    if ( !m_faceGallery.load([self faceGallerySnapshotPath].UTF8String) || m_faceGallery.sequence() != sequence ) {
+        NSLog(@"%s couldn't load the compacted gallery back in.  Rebuilding.", __FUNCTION__);
+        [self rebuildFaceGallery];
+        return;
+    }
+    
+    // Rows have been renumbered, and training started on the old ones is no good.
+    m_faceSearchCache.clear();
+    m_faceIvfGeneration++;
+    [self verifyFaceGalleryInBackground];
+    [self loadFaceIndexes];
+    [self updateFaceIndexes];
+    
+    NSLog(@"%s dropped %lu removed faces, %lu left, in %f s", __FUNCTION__, removed, m_faceGallery.size(), -[before timeIntervalSinceNow]);
+}
+
+// Applies database changes to the gallery as they happen, so that queries always find a warm gallery.
+-(void)imageDatabaseChanged:(NSNotification *)notification
+{
+    [self catchUpFaceGallery];
+}
+
+// Applies every change made since the gallery's sequence.  Any changed image simply has its faces replaced, which
+// covers inserts, updates and deletes alike.  The changes are read from the database by sequence, rather than taken
+// from notifications, so the gallery never has to guess how far they take it, and one that missed some still
+// catches up.
+-(void)catchUpFaceGallery
+{
+    CBLDatabase * db = [self databaseForName:CBIR_IMAGE_DB_NAME];
+    CBLQuery * query = [db createAllDocumentsQuery];
+    query.allDocsMode = kCBLBySequence;
+    query.startKey = @(m_faceGallery.sequence() + 1);
+    
+    // The query sees every change up to here.  Sequences past the last row it returns belong to revisions that
+    // have since been replaced, or purged, so the gallery has caught up with them too.
+    SInt64 sequence = db.lastSequenceNumber;
+    
+    NSError * error = nil;
+    CBLQueryEnumerator * qEnum = [query run:&error];
+    if ( error ) {
+        NSLog(@"%s changes query failed: %@", __FUNCTION__, error);
+        return;
+    }
+    
+    // Each document comes up once, at the sequence of its latest revision, deletions included.
+    std::vector<float> descriptor(cbir::kDescriptorLength);
+    
+    for ( CBLQueryRow * row in qEnum ) {
+        @autoreleasepool {
+            m_faceGallery.removeImage(row.documentID.UTF8String);
+            
+            CBLDocument * doc = row.document;
+            CBLRevision * revision = doc.currentRevision;
+            
+            if ( revision && !doc.isDeleted ) {
+                for ( NSDictionary * faceData in revision.properties[kCBIRFaceDataList] ) {
+                    [self appendFace:faceData[kCBIRFaceID] withData:faceData fromRevision:revision descriptorBuffer:descriptor];
+                }
+            }
+        }
+        
+        // Changes made while the query ran may come up too.  Their notifications are still on the way, and will
+        // find nothing more to do.
+        sequence = MAX(sequence, (SInt64)row.sequenceNumber);
+        m_faceGalleryUnsavedChanges++;
+    }
+    
+    if ( sequence <= m_faceGallery.sequence() ) {
+        return;
+    }
+    m_faceGallery.setSequence(sequence);
+    
+    // Queries already running keep the snapshot they started with, new ones pick this one up.
+    m_faceGallery.publish();
+    [self updateFaceIndexes];
+    
+    [self compactFaceGalleryIfNeeded];
+    if ( m_faceGalleryUnsavedChanges >= CBIR_FACE_GALLERY_SAVE_INTERVAL ) {
+        [self saveFaceGallery];
+    }
+}
+
+-(void)execQuery:(CBIRQuery *)query
+{
+    // Queries search a gallery snapshot, so they don't need the engine thread at all.  Their scoring
+    // tasks inherit the query's priority.
+    cbir::TaskPriority priority = cbir::kPriorityInteractive;
+    switch ( query.priority ) {
+        case QUERY_PRIORITY_BACKGROUND: priority = cbir::kPriorityBackground; break;
+        case QUERY_PRIORITY_NORMAL: priority = cbir::kPriorityNormal; break;
+        case QUERY_PRIORITY_INTERACTIVE: priority = cbir::kPriorityInteractive; break;
+    }
+    
+    m_scheduler.submit([query]() {
+        @autoreleasepool {
+            [query evaluate];
+        }
+    }, priority);
+}
+
+-(cbir::TaskScheduler *)scheduler
+{
+    return &m_scheduler;
+}
+
+-(cbir::FaceSearchCache *)faceSearchCache
+{
+    return &m_faceSearchCache;
+}
+
+-(cbir::FaceNeighborGraph *)faceNeighborGraph
+{
+    return &m_faceNeighborGraph;
+}
+
+-(cbir::FaceHnswIndex *)faceIndex
+{
+    return m_faceIndex.get();
+}
+
+-(cbir::FaceIvfIndex *)faceIvfIndex
+{
+    return &m_faceIvfIndex;
+}
+
+
+-(CBLDatabase *)databaseForName:(NSString *)name
+{
+    NSError * error = nil;
+    CBLDatabase * dbRef = [m_cblManager databaseNamed:name error:&error];
+    
+    if ( error ) {
+        NSLog(@"databaseForName: Database could not be resolved by name: %@ error: %@", name, error);
+    } else {
+        NSLog(@"databaseForName: Database %@ resolved.", name);
+    }
+    
+    return dbRef;
+}
+
+-(NSError *)deleteDatabaseNamed:(NSString *)name
+{
+    NSError * err = nil;
+    [[self databaseForName:name] deleteDatabase:&err];
+    
+    if ( err ) {
+        NSLog(@"deleteDatabaseNamed: %@ failed with error: %@", name, err);
+    } else {
+        NSLog(@"deleteDatabaseNamed: database %@ successfully deleted.", name);
+    }
+    
+    return err;
+}
+
+
+@end
\ No newline at end of file
@@ -0,0 +1,40 @@
+//
+//  CBIRDatabaseEngine_Private.h
+//  CBIRDatabase
+//
+//  Created by Joseph Carson on 10/19/16.
+//  Copyright © 2016 Joseph Carson. All rights reserved.
+//
+
+#import "CBIRDatabaseEngine.h"
+
+#include "FaceGallery.hpp"
+#include "FaceHnswIndex.hpp"
+#include "FaceIvfIndex.hpp"
+#include "FaceNeighborGraph.hpp"
+#include "FaceSearchCache.hpp"
+#include "TaskScheduler.hpp"
+
+// Engine internals shared with the built in queries.  Objective-C++ only.
+@interface CBIRDatabaseEngine ()
+
+// The latest snapshot of the query-ready gallery of all indexed faces.  Can be called from any thread, and
+// any number of queries can read their snapshots in parallel while the engine thread ingests new faces.
+-(std::shared_ptr<const cbir::FaceGallerySnapshot>)faceGallerySnapshot;
+
+// The pool that feature extraction and query scoring fan out on.  Lives as long as the engine, usable from any thread.
+-(cbir::TaskScheduler *)scheduler;
+
+// Recently completed face searches, see FaceSearchCache.hpp.  Thread safe.
+-(cbir::FaceSearchCache *)faceSearchCache;
+
+// The nearest neighbours of every stored face, see FaceNeighborGraph.hpp.  Thread safe.
+-(cbir::FaceNeighborGraph *)faceNeighborGraph;
+
+// The approximate nearest neighbour index over every stored face, see FaceHnswIndex.hpp.  Thread safe.
+-(cbir::FaceHnswIndex *)faceIndex;
+
+// The inverted file over every stored face, see FaceIvfIndex.hpp.  Thread safe.
+-(cbir::FaceIvfIndex *)faceIvfIndex;
+
+@end
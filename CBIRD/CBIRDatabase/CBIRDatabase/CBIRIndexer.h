@@ -23,8 +23,19 @@
 
 
 // Indexer objects should be immutable such that they can be shared by threads.
+//
+// Indexing is split in two.  Feature extraction is the expensive part and runs on the engine's task scheduler,
+// possibly for several documents at once, so it must not touch the database.  Writing the extracted features
+// into a revision is cheap and runs on the engine thread, which keeps all database mutations in order.
 @interface CBIRIndexer : NSObject
 
+// Extracts the features of the document.  Subclasses must override.
+-(id)extractFeaturesFromDocument:(CBIRDocument *)document;
+
+// Writes features returned by extractFeaturesFromDocument: into the revision.  Subclasses must override.
+-(void)writeFeatures:(id)features toRevision:(CBLUnsavedRevision *)revision;
+
+// Extracts and writes the features in one go, on the calling thread.
 -(CBLUnsavedRevision *)indexImage:(CBIRDocument *)document cblDocument:(CBLDocument *)cblDoc;
 
 @end
@@ -7,6 +7,8 @@
 //
 #import "CBIRIndexer.h"
 
+#import <CouchbaseLite/CouchbaseLite.h>
+
 @implementation CBIRIndexResult
 
 @synthesize indexResult = _indexResult;
@@ -28,10 +30,22 @@
 
 @implementation CBIRIndexer
 
--(CBLUnsavedRevision *)indexImage:(CBIRDocument *)document cblDocument:(CBLDocument *)cblDoc
+-(id)extractFeaturesFromDocument:(CBIRDocument *)document
 {
     [self doesNotRecognizeSelector:_cmd];
     return nil;
 }
 
+-(void)writeFeatures:(id)features toRevision:(CBLUnsavedRevision *)revision
+{
+    [self doesNotRecognizeSelector:_cmd];
+}
+
+-(CBLUnsavedRevision *)indexImage:(CBIRDocument *)document cblDocument:(CBLDocument *)cblDoc
+{
+    CBLUnsavedRevision * revision = [cblDoc newRevision];
+    [self writeFeatures:[self extractFeaturesFromDocument:document] toRevision:revision];
+    return revision;
+}
+
 @end
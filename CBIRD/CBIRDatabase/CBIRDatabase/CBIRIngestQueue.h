@@ -0,0 +1,40 @@
+//
+//  CBIRIngestQueue.h
+//  CBIRDatabase
+//
+//  Created by Joseph Carson on 10/19/16.
+//  Copyright © 2016 Joseph Carson. All rights reserved.
+//
+
+#import <Foundation/Foundation.h>
+
+@class CBIRDocument, CBIRIndexResult;
+
+// A bounded queue of documents on their way into the engine.  Producers add documents as fast as they can
+// load them and are blocked once the documents in flight reach either the depth or the byte budget.  That
+// lets decoding and feature extraction run ahead of the database by as much as memory allows, and no more.
+// Thread safe.
+@interface CBIRIngestQueue : NSObject
+
+// The most documents that may be in flight at once.
+@property (nonatomic, readonly) NSUInteger maxDepth;
+
+// The most bytes that may be in flight at once, according to the costs given by the producers.
+@property (nonatomic, readonly) NSUInteger byteBudget;
+
+// Documents and bytes currently in flight.
+@property (nonatomic, readonly) NSUInteger depth;
+@property (nonatomic, readonly) NSUInteger bytesInFlight;
+
+-(instancetype)initWithMaxDepth:(NSUInteger)maxDepth byteBudget:(NSUInteger)byteBudget NS_DESIGNATED_INITIALIZER;
+
+// Hands the document to the engine for indexing, blocking first while the queue is full.  The cost should
+// estimate the memory the document holds on to until it's indexed, such as the size of its decoded image.
+// A document that costs more than the whole budget is let in once the queue is empty, so it can't stall.
+// The completion handler is called on one of the engine's worker threads and may be nil.
+-(void)addDocument:(CBIRDocument *)document cost:(NSUInteger)cost completion:(void (^)(CBIRIndexResult * result))completion;
+
+// Blocks until every document added so far has been indexed.
+-(void)waitUntilEmpty;
+
+@end
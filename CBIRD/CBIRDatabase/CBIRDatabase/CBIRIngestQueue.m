@@ -0,0 +1,88 @@
+//
+//  CBIRIngestQueue.m
+//  CBIRDatabase
+//
+//  Created by Joseph Carson on 10/19/16.
+//  Copyright © 2016 Joseph Carson. All rights reserved.
+//
+
+#import "CBIRIngestQueue.h"
+#import "CBIRDatabaseEngine.h"
+
+@implementation CBIRIngestQueue
+{
+    // Guards the depth and bytes in flight, and is signalled whenever a document is done.
+    NSCondition * m_condition;
+}
+
+@synthesize maxDepth = _maxDepth;
+@synthesize byteBudget = _byteBudget;
+@synthesize depth = _depth;
+@synthesize bytesInFlight = _bytesInFlight;
+
+-(instancetype)init
+{
+    return [self initWithMaxDepth:4 byteBudget:(64 * 1024 * 1024)];
+}
+
+-(instancetype)initWithMaxDepth:(NSUInteger)maxDepth byteBudget:(NSUInteger)byteBudget
+{
+    self = [super init];
+    if ( self ) {
+        _maxDepth = MAX(maxDepth, 1);
+        _byteBudget = byteBudget;
+        m_condition = [[NSCondition alloc] init];
+    }
+    return self;
+}
+
+-(NSUInteger)depth
+{
+    [m_condition lock];
+    NSUInteger depth = _depth;
+    [m_condition unlock];
+    return depth;
+}
+
+-(NSUInteger)bytesInFlight
+{
+    [m_condition lock];
+    NSUInteger bytes = _bytesInFlight;
+    [m_condition unlock];
+    return bytes;
+}
+
+-(void)addDocument:(CBIRDocument *)document cost:(NSUInteger)cost completion:(void (^)(CBIRIndexResult * result))completion
+{
+    [m_condition lock];
+    while ( _depth >= _maxDepth || (_depth > 0 && _bytesInFlight + cost > _byteBudget) ) {
+        [m_condition wait];
+    }
+    _depth++;
+    _bytesInFlight += cost;
+    [m_condition unlock];
+
+    [[CBIRDatabaseEngine sharedEngine] indexImage:document completion:^(CBIRIndexResult * result) {
+
+        [m_condition lock];
+        _depth--;
+        _bytesInFlight -= cost;
+        [m_condition broadcast];
+        [m_condition unlock];
+
+        if ( completion ) {
+            completion(result);
+        }
+    }];
+}
+
+-(void)waitUntilEmpty
+{
+    [m_condition lock];
+    while ( _depth > 0 ) {
+        [m_condition wait];
+    }
+    [m_condition unlock];
+}
+
+@end
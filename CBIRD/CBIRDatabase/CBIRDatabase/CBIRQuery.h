@@ -9,6 +9,15 @@
 #import <Foundation/Foundation.h>
 #import "CBIRQueryDelegate.h"
 
+// How urgently the engine should run a query, relative to everything else it has going on.  Indexing always
+// runs in the background, so an interactive query gets to the front of the line while a library is indexed.
+typedef NS_ENUM(NSInteger, CBIR_QUERY_PRIORITY)
+{
+    QUERY_PRIORITY_BACKGROUND,
+    QUERY_PRIORITY_NORMAL,
+    QUERY_PRIORITY_INTERACTIVE
+};
+
 @interface CBIRQuery : NSObject
 
 @property (nonatomic, readonly, weak) id<CBIRQueryDelegate> delegate;
@@ -16,9 +25,42 @@
 @property (nonatomic, readonly) BOOL isCanceled;
 @property (nonatomic, readonly) CBIR_QUERY_STATE state;
 
+// Defaults to QUERY_PRIORITY_INTERACTIVE.  Only read when the query is handed to the engine.
+@property (nonatomic) CBIR_QUERY_PRIORITY priority;
+
+// How long the query may run for, counted from when it starts.  When time runs out the query completes
+// with the best of what it found so far, and isPartial set.  Zero, the default, means no limit.
+@property (nonatomic) NSTimeInterval timeout;
+
+// Whether the query ran out of time, so that its results only cover part of the database.
+@property (nonatomic, readonly, getter=isPartial) BOOL partial;
+
+// How often, at most, the delegate is sent resultsUpdated:progress: while the query runs.  Updates that would
+// come sooner are dropped rather than queued up, so a delegate that hops to the main queue can't be flooded.
+// Defaults to a quarter of a second.  Zero turns progressive results off.
+@property (nonatomic) NSTimeInterval progressInterval;
+
+// How many of the best results go with each progress update.  Defaults to 10.
+@property (nonatomic) NSUInteger progressResultCount;
+
 -(instancetype)initWithDelegate:(id<CBIRQueryDelegate>)delegate NS_DESIGNATED_INITIALIZER;
 
 -(void) evaluate;
+
+// Stops the query as soon as it next checks shouldStop, which the built in queries do for every face.
+// Can be called from any thread.
 -(void) cancel;
 
+// Whether the query should stop what it's doing, because it was canceled or ran out of time.  Cheap enough
+// to call from inner loops, on any thread.  Running out of time makes the query partial, so only ask when the
+// answer stops the work.
+-(BOOL) shouldStop;
+
+// For subclasses.  Sends the delegate the results so far, if an update is due.  The results block is only
+// called when one is, so it's cheap to call this often.  Can be called from any thread.
+-(void) reportProgress:(float)progress results:(NSArray * (^)(NSUInteger count))results;
+
+// For subclasses.  Sends the delegate a result that was just found.  Can be called from any thread.
+-(void) reportResult:(id)result;
+
 @end
@@ -10,13 +10,31 @@
 #import "CBIRQueryDelegate.h"
 #import "CBIRDatabase.h"
 
+#include <stdatomic.h>
+
 
 @implementation CBIRQuery
+{
+    // Absolute time at which the query runs out of time, or 0 for never.
+    CFAbsoluteTime m_deadline;
+    
+    // Earliest time the next progress update may go out, and whether one is being sent right now.
+    // Both guarded by @synchronized(self).
+    CFAbsoluteTime m_nextProgressTime;
+    BOOL m_reportingProgress;
+    
+    // Backs the partial property.  Set by whichever worker first notices the deadline, so it's atomic.
+    atomic_bool m_partial;
+}
 
 @synthesize delegate = _delegate;
 @synthesize running = _running;
 @synthesize isCanceled = _isCanceled;
 @synthesize state = _state;
+@synthesize priority = _priority;
+@synthesize timeout = _timeout;
+@synthesize progressInterval = _progressInterval;
+@synthesize progressResultCount = _progressResultCount;
 
 -(instancetype)init
 {
@@ -32,6 +50,10 @@
         _running = NO;
         _isCanceled = NO;
         _state = QUERY_INIT;
+        _priority = QUERY_PRIORITY_INTERACTIVE;
+        _progressInterval = 0.25;
+        _progressResultCount = 10;
+        atomic_init(&m_partial, false);
     }
     
     return self;
@@ -42,15 +64,79 @@
     _isCanceled = YES;
 }
 
+-(BOOL) isPastDeadline
+{
+    return m_deadline > 0 && CFAbsoluteTimeGetCurrent() >= m_deadline;
+}
+
+-(BOOL) shouldStop
+{
+    if ( _isCanceled ) {
+        return YES;
+    }
+    
+    if ( [self isPastDeadline] ) {
+        // Only a query that actually gave up early on account of the deadline is partial.
+        atomic_store(&m_partial, true);
+        return YES;
+    }
+    
+    return NO;
+}
+
+-(BOOL) isPartial
+{
+    return atomic_load(&m_partial);
+}
+
+-(void) reportProgress:(float)progress results:(NSArray * (^)(NSUInteger count))results
+{
+    // Not shouldStop, as a chunk of work that finished just as time ran out doesn't make the query partial.
+    if ( _progressInterval <= 0 || _isCanceled || [self isPastDeadline] || ![self.delegate respondsToSelector:@selector(resultsUpdated:progress:)] ) {
+        return;
+    }
+    
+    // Only one thread gets to send an update, the rest drop theirs.
+    @synchronized(self) {
+        if ( m_reportingProgress || CFAbsoluteTimeGetCurrent() < m_nextProgressTime ) {
+            return;
+        }
+        m_reportingProgress = YES;
+    }
+    
+    [self.delegate resultsUpdated:results(_progressResultCount) progress:progress];
+    
+    // The interval counts from when the delegate is done, so a slow delegate gets fewer updates.
+    @synchronized(self) {
+        m_nextProgressTime = CFAbsoluteTimeGetCurrent() + _progressInterval;
+        m_reportingProgress = NO;
+    }
+}
+
+-(void) reportResult:(id)result
+{
+    if ( [self.delegate respondsToSelector:@selector(resultFound:)] ) {
+        [self.delegate resultFound:result];
+    }
+}
+
 -(void) evaluate
 {
     _running = YES;
+    atomic_store(&m_partial, false);
+    m_deadline = (_timeout > 0) ? CFAbsoluteTimeGetCurrent() + _timeout : 0;
+    
+    // The first update goes out as soon as there's something to show.
+    m_nextProgressTime = 0;
+    m_reportingProgress = NO;
+    
     // Tell the delegate.
     [self updateState:QUERY_START];
  
     NSLog(@"evaluating the query");
     [self run];
     
+    // Running out of time isn't canceling, the query completes with what it has.
     if ( self.isCanceled ) {
         [self updateState:QUERY_CANCEL];
     } else {
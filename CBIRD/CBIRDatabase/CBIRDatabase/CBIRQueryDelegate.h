@@ -24,4 +24,13 @@ typedef NS_ENUM(NSInteger, CBIR_QUERY_STATE)
 @optional
 -(void)stateUpdated:(CBIR_QUERY_STATE)state;
 
+// The best results found so far, best first, and how much of the database has been searched, from 0 to 1.
+// Called every so often while the query runs (see CBIRQuery progressInterval), on the thread running it.
+// The final results still come with QUERY_COMPLETE.
+-(void)resultsUpdated:(NSArray *)results progress:(float)progress;
+
+// A single result, sent the moment it's found by queries that stream their results, such as a range FaceQuery.
+// Called on whichever thread found it, possibly several at once.
+-(void)resultFound:(id)result;
+
 @end
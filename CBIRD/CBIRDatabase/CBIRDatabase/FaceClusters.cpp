@@ -0,0 +1,268 @@
+//
+//  FaceClusters.cpp
+//  CBIRDatabase
+//
+//  Created by Joseph Carson on 10/19/16.
+//  Copyright © 2016 Joseph Carson. All rights reserved.
+//
+
+#include "FaceClusters.hpp"
+
+#include <algorithm>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+namespace cbir {
+
+// Bump the version whenever the layout of the labels file changes.
+static const char kLabelsMagic[8] = {'C', 'B', 'I', 'R', 'C', 'L', 'U', '\0'};
+static const uint32_t kLabelsVersion = 1;
+
+struct LabelsHeader
+{
+    char magic[8];
+    uint32_t version;
+
+    // adler32 of everything following the header.
+    uint32_t checksum;
+    uint64_t faceCount;
+    int64_t sequence;
+    uint64_t nextLabel;
+};
+
+// Union-find over gallery rows, by size with path halving.
+class RowSets
+{
+public:
+
+    explicit RowSets(size_t count) : m_parents(count), m_sizes(count, 1)
+    {
+        for ( size_t i = 0; i < count; i++ ) {
+            m_parents[i] = i;
+        }
+    }
+
+    size_t find(size_t row)
+    {
+        while ( m_parents[row] != row ) {
+            m_parents[row] = m_parents[m_parents[row]];
+            row = m_parents[row];
+        }
+        return row;
+    }
+
+    void join(size_t a, size_t b)
+    {
+        a = find(a);
+        b = find(b);
+        if ( a == b ) {
+            return;
+        }
+        if ( m_sizes[a] < m_sizes[b] ) {
+            std::swap(a, b);
+        }
+        m_parents[b] = a;
+        m_sizes[a] += m_sizes[b];
+    }
+
+private:
+
+    std::vector<size_t> m_parents;
+    std::vector<size_t> m_sizes;
+};
+
+FaceClusters::FaceClusters()
+    : m_nextLabel(1), m_sequence(0)
+{
+}
+
+void FaceClusters::update(const FaceGallerySnapshot & gallery, const std::vector<std::pair<size_t, size_t>> & edges)
+{
+    RowSets sets(gallery.size());
+    for ( size_t i = 0; i < edges.size(); i++ ) {
+        sets.join(edges[i].first, edges[i].second);
+    }
+
+    std::unordered_map<size_t, std::vector<size_t>> members;
+    for ( size_t row = 0; row < gallery.size(); row++ ) {
+        if ( !gallery.isRemoved(row) ) {
+            members[sets.find(row)].push_back(row);
+        }
+    }
+
+    // Biggest clusters pick their labels first, so that a merged cluster keeps the bigger side's label.
+    std::vector<const std::vector<size_t> *> clusters;
+    for ( std::unordered_map<size_t, std::vector<size_t>>::const_iterator it = members.begin(); it != members.end(); ++it ) {
+        clusters.push_back(&it->second);
+    }
+    std::sort(clusters.begin(), clusters.end(), [](const std::vector<size_t> * a, const std::vector<size_t> * b) {
+        return a->size() > b->size() || (a->size() == b->size() && a->front() < b->front());
+    });
+
+    // Only update() writes the labels, so they can be read here without the lock.
+    std::unordered_map<std::string, uint64_t> labels;
+    std::unordered_map<uint64_t, bool> claimed;
+    uint64_t nextLabel = m_nextLabel;
+
+    for ( size_t c = 0; c < clusters.size(); c++ ) {
+        const std::vector<size_t> & rows = *clusters[c];
+
+        std::unordered_map<uint64_t, size_t> votes;
+        for ( size_t i = 0; i < rows.size(); i++ ) {
+            std::unordered_map<std::string, uint64_t>::const_iterator old = m_labels.find(gallery.record(rows[i]).faceID);
+            if ( old != m_labels.end() && !claimed[old->second] ) {
+                votes[old->second]++;
+            }
+        }
+
+        uint64_t label = 0;
+        size_t mostVotes = 0;
+        for ( std::unordered_map<uint64_t, size_t>::const_iterator it = votes.begin(); it != votes.end(); ++it ) {
+            if ( it->second > mostVotes || (it->second == mostVotes && it->first < label) ) {
+                label = it->first;
+                mostVotes = it->second;
+            }
+        }
+        if ( label == 0 ) {
+            label = nextLabel++;
+        }
+        claimed[label] = true;
+
+        for ( size_t i = 0; i < rows.size(); i++ ) {
+            labels[gallery.record(rows[i]).faceID] = label;
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_labels.swap(labels);
+    m_nextLabel = nextLabel;
+    m_sequence = gallery.sequence();
+}
+
+uint64_t FaceClusters::label(const std::string & faceID) const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::unordered_map<std::string, uint64_t>::const_iterator it = m_labels.find(faceID);
+    return (it == m_labels.end()) ? 0 : it->second;
+}
+
+std::unordered_map<uint64_t, std::vector<std::string>> FaceClusters::clusters() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::unordered_map<uint64_t, std::vector<std::string>> clusters;
+    for ( std::unordered_map<std::string, uint64_t>::const_iterator it = m_labels.begin(); it != m_labels.end(); ++it ) {
+        clusters[it->second].push_back(it->first);
+    }
+    return clusters;
+}
+
+int64_t FaceClusters::sequence() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_sequence;
+}
+
+bool FaceClusters::save(const std::string & path) const
+{
+    std::string body;
+    LabelsHeader header;
+    memset(&header, 0, sizeof(header));
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for ( std::unordered_map<std::string, uint64_t>::const_iterator it = m_labels.begin(); it != m_labels.end(); ++it ) {
+            uint32_t length = (uint32_t)it->first.size();
+            body.append((const char *)&length, sizeof(length));
+            body.append(it->first);
+            body.append((const char *)&it->second, sizeof(it->second));
+        }
+        header.faceCount = m_labels.size();
+        header.sequence = m_sequence;
+        header.nextLabel = m_nextLabel;
+    }
+
+    memcpy(header.magic, kLabelsMagic, sizeof(header.magic));
+    header.version = kLabelsVersion;
+    header.checksum = (uint32_t)adler32(adler32(0L, Z_NULL, 0), (const Bytef *)body.data(), (uInt)body.size());
+
+    // Write to the side and rename so that a crash never leaves a half written file in place.
+    std::string tempPath = path + ".tmp";
+    FILE * file = fopen(tempPath.c_str(), "wb");
+    if ( !file ) {
+        return false;
+    }
+
+    bool ok = (fwrite(&header, sizeof(header), 1, file) == 1);
+    if ( ok && body.size() > 0 ) {
+        ok = (fwrite(body.data(), body.size(), 1, file) == 1);
+    }
+
+    ok = (fclose(file) == 0) && ok;
+    ok = ok && (rename(tempPath.c_str(), path.c_str()) == 0);
+
+    if ( !ok ) {
+        unlink(tempPath.c_str());
+    }
+    return ok;
+}
+
+bool FaceClusters::load(const std::string & path)
+{
+    std::unordered_map<std::string, uint64_t> labels;
+    LabelsHeader header;
+    std::string body;
+
+    FILE * file = fopen(path.c_str(), "rb");
+    bool valid = (file != NULL) && (fread(&header, sizeof(header), 1, file) == 1);
+
+    if ( valid ) {
+        char buffer[64 * 1024];
+        size_t count = 0;
+        while ( (count = fread(buffer, 1, sizeof(buffer), file)) > 0 ) {
+            body.append(buffer, count);
+        }
+        valid = memcmp(header.magic, kLabelsMagic, sizeof(header.magic)) == 0 &&
+                header.version == kLabelsVersion &&
+                header.checksum == (uint32_t)adler32(adler32(0L, Z_NULL, 0), (const Bytef *)body.data(), (uInt)body.size());
+    }
+    if ( file ) {
+        fclose(file);
+    }
+
+    const char * in = body.data();
+    const char * end = in + body.size();
+    for ( uint64_t i = 0; valid && i < header.faceCount; i++ ) {
+        uint32_t length = 0;
+        uint64_t label = 0;
+        valid = (size_t)(end - in) >= sizeof(length);
+        if ( valid ) {
+            memcpy(&length, in, sizeof(length));
+            in += sizeof(length);
+            valid = (size_t)(end - in) >= length + sizeof(label);
+        }
+        if ( valid ) {
+            std::string faceID(in, length);
+            in += length;
+            memcpy(&label, in, sizeof(label));
+            in += sizeof(label);
+            labels[faceID] = label;
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if ( !valid ) {
+        m_labels.clear();
+        m_nextLabel = 1;
+        m_sequence = 0;
+        return false;
+    }
+
+    m_labels.swap(labels);
+    m_nextLabel = header.nextLabel;
+    m_sequence = header.sequence;
+    return true;
+}
+
+}
@@ -0,0 +1,73 @@
+//
+//  FaceClusters.hpp
+//  CBIRDatabase
+//
+//  Created by Joseph Carson on 10/19/16.
+//  Copyright © 2016 Joseph Carson. All rights reserved.
+//
+
+#ifndef FaceClusters_hpp
+#define FaceClusters_hpp
+
+#include <stdint.h>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "FaceGallery.hpp"
+
+namespace cbir {
+
+// Groups the faces of the gallery into identities.  Faces are linked by the edges of the neighbour graph
+// (see FaceNeighborGraph::mutualEdges()), and every set of faces connected by links is a cluster, worked out
+// with union-find.  That's cheap next to finding the edges, so every update() clusters the whole gallery
+// again, which also takes care of removed faces.
+//
+// Each cluster has a label that outlives updates.  A cluster takes the label most of its faces had before,
+// so newly indexed faces join the existing clusters they link to, and a face only gets a new label when it
+// doesn't link to any labelled face.  When two clusters merge the bigger one's label wins.  The labels are
+// saved to a file next to the gallery snapshot so that they also survive relaunches.
+//
+// Thread safe, but only one thread may update() at a time.
+class FaceClusters
+{
+public:
+
+    FaceClusters();
+
+    // Clusters the live faces of the snapshot, linking the given pairs of rows.
+    void update(const FaceGallerySnapshot & gallery, const std::vector<std::pair<size_t, size_t>> & edges);
+
+    // The face's cluster label, or 0 if it hasn't been clustered.  Labels start at 1.
+    uint64_t label(const std::string & faceID) const;
+
+    // The faces of each cluster, by label.
+    std::unordered_map<uint64_t, std::vector<std::string>> clusters() const;
+
+    // The database sequence number of the snapshot last clustered.
+    int64_t sequence() const;
+
+    // Saves the labels to the file at the given path, which is replaced atomically.
+    bool save(const std::string & path) const;
+
+    // Replaces the labels with the ones saved at the given path.  Fails, leaving no labels, if the file is
+    // missing, of another version, or corrupt.
+    bool load(const std::string & path);
+
+private:
+
+    FaceClusters(const FaceClusters &);
+    FaceClusters & operator=(const FaceClusters &);
+
+    mutable std::mutex m_mutex;
+
+    std::unordered_map<std::string, uint64_t> m_labels;
+    uint64_t m_nextLabel;
+    int64_t m_sequence;
+};
+
+}
+
+#endif /* FaceClusters_hpp */
@@ -0,0 +1,156 @@
+//
+//  FaceDescriptor.cpp
+//  CBIRDatabase
+//
+//  Created by Joseph Carson on 10/19/16.
+//  Copyright © 2016 Joseph Carson. All rights reserved.
+//
+
+#include "FaceDescriptor.hpp"
+
+#include <float.h>
+#include <math.h>
+#include <string.h>
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+namespace cbir {
+
+const unsigned kSpatialWeightMap[kGridBlockCount] = {0, 0, 0, 0, 0, 0, 0, 0,
+                                                     0, 0, 0, 0, 0, 0, 0, 0,
+                                                     0, 8, 8, 8, 8, 8, 8, 0,
+                                                     0, 8, 8, 8, 8, 8, 8, 0,
+                                                     0, 2, 1, 1, 1, 1, 2, 0,
+                                                     0, 2, 1, 4, 4, 1, 2, 0,
+                                                     0, 0, 1, 4, 4, 1, 0, 0,
+                                                     0, 0, 1, 1, 1, 1, 0, 0
+                                                    };
+
+const float kDescriptorBlockWeights[kWeightedBlockCount] = {8, 8, 8, 8, 8, 8,
+                                                            8, 8, 8, 8, 8, 8,
+                                                            2, 1, 1, 1, 1, 2,
+                                                            2, 1, 4, 4, 1, 2,
+                                                               1, 4, 4, 1,
+                                                               1, 1, 1, 1
+                                                           };
+
+void compactHistogramImage(const float * histogramImage, float * descriptor)
+{
+    for ( size_t block = 0; block < kGridBlockCount; block++ ) {
+        if ( kSpatialWeightMap[block] != 0 ) {
+            memcpy(descriptor, histogramImage + (block * kHistogramBinCount), kHistogramBinCount * sizeof(float));
+            descriptor += kHistogramBinCount;
+        }
+    }
+}
+
+void coarsenDescriptor(const float * descriptor, float * coarse)
+{
+    for ( size_t i = 0; i < kCoarseDescriptorLength; i++ ) {
+        float sum = 0;
+        for ( size_t bin = 0; bin < kCoarseBinSpan; bin++ ) {
+            sum += descriptor[bin];
+        }
+        coarse[i] = sum;
+        descriptor += kCoarseBinSpan;
+    }
+}
+
+void embedCoarseDescriptor(const float * coarse, float * embedding)
+{
+    for ( size_t block = 0; block < kWeightedBlockCount; block++ ) {
+        float scale = sqrtf(kDescriptorBlockWeights[block]);
+        for ( size_t bin = 0; bin < kCoarseBinCount; bin++ ) {
+            // Bins are never negative, but a bad descriptor mustn't turn the embedding into NaNs.
+            embedding[bin] = scale * sqrtf(fmaxf(coarse[bin], 0.0f));
+        }
+        coarse += kCoarseBinCount;
+        embedding += kCoarseBinCount;
+    }
+}
+
+float embeddingDistance(const float * a, const float * b)
+{
+#if defined(__ARM_NEON)
+    // Four accumulators, so that each multiply-add doesn't have to wait for the one before it.
+    static_assert(kEmbeddingLength % 16 == 0, "embeddings are summed 16 floats at a time");
+
+    float32x4_t sum0 = vdupq_n_f32(0);
+    float32x4_t sum1 = vdupq_n_f32(0);
+    float32x4_t sum2 = vdupq_n_f32(0);
+    float32x4_t sum3 = vdupq_n_f32(0);
+
+    for ( size_t i = 0; i < kEmbeddingLength; i += 16 ) {
+        float32x4_t diff0 = vsubq_f32(vld1q_f32(a + i), vld1q_f32(b + i));
+        float32x4_t diff1 = vsubq_f32(vld1q_f32(a + i + 4), vld1q_f32(b + i + 4));
+        float32x4_t diff2 = vsubq_f32(vld1q_f32(a + i + 8), vld1q_f32(b + i + 8));
+        float32x4_t diff3 = vsubq_f32(vld1q_f32(a + i + 12), vld1q_f32(b + i + 12));
+        sum0 = vmlaq_f32(sum0, diff0, diff0);
+        sum1 = vmlaq_f32(sum1, diff1, diff1);
+        sum2 = vmlaq_f32(sum2, diff2, diff2);
+        sum3 = vmlaq_f32(sum3, diff3, diff3);
+    }
+
+    float32x4_t sum = vaddq_f32(vaddq_f32(sum0, sum1), vaddq_f32(sum2, sum3));
+    float32x2_t half = vadd_f32(vget_low_f32(sum), vget_high_f32(sum));
+    return vget_lane_f32(vpadd_f32(half, half), 0);
+#else
+    float distance = 0;
+    for ( size_t i = 0; i < kEmbeddingLength; i++ ) {
+        float diff = a[i] - b[i];
+        distance += diff * diff;
+    }
+    return distance;
+#endif
+}
+
+// The distances are all the same weighted Chi-Square, over blocks of binCount bins.  The bin count is a template
+// argument so that the compiler can unroll the inner loop for each.  The heavily weighted eye blocks come first
+// in a descriptor, so a bounded distance usually passes the bound within the first few blocks.
+template <size_t binCount>
+static float weightedChiSquare(const float * probe, const float * train, float bound = INFINITY)
+{
+    double distance = 0;
+
+    for ( size_t block = 0; block < kWeightedBlockCount; block++ ) {
+        float blockDistance = 0;
+
+        for ( size_t bin = 0; bin < binCount; bin++ ) {
+            float expected = probe[bin];
+            float diff = expected - train[bin];
+
+            // Same as OpenCV, empty expected bins don't contribute.
+            if ( fabsf(expected) > FLT_EPSILON ) {
+                blockDistance += (diff * diff) / expected;
+            }
+        }
+
+        distance += kDescriptorBlockWeights[block] * blockDistance;
+        if ( distance > bound ) {
+            break;
+        }
+        probe += binCount;
+        train += binCount;
+    }
+
+    return (float)distance;
+}
+
+float faceDistance(const float * probe, const float * train)
+{
+    return weightedChiSquare<kHistogramBinCount>(probe, train);
+}
+
+float boundedFaceDistance(const float * probe, const float * train, float bound)
+{
+    return weightedChiSquare<kHistogramBinCount>(probe, train, bound);
+}
+
+float coarseFaceDistance(const float * probe, const float * train)
+{
+    return weightedChiSquare<kCoarseBinCount>(probe, train);
+}
+
+}
@@ -0,0 +1,81 @@
+//
+//  FaceDescriptor.hpp
+//  CBIRDatabase
+//
+//  Created by Joseph Carson on 10/19/16.
+//  Copyright © 2016 Joseph Carson. All rights reserved.
+//
+
+#ifndef FaceDescriptor_hpp
+#define FaceDescriptor_hpp
+
+#include <stddef.h>
+
+namespace cbir {
+
+// These must agree with FACE_INDEXER_HISTOGRAM_BIN_COUNT and FACE_INDEXER_GRID_*_IN_BLOCKS in FaceIndexer.h.
+static const size_t kHistogramBinCount = 256;
+static const size_t kGridBlockCount = 64;
+
+// Only blocks with a non-zero spatial weight contribute to the distance between two faces, so
+// descriptors keep just those blocks.  This halves the memory of every face held in a gallery.
+static const size_t kWeightedBlockCount = 32;
+static const size_t kDescriptorLength = kWeightedBlockCount * kHistogramBinCount;
+
+// The coarse descriptor sums each run of kCoarseBinSpan bins of every weighted block.  It's 16 times smaller,
+// so a whole gallery of them can be scored quickly to pick out the candidates worth a full comparison.
+static const size_t kCoarseBinCount = 16;
+static const size_t kCoarseBinSpan = kHistogramBinCount / kCoarseBinCount;
+static const size_t kCoarseDescriptorLength = kWeightedBlockCount * kCoarseBinCount;
+
+// The embedding maps a coarse descriptor into a space where plain Euclidean distance stands in for the
+// Chi-Square one, which is what index structures like FaceHnswIndex need.  See embedCoarseDescriptor().
+static const size_t kEmbeddingLength = kCoarseDescriptorLength;
+
+// Spatial map of weights to apply to differences as certain blocks are of more
+// significance than others, e.g. the eyes are weighted by 8 whereas the lips are
+// weighted by 4.
+// [0 ][1 ][2 ][3 ][4 ][5 ][6 ][7 ]
+// [8 ][9 ][10][11][12][13][14][15]
+// [16][17][18][19][20][21][22][23]
+// [24][25][26][27][28][29][30][31] => Spatial mapping is according to feature index in buffer.
+// [32][33][34][35][36][37][38][39]
+// [40][41][42][43][44][45][46][47]
+// [48][49][50][51][52][53][54][55]
+// [56][57][58][59][60][61][62][63]
+extern const unsigned kSpatialWeightMap[kGridBlockCount];
+
+// The weight of each descriptor block, in descriptor order.
+extern const float kDescriptorBlockWeights[kWeightedBlockCount];
+
+// Packs the weighted blocks of a full histogram image (kGridBlockCount block histograms, back to back
+// in feature index order) into a descriptor of kDescriptorLength floats.
+void compactHistogramImage(const float * histogramImage, float * descriptor);
+
+// Sums a descriptor of kDescriptorLength floats down to a coarse descriptor of kCoarseDescriptorLength floats.
+void coarsenDescriptor(const float * descriptor, float * coarse);
+
+// The spatially weighted Chi-Square distance between the probe (expected) and training descriptors.
+// Each block is compared like cv::compareHist(..., CV_COMP_CHISQR), which divides by the expected value.
+float faceDistance(const float * probe, const float * train);
+
+// faceDistance(), except that it gives up as soon as the distance is known to exceed the bound, and returns
+// what it had summed so far, which is more than the bound.  Every block adds to the distance, so once past
+// the bound it can't come back.
+float boundedFaceDistance(const float * probe, const float * train, float bound);
+
+// The Hellinger map of a coarse descriptor: the square root of every bin, times the square root of its block's
+// weight.  The squared Euclidean distance between two embeddings is then the weighted squared Hellinger distance,
+// which for nearby histograms is a quarter of the weighted Chi-Square one, so it ranks faces much the same.
+void embedCoarseDescriptor(const float * coarse, float * embedding);
+
+// The squared Euclidean distance between two embeddings of kEmbeddingLength floats.  Uses NEON where there is
+// any, i.e. on the devices, and plain C elsewhere, such as the simulator.
+float embeddingDistance(const float * a, const float * b);
+
+// faceDistance() for coarse descriptors.  Only an estimate of the full distance, good for ranking candidates.
+float coarseFaceDistance(const float * probe, const float * train);
+
+}
+
+#endif /* FaceDescriptor_hpp */
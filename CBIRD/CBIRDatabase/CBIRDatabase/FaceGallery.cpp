@@ -0,0 +1,463 @@
+//
+//  FaceGallery.cpp
+//  CBIRDatabase
+//
+//  Created by Joseph Carson on 10/19/16.
+//  Copyright © 2016 Joseph Carson. All rights reserved.
+//
+
+#include "FaceGallery.hpp"
+#include "FaceDescriptor.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+namespace cbir {
+
+// Bump the version whenever the layout of the snapshot or the descriptors changes.
+static const char kSnapshotMagic[8] = {'C', 'B', 'I', 'R', 'G', 'A', 'L', '\0'};
+static const uint32_t kSnapshotVersion = 4;
+
+struct SnapshotHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t descriptorLength;
+    uint64_t faceCount;
+    int64_t sequence;
+    uint64_t recordsOffset;
+    uint64_t recordsLength;
+
+    // adler32 of the header, with this zeroed, and the records.  The descriptors are left out, checking them would
+    // mean reading the whole file in just to map it.  They have a checksum of their own, see verifyDescriptors().
+    uint32_t checksum;
+    uint32_t coarseDescriptorLength;
+    uint32_t descriptorChecksum;
+    uint32_t reserved;
+};
+
+static_assert(sizeof(SnapshotHeader) == 64, "SnapshotHeader must keep the descriptors that follow it aligned.");
+
+// zlib takes 32 bit lengths, so feed it in chunks.
+static uLong updateChecksum(uLong checksum, const void * data, size_t length)
+{
+    const Bytef * bytes = (const Bytef *)data;
+    while ( length > 0 ) {
+        uInt chunk = (length > 0x40000000) ? 0x40000000 : (uInt)length;
+        checksum = adler32(checksum, bytes, chunk);
+        bytes += chunk;
+        length -= chunk;
+    }
+    return checksum;
+}
+
+// The checksum of the header, as if its checksum were 0, followed by the records.
+static uint32_t headerChecksum(const SnapshotHeader & header, const char * records)
+{
+    SnapshotHeader unchecked = header;
+    unchecked.checksum = 0;
+
+    uLong checksum = adler32(0L, Z_NULL, 0);
+    checksum = updateChecksum(checksum, &unchecked, sizeof(unchecked));
+    checksum = updateChecksum(checksum, records, (size_t)header.recordsLength);
+    return (uint32_t)checksum;
+}
+
+static uint64_t nextGeneration()
+{
+    static std::atomic<uint64_t> generation(0);
+    return ++generation;
+}
+
+static void writeString(std::string & out, const std::string & value)
+{
+    uint32_t length = (uint32_t)value.size();
+    out.append((const char *)&length, sizeof(length));
+    out.append(value);
+}
+
+static bool readString(const char *& in, const char * end, std::string & value)
+{
+    uint32_t length = 0;
+    if ( (size_t)(end - in) < sizeof(length) ) {
+        return false;
+    }
+    memcpy(&length, in, sizeof(length));
+    in += sizeof(length);
+
+    if ( (size_t)(end - in) < length ) {
+        return false;
+    }
+    value.assign(in, length);
+    in += length;
+    return true;
+}
+
+FaceGallerySegment::FaceGallerySegment()
+    : m_descriptors(NULL), m_coarseDescriptors(NULL), m_map(NULL), m_mapLength(0), m_descriptorChecksum(0)
+{
+}
+
+FaceGallerySegment::FaceGallerySegment(std::vector<FaceRecord> && records, std::vector<float> && descriptors, std::vector<float> && coarseDescriptors)
+    : m_records(std::move(records)), m_ownedDescriptors(std::move(descriptors)), m_ownedCoarseDescriptors(std::move(coarseDescriptors)),
+      m_map(NULL), m_mapLength(0), m_descriptorChecksum(0)
+{
+    m_descriptors = m_ownedDescriptors.data();
+    m_coarseDescriptors = m_ownedCoarseDescriptors.data();
+}
+
+FaceGallerySegment::~FaceGallerySegment()
+{
+    if ( m_map ) {
+        munmap(m_map, m_mapLength);
+    }
+}
+
+const float * FaceGallerySegment::descriptor(size_t i) const
+{
+    return m_descriptors + (i * kDescriptorLength);
+}
+
+const float * FaceGallerySegment::coarseDescriptor(size_t i) const
+{
+    return m_coarseDescriptors + (i * kCoarseDescriptorLength);
+}
+
+bool FaceGallerySegment::verifyDescriptors() const
+{
+    if ( !m_map ) {
+        return true;
+    }
+
+    // The coarse descriptors follow straight on from the others.
+    size_t length = size() * (kDescriptorLength + kCoarseDescriptorLength) * sizeof(float);
+    uLong checksum = updateChecksum(adler32(0L, Z_NULL, 0), m_descriptors, length);
+    return (uint32_t)checksum == m_descriptorChecksum;
+}
+
+std::shared_ptr<const FaceGallerySegment> FaceGallerySegment::merge(const FaceGallerySegment & a, const FaceGallerySegment & b)
+{
+    std::vector<FaceRecord> records;
+    records.reserve(a.size() + b.size());
+    records.insert(records.end(), a.m_records.begin(), a.m_records.end());
+    records.insert(records.end(), b.m_records.begin(), b.m_records.end());
+
+    std::vector<float> descriptors;
+    descriptors.reserve((a.size() + b.size()) * kDescriptorLength);
+    descriptors.insert(descriptors.end(), a.m_descriptors, a.m_descriptors + (a.size() * kDescriptorLength));
+    descriptors.insert(descriptors.end(), b.m_descriptors, b.m_descriptors + (b.size() * kDescriptorLength));
+
+    std::vector<float> coarseDescriptors;
+    coarseDescriptors.reserve((a.size() + b.size()) * kCoarseDescriptorLength);
+    coarseDescriptors.insert(coarseDescriptors.end(), a.m_coarseDescriptors, a.m_coarseDescriptors + (a.size() * kCoarseDescriptorLength));
+    coarseDescriptors.insert(coarseDescriptors.end(), b.m_coarseDescriptors, b.m_coarseDescriptors + (b.size() * kCoarseDescriptorLength));
+
+    return std::shared_ptr<const FaceGallerySegment>(new FaceGallerySegment(std::move(records), std::move(descriptors), std::move(coarseDescriptors)));
+}
+
+std::shared_ptr<const FaceGallerySegment> FaceGallerySegment::map(const std::string & path, int64_t & sequence)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if ( fd < 0 ) {
+        return NULL;
+    }
+
+    struct stat st;
+    if ( fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(SnapshotHeader) ) {
+        close(fd);
+        return NULL;
+    }
+
+    size_t length = (size_t)st.st_size;
+    void * map = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if ( map == MAP_FAILED ) {
+        return NULL;
+    }
+
+    // From here on the mapping belongs to the segment, so that any failure simply drops it.
+    std::shared_ptr<FaceGallerySegment> segment(new FaceGallerySegment());
+    segment->m_map = map;
+    segment->m_mapLength = length;
+
+    const char * base = (const char *)map;
+    SnapshotHeader header;
+    memcpy(&header, base, sizeof(header));
+
+    // Both kinds of descriptor for a face, which is what each face takes up before the records.
+    size_t descriptorBytes = kDescriptorLength * sizeof(float);
+    size_t faceBytes = descriptorBytes + (kCoarseDescriptorLength * sizeof(float));
+    bool valid = memcmp(header.magic, kSnapshotMagic, sizeof(header.magic)) == 0 &&
+                 header.version == kSnapshotVersion &&
+                 header.descriptorLength == kDescriptorLength &&
+                 header.coarseDescriptorLength == kCoarseDescriptorLength &&
+                 header.faceCount <= (length - sizeof(SnapshotHeader)) / faceBytes &&
+                 header.recordsOffset == sizeof(SnapshotHeader) + (header.faceCount * faceBytes) &&
+                 header.recordsLength == length - header.recordsOffset;
+
+    if ( valid ) {
+        valid = (headerChecksum(header, base + header.recordsOffset) == header.checksum);
+    }
+
+    if ( valid ) {
+        const char * in = base + header.recordsOffset;
+        const char * end = in + header.recordsLength;
+        segment->m_records.resize((size_t)header.faceCount);
+
+        for ( size_t row = 0; valid && row < segment->m_records.size(); row++ ) {
+            FaceRecord & r = segment->m_records[row];
+            valid = readString(in, end, r.faceID) &&
+                    readString(in, end, r.imageDocumentID) &&
+                    readString(in, end, r.thumbnailName) &&
+                    (size_t)(end - in) >= sizeof(r.rect);
+            if ( valid ) {
+                memcpy(r.rect, in, sizeof(r.rect));
+                in += sizeof(r.rect);
+            }
+        }
+    }
+
+    if ( !valid ) {
+        return NULL;
+    }
+
+    segment->m_descriptors = (const float *)(base + sizeof(SnapshotHeader));
+    segment->m_coarseDescriptors = segment->m_descriptors + (header.faceCount * kDescriptorLength);
+    segment->m_descriptorChecksum = header.descriptorChecksum;
+    sequence = header.sequence;
+    return segment;
+}
+
+FaceGallerySnapshot::FaceGallerySnapshot(const std::vector<std::shared_ptr<const FaceGallerySegment>> & segments,
+                                         const std::vector<bool> & removed, size_t removedCount, int64_t sequence, uint64_t generation)
+    : m_segments(segments), m_removed(removed), m_removedCount(removedCount), m_sequence(sequence), m_generation(generation)
+{
+    size_t end = 0;
+    for ( size_t i = 0; i < m_segments.size(); i++ ) {
+        end += m_segments[i]->size();
+        m_segmentEnds.push_back(end);
+    }
+}
+
+const FaceGallerySegment & FaceGallerySnapshot::locate(size_t row, size_t & index) const
+{
+    // There are only ever a handful of segments.
+    size_t segment = std::upper_bound(m_segmentEnds.begin(), m_segmentEnds.end(), row) - m_segmentEnds.begin();
+    index = row - ((segment > 0) ? m_segmentEnds[segment - 1] : 0);
+    return *m_segments[segment];
+}
+
+const FaceRecord & FaceGallerySnapshot::record(size_t row) const
+{
+    size_t index = 0;
+    const FaceGallerySegment & segment = locate(row, index);
+    return segment.record(index);
+}
+
+const float * FaceGallerySnapshot::descriptor(size_t row) const
+{
+    size_t index = 0;
+    const FaceGallerySegment & segment = locate(row, index);
+    return segment.descriptor(index);
+}
+
+const float * FaceGallerySnapshot::coarseDescriptor(size_t row) const
+{
+    size_t index = 0;
+    const FaceGallerySegment & segment = locate(row, index);
+    return segment.coarseDescriptor(index);
+}
+
+bool FaceGallerySnapshot::verifyDescriptors() const
+{
+    for ( size_t i = 0; i < m_segments.size(); i++ ) {
+        if ( !m_segments[i]->verifyDescriptors() ) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool FaceGallerySnapshot::save(const std::string & path) const
+{
+    std::string records;
+    for ( size_t row = 0; row < size(); row++ ) {
+        if ( m_removed[row] ) {
+            continue;
+        }
+        const FaceRecord & r = record(row);
+        writeString(records, r.faceID);
+        writeString(records, r.imageDocumentID);
+        writeString(records, r.thumbnailName);
+        records.append((const char *)r.rect, sizeof(r.rect));
+    }
+
+    size_t descriptorBytes = kDescriptorLength * sizeof(float);
+    size_t coarseDescriptorBytes = kCoarseDescriptorLength * sizeof(float);
+
+    SnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, kSnapshotMagic, sizeof(header.magic));
+    header.version = kSnapshotVersion;
+    header.descriptorLength = (uint32_t)kDescriptorLength;
+    header.coarseDescriptorLength = (uint32_t)kCoarseDescriptorLength;
+    header.faceCount = liveCount();
+    header.sequence = m_sequence;
+    header.recordsOffset = sizeof(SnapshotHeader) + (header.faceCount * (descriptorBytes + coarseDescriptorBytes));
+    header.recordsLength = records.size();
+
+    uLong descriptorChecksum = adler32(0L, Z_NULL, 0);
+    for ( size_t row = 0; row < size(); row++ ) {
+        if ( !m_removed[row] ) {
+            descriptorChecksum = updateChecksum(descriptorChecksum, descriptor(row), descriptorBytes);
+        }
+    }
+    for ( size_t row = 0; row < size(); row++ ) {
+        if ( !m_removed[row] ) {
+            descriptorChecksum = updateChecksum(descriptorChecksum, coarseDescriptor(row), coarseDescriptorBytes);
+        }
+    }
+    header.descriptorChecksum = (uint32_t)descriptorChecksum;
+
+    header.checksum = headerChecksum(header, records.data());
+
+    // Write to the side and rename so that a crash never leaves a half written snapshot in place.
+    std::string tempPath = path + ".tmp";
+    FILE * file = fopen(tempPath.c_str(), "wb");
+    if ( !file ) {
+        return false;
+    }
+
+    bool ok = (fwrite(&header, sizeof(header), 1, file) == 1);
+    for ( size_t row = 0; ok && row < size(); row++ ) {
+        if ( !m_removed[row] ) {
+            ok = (fwrite(descriptor(row), descriptorBytes, 1, file) == 1);
+        }
+    }
+    for ( size_t row = 0; ok && row < size(); row++ ) {
+        if ( !m_removed[row] ) {
+            ok = (fwrite(coarseDescriptor(row), coarseDescriptorBytes, 1, file) == 1);
+        }
+    }
+    if ( ok && records.size() > 0 ) {
+        ok = (fwrite(records.data(), records.size(), 1, file) == 1);
+    }
+
+    ok = (fclose(file) == 0) && ok;
+    ok = ok && (rename(tempPath.c_str(), path.c_str()) == 0);
+
+    if ( !ok ) {
+        unlink(tempPath.c_str());
+    }
+    return ok;
+}
+
+FaceGallery::FaceGallery()
+    : m_removedCount(0), m_sequence(0), m_generation(nextGeneration())
+{
+    publish();
+}
+
+std::shared_ptr<const FaceGallerySnapshot> FaceGallery::snapshot() const
+{
+    return std::atomic_load(&m_snapshot);
+}
+
+void FaceGallery::append(const FaceRecord & record, const float * descriptor)
+{
+    m_rowsByImage[record.imageDocumentID].push_back(m_removed.size());
+    m_removed.push_back(false);
+    m_pendingRecords.push_back(record);
+    m_pendingDescriptors.insert(m_pendingDescriptors.end(), descriptor, descriptor + kDescriptorLength);
+
+    m_pendingCoarseDescriptors.resize(m_pendingCoarseDescriptors.size() + kCoarseDescriptorLength);
+    coarsenDescriptor(descriptor, &m_pendingCoarseDescriptors[m_pendingCoarseDescriptors.size() - kCoarseDescriptorLength]);
+}
+
+size_t FaceGallery::removeImage(const std::string & imageDocumentID)
+{
+    std::unordered_map<std::string, std::vector<size_t>>::iterator it = m_rowsByImage.find(imageDocumentID);
+    if ( it == m_rowsByImage.end() ) {
+        return 0;
+    }
+
+    size_t count = it->second.size();
+    for ( size_t i = 0; i < count; i++ ) {
+        m_removed[it->second[i]] = true;
+    }
+    m_removedCount += count;
+    m_rowsByImage.erase(it);
+    return count;
+}
+
+void FaceGallery::clear()
+{
+    m_segments.clear();
+    m_pendingRecords.clear();
+    m_pendingDescriptors.clear();
+    m_pendingCoarseDescriptors.clear();
+    m_removed.clear();
+    m_removedCount = 0;
+    m_rowsByImage.clear();
+    m_sequence = 0;
+    m_generation = nextGeneration();
+}
+
+void FaceGallery::publish()
+{
+    if ( !m_pendingRecords.empty() ) {
+        m_segments.push_back(std::shared_ptr<const FaceGallerySegment>(new FaceGallerySegment(std::move(m_pendingRecords),
+                                                                                              std::move(m_pendingDescriptors),
+                                                                                              std::move(m_pendingCoarseDescriptors))));
+        m_pendingRecords.clear();
+        m_pendingDescriptors.clear();
+        m_pendingCoarseDescriptors.clear();
+
+        // Merge the newest segments while they're of similar size, like a binary counter.  That keeps the
+        // number of segments logarithmic and the cost of merging amortised.  Mapped segments stay as they are.
+        while ( m_segments.size() >= 2 ) {
+            const FaceGallerySegment & newest = *m_segments[m_segments.size() - 1];
+            const FaceGallerySegment & previous = *m_segments[m_segments.size() - 2];
+            if ( previous.isMapped() || previous.size() > 2 * newest.size() ) {
+                break;
+            }
+
+            std::shared_ptr<const FaceGallerySegment> merged = FaceGallerySegment::merge(previous, newest);
+            m_segments.pop_back();
+            m_segments.back() = merged;
+        }
+    }
+
+    std::shared_ptr<const FaceGallerySnapshot> snapshot(new FaceGallerySnapshot(m_segments, m_removed, m_removedCount, m_sequence, m_generation));
+    std::atomic_store(&m_snapshot, snapshot);
+}
+
+bool FaceGallery::load(const std::string & path)
+{
+    clear();
+
+    int64_t sequence = 0;
+    std::shared_ptr<const FaceGallerySegment> segment = FaceGallerySegment::map(path, sequence);
+
+    if ( segment ) {
+        for ( size_t row = 0; row < segment->size(); row++ ) {
+            m_rowsByImage[segment->record(row).imageDocumentID].push_back(row);
+        }
+        m_segments.push_back(segment);
+        m_removed.assign(segment->size(), false);
+        m_sequence = sequence;
+    }
+
+    publish();
+    return segment != NULL;
+}
+
+}
@@ -0,0 +1,217 @@
+//
+//  FaceGallery.hpp
+//  CBIRDatabase
+//
+//  Created by Joseph Carson on 10/19/16.
+//  Copyright © 2016 Joseph Carson. All rights reserved.
+//
+
+#ifndef FaceGallery_hpp
+#define FaceGallery_hpp
+
+#include <stdint.h>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace cbir {
+
+// Everything about a stored face that a query needs, except for its descriptor.
+struct FaceRecord
+{
+    std::string faceID;
+    std::string imageDocumentID;
+
+    // Name of the face crop JPEG attachment in the image document.
+    std::string thumbnailName;
+
+    // x, y, width, height of the face in the source image.
+    float rect[4];
+};
+
+// An immutable run of faces: a record, a descriptor and a coarse descriptor (see FaceDescriptor.hpp) per face,
+// with each kind of descriptor stored contiguously.  The descriptors are either owned or mapped from a snapshot file.
+class FaceGallerySegment
+{
+public:
+
+    FaceGallerySegment(std::vector<FaceRecord> && records, std::vector<float> && descriptors, std::vector<float> && coarseDescriptors);
+
+    // Maps the snapshot file at the given path.  Returns NULL if it's missing, of another version, or corrupt.
+    // Only the header and records are checked, the descriptors are left to verifyDescriptors().
+    static std::shared_ptr<const FaceGallerySegment> map(const std::string & path, int64_t & sequence);
+
+    // A new owned segment holding the rows of a followed by the rows of b.
+    static std::shared_ptr<const FaceGallerySegment> merge(const FaceGallerySegment & a, const FaceGallerySegment & b);
+
+    ~FaceGallerySegment();
+
+    size_t size() const { return m_records.size(); }
+
+    bool isMapped() const { return m_map != NULL; }
+
+    // Whether the descriptors of a mapped segment match the checksum they were saved with.  Reads every one of
+    // them, so it's for the background.  Owned segments always pass.
+    bool verifyDescriptors() const;
+
+    const FaceRecord & record(size_t i) const { return m_records[i]; }
+
+    const float * descriptor(size_t i) const;
+    const float * coarseDescriptor(size_t i) const;
+
+private:
+
+    FaceGallerySegment();
+    FaceGallerySegment(const FaceGallerySegment &);
+    FaceGallerySegment & operator=(const FaceGallerySegment &);
+
+    std::vector<FaceRecord> m_records;
+
+    // Owned descriptors.  Empty for mapped segments.
+    std::vector<float> m_ownedDescriptors;
+    std::vector<float> m_ownedCoarseDescriptors;
+
+    const float * m_descriptors;
+    const float * m_coarseDescriptors;
+    void * m_map;
+    size_t m_mapLength;
+    uint32_t m_descriptorChecksum;
+};
+
+// A consistent, immutable view of the gallery at one database sequence.  Any number of threads can read
+// a snapshot while the gallery moves on.  Whatever it references stays alive until the last reader lets go.
+class FaceGallerySnapshot
+{
+public:
+
+    FaceGallerySnapshot(const std::vector<std::shared_ptr<const FaceGallerySegment>> & segments,
+                        const std::vector<bool> & removed, size_t removedCount, int64_t sequence, uint64_t generation);
+
+    // The number of rows, including removed ones.  Scans should skip rows that are isRemoved().
+    size_t size() const { return m_removed.size(); }
+
+    // The number of rows that haven't been removed.
+    size_t liveCount() const { return m_removed.size() - m_removedCount; }
+
+    bool isRemoved(size_t row) const { return m_removed[row]; }
+
+    // The database sequence number that the snapshot reflects.
+    int64_t sequence() const { return m_sequence; }
+
+    // Snapshots of the same generation number their rows the same way, later ones only having more of them.
+    // See FaceGallery::generation().
+    uint64_t generation() const { return m_generation; }
+
+    const FaceRecord & record(size_t row) const;
+
+    const float * descriptor(size_t row) const;
+    const float * coarseDescriptor(size_t row) const;
+
+    // Whether every mapped descriptor is as it was saved.  See FaceGallerySegment::verifyDescriptors().
+    bool verifyDescriptors() const;
+
+    // Writes the live rows to the snapshot file at the given path.  The file is replaced atomically.
+    bool save(const std::string & path) const;
+
+private:
+
+    // The segment holding the row, and the row's index within it.
+    const FaceGallerySegment & locate(size_t row, size_t & index) const;
+
+    std::vector<std::shared_ptr<const FaceGallerySegment>> m_segments;
+
+    // Row at which each segment ends.
+    std::vector<size_t> m_segmentEnds;
+
+    std::vector<bool> m_removed;
+    size_t m_removedCount;
+    int64_t m_sequence;
+    uint64_t m_generation;
+};
+
+// The query-ready set of all indexed faces, so that they can be scanned without touching the database.
+//
+// There's a single writer, which appends and removes faces then publish()es the result.  Publishing seals
+// the appended faces into a new segment and swaps in a new snapshot, which readers pick up with snapshot().
+// Segments are shared between snapshots, so publishing doesn't copy descriptors, other than the occasional
+// merge of small segments that keeps their number logarithmic in the number of faces.  Old snapshots are
+// reclaimed by reference counting once their last reader is done.
+//
+// The gallery can be saved to a snapshot file and mapped back in at startup, which is much cheaper
+// than rebuilding it from the database.  The snapshot remembers the database sequence number it was
+// built at, so that the caller can tell whether it's stale.
+//
+// Within a generation, rows are only ever appended, so a row means the same face in every snapshot.  Clearing
+// or loading the gallery renumbers the rows, so it starts a new generation.  Generations are unique across all
+// galleries and only go up, so that whatever is keyed by row can tell which snapshots it matches, and which is
+// newer.
+//
+// Snapshot layout.
+// [header][descriptors: faceCount * kDescriptorLength floats][coarse descriptors: faceCount * kCoarseDescriptorLength floats][records]
+//
+// Only snapshot() is thread safe, everything else belongs to the writer.
+class FaceGallery
+{
+public:
+
+    FaceGallery();
+
+    // The latest published snapshot.  Can be called from any thread.
+    std::shared_ptr<const FaceGallerySnapshot> snapshot() const;
+
+    // The number of rows, including unpublished and removed ones.
+    size_t size() const { return m_removed.size(); }
+
+    // The database sequence number that the writer is at.
+    int64_t sequence() const { return m_sequence; }
+    void setSequence(int64_t sequence) { m_sequence = sequence; }
+
+    uint64_t generation() const { return m_generation; }
+
+    // Appends a face.  The descriptor is copied, and coarsened.
+    void append(const FaceRecord & record, const float * descriptor);
+
+    // Marks every face of the given image removed.  Returns how many were.
+    size_t removeImage(const std::string & imageDocumentID);
+
+    // Removes all faces.
+    void clear();
+
+    // Makes the changes since the last publish visible to readers.
+    void publish();
+
+    // Replaces the contents of the gallery with the snapshot file at the given path, and publishes it.
+    // Fails, leaving the gallery empty, if the file is missing, of another version, or corrupt.  Corrupt
+    // descriptors aren't caught until the published snapshot is verified.
+    bool load(const std::string & path);
+
+private:
+
+    FaceGallery(const FaceGallery &);
+    FaceGallery & operator=(const FaceGallery &);
+
+    // Sealed segments, in row order.
+    std::vector<std::shared_ptr<const FaceGallerySegment>> m_segments;
+
+    // Faces appended since the last publish.
+    std::vector<FaceRecord> m_pendingRecords;
+    std::vector<float> m_pendingDescriptors;
+    std::vector<float> m_pendingCoarseDescriptors;
+
+    std::vector<bool> m_removed;
+    size_t m_removedCount;
+
+    // The live rows of each image.
+    std::unordered_map<std::string, std::vector<size_t>> m_rowsByImage;
+
+    int64_t m_sequence;
+    uint64_t m_generation;
+
+    // Only accessed through std::atomic_load and std::atomic_store.
+    std::shared_ptr<const FaceGallerySnapshot> m_snapshot;
+};
+
+}
+
+#endif /* FaceGallery_hpp */
@@ -0,0 +1,553 @@
+//
+//  FaceHnswIndex.cpp
+//  CBIRDatabase
+//
+//  Created by Joseph Carson on 10/19/16.
+//  Copyright © 2016 Joseph Carson. All rights reserved.
+//
+
+#include "FaceHnswIndex.hpp"
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <algorithm>
+#include <functional>
+#include <queue>
+
+namespace cbir {
+
+// Bump the version whenever the layout of the index file, or the embedding, changes.
+static const char kIndexMagic[8] = {'C', 'B', 'I', 'R', 'H', 'N', 'S', '\0'};
+static const uint32_t kIndexVersion = 1;
+
+// Marks the nodes that saving leaves out.
+static const uint32_t kDropped = UINT32_MAX;
+
+struct IndexHeader
+{
+    char magic[8];
+    uint32_t version;
+
+    // adler32 of everything following the header.
+    uint32_t checksum;
+    uint64_t nodeCount;
+    uint64_t embeddingLength;
+    uint64_t m;
+    int64_t entryPoint;
+    int32_t maxLevel;
+    int32_t reserved;
+    int64_t sequence;
+};
+
+// Holds the index's lock for reading, or writing, for as long as it lives.
+class ReadLock
+{
+public:
+    explicit ReadLock(pthread_rwlock_t & lock) : m_lock(lock) { pthread_rwlock_rdlock(&m_lock); }
+    ~ReadLock() { pthread_rwlock_unlock(&m_lock); }
+
+private:
+    ReadLock(const ReadLock &);
+    ReadLock & operator=(const ReadLock &);
+
+    pthread_rwlock_t & m_lock;
+};
+
+class WriteLock
+{
+public:
+    explicit WriteLock(pthread_rwlock_t & lock) : m_lock(lock) { pthread_rwlock_wrlock(&m_lock); }
+    ~WriteLock() { pthread_rwlock_unlock(&m_lock); }
+
+private:
+    WriteLock(const WriteLock &);
+    WriteLock & operator=(const WriteLock &);
+
+    pthread_rwlock_t & m_lock;
+};
+
+// Copies the next length bytes of the body out, if there are that many left.
+static bool readBytes(const char *& in, const char * end, void * out, size_t length)
+{
+    if ( (size_t)(end - in) < length ) {
+        return false;
+    }
+    if ( length > 0 ) {
+        memcpy(out, in, length);
+        in += length;
+    }
+    return true;
+}
+
+FaceHnswIndex::FaceHnswIndex(const HnswParams & params)
+    : m_params(params), m_levelMultiplier(1.0 / log((double)std::max<size_t>(params.m, 2))),
+      m_entryPoint(-1), m_maxLevel(-1), m_sequence(0), m_generation(0), m_stopped(false)
+{
+    pthread_rwlock_init(&m_lock, NULL);
+}
+
+FaceHnswIndex::~FaceHnswIndex()
+{
+    pthread_rwlock_destroy(&m_lock);
+}
+
+size_t FaceHnswIndex::size() const
+{
+    ReadLock lock(m_lock);
+    return m_faceIDs.size();
+}
+
+int64_t FaceHnswIndex::sequence() const
+{
+    ReadLock lock(m_lock);
+    return m_sequence;
+}
+
+std::unique_ptr<FaceHnswIndex::VisitList> FaceHnswIndex::takeVisitList() const
+{
+    std::unique_ptr<VisitList> visited;
+    {
+        std::lock_guard<std::mutex> lock(m_visitListsMutex);
+        if ( !m_visitLists.empty() ) {
+            visited = std::move(m_visitLists.back());
+            m_visitLists.pop_back();
+        }
+    }
+
+    if ( !visited ) {
+        visited.reset(new VisitList());
+    }
+    if ( visited->marks.size() < m_faceIDs.size() ) {
+        visited->marks.resize(m_faceIDs.size(), 0);
+    }
+    return visited;
+}
+
+void FaceHnswIndex::returnVisitList(std::unique_ptr<VisitList> visited) const
+{
+    std::lock_guard<std::mutex> lock(m_visitListsMutex);
+    m_visitLists.push_back(std::move(visited));
+}
+
+void FaceHnswIndex::clear()
+{
+    m_embeddings.clear();
+    m_faceIDs.clear();
+    m_levels.clear();
+    m_links.clear();
+    m_entryPoint = -1;
+    m_maxLevel = -1;
+    m_sequence = 0;
+}
+
+bool FaceHnswIndex::update(const FaceGallerySnapshot & gallery)
+{
+    size_t start = 0;
+
+    // Carry on from the last update if the gallery is of the same generation, so has only grown since, and start
+    // over if it's newer.  An older one has nothing left to add.
+    {
+        WriteLock lock(m_lock);
+        if ( gallery.generation() < m_generation ) {
+            return true;
+        }
+        if ( gallery.generation() != m_generation ) {
+            clear();
+            m_generation = gallery.generation();
+        }
+        start = m_faceIDs.size();
+    }
+
+    std::vector<float> embedding(kEmbeddingLength);
+
+    for ( size_t row = start; row < gallery.size(); row++ ) {
+        if ( m_stopped ) {
+            return false;
+        }
+
+        embedCoarseDescriptor(gallery.coarseDescriptor(row), embedding.data());
+
+        // A load may have swapped in another generation between inserts.
+        WriteLock lock(m_lock);
+        if ( m_generation != gallery.generation() ) {
+            return true;
+        }
+        if ( row == m_faceIDs.size() ) {
+            insert(gallery.record(row).faceID, embedding.data(), gallery.isRemoved(row));
+        }
+    }
+
+    WriteLock lock(m_lock);
+    if ( m_generation == gallery.generation() && m_faceIDs.size() == gallery.size() ) {
+        m_sequence = gallery.sequence();
+    }
+    return true;
+}
+
+void FaceHnswIndex::insert(const std::string & faceID, const float * embedding, bool removed)
+{
+    uint32_t node = (uint32_t)m_faceIDs.size();
+
+    // The odds of a node reaching each level up fall by a factor of m.
+    std::uniform_real_distribution<double> uniform(0.0, 1.0);
+    int level = removed ? -1 : (int)floor(-log(1.0 - uniform(m_random)) * m_levelMultiplier);
+
+    m_embeddings.insert(m_embeddings.end(), embedding, embedding + kEmbeddingLength);
+    m_faceIDs.push_back(faceID);
+    m_levels.push_back(level);
+    m_links.push_back(std::vector<std::vector<uint32_t>>(level + 1));
+
+    if ( level < 0 ) {
+        return;
+    }
+
+    if ( m_entryPoint < 0 ) {
+        m_entryPoint = node;
+        m_maxLevel = level;
+        return;
+    }
+
+    std::unique_ptr<VisitList> visited = takeVisitList();
+
+    // Head straight for the nearest node on each level above the node's own...
+    uint32_t entryPoint = (uint32_t)m_entryPoint;
+    std::vector<Candidate> entryPoints(1, Candidate(embeddingDistance(embedding, this->embedding(entryPoint)), entryPoint));
+    for ( int l = m_maxLevel; l > level; l-- ) {
+        entryPoints[0] = searchLevel(embedding, entryPoints, 1, l, *visited).front();
+    }
+
+    // ...then link it to its neighbours on each of its own, and them back to it.
+    for ( int l = std::min(level, m_maxLevel); l >= 0; l-- ) {
+        std::vector<Candidate> nearest = searchLevel(embedding, entryPoints, m_params.efConstruction, l, *visited);
+
+        m_links[node][l] = selectNeighbors(nearest, m_params.m);
+        for ( size_t i = 0; i < m_links[node][l].size(); i++ ) {
+            addLink(m_links[node][l][i], node, l);
+        }
+
+        entryPoints.swap(nearest);
+    }
+    returnVisitList(std::move(visited));
+
+    if ( level > m_maxLevel ) {
+        m_entryPoint = node;
+        m_maxLevel = level;
+    }
+}
+
+std::vector<FaceHnswIndex::Candidate> FaceHnswIndex::searchLevel(const float * embedding, const std::vector<Candidate> & entryPoints,
+                                                                 size_t ef, int level, VisitList & visited) const
+{
+    if ( ++visited.tag == 0 ) {
+        std::fill(visited.marks.begin(), visited.marks.end(), 0);
+        visited.tag = 1;
+    }
+
+    // The nodes left to expand, nearest on top, and the ef nearest found so far, furthest on top.
+    std::priority_queue<Candidate, std::vector<Candidate>, std::greater<Candidate>> pending;
+    std::priority_queue<Candidate> nearest;
+
+    for ( size_t i = 0; i < entryPoints.size(); i++ ) {
+        visited.marks[entryPoints[i].second] = visited.tag;
+        pending.push(entryPoints[i]);
+        nearest.push(entryPoints[i]);
+        if ( nearest.size() > ef ) {
+            nearest.pop();
+        }
+    }
+
+    while ( !pending.empty() ) {
+        Candidate current = pending.top();
+
+        // Everything left to expand is further than everything kept.
+        if ( nearest.size() >= ef && current.first > nearest.top().first ) {
+            break;
+        }
+        pending.pop();
+
+        const std::vector<uint32_t> & links = m_links[current.second][level];
+        for ( size_t i = 0; i < links.size(); i++ ) {
+            uint32_t neighbor = links[i];
+            if ( visited.marks[neighbor] == visited.tag ) {
+                continue;
+            }
+            visited.marks[neighbor] = visited.tag;
+
+            float distance = embeddingDistance(embedding, this->embedding(neighbor));
+            if ( nearest.size() < ef || distance < nearest.top().first ) {
+                pending.push(Candidate(distance, neighbor));
+                nearest.push(Candidate(distance, neighbor));
+                if ( nearest.size() > ef ) {
+                    nearest.pop();
+                }
+            }
+        }
+    }
+
+    std::vector<Candidate> result(nearest.size());
+    for ( size_t i = result.size(); i > 0; i-- ) {
+        result[i - 1] = nearest.top();
+        nearest.pop();
+    }
+    return result;
+}
+
+std::vector<uint32_t> FaceHnswIndex::selectNeighbors(const std::vector<Candidate> & candidates, size_t count) const
+{
+    std::vector<uint32_t> selected;
+
+    for ( size_t i = 0; i < candidates.size() && selected.size() < count; i++ ) {
+        const float * candidate = embedding(candidates[i].second);
+
+        bool spreads = true;
+        for ( size_t j = 0; j < selected.size() && spreads; j++ ) {
+            spreads = embeddingDistance(candidate, embedding(selected[j])) >= candidates[i].first;
+        }
+        if ( spreads ) {
+            selected.push_back(candidates[i].second);
+        }
+    }
+
+    return selected;
+}
+
+void FaceHnswIndex::addLink(uint32_t node, uint32_t neighbor, int level)
+{
+    std::vector<uint32_t> & links = m_links[node][level];
+    links.push_back(neighbor);
+    if ( links.size() <= maxLinks(level) ) {
+        return;
+    }
+
+    // Too many, so pick the ones to keep the same way as when the node went in.
+    std::vector<Candidate> candidates(links.size());
+    for ( size_t i = 0; i < links.size(); i++ ) {
+        candidates[i] = Candidate(embeddingDistance(embedding(node), embedding(links[i])), links[i]);
+    }
+    std::sort(candidates.begin(), candidates.end());
+    links = selectNeighbors(candidates, maxLinks(level));
+}
+
+bool FaceHnswIndex::search(const FaceGallerySnapshot & gallery, const float * embedding, size_t count, size_t ef,
+                           std::vector<ScoredRow> & nearest, size_t & indexedRows) const
+{
+    ReadLock lock(m_lock);
+    nearest.clear();
+
+    // The index may be ahead of the snapshot as well as behind it, but it must number the rows the same way.
+    size_t covered = std::min(m_faceIDs.size(), gallery.size());
+    if ( covered == 0 || gallery.generation() != m_generation ) {
+        return false;
+    }
+    indexedRows = covered;
+
+    if ( m_entryPoint < 0 ) {
+        return true;
+    }
+
+    std::unique_ptr<VisitList> visited = takeVisitList();
+
+    uint32_t entryPoint = (uint32_t)m_entryPoint;
+    std::vector<Candidate> entryPoints(1, Candidate(embeddingDistance(embedding, this->embedding(entryPoint)), entryPoint));
+    for ( int l = m_maxLevel; l > 0; l-- ) {
+        entryPoints[0] = searchLevel(embedding, entryPoints, 1, l, *visited).front();
+    }
+
+    std::vector<Candidate> found = searchLevel(embedding, entryPoints, std::max(ef, count), 0, *visited);
+    returnVisitList(std::move(visited));
+    for ( size_t i = 0; i < found.size() && nearest.size() < count; i++ ) {
+        size_t row = found[i].second;
+        if ( row < covered && !gallery.isRemoved(row) ) {
+            ScoredRow entry = { found[i].first, row };
+            nearest.push_back(entry);
+        }
+    }
+
+    return true;
+}
+
+bool FaceHnswIndex::save(const std::string & path, const FaceGallerySnapshot & gallery) const
+{
+    std::string body;
+    IndexHeader header;
+    memset(&header, 0, sizeof(header));
+    header.entryPoint = -1;
+    header.maxLevel = -1;
+
+    {
+        ReadLock lock(m_lock);
+
+        // Only the nodes of rows that are live in the snapshot are kept, and numbered the way the snapshot's save
+        // numbers their rows.  An index of another generation has none of them.
+        size_t covered = gallery.generation() == m_generation ? std::min(m_faceIDs.size(), gallery.size()) : 0;
+        std::vector<uint32_t> renumbered(covered, kDropped);
+        uint32_t kept = 0;
+        for ( size_t node = 0; node < covered; node++ ) {
+            if ( !gallery.isRemoved(node) ) {
+                renumbered[node] = kept++;
+            }
+        }
+
+        // Dropping the entry point takes the top of the graph with it, so the highest node left takes over.
+        int64_t entryPoint = (m_entryPoint >= 0 && (size_t)m_entryPoint < covered) ? m_entryPoint : -1;
+        if ( entryPoint < 0 || renumbered[entryPoint] == kDropped ) {
+            entryPoint = -1;
+            for ( size_t node = 0; node < covered; node++ ) {
+                if ( renumbered[node] != kDropped && m_levels[node] >= 0 && (entryPoint < 0 || m_levels[node] > m_levels[entryPoint]) ) {
+                    entryPoint = node;
+                }
+            }
+        }
+
+        std::vector<uint32_t> links;
+        for ( size_t node = 0; node < covered; node++ ) {
+            if ( renumbered[node] == kDropped ) {
+                continue;
+            }
+
+            int32_t level = m_levels[node];
+            uint32_t length = (uint32_t)m_faceIDs[node].size();
+            body.append((const char *)&level, sizeof(level));
+            body.append((const char *)&length, sizeof(length));
+            body.append(m_faceIDs[node]);
+            body.append((const char *)embedding((uint32_t)node), kEmbeddingLength * sizeof(float));
+
+            for ( int l = 0; l <= level; l++ ) {
+                links.clear();
+                for ( size_t i = 0; i < m_links[node][l].size(); i++ ) {
+                    uint32_t neighbor = m_links[node][l][i];
+                    if ( neighbor < covered && renumbered[neighbor] != kDropped ) {
+                        links.push_back(renumbered[neighbor]);
+                    }
+                }
+                uint32_t linkCount = (uint32_t)links.size();
+                body.append((const char *)&linkCount, sizeof(linkCount));
+                body.append((const char *)links.data(), linkCount * sizeof(uint32_t));
+            }
+        }
+
+        header.nodeCount = kept;
+        if ( entryPoint >= 0 ) {
+            header.entryPoint = renumbered[entryPoint];
+            header.maxLevel = m_levels[entryPoint];
+        }
+        header.sequence = (covered == gallery.size()) ? gallery.sequence() : 0;
+    }
+
+    memcpy(header.magic, kIndexMagic, sizeof(header.magic));
+    header.version = kIndexVersion;
+    header.embeddingLength = kEmbeddingLength;
+    header.m = m_params.m;
+    header.checksum = (uint32_t)adler32(adler32(0L, Z_NULL, 0), (const Bytef *)body.data(), (uInt)body.size());
+
+    // Write to the side and rename so that a crash never leaves a half written file in place.
+    std::string tempPath = path + ".tmp";
+    FILE * file = fopen(tempPath.c_str(), "wb");
+    if ( !file ) {
+        return false;
+    }
+
+    bool ok = (fwrite(&header, sizeof(header), 1, file) == 1);
+    if ( ok && body.size() > 0 ) {
+        ok = (fwrite(body.data(), body.size(), 1, file) == 1);
+    }
+
+    ok = (fclose(file) == 0) && ok;
+    ok = ok && (rename(tempPath.c_str(), path.c_str()) == 0);
+
+    if ( !ok ) {
+        unlink(tempPath.c_str());
+    }
+    return ok;
+}
+
+bool FaceHnswIndex::load(const std::string & path, const FaceGallerySnapshot & gallery)
+{
+    IndexHeader header;
+    std::string body;
+
+    FILE * file = fopen(path.c_str(), "rb");
+    bool valid = (file != NULL) && (fread(&header, sizeof(header), 1, file) == 1);
+
+    if ( valid ) {
+        char buffer[64 * 1024];
+        size_t count = 0;
+        while ( (count = fread(buffer, 1, sizeof(buffer), file)) > 0 ) {
+            body.append(buffer, count);
+        }
+        valid = memcmp(header.magic, kIndexMagic, sizeof(header.magic)) == 0 &&
+                header.version == kIndexVersion &&
+                header.embeddingLength == kEmbeddingLength &&
+                header.m == m_params.m &&
+                header.nodeCount <= gallery.size() &&
+                header.checksum == (uint32_t)adler32(adler32(0L, Z_NULL, 0), (const Bytef *)body.data(), (uInt)body.size()) &&
+                header.entryPoint < (int64_t)header.nodeCount;
+    }
+    if ( file ) {
+        fclose(file);
+    }
+
+    WriteLock lock(m_lock);
+    clear();
+
+    const char * in = body.data();
+    const char * end = in + body.size();
+    for ( uint64_t node = 0; valid && node < header.nodeCount; node++ ) {
+        int32_t level = 0;
+        uint32_t length = 0;
+        valid = readBytes(in, end, &level, sizeof(level)) && level <= header.maxLevel &&
+                readBytes(in, end, &length, sizeof(length)) && (size_t)(end - in) >= length;
+        if ( !valid ) {
+            break;
+        }
+
+        // Each node must be the face at the same row of the gallery.
+        m_faceIDs.push_back(std::string(in, length));
+        in += length;
+        if ( m_faceIDs.back() != gallery.record(node).faceID ) {
+            valid = false;
+            break;
+        }
+
+        m_embeddings.resize(m_embeddings.size() + kEmbeddingLength);
+        valid = readBytes(in, end, &m_embeddings[m_embeddings.size() - kEmbeddingLength], kEmbeddingLength * sizeof(float));
+
+        m_levels.push_back(std::max(level, -1));
+        m_links.push_back(std::vector<std::vector<uint32_t>>(std::max(level + 1, 0)));
+        for ( int l = 0; valid && l <= level; l++ ) {
+            uint32_t linkCount = 0;
+            valid = readBytes(in, end, &linkCount, sizeof(linkCount)) && linkCount <= maxLinks(l);
+            if ( valid ) {
+                m_links.back()[l].resize(linkCount);
+                valid = readBytes(in, end, m_links.back()[l].data(), linkCount * sizeof(uint32_t));
+            }
+        }
+    }
+
+    // Links must lead to nodes that are on the level they're linked on, or a walk would go astray.
+    for ( size_t node = 0; valid && node < m_links.size(); node++ ) {
+        for ( size_t l = 0; valid && l < m_links[node].size(); l++ ) {
+            for ( size_t i = 0; valid && i < m_links[node][l].size(); i++ ) {
+                uint32_t neighbor = m_links[node][l][i];
+                valid = neighbor < m_levels.size() && m_levels[neighbor] >= (int)l;
+            }
+        }
+    }
+    valid = valid && (header.entryPoint < 0 || m_levels[header.entryPoint] == header.maxLevel);
+
+    if ( !valid ) {
+        clear();
+        return false;
+    }
+
+    m_entryPoint = header.entryPoint;
+    m_maxLevel = header.maxLevel;
+    m_sequence = header.sequence;
+    m_generation = gallery.generation();
+    return true;
+}
+
+}
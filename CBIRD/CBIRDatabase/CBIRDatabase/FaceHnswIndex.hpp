@@ -0,0 +1,175 @@
+//
+//  FaceHnswIndex.hpp
+//  CBIRDatabase
+//
+//  Created by Joseph Carson on 10/19/16.
+//  Copyright © 2016 Joseph Carson. All rights reserved.
+//
+
+#ifndef FaceHnswIndex_hpp
+#define FaceHnswIndex_hpp
+
+#include <pthread.h>
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "FaceDescriptor.hpp"
+#include "FaceGallery.hpp"
+#include "TopKCollector.hpp"
+
+namespace cbir {
+
+// How the index trades build and search time for recall.
+struct HnswParams
+{
+    // Links per face on the upper layers, twice as many on the bottom one.  More links find more of the
+    // true neighbours at the cost of memory and time.
+    size_t m;
+
+    // How many candidates insertion and search keep track of while they walk the graph.  A search always
+    // keeps at least as many as it's asked for.
+    size_t efConstruction;
+    size_t efSearch;
+
+    HnswParams() : m(16), efConstruction(100), efSearch(64) {}
+};
+
+// A Hierarchical Navigable Small World graph over the embeddings of the gallery's faces (see
+// embedCoarseDescriptor()), so that the candidates nearest a probe are found by walking a few hundred faces
+// rather than scanning them all.  Each face is a node on the bottom layer and, with exponentially falling odds,
+// on the layers above it, which link it to faces further away.  A search drops down from the sparse top layer,
+// getting closer at each, then widens out on the bottom one.
+//
+// Like the neighbour graph, the index keys faces by gallery row, so it belongs to one generation of the gallery
+// (see FaceGallery), and update() inserts the rows added since the last one.  Nothing is inserted on the indexing
+// path itself.  Each publish kicks off the engine's background catch-up, which calls update() with the new
+// snapshot, and until that's done searches get the rows past indexedRows to look through some other way.  Removed
+// faces stay in the graph as waypoints and are left out of results.  The embedding distance only approximates the
+// Chi-Square one, so what a search finds are candidates for the full comparison.
+//
+// The index is saved next to the gallery snapshot, from the same snapshot, and renumbered the same way, so that
+// the two load back in together.  Loading checks every node against the face at its row of the gallery, so that
+// a relaunch only inserts the faces indexed since.
+//
+// Thread safe, but only one thread may update() at a time.  Searches share a readers-writer lock, so any number
+// of them walk the graph side by side.  Each insert takes it for writing on its own, so a search never waits for
+// more than one face to go in.
+class FaceHnswIndex
+{
+public:
+
+    explicit FaceHnswIndex(const HnswParams & params = HnswParams());
+
+    ~FaceHnswIndex();
+
+    const HnswParams & params() const { return m_params; }
+
+    // Inserts the faces of the snapshot that aren't in the index yet, or starts over if the snapshot is of a newer
+    // generation.  Returns false if stopped before it was done.
+    bool update(const FaceGallerySnapshot & gallery);
+
+    // Makes a running or future update() give up as soon as it can.
+    void stop() { m_stopped = true; }
+
+    // The count nearest faces to the embedding, as rows of the snapshot, nearest first, searching with at least ef
+    // candidates.  Faces removed from the snapshot are left out.  Only the first indexedRows rows of the snapshot
+    // are in the index, so rows from there on need searching some other way.  Returns false if the index doesn't
+    // cover the snapshot at all, e.g. it's empty or of another generation.
+    bool search(const FaceGallerySnapshot & gallery, const float * embedding, size_t count, size_t ef,
+                std::vector<ScoredRow> & nearest, size_t & indexedRows) const;
+
+    // The number of rows in the index, including removed ones.
+    size_t size() const;
+
+    // The database sequence number of the snapshot that the index has caught up with.
+    int64_t sequence() const;
+
+    // Saves the index to the file at the given path, which is replaced atomically.  Only the nodes of rows that are
+    // live in the snapshot are saved, renumbered the same way as FaceGallerySnapshot::save() does, and links to the
+    // rest are dropped.  An index of another generation saves empty.
+    bool save(const std::string & path, const FaceGallerySnapshot & gallery) const;
+
+    // Replaces the index with the one saved at the given path, as long as each of its nodes is the face at the same
+    // row of the gallery, and adopts the gallery's generation.  Fails, leaving the index empty, if the file is
+    // missing, doesn't match, was saved with other params, of another version, or corrupt.
+    bool load(const std::string & path, const FaceGallerySnapshot & gallery);
+
+private:
+
+    FaceHnswIndex(const FaceHnswIndex &);
+    FaceHnswIndex & operator=(const FaceHnswIndex &);
+
+    typedef std::pair<float, uint32_t> Candidate;
+
+    // Marks the nodes visited by a walk.  A walk is visiting a node when its mark is the tag, so starting a new
+    // walk is just bumping the tag.  Each search or insert takes one of its own from a pool.
+    struct VisitList
+    {
+        std::vector<uint32_t> marks;
+        uint32_t tag;
+
+        VisitList() : tag(0) {}
+    };
+
+    // A visit list with a mark for every node.  Needs the lock, for reading at least.
+    std::unique_ptr<VisitList> takeVisitList() const;
+    void returnVisitList(std::unique_ptr<VisitList> visited) const;
+
+    const float * embedding(uint32_t node) const { return &m_embeddings[(size_t)node * kEmbeddingLength]; }
+
+    size_t maxLinks(int level) const { return level == 0 ? m_params.m * 2 : m_params.m; }
+
+    // Adds a node for the next row.  Removed rows get a node that isn't linked into the graph.
+    void insert(const std::string & faceID, const float * embedding, bool removed);
+
+    // The ef nearest nodes to the embedding on the level, reachable from the entry points, nearest first.
+    std::vector<Candidate> searchLevel(const float * embedding, const std::vector<Candidate> & entryPoints,
+                                       size_t ef, int level, VisitList & visited) const;
+
+    // Picks up to count of the candidates, nearest first, skipping any that are nearer to one already picked than
+    // to the embedding, so that the links spread out in every direction rather than bunching up.
+    std::vector<uint32_t> selectNeighbors(const std::vector<Candidate> & candidates, size_t count) const;
+
+    // Links from the node to a new neighbour, pruning its links if there are too many.
+    void addLink(uint32_t node, uint32_t neighbor, int level);
+
+    void clear();
+
+    HnswParams m_params;
+    double m_levelMultiplier;
+
+    // Everything from here to m_visitLists is guarded by m_lock.  Searches read under it, the rest writes.
+    mutable pthread_rwlock_t m_lock;
+
+    std::vector<float> m_embeddings;
+    std::vector<std::string> m_faceIDs;
+
+    // The top level of each node, or -1 for a node that isn't in the graph.
+    std::vector<int> m_levels;
+
+    // Per node, its links on each of its levels.
+    std::vector<std::vector<std::vector<uint32_t>>> m_links;
+
+    int64_t m_entryPoint;
+    int m_maxLevel;
+    int64_t m_sequence;
+    uint64_t m_generation;
+
+    std::mt19937 m_random;
+
+    // Visit lists not in use.  Guarded by m_visitListsMutex.
+    mutable std::vector<std::unique_ptr<VisitList>> m_visitLists;
+    mutable std::mutex m_visitListsMutex;
+
+    std::atomic<bool> m_stopped;
+};
+
+}
+
+#endif /* FaceHnswIndex_hpp */
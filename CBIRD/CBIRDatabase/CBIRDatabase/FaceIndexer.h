@@ -21,6 +21,26 @@
 @end
 
 
+// The features extracted from a FaceLBP.  Lives in memory only, nothing about it touches the database.
+@interface FaceFeatures : NSObject
+
+@property(nonatomic, readonly) CGRect faceRect;
+
+// All block histograms of the face, back to back in feature index order.  That is
+// FACE_INDEXER_GRID_WIDTH_IN_BLOCKS * FACE_INDEXER_GRID_HEIGHT_IN_BLOCKS histograms of
+// FACE_INDEXER_HISTOGRAM_BIN_COUNT floats each, the same layout as the kCBIRHistogramImage attachment.
+@property(nonatomic, readonly) NSData * histogramImage;
+
+// JPEG of the cropped face.  Only rendered when indexing, queries have no use for it.
+@property(nonatomic, readonly) NSData * croppedFaceJPEG;
+
+-(instancetype) initWithRect:(CGRect)rect histogramImage:(NSData *)histogramImage;
+
+-(instancetype) initWithRect:(CGRect)rect histogramImage:(NSData *)histogramImage croppedFaceJPEG:(NSData *)croppedFaceJPEG;
+
+@end
+
+
 
 
 @class CIFilter;
@@ -37,12 +57,32 @@ static const NSString * const kCBIRHistogramImage = @"histogram_image_attachment
 static const NSString * const kCBIRFaceRect = @"face_rect";
 static const NSString * const kCBIRSourceFaceImage = @"source_face_image";
 
+// The name of the view that emits one row per indexed face.
+// Row key: [imageDocumentID, faceID]  Row value: { face_rect, histogram_image_attachment, source_face_image }
+static const NSString * const kCBIRFaceIndexViewName = @"face_index";
+
+@class CBLView, CBLDatabase;
+
 @interface FaceIndexer : CBIRIndexer
 
+// Defines (if necessary) and returns the face index view of the given database.  CBL keeps the
+// view up to date incrementally, only mapping documents that changed since it was last indexed.
++(CBLView *) faceIndexViewInDatabase:(CBLDatabase *)database;
+
+// The filter graph is shared, so these are serialised internally.  The returned images are
+// lazy, rendering them is what costs, and that can happen on any number of threads at once.
 -(NSArray<FaceLBP *> *) generateLBPFaces:(CIImage *)image;
 
 -(FaceLBP *) generateLBPFace:(CIImage *)inputImage fromFeature:(CIFaceFeature *)feature;
 
-- (void) extractFeatures:(NSArray<FaceLBP *> *)faces andPersistTo:(CBLUnsavedRevision *)revision;
+// Returns an NSArray<FaceFeatures *> with one entry per detected face, cropped face JPEGs included.
+// The faces are extracted in parallel on the engine's task scheduler.
+-(id)extractFeaturesFromDocument:(CBIRDocument *)document;
+
+// Writes the attachments of each face, along with the face data list, into the revision.
+-(void)writeFeatures:(id)features toRevision:(CBLUnsavedRevision *)revision;
+
+// Extracts the features of a single face in memory.
+- (FaceFeatures *) extractFeatures:(FaceLBP *)face;
 
 @end
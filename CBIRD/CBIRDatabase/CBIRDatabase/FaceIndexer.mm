@@ -16,10 +16,16 @@
 #import "FaceIndexer.h"
 #import "ImageUtil.h"
 #import "CBLUtil.h"
+#import "CBIRDatabaseEngine_Private.h"
+
+#include <vector>
 
 
 NSString * FACE_KEY_PREFIX = @"face_";
 
+// Bump this whenever the map block below changes what it emits, so that CBL rebuilds the index.
+NSString * FACE_INDEX_VIEW_VERSION = @"1";
+
 
 @implementation FaceLBP
 
@@ -43,6 +49,33 @@ NSString * FACE_KEY_PREFIX = @"face_";
 
 
 
+@implementation FaceFeatures
+
+@synthesize faceRect = _faceRect;
+@synthesize histogramImage = _histogramImage;
+@synthesize croppedFaceJPEG = _croppedFaceJPEG;
+
+-(instancetype) initWithRect:(CGRect)rect histogramImage:(NSData *)histogramImage
+{
+    return [self initWithRect:rect histogramImage:histogramImage croppedFaceJPEG:nil];
+}
+
+-(instancetype) initWithRect:(CGRect)rect histogramImage:(NSData *)histogramImage croppedFaceJPEG:(NSData *)croppedFaceJPEG
+{
+    self = [super init];
+    if ( self ) {
+        _faceRect = rect;
+        _histogramImage = histogramImage;
+        _croppedFaceJPEG = croppedFaceJPEG;
+    }
+    return self;
+}
+
+@end
+
+
+
+
 @implementation FaceIndexer
 {
     CIFilter * _affineFilter;
@@ -73,13 +106,65 @@ NSString * FACE_KEY_PREFIX = @"face_";
     return self;
 }
 
--(CBLUnsavedRevision *)indexImage:(CBIRDocument *)document cblDocument:(CBLDocument *)cblDoc
++(CBLView *) faceIndexViewInDatabase:(CBLDatabase *)database
+{
+    CBLView * view = [database viewNamed:(NSString *)kCBIRFaceIndexViewName];
+    
+    if ( !view.mapBlock ) {
+        // Keys start with the document ID so that all faces of an image are adjacent, allowing the reader
+        // to load the image revision once for all of its faces.  Remember that this must stay a pure function.
+        [view setMapBlock:MAPBLOCK({
+            NSString * docID = doc[@"_id"];
+            NSArray * faceDataList = doc[kCBIRFaceDataList];
+            
+            for ( NSDictionary * faceData in faceDataList ) {
+                NSString * faceID = faceData[kCBIRFaceID];
+                NSString * histoImageID = faceData[kCBIRHistogramImage];
+                
+                if ( faceID && histoImageID ) {
+                    emit(@[docID, faceID], @{kCBIRFaceRect:faceData[kCBIRFaceRect] ?: @"",
+                                             kCBIRHistogramImage:histoImageID,
+                                             kCBIRSourceFaceImage:faceData[kCBIRSourceFaceImage] ?: @""});
+                }
+            }
+        }) version:FACE_INDEX_VIEW_VERSION];
+    }
+    
+    return view;
+}
+
+-(id)extractFeaturesFromDocument:(CBIRDocument *)document
 {
     // 1.  Filter the image using the LBP filter.
     NSArray<FaceLBP *> * lbpFaces = [self generateLBPFaces:document.imageResource];
     
-    CBLUnsavedRevision * result = [cblDoc newRevision];
-    [self extractFeatures:lbpFaces andPersistTo:result];
+    // 2.  Render and histogram each face.  They're independent of each other, so fan them out.
+    std::vector<FaceFeatures *> features(lbpFaces.count);
+    cbir::TaskScheduler * scheduler = [[CBIRDatabaseEngine sharedEngine] scheduler];
+    
+    cbir::parallelFor(*scheduler, 0, lbpFaces.count, 1, [&](size_t begin, size_t end) {
+        for ( size_t i = begin; i < end; i++ ) {
+            @autoreleasepool {
+                // Let any query that came in meanwhile go first.
+                scheduler->checkpoint();
+                
+                FaceLBP * face = lbpFaces[i];
+                FaceFeatures * histograms = [self extractFeatures:face];
+                
+                CGImageRef faceRef = [ImageUtil renderCIImage:face.croppedFaceImage];
+                UIImage * tempUIImage = [[UIImage alloc] initWithCGImage:faceRef];
+                NSData * jpegData = UIImageJPEGRepresentation(tempUIImage, 0.8);
+                CGImageRelease(faceRef);
+                
+                features[i] = [[FaceFeatures alloc] initWithRect:face.faceRect histogramImage:histograms.histogramImage croppedFaceJPEG:jpegData];
+            }
+        }
+    });
+    
+    NSMutableArray<FaceFeatures *> * result = [[NSMutableArray alloc] initWithCapacity:features.size()];
+    for ( FaceFeatures * f : features ) {
+        [result addObject:f];
+    }
     
     return result;
 }
@@ -94,9 +179,12 @@ NSString * FACE_KEY_PREFIX = @"face_";
     CGFloat rotationAngle = [ImageUtil resolveRotationAngle:image];
     CGAffineTransform rotateXForm = CGAffineTransformMakeRotation([ImageUtil degreesToRadians:rotationAngle]);
     NSValue * encodedTransform = [NSValue valueWithBytes:&rotateXForm objCType:@encode(CGAffineTransform)];
-    [_affineFilter setValue:encodedTransform forKey:@"inputTransform"];
-    [_affineFilter setValue:image forKey:@"inputImage"];
-    CIImage * rotatedImage = _affineFilter.outputImage;
+    CIImage * rotatedImage = nil;
+    @synchronized ( self ) {
+        [_affineFilter setValue:encodedTransform forKey:@"inputTransform"];
+        [_affineFilter setValue:image forKey:@"inputImage"];
+        rotatedImage = _affineFilter.outputImage;
+    }
     
     // Apply the filter for each face rectangle.  This generates a different
     // outputImage for each face rectangle.
@@ -112,6 +200,14 @@ NSString * FACE_KEY_PREFIX = @"face_";
 }
 
 -(FaceLBP *)generateLBPFace:(CIImage *)inputImage fromFeature:(CIFaceFeature *)feature
+{
+    // Building the graph only takes the lock for a moment, no pixels are touched until the output is rendered.
+    @synchronized ( self ) {
+        return [self generateLBPFaceLocked:inputImage fromFeature:feature];
+    }
+}
+
+-(FaceLBP *)generateLBPFaceLocked:(CIImage *)inputImage fromFeature:(CIFaceFeature *)feature
 {
     // We might need to consier potentially rotating the face image so that we're always matching from (0, 0).
     // Rotate the image according to the face angle.
@@ -159,140 +255,47 @@ NSString * FACE_KEY_PREFIX = @"face_";
     return f;
 }
 
-// Extracts features from each face in the list and save them to the document.
-- (void) extractFeatures:(NSArray<FaceLBP *> *)faces andPersistTo:(CBLUnsavedRevision *)revision
+// Writes each face's features to the revision.
+-(void)writeFeatures:(id)features toRevision:(CBLUnsavedRevision *)revision
 {
+    NSArray<FaceFeatures *> * faces = features;
+    
     // Array of face data dictionaries.
     NSMutableArray * faceDataList = [[NSMutableArray alloc] init];
- 
-    // For each face, we shall also keep a full histogram image.  This is necessary so that the
-    // query operation doesn't have to continually build the buffer.  It also be may be useful
-    // to exclusively use this entire buffer in the future instead of storing the individual
-    // block histograms too.
-    size_t histoLengthInBytes = 256 * sizeof(float);
-    NSUInteger histoImageSize = FACE_INDEXER_GRID_HEIGHT_IN_BLOCKS * FACE_INDEXER_GRID_WIDTH_IN_BLOCKS * histoLengthInBytes;
-    unsigned char * trainingHistoImageBuffer = (unsigned char *) malloc(histoImageSize);
     
-    // For each given face image, we need to build a list of histograms over 8x8 regions.
-    // TODO:  CIAreaHistogram looks like a good parallel candidate to replace this manual method with.  Investigate it!
+    size_t histoLengthInBytes = FACE_INDEXER_HISTOGRAM_BIN_COUNT * sizeof(float);
+    NSUInteger blockCount = FACE_INDEXER_GRID_WIDTH_IN_BLOCKS * FACE_INDEXER_GRID_HEIGHT_IN_BLOCKS;
+ 
     for ( NSUInteger i = 0; i < faces.count; i++ ) {
         @autoreleasepool {
             
-            // Prepare for writing this face's histogram image.
-            // Clear the histogram image buffer and point output to [0].
-            memset(trainingHistoImageBuffer, 0, sizeof(*trainingHistoImageBuffer));
-            unsigned char * outputHistoPointer = trainingHistoImageBuffer;
+            FaceFeatures * face = faces[i];
             
             // Identifier of this particular face.
             NSString * faceUUID = [self generateFaceKey];
             
-            // Render the face LBP and get a pointer to the underlying data buffer.
-            FaceLBP * face = faces[i];
-            
-            // Dimensions of the face and pixel buffer.
-            CGFloat width  = face.lbpImage.extent.size.width;
-            CGFloat height = face.lbpImage.extent.size.height;
-            NSData * pixelData = [ImageUtil copyPixelData:face.lbpImage];
-            
-            // The number of blocks we're slicing the image into.
-            UInt32 horizontalBlockCt = FACE_INDEXER_GRID_WIDTH_IN_BLOCKS;
-            UInt32 verticalBlockCt   = FACE_INDEXER_GRID_HEIGHT_IN_BLOCKS;
-            
-            // TODO: Come up with a safe (e.g. not overstepping the array) way to partition
-            // the image such that we aren't losing precision in width per block.
-            // If we rounded up for the fraction of the pixel, it will make the block widths
-            // add up to greater than the actual width of the buffer.
-            // Interesting little problem.  But just keep it mildly imprecise and safe for now.
-            UInt32 block_width  = width / horizontalBlockCt;
-            UInt32 block_height = height / verticalBlockCt;
-            
-            // Allocate the block to hold 4 bytes per pixel.
-            unsigned char * buffer = (unsigned char *) malloc(block_width * block_height * 4);
-            
             // List of the names of feature ID's.
             NSMutableArray<NSString *> * featureIdentifiers = [[NSMutableArray alloc] init];
             NSMutableDictionary * faceData = [[NSMutableDictionary alloc] init];
             
-            // The size of the face.
-            CGSize faceSize = CGSizeMake(4 * width, height);
-            
-            // Extract features blocks from each row as such.
-            // [0 ][1 ][2 ][3 ] 0
-            // [4 ][5 ][6 ][7 ] 1             example: a 4x4 grid.
-            // [8 ][9 ][10][11] 2             See GRID_WIDTH_IN_BLOCKS
-            // [12][13][14][15] 3             and GRID_HEIGHT_IN_BLOCKS.
-            //  0   1   2   3
-            
-            // featureIndex identifies the index of the feature in the overall face image.
-            NSUInteger featureIndex = 0;
-            
-            for ( UInt32 blockRow = 0; blockRow < verticalBlockCt; blockRow++ ) {
+            // Write each block histogram to the CBLDocument as its own attachment.
+            for ( NSUInteger featureIndex = 0; featureIndex < blockCount; featureIndex++ ) {
+                NSString * featureID = [NSString stringWithFormat:@"%@_%u", faceUUID, (unsigned int)featureIndex];
+                NSData * histogramData = [face.histogramImage subdataWithRange:NSMakeRange(featureIndex * histoLengthInBytes, histoLengthInBytes)];
+                [revision setAttachmentNamed:featureID withContentType:MIME_TYPE_OCTET_STREAM content:histogramData];
                 
-                // blockIndex identfies the index of the block relative to the current row.
-            
-                for ( UInt32 blockIndex = 0; blockIndex < horizontalBlockCt; blockIndex++, featureIndex++ ) {
-                    
-                    @autoreleasepool {
-                        
-                        // Extract the rectangle. Make sure that the image and block sizes accounts for 4 bytes per pixel.
-                        CGRect rect = CGRectMake(blockIndex, blockRow, 4 * block_width, block_height);
-                        [ImageUtil extractRect:rect fromData:pixelData ofSize:faceSize intoBuffer:buffer];
-                        
-                        // Load the rectangle into a cv matrix and split it up into channels.
-                        // We only need the first one.  Ideally need to figure out how to output single byte pixels.
-                        cv::Mat blockPixels(block_width, block_height, CV_8UC4, buffer, sizeof(*buffer));
-                        std::vector<cv::Mat> channels;
-                        cv::split(blockPixels, channels);
-                        
-                        // Calculate the histogram.
-                        cv::Mat lbpHistogram;
-                        int histSize = 256;
-                        float range[] = { -0.1, 255.000001 }; // [0, 255]
-                        const float* histRange = { range };
-                        cv::calcHist( &channels[0], 1, 0, cv::Mat(), lbpHistogram, 1, &histSize, &histRange, true, false );
-                        
-                        // Normalize all gray levels to their overall percentage in the region.
-                        [self percentizeHistogram:&lbpHistogram blockArea:(block_height * block_width)];
-                        
-                        // We need to be cognizant of the type of underlying data that OpenCV is producing in the histogram.
-                        // We're only aware of 32bit floats.
-                        NSAssert(lbpHistogram.type() == CV_32F, @"LBP Histogram type is %d.  Only CV_32F is supported", lbpHistogram.type());
-                        
-                        // Write the data and total to the CBLDocument.  Might be able to use no-copy, assuming that
-                        // CBL itself will eventually copy the data, no need for it twice.  Might be necessary for thread safety.
-                        NSString * featureID = [NSString stringWithFormat:@"%@_%u", faceUUID, (unsigned int)featureIndex];
-                        NSUInteger sizeOfHistogramData = lbpHistogram.total() * lbpHistogram.elemSize();
-                        NSData * histogramData = [NSData dataWithBytes:lbpHistogram.data length:sizeOfHistogramData];
-                        [revision setAttachmentNamed:featureID withContentType:MIME_TYPE_OCTET_STREAM content:histogramData];
-                        
-                        // Also write the histogramData into the histogram image.
-                        memcpy(outputHistoPointer, histogramData.bytes, sizeOfHistogramData);
-                        outputHistoPointer += sizeOfHistogramData;
-                        
-                        // Store the feature ID in the list.
-                        [featureIdentifiers addObject:featureID];
-                        
-                        //NSLog(@"pixels");
-                        //std::cout << channels[0];
-                        
-                        //NSLog(@"histogram type: %d elemSize: %zu", lbpHistogram.type(), lbpHistogram.elemSize());
-                        //std::cout << lbpHistogram;
-                    }
-                }
+                // Store the feature ID in the list.
+                [featureIdentifiers addObject:featureID];
             }
             
-            NSData * fullHistoImageData = [NSData dataWithBytes:trainingHistoImageBuffer length:histoImageSize];
+            // For each face, we shall also keep a full histogram image.  This is what queries use, so that they
+            // don't have to continually build the buffer.  It also be may be useful to exclusively use this entire
+            // buffer in the future instead of storing the individual block histograms too.
             NSString * faceHistoID = [NSString stringWithFormat:@"%@_%@", faceUUID, kCBIRHistogramImage];
-            [revision setAttachmentNamed:faceHistoID withContentType:MIME_TYPE_OCTET_STREAM content:fullHistoImageData];
-            
+            [revision setAttachmentNamed:faceHistoID withContentType:MIME_TYPE_OCTET_STREAM content:face.histogramImage];
             
-            CIImage * croppedFace = face.croppedFaceImage;
-            CGImageRef faceRef = [ImageUtil renderCIImage:croppedFace];
-            UIImage * tempUIImage = [[UIImage alloc] initWithCGImage:faceRef];
-            NSData * jpegData = UIImageJPEGRepresentation(tempUIImage, 0.8);
             NSString * faceCropID = [NSString stringWithFormat:@"%@_%@", faceUUID, kCBIRSourceFaceImage];
-            [revision setAttachmentNamed:faceCropID withContentType:MIME_TYPE_OCTET_STREAM content:jpegData];
-            CGImageRelease(faceRef);
+            [revision setAttachmentNamed:faceCropID withContentType:MIME_TYPE_OCTET_STREAM content:face.croppedFaceJPEG];
             
             
             // Load up all data.
@@ -303,28 +306,110 @@ NSString * FACE_KEY_PREFIX = @"face_";
             faceData[kCBIRSourceFaceImage] = faceCropID;
 
             [faceDataList addObject:faceData];
-            
-            if ( buffer ) {
-                // Why on Earth wouldn't there be a buffer?
-                free(buffer);
-                buffer = NULL;
-            }
         }
     }
     
-    // This buffer is reused for each face histogram image as they're all the same size.
-    // Clear it when we're done.
-    if ( trainingHistoImageBuffer ) {
-        free(trainingHistoImageBuffer);
-        trainingHistoImageBuffer = NULL;
-    }
-    
     if ( faceDataList.count > 0 ) {
         NSMutableDictionary * newProperties = revision.properties;
         newProperties[kCBIRFaceDataList] = faceDataList;
     }
 }
 
+// Computes the block histograms of the face, entirely in memory.
+-(FaceFeatures *) extractFeatures:(FaceLBP *)face
+{
+    // All block histograms go into a single histogram image, one after another.
+    size_t histoLengthInBytes = FACE_INDEXER_HISTOGRAM_BIN_COUNT * sizeof(float);
+    NSUInteger histoImageSize = FACE_INDEXER_GRID_HEIGHT_IN_BLOCKS * FACE_INDEXER_GRID_WIDTH_IN_BLOCKS * histoLengthInBytes;
+    NSMutableData * histoImageData = [NSMutableData dataWithLength:histoImageSize];
+    unsigned char * outputHistoPointer = (unsigned char *) histoImageData.mutableBytes;
+    
+    // Dimensions of the face and pixel buffer.
+    CGFloat width  = face.lbpImage.extent.size.width;
+    CGFloat height = face.lbpImage.extent.size.height;
+    NSData * pixelData = [ImageUtil copyPixelData:face.lbpImage];
+    
+    // The number of blocks we're slicing the image into.
+    UInt32 horizontalBlockCt = FACE_INDEXER_GRID_WIDTH_IN_BLOCKS;
+    UInt32 verticalBlockCt   = FACE_INDEXER_GRID_HEIGHT_IN_BLOCKS;
+    
+    // TODO: Come up with a safe (e.g. not overstepping the array) way to partition
+    // the image such that we aren't losing precision in width per block.
+    // If we rounded up for the fraction of the pixel, it will make the block widths
+    // add up to greater than the actual width of the buffer.
+    // Interesting little problem.  But just keep it mildly imprecise and safe for now.
+    UInt32 block_width  = width / horizontalBlockCt;
+    UInt32 block_height = height / verticalBlockCt;
+    
+    // Allocate the block to hold 4 bytes per pixel.
+    unsigned char * buffer = (unsigned char *) malloc(block_width * block_height * 4);
+    
+    // The size of the face.
+    CGSize faceSize = CGSizeMake(4 * width, height);
+    
+    // Extract features blocks from each row as such.
+    // [0 ][1 ][2 ][3 ] 0
+    // [4 ][5 ][6 ][7 ] 1             example: a 4x4 grid.
+    // [8 ][9 ][10][11] 2             See GRID_WIDTH_IN_BLOCKS
+    // [12][13][14][15] 3             and GRID_HEIGHT_IN_BLOCKS.
+    //  0   1   2   3
+    
+    // Indexing runs in the background, so let more urgent work past between rows.
+    cbir::TaskScheduler * scheduler = [[CBIRDatabaseEngine sharedEngine] scheduler];
+    
+    // TODO:  CIAreaHistogram looks like a good parallel candidate to replace this manual method with.  Investigate it!
+    for ( UInt32 blockRow = 0; blockRow < verticalBlockCt; blockRow++ ) {
+        
+        scheduler->checkpoint();
+        
+        // blockIndex identfies the index of the block relative to the current row.
+        for ( UInt32 blockIndex = 0; blockIndex < horizontalBlockCt; blockIndex++ ) {
+            
+            @autoreleasepool {
+                
+                // Extract the rectangle. Make sure that the image and block sizes accounts for 4 bytes per pixel.
+                CGRect rect = CGRectMake(blockIndex, blockRow, 4 * block_width, block_height);
+                [ImageUtil extractRect:rect fromData:pixelData ofSize:faceSize intoBuffer:buffer];
+                
+                // Load the rectangle into a cv matrix and split it up into channels.
+                // We only need the first one.  Ideally need to figure out how to output single byte pixels.
+                cv::Mat blockPixels(block_width, block_height, CV_8UC4, buffer, sizeof(*buffer));
+                std::vector<cv::Mat> channels;
+                cv::split(blockPixels, channels);
+                
+                // Calculate the histogram.
+                cv::Mat lbpHistogram;
+                int histSize = 256;
+                float range[] = { -0.1, 255.000001 }; // [0, 255]
+                const float* histRange = { range };
+                cv::calcHist( &channels[0], 1, 0, cv::Mat(), lbpHistogram, 1, &histSize, &histRange, true, false );
+                
+                // Normalize all gray levels to their overall percentage in the region.
+                [self percentizeHistogram:&lbpHistogram blockArea:(block_height * block_width)];
+                
+                // We need to be cognizant of the type of underlying data that OpenCV is producing in the histogram.
+                // We're only aware of 32bit floats.
+                NSAssert(lbpHistogram.type() == CV_32F, @"LBP Histogram type is %d.  Only CV_32F is supported", lbpHistogram.type());
+                
+                NSUInteger sizeOfHistogramData = lbpHistogram.total() * lbpHistogram.elemSize();
+                NSAssert(sizeOfHistogramData == histoLengthInBytes, @"LBP Histogram is %lu bytes, expected %zu", (unsigned long)sizeOfHistogramData, histoLengthInBytes);
+                
+                // Write the histogram into its block of the histogram image.
+                memcpy(outputHistoPointer, lbpHistogram.data, sizeOfHistogramData);
+                outputHistoPointer += sizeOfHistogramData;
+            }
+        }
+    }
+    
+    if ( buffer ) {
+        // Why on Earth wouldn't there be a buffer?
+        free(buffer);
+        buffer = NULL;
+    }
+    
+    return [[FaceFeatures alloc] initWithRect:face.faceRect histogramImage:histoImageData];
+}
+
 // Normalizes the values in the histogram such that each bin (lbp intensity) value is the percentage of the occurrence
 // of the color that the bin represents in the region.  This should correct for equal faces at different scales which cause
 // the values of each intensity to be scaled to more or less, despite the images being effectively equal.
@@ -0,0 +1,444 @@
+//
+//  FaceIvfIndex.cpp
+//  CBIRDatabase
+//
+//  Created by Joseph Carson on 10/19/16.
+//  Copyright © 2016 Joseph Carson. All rights reserved.
+//
+
+#include "FaceIvfIndex.hpp"
+#include "FaceDescriptor.hpp"
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <algorithm>
+#include <random>
+#include <utility>
+
+namespace cbir {
+
+const uint32_t FaceIvfIndex::kUnassigned;
+
+// Bump the version whenever the layout of the index file, or the embedding, changes.
+static const char kIndexMagic[8] = {'C', 'B', 'I', 'R', 'I', 'V', 'F', '\0'};
+static const uint32_t kIndexVersion = 1;
+
+// k-means only needs a sample of the faces to place the centroids, and this many per list is plenty.
+static const size_t kTrainingSamplesPerList = 64;
+static const size_t kTrainingIterations = 10;
+
+// Embeddings assigned to centroids per task.  Each one is scored against every centroid, so it's a lot of work.
+static const size_t kAssignmentGrain = 64;
+
+struct IndexHeader
+{
+    char magic[8];
+    uint32_t version;
+
+    // adler32 of everything following the header.
+    uint32_t checksum;
+    uint64_t faceCount;
+    uint64_t listCount;
+    uint64_t embeddingLength;
+    uint64_t trainedSize;
+};
+
+// Copies the next length bytes of the body out, if there are that many left.
+static bool readBytes(const char *& in, const char * end, void * out, size_t length)
+{
+    if ( (size_t)(end - in) < length ) {
+        return false;
+    }
+    memcpy(out, in, length);
+    in += length;
+    return true;
+}
+
+static uint32_t nearestCentroid(const float * centroids, size_t count, const float * embedding)
+{
+    uint32_t nearest = 0;
+    float nearestDistance = INFINITY;
+    for ( size_t i = 0; i < count; i++ ) {
+        float distance = embeddingDistance(embedding, centroids + i * kEmbeddingLength);
+        if ( distance < nearestDistance ) {
+            nearest = (uint32_t)i;
+            nearestDistance = distance;
+        }
+    }
+    return nearest;
+}
+
+FaceIvfIndex::FaceIvfIndex()
+    : m_listCount(0), m_trainedSize(0), m_stopped(false)
+{
+}
+
+size_t FaceIvfIndex::listCountFor(size_t faceCount)
+{
+    return std::max<size_t>(1, (size_t)sqrt((double)faceCount));
+}
+
+std::shared_ptr<const IvfTraining> FaceIvfIndex::train(const FaceGallerySnapshot & gallery, size_t listCount, TaskScheduler & scheduler) const
+{
+    std::vector<size_t> live;
+    for ( size_t row = 0; row < gallery.size(); row++ ) {
+        if ( !gallery.isRemoved(row) ) {
+            live.push_back(row);
+        }
+    }
+
+    // An even spread of the live faces, so that the sample covers the gallery's whole history.
+    size_t sampleCount = std::min(live.size(), listCount * kTrainingSamplesPerList);
+    listCount = std::min(listCount, sampleCount);
+    if ( listCount == 0 ) {
+        return std::shared_ptr<const IvfTraining>();
+    }
+
+    std::vector<float> samples(sampleCount * kEmbeddingLength);
+    parallelFor(scheduler, 0, sampleCount, kAssignmentGrain, [&](size_t begin, size_t end) {
+        for ( size_t i = begin; i < end; i++ ) {
+            embedCoarseDescriptor(gallery.coarseDescriptor(live[i * live.size() / sampleCount]), &samples[i * kEmbeddingLength]);
+        }
+    });
+
+    // Start from distinct samples picked at random.  The seed is fixed so that training the same gallery always
+    // comes up with the same lists.
+    std::mt19937 generator(1);
+    std::vector<size_t> order(sampleCount);
+    for ( size_t i = 0; i < sampleCount; i++ ) {
+        order[i] = i;
+    }
+    std::shuffle(order.begin(), order.end(), generator);
+
+    std::shared_ptr<IvfTraining> training(new IvfTraining());
+    training->listCount = listCount;
+    training->centroids.resize(listCount * kEmbeddingLength);
+    for ( size_t c = 0; c < listCount; c++ ) {
+        memcpy(&training->centroids[c * kEmbeddingLength], &samples[order[c] * kEmbeddingLength], kEmbeddingLength * sizeof(float));
+    }
+
+    std::vector<uint32_t> assignments(sampleCount);
+    std::vector<std::vector<size_t>> members(listCount);
+
+    for ( size_t iteration = 0; iteration < kTrainingIterations && !m_stopped; iteration++ ) {
+
+        // Assign every sample to its nearest centroid.  Each task writes only its own assignments.
+        const float * centroids = training->centroids.data();
+        parallelFor(scheduler, 0, sampleCount, kAssignmentGrain, [&](size_t begin, size_t end) {
+            for ( size_t i = begin; i < end && !m_stopped; i++ ) {
+                assignments[i] = nearestCentroid(centroids, listCount, &samples[i * kEmbeddingLength]);
+            }
+        });
+
+        for ( size_t c = 0; c < listCount; c++ ) {
+            members[c].clear();
+        }
+        for ( size_t i = 0; i < sampleCount; i++ ) {
+            members[assignments[i]].push_back(i);
+        }
+
+        // Move every centroid to the mean of its samples.  Each task owns its centroids.
+        parallelFor(scheduler, 0, listCount, 1, [&](size_t begin, size_t end) {
+            for ( size_t c = begin; c < end; c++ ) {
+                if ( members[c].empty() ) {
+                    continue;
+                }
+
+                std::vector<double> sum(kEmbeddingLength, 0.0);
+                for ( size_t m = 0; m < members[c].size(); m++ ) {
+                    const float * sample = &samples[members[c][m] * kEmbeddingLength];
+                    for ( size_t i = 0; i < kEmbeddingLength; i++ ) {
+                        sum[i] += sample[i];
+                    }
+                }
+
+                float * centroid = &training->centroids[c * kEmbeddingLength];
+                for ( size_t i = 0; i < kEmbeddingLength; i++ ) {
+                    centroid[i] = (float)(sum[i] / members[c].size());
+                }
+            }
+        });
+
+        // A centroid that lost all its samples takes one from the biggest list, which splits it next time around.
+        for ( size_t c = 0; c < listCount; c++ ) {
+            if ( !members[c].empty() ) {
+                continue;
+            }
+
+            size_t biggest = 0;
+            for ( size_t other = 1; other < listCount; other++ ) {
+                if ( members[other].size() > members[biggest].size() ) {
+                    biggest = other;
+                }
+            }
+            if ( members[biggest].size() < 2 ) {
+                break;
+            }
+
+            size_t sample = members[biggest][generator() % members[biggest].size()];
+            memcpy(&training->centroids[c * kEmbeddingLength], &samples[sample * kEmbeddingLength], kEmbeddingLength * sizeof(float));
+            members[c].push_back(sample);
+            members[biggest].erase(std::find(members[biggest].begin(), members[biggest].end(), sample));
+        }
+    }
+
+    // Now put every live face in the list of its nearest centroid, not just the samples.
+    training->lists.assign(gallery.size(), kUnassigned);
+    const float * centroids = training->centroids.data();
+    parallelFor(scheduler, 0, gallery.size(), kAssignmentGrain, [&](size_t begin, size_t end) {
+        float embedding[kEmbeddingLength];
+        for ( size_t row = begin; row < end && !m_stopped; row++ ) {
+            if ( !gallery.isRemoved(row) ) {
+                embedCoarseDescriptor(gallery.coarseDescriptor(row), embedding);
+                training->lists[row] = nearestCentroid(centroids, listCount, embedding);
+            }
+        }
+    });
+
+    if ( m_stopped ) {
+        return std::shared_ptr<const IvfTraining>();
+    }
+    return training;
+}
+
+uint32_t FaceIvfIndex::nearestList(const float * embedding) const
+{
+    return nearestCentroid(m_centroids.data(), m_listCount, embedding);
+}
+
+void FaceIvfIndex::install(const IvfTraining & training, const FaceGallerySnapshot & gallery)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    m_listCount = training.listCount;
+    m_centroids = training.centroids;
+    m_lists.assign(m_listCount, std::vector<uint32_t>());
+
+    for ( size_t row = 0; row < training.lists.size() && row < m_faceIDs.size(); row++ ) {
+        if ( training.lists[row] != kUnassigned ) {
+            m_lists[training.lists[row]].push_back((uint32_t)row);
+        }
+    }
+
+    float embedding[kEmbeddingLength];
+    for ( size_t row = training.lists.size(); row < m_faceIDs.size(); row++ ) {
+        embedCoarseDescriptor(gallery.coarseDescriptor(row), embedding);
+        m_lists[nearestList(embedding)].push_back((uint32_t)row);
+    }
+
+    m_trainedSize = gallery.liveCount();
+}
+
+void FaceIvfIndex::append(const std::string & faceID, const float * coarseDescriptor)
+{
+    float embedding[kEmbeddingLength];
+    embedCoarseDescriptor(coarseDescriptor, embedding);
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    uint32_t row = (uint32_t)m_faceIDs.size();
+    m_faceIDs.push_back(faceID);
+
+    if ( m_listCount > 0 ) {
+        m_lists[nearestList(embedding)].push_back(row);
+    }
+}
+
+void FaceIvfIndex::clear()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_listCount = 0;
+    m_centroids.clear();
+    m_lists.clear();
+    m_faceIDs.clear();
+    m_trainedSize = 0;
+}
+
+bool FaceIvfIndex::isTrained() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_listCount > 0;
+}
+
+size_t FaceIvfIndex::size() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_faceIDs.size();
+}
+
+size_t FaceIvfIndex::trainedSize() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_trainedSize;
+}
+
+bool FaceIvfIndex::search(const FaceGallerySnapshot & gallery, const float * embedding, size_t probeCount, std::vector<size_t> & rows) const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    rows.clear();
+
+    // The index is never behind the gallery, but the snapshot may be.  Either way their rows must agree.
+    size_t covered = std::min(m_faceIDs.size(), gallery.size());
+    if ( m_listCount == 0 || covered == 0 || gallery.record(covered - 1).faceID != m_faceIDs[covered - 1] ) {
+        return false;
+    }
+
+    std::vector<std::pair<float, uint32_t>> lists(m_listCount);
+    for ( size_t i = 0; i < m_listCount; i++ ) {
+        lists[i] = std::make_pair(embeddingDistance(embedding, &m_centroids[i * kEmbeddingLength]), (uint32_t)i);
+    }
+    probeCount = std::min(probeCount, m_listCount);
+    std::partial_sort(lists.begin(), lists.begin() + probeCount, lists.end());
+
+    for ( size_t i = 0; i < probeCount; i++ ) {
+        const std::vector<uint32_t> & list = m_lists[lists[i].second];
+        for ( size_t j = 0; j < list.size(); j++ ) {
+            if ( list[j] < covered && !gallery.isRemoved(list[j]) ) {
+                rows.push_back(list[j]);
+            }
+        }
+    }
+    std::sort(rows.begin(), rows.end());
+
+    return true;
+}
+
+bool FaceIvfIndex::save(const std::string & path, const FaceGallerySnapshot & gallery) const
+{
+    std::string body;
+    IndexHeader header;
+    memset(&header, 0, sizeof(header));
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        // The lists aren't saved as such.  Each row's list is, which is the same thing in less space.
+        std::vector<uint32_t> rowLists(m_faceIDs.size(), kUnassigned);
+        for ( size_t list = 0; list < m_lists.size(); list++ ) {
+            for ( size_t i = 0; i < m_lists[list].size(); i++ ) {
+                rowLists[m_lists[list][i]] = (uint32_t)list;
+            }
+        }
+
+        body.append((const char *)m_centroids.data(), m_centroids.size() * sizeof(float));
+        for ( size_t row = 0; row < m_faceIDs.size() && row < gallery.size(); row++ ) {
+            if ( gallery.isRemoved(row) ) {
+                continue;
+            }
+            uint32_t length = (uint32_t)m_faceIDs[row].size();
+            body.append((const char *)&rowLists[row], sizeof(rowLists[row]));
+            body.append((const char *)&length, sizeof(length));
+            body.append(m_faceIDs[row]);
+            header.faceCount++;
+        }
+
+        header.listCount = m_listCount;
+        header.trainedSize = std::min<uint64_t>(m_trainedSize, header.faceCount);
+    }
+
+    memcpy(header.magic, kIndexMagic, sizeof(header.magic));
+    header.version = kIndexVersion;
+    header.embeddingLength = kEmbeddingLength;
+    header.checksum = (uint32_t)adler32(adler32(0L, Z_NULL, 0), (const Bytef *)body.data(), (uInt)body.size());
+
+    // Write to the side and rename so that a crash never leaves a half written file in place.
+    std::string tempPath = path + ".tmp";
+    FILE * file = fopen(tempPath.c_str(), "wb");
+    if ( !file ) {
+        return false;
+    }
+
+    bool ok = (fwrite(&header, sizeof(header), 1, file) == 1);
+    if ( ok && body.size() > 0 ) {
+        ok = (fwrite(body.data(), body.size(), 1, file) == 1);
+    }
+
+    ok = (fclose(file) == 0) && ok;
+    ok = ok && (rename(tempPath.c_str(), path.c_str()) == 0);
+
+    if ( !ok ) {
+        unlink(tempPath.c_str());
+    }
+    return ok;
+}
+
+bool FaceIvfIndex::load(const std::string & path, const FaceGallerySnapshot & gallery)
+{
+    IndexHeader header;
+    std::string body;
+
+    FILE * file = fopen(path.c_str(), "rb");
+    bool valid = (file != NULL) && (fread(&header, sizeof(header), 1, file) == 1);
+
+    if ( valid ) {
+        char buffer[64 * 1024];
+        size_t count = 0;
+        while ( (count = fread(buffer, 1, sizeof(buffer), file)) > 0 ) {
+            body.append(buffer, count);
+        }
+        valid = memcmp(header.magic, kIndexMagic, sizeof(header.magic)) == 0 &&
+                header.version == kIndexVersion &&
+                header.embeddingLength == kEmbeddingLength &&
+                header.faceCount == gallery.size() &&
+                header.checksum == (uint32_t)adler32(adler32(0L, Z_NULL, 0), (const Bytef *)body.data(), (uInt)body.size());
+    }
+    if ( file ) {
+        fclose(file);
+    }
+
+    std::vector<float> centroids;
+    std::vector<std::vector<uint32_t>> lists;
+    std::vector<std::string> faceIDs;
+
+    const char * in = body.data();
+    const char * end = in + body.size();
+
+    // The centroids have to fit in the body before there's any point allocating them.
+    valid = valid && header.listCount <= body.size() / (kEmbeddingLength * sizeof(float));
+
+    if ( valid ) {
+        centroids.resize(header.listCount * kEmbeddingLength);
+        lists.resize(header.listCount);
+        valid = readBytes(in, end, centroids.data(), centroids.size() * sizeof(float));
+    }
+
+    for ( uint64_t row = 0; valid && row < header.faceCount; row++ ) {
+        uint32_t list = 0;
+        uint32_t length = 0;
+        valid = readBytes(in, end, &list, sizeof(list)) && (list == kUnassigned || list < header.listCount) &&
+                readBytes(in, end, &length, sizeof(length)) && (size_t)(end - in) >= length;
+        if ( !valid ) {
+            break;
+        }
+
+        faceIDs.push_back(std::string(in, length));
+        in += length;
+
+        // Every row must be the same face as in the gallery.
+        valid = faceIDs.back() == gallery.record(row).faceID;
+        if ( valid && list != kUnassigned ) {
+            lists[list].push_back((uint32_t)row);
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if ( !valid ) {
+        m_listCount = 0;
+        m_centroids.clear();
+        m_lists.clear();
+        m_faceIDs.clear();
+        m_trainedSize = 0;
+        return false;
+    }
+
+    m_listCount = header.listCount;
+    m_centroids.swap(centroids);
+    m_lists.swap(lists);
+    m_faceIDs.swap(faceIDs);
+    m_trainedSize = header.trainedSize;
+    return true;
+}
+
+}
@@ -0,0 +1,133 @@
+//
+//  FaceIvfIndex.hpp
+//  CBIRDatabase
+//
+//  Created by Joseph Carson on 10/19/16.
+//  Copyright © 2016 Joseph Carson. All rights reserved.
+//
+
+#ifndef FaceIvfIndex_hpp
+#define FaceIvfIndex_hpp
+
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "FaceGallery.hpp"
+#include "TaskScheduler.hpp"
+
+namespace cbir {
+
+// What training an IVF index comes up with: the centroids, and the list of every live row of the snapshot it
+// was trained on.
+struct IvfTraining
+{
+    size_t listCount;
+
+    // listCount * kEmbeddingLength floats.
+    std::vector<float> centroids;
+
+    // Per row of the snapshot, its list, or kUnassigned for removed rows.
+    std::vector<uint32_t> lists;
+};
+
+// An inverted file over the embeddings of the gallery's faces (see embedCoarseDescriptor()).  k-means splits the
+// faces into lists around centroids, and a search only looks in the probeCount lists whose centroids are nearest the
+// probe.  The more lists probed, the more of the true nearest faces are found, and the more faces there are to
+// score, so probeCount is a straight trade of recall for time.
+//
+// Unlike the HNSW index, the rows of the gallery go in as they're appended to it, each to the list of its nearest
+// centroid, so the index is never behind.  The lists are only as good as the centroids though, and those come from
+// training on a snapshot, which takes a while, so train() runs in the background and its result is install()ed
+// by the writer.  Until then searches fail, and the caller has to look elsewhere.  As the gallery grows, the lists
+// get long and the engine trains again.
+//
+// Saved next to the gallery snapshot, at the same time, so that the two always agree.  Saving leaves removed faces
+// out, as the snapshot does.
+//
+// Layout.
+// [header][centroids: listCount * kEmbeddingLength floats][per row: list, face ID]
+//
+// Thread safe.  There's a single writer, which appends, installs and clears, and any number of searches, which
+// take turns with the writer on a lock.  train() doesn't touch the index, so it can run alongside all of them.
+class FaceIvfIndex
+{
+public:
+
+    static const uint32_t kUnassigned = UINT32_MAX;
+
+    FaceIvfIndex();
+
+    // The number of lists to train for a gallery of the given number of faces, about its square root, so that
+    // lists hold about as many faces as there are lists.
+    static size_t listCountFor(size_t faceCount);
+
+    // Runs k-means over the live rows of the snapshot, in parallel on the scheduler.  Returns NULL if stopped
+    // before it was done.
+    std::shared_ptr<const IvfTraining> train(const FaceGallerySnapshot & gallery, size_t listCount, TaskScheduler & scheduler) const;
+
+    // Makes a running or future train() give up as soon as it can.
+    void stop() { m_stopped = true; }
+
+    // Switches the index over to the trained centroids and lists.  The rows appended since the snapshot that was
+    // trained on go in the lists of their nearest centroids, so the gallery must hold every row appended to the index.
+    // Its live rows are what trainedSize() counts from then on.
+    void install(const IvfTraining & training, const FaceGallerySnapshot & gallery);
+
+    // Appends the next row of the gallery, putting it in the list of the centroid nearest its coarse descriptor.
+    void append(const std::string & faceID, const float * coarseDescriptor);
+
+    // Forgets every row and the centroids, leaving the index untrained.
+    void clear();
+
+    bool isTrained() const;
+
+    // The number of rows, including removed ones.
+    size_t size() const;
+
+    // The number of live rows in the gallery when the index was last trained.  0 if it's untrained.
+    size_t trainedSize() const;
+
+    // The rows of the probeCount lists nearest the embedding, that are in the snapshot and not removed from it,
+    // in row order.  Returns false if there's nothing to search, or the index doesn't cover the snapshot, e.g. it's
+    // untrained or the gallery has been rebuilt since the snapshot.
+    bool search(const FaceGallerySnapshot & gallery, const float * embedding, size_t probeCount, std::vector<size_t> & rows) const;
+
+    // Saves the index to the file at the given path, which is replaced atomically.  Only the rows that are live in
+    // the snapshot are saved, renumbered the same way as FaceGallerySnapshot::save() does, so that the index loads
+    // alongside the gallery saved from the same snapshot.
+    bool save(const std::string & path, const FaceGallerySnapshot & gallery) const;
+
+    // Replaces the index with the one saved at the given path, as long as it holds exactly the rows of the gallery.
+    // Fails, leaving the index empty, if the file is missing, doesn't match, of another version, or corrupt.
+    bool load(const std::string & path, const FaceGallerySnapshot & gallery);
+
+private:
+
+    FaceIvfIndex(const FaceIvfIndex &);
+    FaceIvfIndex & operator=(const FaceIvfIndex &);
+
+    // The centroid nearest the embedding.
+    uint32_t nearestList(const float * embedding) const;
+
+    // Everything from here to m_stopped is guarded by m_mutex.
+    mutable std::mutex m_mutex;
+
+    size_t m_listCount;
+    std::vector<float> m_centroids;
+
+    // The rows of each list, in row order.
+    std::vector<std::vector<uint32_t>> m_lists;
+
+    std::vector<std::string> m_faceIDs;
+    size_t m_trainedSize;
+
+    std::atomic<bool> m_stopped;
+};
+
+}
+
+#endif /* FaceIvfIndex_hpp */
@@ -0,0 +1,437 @@
+//
+//  FaceNeighborGraph.cpp
+//  CBIRDatabase
+//
+//  Created by Joseph Carson on 10/19/16.
+//  Copyright © 2016 Joseph Carson. All rights reserved.
+//
+
+#include "FaceNeighborGraph.hpp"
+#include "FaceDescriptor.hpp"
+
+#include <algorithm>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+namespace cbir {
+
+const size_t FaceNeighborGraph::kNeighborCount;
+
+// Bump the version whenever the layout of the graph file changes.
+static const char kGraphMagic[8] = {'C', 'B', 'I', 'R', 'N', 'B', 'R', '\0'};
+static const uint32_t kGraphVersion = 1;
+
+// Marks the rows that saving leaves out.
+static const uint32_t kDropped = UINT32_MAX;
+
+struct GraphHeader
+{
+    char magic[8];
+    uint32_t version;
+
+    // adler32 of everything following the header.
+    uint32_t checksum;
+    uint64_t rowCount;
+    int64_t sequence;
+};
+
+// Coarse candidates per neighbour, the same trade off as a query makes.
+static const size_t kCandidatesPerNeighbor = 8;
+
+// A face that's down to fewer live neighbours than this has them found again.
+static const size_t kMinLiveNeighbors = FaceNeighborGraph::kNeighborCount / 2;
+
+// Copies the next length bytes of the body out, if there are that many left.
+static bool readBytes(const char *& in, const char * end, void * out, size_t length)
+{
+    if ( (size_t)(end - in) < length ) {
+        return false;
+    }
+    if ( length > 0 ) {
+        memcpy(out, in, length);
+        in += length;
+    }
+    return true;
+}
+
+// Inserts the row into a neighbour list, nearest first, if it's near enough and not already there.
+static void offerNeighbor(std::vector<ScoredRow> & neighbors, const ScoredRow & candidate)
+{
+    if ( neighbors.size() >= FaceNeighborGraph::kNeighborCount && !(candidate.distance < neighbors.back().distance) ) {
+        return;
+    }
+
+    for ( size_t i = 0; i < neighbors.size(); i++ ) {
+        if ( neighbors[i].row == candidate.row ) {
+            return;
+        }
+    }
+
+    std::vector<ScoredRow>::iterator position = neighbors.begin();
+    while ( position != neighbors.end() && position->distance <= candidate.distance ) {
+        ++position;
+    }
+    neighbors.insert(position, candidate);
+
+    if ( neighbors.size() > FaceNeighborGraph::kNeighborCount ) {
+        neighbors.pop_back();
+    }
+}
+
+FaceNeighborGraph::FaceNeighborGraph()
+    : m_sequence(0), m_stopped(false)
+{
+}
+
+int64_t FaceNeighborGraph::sequence() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_sequence;
+}
+
+bool FaceNeighborGraph::neighbors(const std::string & faceID, std::vector<ScoredRow> & neighbors,
+                                  std::shared_ptr<const FaceGallerySnapshot> & gallery) const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    std::unordered_map<std::string, size_t>::const_iterator it = m_rowsByFaceID.find(faceID);
+    if ( it == m_rowsByFaceID.end() || m_gallery->isRemoved(it->second) || m_neighbors[it->second].empty() ) {
+        return false;
+    }
+
+    const std::vector<ScoredRow> & list = m_neighbors[it->second];
+    neighbors.clear();
+    for ( size_t i = 0; i < list.size(); i++ ) {
+        if ( !m_gallery->isRemoved(list[i].row) ) {
+            neighbors.push_back(list[i]);
+        }
+    }
+
+    gallery = m_gallery;
+    return true;
+}
+
+// Whether the row is among the first rank entries of the list.
+static bool isAmongFirst(const std::vector<ScoredRow> & neighbors, size_t rank, size_t row)
+{
+    for ( size_t i = 0; i < neighbors.size() && i < rank; i++ ) {
+        if ( neighbors[i].row == row ) {
+            return true;
+        }
+    }
+    return false;
+}
+
+std::shared_ptr<const FaceGallerySnapshot> FaceNeighborGraph::mutualEdges(size_t rank, float maxDistance,
+                                                                          std::vector<std::pair<size_t, size_t>> & edges) const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    edges.clear();
+
+    for ( size_t row = 0; row < m_neighbors.size(); row++ ) {
+        if ( m_gallery->isRemoved(row) ) {
+            continue;
+        }
+
+        const std::vector<ScoredRow> & neighbors = m_neighbors[row];
+        for ( size_t i = 0; i < neighbors.size() && i < rank; i++ ) {
+            size_t other = neighbors[i].row;
+
+            // Only taking pairs from their lower row means each comes up once.
+            if ( other > row && !m_gallery->isRemoved(other) && neighbors[i].distance <= maxDistance &&
+                 isAmongFirst(m_neighbors[other], rank, row) ) {
+                edges.push_back(std::make_pair(row, other));
+            }
+        }
+    }
+
+    return m_gallery;
+}
+
+std::vector<ScoredRow> FaceNeighborGraph::findNeighbors(const FaceGallerySnapshot & gallery, size_t row, const FaceHnswIndex * index) const
+{
+    size_t candidateCount = kNeighborCount * kCandidatesPerNeighbor;
+    const float * coarseProbe = gallery.coarseDescriptor(row);
+
+    // The index finds the candidates among the rows it has, the rest are scanned.
+    std::vector<ScoredRow> indexed;
+    size_t indexedRows = 0;
+    if ( index ) {
+        std::vector<float> embedding(kEmbeddingLength);
+        embedCoarseDescriptor(coarseProbe, embedding.data());
+        if ( !index->search(gallery, embedding.data(), candidateCount + 1, index->params().efSearch, indexed, indexedRows) ) {
+            indexedRows = 0;
+        }
+    }
+
+    TopKCollector candidates(candidateCount);
+    for ( size_t other = indexedRows; other < gallery.size(); other++ ) {
+        if ( other != row && !gallery.isRemoved(other) ) {
+            candidates.add(coarseFaceDistance(coarseProbe, gallery.coarseDescriptor(other)), other);
+        }
+    }
+
+    TopKCollector nearest(kNeighborCount);
+    const float * probe = gallery.descriptor(row);
+    std::vector<ScoredRow> candidateRows = candidates.sorted();
+    candidateRows.insert(candidateRows.end(), indexed.begin(), indexed.end());
+
+    for ( size_t i = 0; i < candidateRows.size(); i++ ) {
+        if ( candidateRows[i].row != row ) {
+            nearest.add(faceDistance(probe, gallery.descriptor(candidateRows[i].row)), candidateRows[i].row);
+        }
+    }
+
+    return nearest.sorted();
+}
+
+void FaceNeighborGraph::clear()
+{
+    m_gallery.reset();
+    m_neighbors.clear();
+    m_rowsByFaceID.clear();
+    m_sequence = 0;
+}
+
+bool FaceNeighborGraph::update(const std::shared_ptr<const FaceGallerySnapshot> & gallery, TaskScheduler & scheduler,
+                               const FaceHnswIndex * index)
+{
+    size_t previousSize = 0;
+    std::vector<size_t> work;
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        // Carry on from the last update if the gallery is of the same generation, so has only grown since, and
+        // start over if it's newer.  An older one has nothing left to add.
+        bool continuing = m_gallery && gallery->generation() == m_gallery->generation();
+        if ( m_gallery && (gallery->generation() < m_gallery->generation() || (continuing && gallery->size() < m_neighbors.size())) ) {
+            return true;
+        }
+
+        if ( continuing ) {
+            previousSize = m_neighbors.size();
+        } else {
+            m_neighbors.clear();
+            m_rowsByFaceID.clear();
+        }
+
+        m_gallery = gallery;
+        m_neighbors.resize(gallery->size());
+        for ( size_t row = previousSize; row < gallery->size(); row++ ) {
+            m_rowsByFaceID[gallery->record(row).faceID] = row;
+        }
+
+        // The new faces, and the old ones that removals have left short of neighbours.
+        for ( size_t row = 0; row < gallery->size(); row++ ) {
+            if ( gallery->isRemoved(row) ) {
+                m_neighbors[row].clear();
+                continue;
+            }
+            if ( row >= previousSize ) {
+                work.push_back(row);
+                continue;
+            }
+
+            size_t live = 0;
+            for ( size_t i = 0; i < m_neighbors[row].size(); i++ ) {
+                live += !gallery->isRemoved(m_neighbors[row][i].row);
+            }
+            if ( live < std::min(kMinLiveNeighbors, gallery->liveCount() - 1) ) {
+                work.push_back(row);
+            }
+        }
+    }
+
+    // A load() may swap in another gallery while this runs, after which there's nothing left to write to.
+    std::atomic<bool> superseded(false);
+
+    parallelFor(scheduler, 0, work.size(), 1, [&](size_t begin, size_t end) {
+        for ( size_t i = begin; i < end && !m_stopped && !superseded; i++ ) {
+            size_t row = work[i];
+            std::vector<ScoredRow> neighbors = findNeighbors(*gallery, row, index);
+
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                if ( m_gallery != gallery ) {
+                    superseded = true;
+                    break;
+                }
+                m_neighbors[row] = neighbors;
+            }
+
+            if ( row < previousSize ) {
+                continue;
+            }
+
+            // The faces near a new face are the ones it's most likely to be near in turn.  The distance isn't
+            // symmetric, so it's scored again from their side.
+            for ( size_t n = 0; n < neighbors.size(); n++ ) {
+                size_t other = neighbors[n].row;
+                ScoredRow candidate = { faceDistance(gallery->descriptor(other), gallery->descriptor(row)), row };
+
+                std::lock_guard<std::mutex> lock(m_mutex);
+                if ( m_gallery == gallery ) {
+                    offerNeighbor(m_neighbors[other], candidate);
+                }
+            }
+        }
+    });
+
+    if ( m_stopped ) {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if ( m_gallery == gallery ) {
+        m_sequence = gallery->sequence();
+    }
+    return true;
+}
+
+bool FaceNeighborGraph::save(const std::string & path, const FaceGallerySnapshot & gallery) const
+{
+    std::string body;
+    GraphHeader header;
+    memset(&header, 0, sizeof(header));
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        // Rows live in the snapshot keep their place among each other, the rest are dropped.  A graph of another
+        // generation has none of them.
+        size_t covered = (m_gallery && m_gallery->generation() == gallery.generation()) ? std::min(m_neighbors.size(), gallery.size()) : 0;
+        std::vector<uint32_t> renumbered(covered, kDropped);
+        uint32_t kept = 0;
+        for ( size_t row = 0; row < covered; row++ ) {
+            if ( !gallery.isRemoved(row) ) {
+                renumbered[row] = kept++;
+            }
+        }
+
+        std::vector<ScoredRow> neighbors;
+        for ( size_t row = 0; row < covered; row++ ) {
+            if ( renumbered[row] == kDropped ) {
+                continue;
+            }
+
+            neighbors.clear();
+            for ( size_t i = 0; i < m_neighbors[row].size(); i++ ) {
+                size_t other = m_neighbors[row][i].row;
+                if ( other < covered && renumbered[other] != kDropped ) {
+                    neighbors.push_back(m_neighbors[row][i]);
+                }
+            }
+
+            const std::string & faceID = gallery.record(row).faceID;
+            uint32_t length = (uint32_t)faceID.size();
+            uint32_t neighborCount = (uint32_t)neighbors.size();
+            body.append((const char *)&length, sizeof(length));
+            body.append(faceID);
+            body.append((const char *)&neighborCount, sizeof(neighborCount));
+            for ( size_t i = 0; i < neighbors.size(); i++ ) {
+                uint32_t other = renumbered[neighbors[i].row];
+                body.append((const char *)&neighbors[i].distance, sizeof(neighbors[i].distance));
+                body.append((const char *)&other, sizeof(other));
+            }
+        }
+
+        header.rowCount = kept;
+        header.sequence = (covered == gallery.size()) ? m_sequence : 0;
+    }
+
+    memcpy(header.magic, kGraphMagic, sizeof(header.magic));
+    header.version = kGraphVersion;
+    header.checksum = (uint32_t)adler32(adler32(0L, Z_NULL, 0), (const Bytef *)body.data(), (uInt)body.size());
+
+    // Write to the side and rename so that a crash never leaves a half written file in place.
+    std::string tempPath = path + ".tmp";
+    FILE * file = fopen(tempPath.c_str(), "wb");
+    if ( !file ) {
+        return false;
+    }
+
+    bool ok = (fwrite(&header, sizeof(header), 1, file) == 1);
+    if ( ok && body.size() > 0 ) {
+        ok = (fwrite(body.data(), body.size(), 1, file) == 1);
+    }
+
+    ok = (fclose(file) == 0) && ok;
+    ok = ok && (rename(tempPath.c_str(), path.c_str()) == 0);
+
+    if ( !ok ) {
+        unlink(tempPath.c_str());
+    }
+    return ok;
+}
+
+bool FaceNeighborGraph::load(const std::string & path, const std::shared_ptr<const FaceGallerySnapshot> & gallery)
+{
+    GraphHeader header;
+    std::string body;
+
+    FILE * file = fopen(path.c_str(), "rb");
+    bool valid = (file != NULL) && (fread(&header, sizeof(header), 1, file) == 1);
+
+    if ( valid ) {
+        char buffer[64 * 1024];
+        size_t count = 0;
+        while ( (count = fread(buffer, 1, sizeof(buffer), file)) > 0 ) {
+            body.append(buffer, count);
+        }
+        valid = memcmp(header.magic, kGraphMagic, sizeof(header.magic)) == 0 &&
+                header.version == kGraphVersion &&
+                header.rowCount <= gallery->size() &&
+                header.checksum == (uint32_t)adler32(adler32(0L, Z_NULL, 0), (const Bytef *)body.data(), (uInt)body.size());
+    }
+    if ( file ) {
+        fclose(file);
+    }
+
+    std::vector<std::vector<ScoredRow>> neighbors;
+    const char * in = body.data();
+    const char * end = in + body.size();
+
+    for ( uint64_t row = 0; valid && row < header.rowCount; row++ ) {
+        // Each row must be the face at the same row of the gallery.
+        uint32_t length = 0;
+        uint32_t neighborCount = 0;
+        valid = readBytes(in, end, &length, sizeof(length)) && (size_t)(end - in) >= length &&
+                gallery->record(row).faceID.compare(0, std::string::npos, in, length) == 0;
+        if ( !valid ) {
+            break;
+        }
+        in += length;
+
+        valid = readBytes(in, end, &neighborCount, sizeof(neighborCount)) && neighborCount <= kNeighborCount;
+        neighbors.push_back(std::vector<ScoredRow>());
+        for ( uint32_t i = 0; valid && i < neighborCount; i++ ) {
+            float distance = 0;
+            uint32_t other = 0;
+            valid = readBytes(in, end, &distance, sizeof(distance)) && readBytes(in, end, &other, sizeof(other)) &&
+                    other < header.rowCount && other != row;
+            if ( valid ) {
+                ScoredRow neighbor = { distance, other };
+                neighbors.back().push_back(neighbor);
+            }
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    clear();
+    if ( !valid ) {
+        return false;
+    }
+
+    m_gallery = gallery;
+    m_neighbors.swap(neighbors);
+    for ( size_t row = 0; row < m_neighbors.size(); row++ ) {
+        m_rowsByFaceID[gallery->record(row).faceID] = row;
+    }
+    m_sequence = header.sequence;
+    return true;
+}
+
+}
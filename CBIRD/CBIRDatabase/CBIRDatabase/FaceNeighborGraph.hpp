@@ -0,0 +1,115 @@
+//
+//  FaceNeighborGraph.hpp
+//  CBIRDatabase
+//
+//  Created by Joseph Carson on 10/19/16.
+//  Copyright © 2016 Joseph Carson. All rights reserved.
+//
+
+#ifndef FaceNeighborGraph_hpp
+#define FaceNeighborGraph_hpp
+
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "FaceGallery.hpp"
+#include "FaceHnswIndex.hpp"
+#include "TaskScheduler.hpp"
+#include "TopKCollector.hpp"
+
+namespace cbir {
+
+// The kNeighborCount nearest faces of every face in the gallery, so that "more like this" for a stored face
+// is a lookup rather than a scan.
+//
+// The graph is kept up to date by update()s in the background, each of which only works on what changed
+// since the last: new faces get their neighbours found, and are offered to the faces they're near, and faces
+// left with too few neighbours by removals get theirs found again.  Finding a face's neighbours works like
+// a query, candidates from the face index then the full distance for the best of them, so the graph is
+// approximate in the same way queries are.  Only the rows the index hasn't caught up with are scanned, and
+// without an index, all of them.  Offering new faces only to their own candidates, rather than every face,
+// makes it a little more so.
+//
+// Rows only refer to the snapshot returned alongside them.  Within a generation of the gallery (see FaceGallery)
+// rows stay put from one snapshot to the next, and a newer generation starts the graph over.
+//
+// The graph is saved next to the gallery snapshot, from the same snapshot, and renumbered the same way, so that
+// the two load back in together and a relaunch only finds the neighbours of the faces indexed since.
+//
+// Layout.
+// [header][per row: face ID, neighbour count, per neighbour: distance, row]
+class FaceNeighborGraph
+{
+public:
+
+    static const size_t kNeighborCount = 16;
+
+    FaceNeighborGraph();
+
+    // Brings the graph up to date with the snapshot, scoring on the scheduler, and taking candidates from the index
+    // if there is one.  Only one thread may update at a time, but any number may read while it does.  Returns false
+    // if stopped before it was done.
+    bool update(const std::shared_ptr<const FaceGallerySnapshot> & gallery, TaskScheduler & scheduler,
+                const FaceHnswIndex * index);
+
+    // Makes a running or future update() give up as soon as it can.
+    void stop() { m_stopped = true; }
+
+    // The face's neighbours, nearest first, and the snapshot they're rows of.  Neighbours that have since
+    // been removed are left out.  Returns false if the face isn't in the graph yet.
+    bool neighbors(const std::string & faceID, std::vector<ScoredRow> & neighbors,
+                   std::shared_ptr<const FaceGallerySnapshot> & gallery) const;
+
+    // The pairs of faces that are each among the other's rank nearest neighbours, and no further apart than
+    // maxDistance, as rows of the returned snapshot.  Removed faces are left out.  Each pair comes up once.
+    std::shared_ptr<const FaceGallerySnapshot> mutualEdges(size_t rank, float maxDistance,
+                                                           std::vector<std::pair<size_t, size_t>> & edges) const;
+
+    // The database sequence number that the graph has caught up with.  It's stale if the gallery is past it.
+    int64_t sequence() const;
+
+    // Saves the graph to the file at the given path, which is replaced atomically.  Only the rows that are live in
+    // the snapshot are saved, renumbered the same way as FaceGallerySnapshot::save() does, and neighbours that
+    // aren't are dropped.  A graph of another generation saves empty.
+    bool save(const std::string & path, const FaceGallerySnapshot & gallery) const;
+
+    // Replaces the graph with the one saved at the given path, as long as each of its rows is the face at the same
+    // row of the gallery.  An update() that's running when the graph is loaded gives up without touching it.  Fails,
+    // leaving the graph empty, if the file is missing, doesn't match, of another version, or corrupt.
+    bool load(const std::string & path, const std::shared_ptr<const FaceGallerySnapshot> & gallery);
+
+private:
+
+    FaceNeighborGraph(const FaceNeighborGraph &);
+    FaceNeighborGraph & operator=(const FaceNeighborGraph &);
+
+    // The nearest neighbours of the row, not counting itself.
+    std::vector<ScoredRow> findNeighbors(const FaceGallerySnapshot & gallery, size_t row, const FaceHnswIndex * index) const;
+
+    void clear();
+
+    // Everything from here to m_stopped is guarded by m_mutex.
+    mutable std::mutex m_mutex;
+
+    std::shared_ptr<const FaceGallerySnapshot> m_gallery;
+
+    // Per row of m_gallery, up to the last one the graph has got to, nearest first.  Empty for removed rows, and
+    // rows whose neighbours haven't been found yet.
+    std::vector<std::vector<ScoredRow>> m_neighbors;
+
+    std::unordered_map<std::string, size_t> m_rowsByFaceID;
+
+    int64_t m_sequence;
+
+    std::atomic<bool> m_stopped;
+};
+
+}
+
+#endif /* FaceNeighborGraph_hpp */
@@ -14,8 +14,7 @@
 
 @interface FaceDataResult : NSObject
 
-// The difference sum of this particular face and the source face.
-// This is the order that should be respected by the heap in min heap fashion.
+// The difference sum of this particular face and the source face.  Results come out smallest first.
 @property (nonatomic) CGFloat differenceSum;
 
 // The document ID of the image that this face exists in.
@@ -25,7 +24,13 @@
 
 @property (nonatomic) CGRect faceRect;
 
-@property (nonatomic) NSData * faceJPEGData;
+// Name of the face crop JPEG attachment in the image document.  This is only a handle,
+// the JPEG bytes themselves aren't read until faceJPEGData is asked for.
+@property (nonatomic) NSString * faceJPEGAttachmentName;
+
+// The face crop JPEG.  Lazily fetched from the database on first access, so that only
+// the results that are actually displayed ever pay for the attachment read.
+@property (nonatomic, readonly) NSData * faceJPEGData;
 
 @end
 
@@ -37,10 +42,65 @@
 @property (nonatomic, readonly) CIImage * inputFaceImage;
 @property (nonatomic, readonly) CIFaceFeature * inputFaceFeature;
 
+// The stored face that a "more like this" query searches around, see initWithStoredFaceID:andDelegate:.
+@property (nonatomic, readonly) NSString * storedFaceID;
+
+// Whether a "more like this" query was answered from neighbours found before the latest changes to the
+// database, so that faces indexed since may be missing from them.
+@property (nonatomic, readonly, getter=isStale) BOOL stale;
+
+// How many of the nearest faces the search itself ranks, and so how many results are ready the moment it
+// completes.  Deeper pages are ranked as they're asked for.  Defaults to 100.
+@property (nonatomic) NSUInteger maxResults;
+
+// Whether to return only the nearest face of each image, so that every result is a different photo.  Grouping
+// happens as faces are scored, so it costs no more than the plain search.  Defaults to NO.
+@property (nonatomic) BOOL distinctImages;
+
+// The search normally runs in two stages.  The first looks up a number of candidates that grows with maxResults
+// in the engine's approximate nearest neighbour index, and scores a coarse descriptor of any faces that aren't in
+// it yet, which is much cheaper.  Only the candidates get the full comparison.  Set exhaustive to fully compare
+// every face instead, which is slower but can't miss a face that the first stage ranks too low.  Either way only
+// the faces that get the full comparison can be paged through.  Defaults to NO.
+@property (nonatomic) BOOL exhaustive;
+
+// Searches the engine's inverted file index instead, when above zero.  Only the faces in the probeCount lists
+// nearest the input face get the full comparison, there's no coarse stage.  Each list holds roughly the square
+// root of the number of faces, so probing more lists finds more of the nearest faces, and takes longer.  A few
+// lists find most of them.  Falls back to the usual search while the index isn't trained yet, which happens in
+// the background once there are enough faces to make it worthwhile.  Ignored when exhaustive.  Defaults to 0.
+@property (nonatomic) NSUInteger probeCount;
+
+// Turns the query into a range search when above zero: rather than the nearest faces, it finds every face
+// whose difference sum is within the threshold.  Each face is only scored until it's clearly out of range, and
+// matches are sent to the delegate's resultFound: as soon as they're found, in no particular order.  Once
+// complete, the matches can be paged through nearest first like any other results.  Defaults to 0.
+@property (nonatomic) CGFloat distanceThreshold;
+
+// Stops a range search once it has found this many matches, so that asking whether a face is in the database
+// at all stops at the first match.  0, the default, means no limit.  With distinctImages, matches are images.
+@property (nonatomic) NSUInteger matchLimit;
+
+// How many results there are to page through: the faces the search scored, or their images when distinct.
+@property (nonatomic, readonly) NSUInteger resultCount;
+
 // Initializes the query with the source image (e.g. not the face, but the whole thing) and a face feature
 //
 -(instancetype)initWithFaceImage:(CIImage *)faceImage withFeature:(CIFaceFeature *)faceFeature andDelegate:(id<CBIRQueryDelegate>)delegate NS_DESIGNATED_INITIALIZER;
 
+// Initializes a "more like this" query for a face that's already in the database, such as a result's faceUUID.
+// It's answered straight from the engine's neighbour graph, which already knows the nearest faces of every
+// stored face, so there's no scan.  Only the first FaceNeighborGraph::kNeighborCount results are available
+// that way, and distanceThreshold doesn't apply.  A face that isn't in the graph yet is searched for with
+// its stored descriptor instead, like any other query.
+-(instancetype)initWithStoredFaceID:(NSString *)faceID andDelegate:(id<CBIRQueryDelegate>)delegate;
+
+// Up to limit results starting at offset, nearest first.  Faces at the same distance are ordered by face ID,
+// so the same page always holds the same results.  Pages past the first maxResults are ranked from distances
+// kept by the search, without scoring any faces again.  Call once the query is complete.
+-(NSArray *)resultsAtOffset:(NSUInteger)offset limit:(NSUInteger)limit;
+
+// The result after the last one dequeued, or nil once they've all been.  Doesn't disturb resultsAtOffset:limit:.
 -(FaceDataResult *)dequeueResult;
 
 @end
@@ -6,12 +6,32 @@
 //  Copyright © 2015 Joseph Carson. All rights reserved.
 //
 #import <CouchbaseLite/CouchbaseLite.h>
-#import <opencv2/opencv.hpp>
 
-#import "FaceQuery.h"
+#import "FaceQuery_Private.h"
 #import "FaceIndexer.h"
 #import "CBIRDocument.h"
-#import "ChiSquareFilter.h"
+#import "CBIRDatabaseEngine_Private.h"
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <unordered_set>
+#include <vector>
+#include "FaceDescriptor.hpp"
+#include "FaceGallery.hpp"
+#include "TopKCollector.hpp"
+
+// Number of gallery rows scored per task.  Big enough that a task outweighs the cost of scheduling it.
+#define FACE_QUERY_SCORING_GRAIN 256
+
+// Coarse rows are 16 times cheaper to score, so their tasks take 16 times as many.
+#define FACE_QUERY_COARSE_SCORING_GRAIN 4096
+
+// How many candidates the coarse stage passes on for each result wanted, and the fewest it ever passes on.
+// The coarse distance only approximates the full one, so the margin has to cover faces that rank lower
+// coarsely than they really are.
+#define FACE_QUERY_CANDIDATES_PER_RESULT 10
+#define FACE_QUERY_MIN_CANDIDATES 500
 
 
 @implementation FaceDataResult
@@ -19,56 +39,53 @@
 @synthesize differenceSum = _differenceSum;
 @synthesize imageDocumentID = _imageDocumentID;
 @synthesize faceUUID = _faceUUID;
+@synthesize faceJPEGAttachmentName = _faceJPEGAttachmentName;
+@synthesize faceJPEGData = _faceJPEGData;
 
-
--(NSString *)description
+-(NSData *)faceJPEGData
 {
-    return [NSString stringWithFormat:@"FaceDataResult: differenceSum: %f imageDocumentID: %@ faceUUID: %@", _differenceSum, _imageDocumentID, _faceUUID];
+    // Only hit the database the first time.  The scan never reads this, so it's only paid for the results that are shown.
+    if ( !_faceJPEGData && _faceJPEGAttachmentName ) {
+        _faceJPEGData = [[CBIRDatabaseEngine sharedEngine] getAttachment:_faceJPEGAttachmentName forDocument:_imageDocumentID];
+    }
+    
+    return _faceJPEGData;
 }
 
--(void)dealloc
+-(NSString *)description
 {
-    NSLog(@"%s", __FUNCTION__);
+    return [NSString stringWithFormat:@"FaceDataResult: differenceSum: %f imageDocumentID: %@ faceUUID: %@", _differenceSum, _imageDocumentID, _faceUUID];
 }
 
 @end
 
-// Spatial map of weights to apply to differences as certain blocks are of more
-// significance than others, e.g. the eyes are weighted by 4 whereas the lips are
-// weighted by 2.
-// [0 ][1 ][2 ][3 ][4 ][5 ][6 ][7 ]
-// [8 ][9 ][10][11][12][13][14][15]
-// [16][17][18][19][20][21][22][23]
-// [24][25][26][27][28][29][30][31] => Spatial mapping is according to feature index in buffer.
-// [32][33][34][35][36][37][38][39]
-// [40][41][42][43][44][45][46][47]
-// [48][49][50][51][52][53][54][55]
-// [56][57][58][59][60][61][62][63]
-const NSUInteger SPATIAL_WEIGHT_MAP[] = {0, 0, 0, 0, 0, 0, 0, 0,
-                                         0, 0, 0, 0, 0, 0, 0, 0,
-                                         0, 8, 8, 8, 8, 8, 8, 0,
-                                         0, 8, 8, 8, 8, 8, 8, 0,
-                                         0, 2, 1, 1, 1, 1, 2, 0,
-                                         0, 2, 1, 4, 4, 1, 2, 0,
-                                         0, 0, 1, 4, 4, 1, 0, 0,
-                                         0, 0, 1, 1, 1, 1, 0, 0
-                                        };
-
-
-
-// TODO:  This class could use some optimization.  For one, eventually remove the usage of the individual fragments
-// and simply read the associated from the whole histogram image, which will allow us to stop saving the indivudual
-// fragments, saving storage.  In the meantime though, don't let premature optimization tempation slow you down!!
+// TODO:  The search now reads each face's whole histogram image rather than the individual fragments, so FaceIndexer
+// could stop saving the individual fragments, saving storage.  In the meantime though, don't let premature optimization
+// tempation slow you down!!
 @implementation FaceQuery
 {
-    CFBinaryHeapRef m_minHeap;
-    CBLRevision * m_inputFaceLBPRevision; // An LBP face revision generated for the input face.  DO NOT PERSIST IN DATABASE!!
-    ChiSquareFilter * m_chiSquareFilter;
-    CIContext * m_chiSquareRenderingContext;
+    // What the last search left behind, so that deeper pages can be ranked without scoring faces again.
+    // A float per face is a lot less than a result per face.  Guarded by @synchronized(self).
+    std::shared_ptr<const cbir::FaceGallerySnapshot> m_gallery;
+    std::vector<float> m_distances; // Per gallery row, INFINITY for rows that weren't scored.
+    std::vector<cbir::ScoredRow> m_ranked; // The nearest faces ranked so far, nearest first.
+    BOOL m_groupByImage; // distinctImages, as it was when the search ran.
+    NSUInteger m_nextResult;
+    std::vector<float> m_probeDescriptor; // The descriptor of the input face, see FaceDescriptor.hpp.
+    std::vector<float> m_probeCoarseDescriptor;
 }
 
 @synthesize inputFaceImage = _inputFaceImage;
 @synthesize inputFaceFeature = _inputFaceFeature;
+@synthesize maxResults = _maxResults;
+@synthesize resultCount = _resultCount;
+@synthesize distinctImages = _distinctImages;
+@synthesize exhaustive = _exhaustive;
+@synthesize probeCount = _probeCount;
+@synthesize distanceThreshold = _distanceThreshold;
+@synthesize matchLimit = _matchLimit;
+@synthesize storedFaceID = _storedFaceID;
+@synthesize stale = _stale;
 
 -(instancetype)initWithDelegate:(id<CBIRQueryDelegate>)delegate
 {
@@ -81,81 +98,169 @@ const NSUInteger SPATIAL_WEIGHT_MAP[] = {0, 0, 0, 0, 0, 0, 0, 0,
     if ( self ) {
         _inputFaceImage = faceImage;
         _inputFaceFeature = faceFeature;
-        [self buildMinBinHeap];
+        _maxResults = 100;
     }
     return self;
 }
 
-
-CFComparisonResult binaryHeapCompareCallBack( const void *ptr1, const void *ptr2, void *info )
+-(instancetype)initWithDescriptor:(const float *)descriptor gallery:(std::shared_ptr<const cbir::FaceGallerySnapshot>)gallery andDelegate:(id<CBIRQueryDelegate>)delegate
 {
-    FaceDataResult * faceData1 = (__bridge FaceDataResult *)ptr1;
-    FaceDataResult * faceData2 = (__bridge FaceDataResult *)ptr2;
-    
-    if ( faceData1.differenceSum < faceData2.differenceSum ) {
-        return kCFCompareLessThan; // kCFCompareLessThan if ptr1 is less than ptr2,
-    } else if ( faceData1.differenceSum > faceData2.differenceSum ) {
-        return kCFCompareGreaterThan; // kCFCompareGreaterThan if ptr1 is greater than ptr2.
+    self = [self initWithFaceImage:nil withFeature:nil andDelegate:delegate];
+    if ( self ) {
+        m_probeDescriptor.assign(descriptor, descriptor + cbir::kDescriptorLength);
+        m_probeCoarseDescriptor.resize(cbir::kCoarseDescriptorLength);
+        cbir::coarsenDescriptor(m_probeDescriptor.data(), m_probeCoarseDescriptor.data());
+        _searchGallery = gallery;
     }
-
-    return kCFCompareEqualTo; // kCFCompareEqualTo if ptr1 and ptr2 are equal, or
+    return self;
 }
 
-void release(CFAllocatorRef allocator, const void *ptr)
+-(instancetype)initWithStoredFaceID:(NSString *)faceID andDelegate:(id<CBIRQueryDelegate>)delegate
 {
-    CFBridgingRelease(ptr);
+    self = [self initWithFaceImage:nil withFeature:nil andDelegate:delegate];
+    if ( self ) {
+        _storedFaceID = faceID;
+    }
+    return self;
 }
 
 
--(void)buildMinBinHeap
+// A collector over the rows of the gallery.  Faces at the same distance are ordered by face ID, so that paging
+// through them is stable, and when grouping by image only the nearest face of each image is kept.
+static cbir::TopKCollector makeCollector(size_t capacity, const cbir::FaceGallerySnapshot & gallery, bool groupByImage)
 {
-    if( !m_minHeap ) {
-        // It's possible that we may need to add a backing dictionary to retain pointers.  We'll see.
-        CFBinaryHeapCallBacks callbackStruct = {.version = 0, .retain = NULL, .release = release, .copyDescription = NULL, .compare = binaryHeapCompareCallBack};
-        m_minHeap = CFBinaryHeapCreate(NULL, 0, &callbackStruct, NULL);
+    const cbir::FaceGallerySnapshot * snapshot = &gallery;
+    cbir::TopKCollector::TieBreak tieBreak = [snapshot](size_t a, size_t b) {
+        return snapshot->record(a).faceID < snapshot->record(b).faceID;
+    };
+    
+    cbir::TopKCollector::GroupKey groupKey;
+    if ( groupByImage ) {
+        groupKey = [snapshot](size_t row) -> const std::string & { return snapshot->record(row).imageDocumentID; };
     }
+    
+    return cbir::TopKCollector(capacity, tieBreak, groupKey);
 }
 
 -(FaceDataResult *)dequeueResult
 {
-    const void * resultVP = NULL;
-    CFBinaryHeapGetMinimumIfPresent(m_minHeap, &resultVP);
-    FaceDataResult * result = (__bridge FaceDataResult *)resultVP;
-    NSLog(@"dequeue result: %@", result);
-    
-    CFBinaryHeapRemoveMinimumValue(m_minHeap);
+    FaceDataResult * result = nil;
+    @synchronized(self) {
+        result = [[self resultsAtOffset:m_nextResult limit:1] firstObject];
+        if ( result ) {
+            m_nextResult++;
+        }
+    }
     
     return result;
 }
 
+-(NSArray *)resultsAtOffset:(NSUInteger)offset limit:(NSUInteger)limit
+{
+    @synchronized(self) {
+        
+        if ( !m_gallery || offset >= _resultCount ) {
+            return @[];
+        }
+        
+        NSUInteger end = offset + MIN(limit, _resultCount - offset);
+        [self rankThrough:end];
+        
+        std::vector<cbir::ScoredRow> page(m_ranked.begin() + offset, m_ranked.begin() + end);
+        return [self resultsForRows:page ofGallery:*m_gallery limit:limit];
+    }
+}
+
+// Extends the ranking to at least count faces.  The faces ranked so far are skipped by continuing from the
+// last of them, so each page only costs a pass over the kept distances.  Must be @synchronized(self).
+-(void)rankThrough:(NSUInteger)count
+{
+    if ( m_ranked.size() >= count ) {
+        return;
+    }
+    
+    // Rank a whole page ahead, so that paging one result at a time doesn't make a pass per result.
+    count = MIN(MAX(count, m_ranked.size() + _maxResults), _resultCount);
+    
+    cbir::TopKCollector next = makeCollector(count - m_ranked.size(), *m_gallery, m_groupByImage);
+    bool hasLast = !m_ranked.empty();
+    cbir::ScoredRow last = hasLast ? m_ranked.back() : cbir::ScoredRow();
+    
+    // When grouping, the other faces of images that are already ranked can come after the last one ranked,
+    // and mustn't show up again.
+    std::unordered_set<std::string> rankedImages;
+    if ( m_groupByImage ) {
+        for ( size_t i = 0; i < m_ranked.size(); i++ ) {
+            rankedImages.insert(m_gallery->record(m_ranked[i].row).imageDocumentID);
+        }
+    }
+    
+    for ( size_t row = 0; row < m_distances.size(); row++ ) {
+        cbir::ScoredRow entry = { m_distances[row], row };
+        if ( isinf(entry.distance) || (hasLast && !next.less(last, entry)) ) {
+            continue;
+        }
+        if ( m_groupByImage && rankedImages.count(m_gallery->record(row).imageDocumentID) ) {
+            continue;
+        }
+        next.add(entry.distance, entry.row);
+    }
+    
+    std::vector<cbir::ScoredRow> ranked = next.sorted();
+    m_ranked.insert(m_ranked.end(), ranked.begin(), ranked.end());
+}
+
 -(void)run
 {
     NSLog(@"%s executing.", __FUNCTION__);
-    CFBinaryHeapRemoveAllValues(m_minHeap);
+    @synchronized(self) {
+        m_gallery.reset();
+        m_distances.clear();
+        m_ranked.clear();
+        m_nextResult = 0;
+        _resultCount = 0;
+        _stale = NO;
+    }
+    
+    if ( self.storedFaceID ) {
+        [self runFromStoredFace];
+        return;
+    }
+    
+    // A query made with a descriptor has nothing to extract.
+    if ( _searchGallery ) {
+        [self performSearch];
+        return;
+    }
     
     // Retrieve the desired Indexer.  It must be registered and it must be a FaceIndexer, lest we give up.
     const CBIRIndexer * indexer = [[CBIRDatabaseEngine sharedEngine] getIndexer:NSStringFromClass([FaceIndexer class])];
     NSAssert(indexer != nil && [indexer class] == [FaceIndexer class], @"%s failed to get FaceIndexer resource.  Object: %@", __FUNCTION__, indexer);
 
     FaceIndexer * faceIndexer = (FaceIndexer *)indexer;
-    NSString * tempQueryID = @"face_query_temp";
-    CBLDocument * dbDocument = [[CBIRDatabaseEngine sharedEngine] newDocument:tempQueryID];
-    m_inputFaceLBPRevision = [dbDocument newRevision];
     
     // Create an LBP for the input face.
     FaceLBP * faceLBP = [faceIndexer generateLBPFace:self.inputFaceImage fromFeature:self.inputFaceFeature];
     NSAssert(faceLBP != nil, @"Face LBP failed generation for FaceQuery input.");
     //[ImageUtil dumpDebugImage:faceLBP.lbpImage];
     
-    // Create the descriptor object for the input face using the same method that FaceIndexer does.
-    [faceIndexer extractFeatures:@[faceLBP] andPersistTo:m_inputFaceLBPRevision];
-    
+    // Create the descriptor for the input face using the same method that FaceIndexer does.  This all
+    // happens in memory, the input face is never written to (or read back from) the database.
+    FaceFeatures * inputFeatures = [faceIndexer extractFeatures:faceLBP];
     
-    NSArray * faceList = m_inputFaceLBPRevision.properties[kCBIRFaceDataList];
-    
-    if ( faceList.count == 1 ) {
+    if ( [self shouldStop] ) {
+        // Nothing has been scored yet, so there's nothing partial to return either.
+        NSLog(@"%s stopped before the search started.", __FUNCTION__);
+        
+    } else if ( inputFeatures.histogramImage.length == cbir::kGridBlockCount * cbir::kHistogramBinCount * sizeof(float) ) {
+        
+        m_probeDescriptor.resize(cbir::kDescriptorLength);
+        cbir::compactHistogramImage((const float *)inputFeatures.histogramImage.bytes, m_probeDescriptor.data());
         
-        // Read the full histo image for the search face and kick off the process to search.
+        m_probeCoarseDescriptor.resize(cbir::kCoarseDescriptorLength);
+        cbir::coarsenDescriptor(m_probeDescriptor.data(), m_probeCoarseDescriptor.data());
+        
+        // Kick off the process to search.
         NSDate * beforeSearch = [NSDate date];
         [self performSearch];
         NSDate * afterSearch = [NSDate date];
@@ -163,11 +268,62 @@ void release(CFAllocatorRef allocator, const void *ptr)
         
         
     } else {
-        NSLog(@"faceList of image must contain only a single face. count: %lu", (unsigned long)faceList.count);
+        NSLog(@"%s input face features are invalid: %@", __FUNCTION__, inputFeatures);
     }
 }
 
 
+// "More like this" for a stored face.  Its neighbours are looked up in the graph, or failing that, its stored
+// descriptor becomes the probe of a regular search.
+-(void)runFromStoredFace
+{
+    CBIRDatabaseEngine * engine = [CBIRDatabaseEngine sharedEngine];
+    std::string faceID = self.storedFaceID.UTF8String;
+    
+    std::vector<cbir::ScoredRow> neighbors;
+    std::shared_ptr<const cbir::FaceGallerySnapshot> graphGallery;
+    
+    if ( [engine faceNeighborGraph]->neighbors(faceID, neighbors, graphGallery) ) {
+        
+        // When grouping, keep the nearest face of each image.  The neighbours are already nearest first.
+        if ( self.distinctImages ) {
+            std::unordered_set<std::string> images;
+            std::vector<cbir::ScoredRow> distinct;
+            for ( size_t i = 0; i < neighbors.size(); i++ ) {
+                if ( images.insert(graphGallery->record(neighbors[i].row).imageDocumentID).second ) {
+                    distinct.push_back(neighbors[i]);
+                }
+            }
+            neighbors.swap(distinct);
+        }
+        
+        @synchronized(self) {
+            m_gallery = graphGallery;
+            m_ranked = neighbors;
+            m_groupByImage = self.distinctImages;
+            _resultCount = neighbors.size();
+            _stale = graphGallery->sequence() < [engine faceGallerySnapshot]->sequence();
+        }
+        
+        NSLog(@"%s answered from the neighbour graph%@.", __FUNCTION__, _stale ? @", which is catching up" : @"");
+        return;
+    }
+    
+    // Not in the graph yet, so search with the face's stored descriptor.
+    std::shared_ptr<const cbir::FaceGallerySnapshot> gallery = [engine faceGallerySnapshot];
+    for ( size_t row = 0; row < gallery->size(); row++ ) {
+        if ( !gallery->isRemoved(row) && gallery->record(row).faceID == faceID ) {
+            
+            m_probeDescriptor.assign(gallery->descriptor(row), gallery->descriptor(row) + cbir::kDescriptorLength);
+            m_probeCoarseDescriptor.assign(gallery->coarseDescriptor(row), gallery->coarseDescriptor(row) + cbir::kCoarseDescriptorLength);
+            [self performSearch];
+            return;
+        }
+    }
+    
+    NSLog(@"%s face %@ isn't in the database.", __FUNCTION__, self.storedFaceID);
+}
+
 // Algorithm:  Maturana's algorithm effectively takes each block of the input face and attempts to find the nearest
 // neighboring block (according to Chi-Square similarity) in each training face.  Using the ChiSquareFilter we will
 // effectively compute the Chi-Square difference of every block in each training face against one block of the input
@@ -193,144 +349,350 @@ void release(CFAllocatorRef allocator, const void *ptr)
 //    the running sum (difference) for that face.
 // 3. When all images have been iterated, choose the face with the least difference, and
 //    the image associated with that face is the best match.  Continue pulling those with
-//    the least difference.  Use a CFBinaryHeap and figure out how to use it as a min heap.
+//    the least difference.  Only the nearest maxResults faces are kept, see TopKCollector.hpp.
 //
 //
 //
 -(NSError *)performSearch
 {
-    // Begin by iterating all documents in the database.
-    // TODO: Come up with a better way of indexing names so that we're not actually running through every object ever.
-    // It's not a big deal right now since the database only contains faces, but if it were to contain more...
-    CBLQuery * allDocsQuery =[[CBIRDatabaseEngine sharedEngine] createAllDocsQuery];
+    // Scan the in memory gallery rather than the database.  The engine keeps it in sync with the face index,
+    // so nothing here reads documents or attachments.  The snapshot stays the same for the whole scan, no
+    // matter what gets indexed in the meantime.
+    std::shared_ptr<const cbir::FaceGallerySnapshot> gallery = _searchGallery ? _searchGallery : [[CBIRDatabaseEngine sharedEngine] faceGallerySnapshot];
+    
+    if ( self.distanceThreshold > 0 ) {
+        return [self performRangeSearch:gallery];
+    }
+    
+    const size_t collectorCapacity = MAX(self.maxResults, self.progressResultCount);
+    const bool groupByImage = self.distinctImages;
     
-    NSError * queryError = nil;
-    CBLQueryEnumerator * qEnum = [allDocsQuery run:&queryError];
+    // A repeat of a recent search, against the same gallery, picks up where that one left off.
+    cbir::FaceSearchCache * cache = [[CBIRDatabaseEngine sharedEngine] faceSearchCache];
+    uint64_t cacheKey = [self searchKeyWithCapacity:collectorCapacity];
+    std::shared_ptr<const cbir::CachedFaceSearch> cached = cache->find(cacheKey, gallery->sequence());
+    if ( cached ) {
+        NSLog(@"%s reusing a cached search.", __FUNCTION__);
+        @synchronized(self) {
+            m_gallery = cached->gallery;
+            m_distances = cached->distances;
+            m_ranked = cached->ranked;
+            m_groupByImage = groupByImage;
+            _resultCount = cached->resultCount;
+        }
+        return nil;
+    }
+    
+    // The first stage finds just enough candidates for the second stage to find the results among, without
+    // fully scoring anything.  It's skipped when it wouldn't leave out much of the gallery.  When probing, the
+    // candidates are the faces of the probed lists instead, as long as the inverted file is trained.
+    std::vector<size_t> candidates;
+    bool probed = !self.exhaustive && self.probeCount > 0 && [self probedCandidates:candidates ofGallery:*gallery];
+    size_t candidateCount = MAX(collectorCapacity * FACE_QUERY_CANDIDATES_PER_RESULT, FACE_QUERY_MIN_CANDIDATES);
+    bool twoStage = probed || (!self.exhaustive && candidateCount < gallery->liveCount() / 2);
     
-    if ( !queryError ) {
+    if ( twoStage && !probed ) {
+        candidates = [self candidates:candidateCount ofGallery:*gallery];
         
-        NSUInteger faceIndex = 0;
-        for ( CBLQueryRow * row in qEnum ) {
-
-            if ( self.isCanceled ) {
-                NSLog(@"%s cancelling processing.", __FUNCTION__);
-                
+        // The coarse scan gives up as soon as the query should.  Nothing has been fully scored by then, so a
+        // query that ran out of time has nothing partial to return either.
+        if ( [self shouldStop] ) {
+            NSLog(@"%s stopped while finding candidates.", __FUNCTION__);
+            return nil;
+        }
+    }
+    
+    // The second stage fully scores the candidates, or the whole gallery.
+    const size_t * scanRows = twoStage ? candidates.data() : NULL;
+    const size_t scanCount = twoStage ? candidates.size() : gallery->size();
+    
+    // Score the faces across all cores.  Each chunk keeps its own nearest faces, then merges them into the
+    // shared collector when it's done, so the lock is taken once per chunk rather than once per face.  The
+    // distances are kept too, each chunk writing only its own slots, for ranking deeper pages later.
+    const float * probe = m_probeDescriptor.data();
+    cbir::TopKCollector nearest = makeCollector(collectorCapacity, *gallery, groupByImage);
+    std::mutex nearestMutex;
+    std::vector<float> distances(gallery->size(), INFINITY);
+    std::atomic<size_t> scannedCount(0);
+    std::atomic<size_t> scoredCount(0);
+    
+    cbir::parallelFor(*[[CBIRDatabaseEngine sharedEngine] scheduler], 0, scanCount, FACE_QUERY_SCORING_GRAIN, [&](size_t begin, size_t end) {
+        cbir::TopKCollector chunkNearest = makeCollector(collectorCapacity, *gallery, groupByImage);
+        size_t chunkScored = 0;
+        size_t i = begin;
+        
+        for ( ; i < end; i++ ) {
+            
+            // Checked for every face, so that a canceled or timed out query lets go of the cores right away.
+            // Whatever the chunk scored before stopping still counts towards partial results.
+            if ( [self shouldStop] ) {
                 break;
             }
             
-            NSDictionary * p = row.document.properties;
-            NSString * faceID = p[kCBIRFaceID];
-            NSArray * faceDataList = p[kCBIRFaceDataList];
+            size_t row = scanRows ? scanRows[i] : i;
             
-            // For each face in the list,
-            for ( NSUInteger i = 0; i < faceDataList.count; i++ ) {
-                NSLog(@"faceIndex: %lu", (unsigned long)faceIndex++);
-                NSDictionary * faceData = faceDataList[i];
-                
-                FaceDataResult * tFace = [[FaceDataResult alloc] init];
-                tFace.differenceSum = [self computeInputFaceDifferenceAgainst:faceData fromDoc:row.document];
-                tFace.imageDocumentID = row.document.documentID;
-                tFace.faceUUID = faceID;
-                
-                
-                NSString * faceJPEGAttName = faceData[kCBIRSourceFaceImage];
-                CBLAttachment * att = [[row.document currentRevision] attachmentNamed:faceJPEGAttName];
-                tFace.faceJPEGData = att.content;
-                
-                NSString * rectString = faceData[kCBIRFaceRect];
-                tFace.faceRect = CGRectFromString(rectString);
-                
-                // Add the face object into the binary heap, manually increasing retain count.
-                CFBinaryHeapAddValue(m_minHeap, CFBridgingRetain(tFace));
+            if ( !gallery->isRemoved(row) ) {
+                distances[row] = cbir::faceDistance(probe, gallery->descriptor(row));
+                chunkNearest.add(distances[row], row);
+                chunkScored++;
             }
-            
         }
         
-    } else {
-        NSLog(@"%s query resulted in error: %@", __FUNCTION__, queryError);
+        // Only the faces the chunk got to before stopping count as scanned.
+        size_t scanned = (scannedCount += i - begin);
+        scoredCount += chunkScored;
+        
+        {
+            std::lock_guard<std::mutex> lock(nearestMutex);
+            nearest.merge(chunkNearest);
+        }
+        
+        @autoreleasepool {
+            [self reportProgress:(float)scanned / scanCount results:^NSArray *(NSUInteger count) {
+                std::vector<cbir::ScoredRow> current;
+                {
+                    std::lock_guard<std::mutex> lock(nearestMutex);
+                    current = nearest.sorted();
+                }
+                return [self resultsForRows:current ofGallery:*gallery limit:count];
+            }];
+        }
+    });
+    
+    if ( self.isCanceled ) {
+        NSLog(@"%s cancelling processing.", __FUNCTION__);
+        return nil;
+    }
+    
+    if ( self.isPartial ) {
+        NSLog(@"%s ran out of time, returning partial results.", __FUNCTION__);
     }
     
+    // When grouping, there's a result per image rather than per face.
+    size_t resultCount = scoredCount;
+    if ( groupByImage ) {
+        std::unordered_set<std::string> images;
+        for ( size_t row = 0; row < distances.size(); row++ ) {
+            if ( !isinf(distances[row]) ) {
+                images.insert(gallery->record(row).imageDocumentID);
+            }
+        }
+        resultCount = images.size();
+    }
     
+    // Only a search of the whole gallery is worth caching.
+    if ( !self.isPartial ) {
+        std::shared_ptr<cbir::CachedFaceSearch> search(new cbir::CachedFaceSearch());
+        search->gallery = gallery;
+        search->distances = distances;
+        search->ranked = nearest.sorted();
+        search->resultCount = resultCount;
+        cache->insert(cacheKey, search);
+    }
     
-    return queryError;
+    // Only the faces that make it onto a page are ever turned into objects.
+    @synchronized(self) {
+        m_gallery = gallery;
+        m_distances.swap(distances);
+        m_ranked = nearest.sorted();
+        m_groupByImage = groupByImage;
+        _resultCount = resultCount;
+    }
+    
+    return nil;
 }
 
-// Computes the difference between the input face data against the given trainingFaceData object.
--(CGFloat) computeInputFaceDifferenceAgainst:(NSDictionary *)trainFaceData fromDoc:(CBLDocument *)trainDoc
+// Finds every face within distanceThreshold of the probe, or the first matchLimit of them.  There's no top-k,
+// so there's no coarse stage either.  Instead each face is scored only until it's clearly too far, and each
+// match goes straight to the delegate.
+-(NSError *)performRangeSearch:(std::shared_ptr<const cbir::FaceGallerySnapshot>)gallery
 {
-    CGFloat difference = 0;
+    const float * probe = m_probeDescriptor.data();
+    const float threshold = self.distanceThreshold;
+    const NSUInteger matchLimit = self.matchLimit;
+    const bool groupByImage = self.distinctImages;
     
-    // This call can get expensive.  Needs an autoreleasepool.
-    @autoreleasepool {
-        
-        NSArray * inFaceList = m_inputFaceLBPRevision.properties[kCBIRFaceDataList];
-        NSAssert(inFaceList.count <= 1, @"Input image has more than one face!  Nooo!!");
-        
-        //
-        NSDictionary * inputFaceData = inFaceList[0];
-        
-        
-        NSArray * inputFeatureList = inputFaceData[kCBIRFeatureIDList];
-        NSArray * trainingFeatureList = trainFaceData[kCBIRFeatureIDList];
+    // Matches are rare compared to faces, so sharing them behind a lock costs next to nothing.
+    std::vector<cbir::ScoredRow> matches;
+    std::unordered_set<std::string> matchedImages;
+    std::mutex matchesMutex;
+    std::atomic<bool> limitReached(false);
+    
+    cbir::parallelFor(*[[CBIRDatabaseEngine sharedEngine] scheduler], 0, gallery->size(), FACE_QUERY_SCORING_GRAIN, [&](size_t begin, size_t end) {
+        for ( size_t row = begin; row < end; row++ ) {
             
-        if ( inputFeatureList.count != trainingFeatureList.count ) {
-            NSLog(@"input feature count different!");
+            if ( limitReached || [self shouldStop] ) {
+                return;
+            }
             
-        } else {
-        
-            for ( NSUInteger featureIndex = 0; featureIndex < inputFeatureList.count; featureIndex++ ) {
+            if ( gallery->isRemoved(row) ) {
+                continue;
+            }
+            
+            float distance = cbir::boundedFaceDistance(probe, gallery->descriptor(row), threshold);
+            if ( distance > threshold ) {
+                continue;
+            }
+            
+            {
+                std::lock_guard<std::mutex> lock(matchesMutex);
                 
-                NSUInteger blockWeight = SPATIAL_WEIGHT_MAP[featureIndex];
-
-                // Optimize by not even computing histo block differences when they weigh nothing!
-                if ( blockWeight != 0 ) {
+                // When grouping, only an image's first match counts.  It's not necessarily its nearest face.
+                if ( limitReached || (groupByImage && !matchedImages.insert(gallery->record(row).imageDocumentID).second) ) {
+                    continue;
+                }
                 
-                    NSString * inputFeatureID = inputFeatureList[featureIndex];
-                    CBLAttachment * inFeatureAtt = [m_inputFaceLBPRevision attachmentNamed:inputFeatureID];
-                    NSAssert(inFeatureAtt != nil ,@"Input feature is nil??");
-                    NSData * inputFeatureHisto = inFeatureAtt.content;
-                    
-                    NSString * trainFeatureID = trainingFeatureList[featureIndex];
-                    CBLAttachment * trainFeatureAtt = [trainDoc.currentRevision attachmentNamed:trainFeatureID];
-                    NSAssert(trainFeatureAtt != nil ,@"Training feature is nil??");
-                    NSData * trainFeatureHisto = trainFeatureAtt.content;
-                    
-                    difference += (blockWeight * [self diffHistogram:inputFeatureHisto againstTraining:trainFeatureHisto]);
+                cbir::ScoredRow match = { distance, row };
+                matches.push_back(match);
+                if ( matchLimit > 0 && matches.size() >= matchLimit ) {
+                    limitReached = true;
                 }
             }
+            
+            @autoreleasepool {
+                [self reportResult:[self resultForRow:row ofGallery:*gallery distance:distance]];
+            }
         }
+    });
+    
+    if ( self.isCanceled ) {
+        NSLog(@"%s cancelling processing.", __FUNCTION__);
+        return nil;
+    }
+    
+    // The matches are all there is, so they're ranked right away.  Only their distances are kept, so that
+    // paging never reaches past them.
+    // Ranked in the same order as any other search, ties and all.
+    cbir::TopKCollector ranking = makeCollector(0, *gallery, false);
+    std::sort(matches.begin(), matches.end(), [&ranking](const cbir::ScoredRow & a, const cbir::ScoredRow & b) { return ranking.less(a, b); });
+    
+    std::vector<float> distances(gallery->size(), INFINITY);
+    for ( size_t i = 0; i < matches.size(); i++ ) {
+        distances[matches[i].row] = matches[i].distance;
     }
+    
+    @synchronized(self) {
+        m_gallery = gallery;
+        m_distances.swap(distances);
+        m_ranked = matches;
+        m_groupByImage = groupByImage;
+        _resultCount = matches.size();
+    }
+    
+    return nil;
+}
 
-    return difference;
+// The key the search is cached under.  Covers everything that decides its results: the probe, the metric
+// and its weights, and the options.
+-(uint64_t)searchKeyWithCapacity:(size_t)capacity
+{
+    // Bump the metric whenever faceDistance() or the coarse stage change what they compute.
+    static const uint64_t kMetricVersion = 2;
+    
+    cbir::SearchFingerprint fingerprint;
+    fingerprint.add(kMetricVersion);
+    fingerprint.addQuantised(cbir::kDescriptorBlockWeights, cbir::kWeightedBlockCount);
+    fingerprint.addQuantised(m_probeDescriptor.data(), m_probeDescriptor.size());
+    fingerprint.add(capacity);
+    fingerprint.add(self.distinctImages);
+    fingerprint.add(self.exhaustive);
+    fingerprint.add(self.probeCount);
+    
+    return fingerprint.value();
 }
 
--(CGFloat)diffHistogram:(NSData *)expected againstTraining:(NSData *)training
+// The rows of the candidates nearest to the probe, in row order so that the second stage walks the gallery
+// front to back.  The engine's face index finds them among the faces it holds, and only the faces indexed since
+// it last caught up are scanned, by coarse distance.  Until the index is built the whole gallery is scanned.
+-(std::vector<size_t>)candidates:(size_t)count ofGallery:(const cbir::FaceGallerySnapshot &)gallery
 {
-    CGFloat difference = 0;
-    cv::Mat exp(1, FACE_INDEXER_HISTOGRAM_BIN_COUNT, CV_32F, (void*)expected.bytes, expected.length );
-    cv::Mat  tr(1, FACE_INDEXER_HISTOGRAM_BIN_COUNT, CV_32F, (void*)training.bytes, training.length);
+    cbir::FaceHnswIndex * index = [[CBIRDatabaseEngine sharedEngine] faceIndex];
+    std::vector<float> embedding(cbir::kEmbeddingLength);
+    cbir::embedCoarseDescriptor(m_probeCoarseDescriptor.data(), embedding.data());
+    
+    std::vector<cbir::ScoredRow> nearest;
+    size_t indexedRows = 0;
+    if ( !index->search(gallery, embedding.data(), count, index->params().efSearch, nearest, indexedRows) ) {
+        indexedRows = 0;
+    }
+    
+    std::vector<size_t> rows = [self coarseCandidates:count ofGallery:gallery fromRow:indexedRows];
+    for ( size_t i = 0; i < nearest.size(); i++ ) {
+        rows.push_back(nearest[i].row);
+    }
+    std::sort(rows.begin(), rows.end());
     
-    difference = cv::compareHist(exp, tr, CV_COMP_CHISQR);
-    //NSLog(@"diffHistogram: %f", difference);
-    return difference;
+    return rows;
 }
 
--(CIImage *)loadHisto:(NSString * )histoImageAttachmentID fromDocument:(CBLDocument *)doc
+// The rows of the faces in the probeCount lists of the inverted file nearest to the probe, in row order.  Returns NO
+// if the index can't be searched yet.
+-(BOOL)probedCandidates:(std::vector<size_t> &)rows ofGallery:(const cbir::FaceGallerySnapshot &)gallery
 {
-    size_t histoBlockSizeInBytes = FACE_INDEXER_HISTOGRAM_BIN_COUNT * sizeof(float);
-    CBLAttachment * att = [[doc currentRevision] attachmentNamed:histoImageAttachmentID];
-    NSData * histoImageData = att.content;
-    CGSize histoImageSize = CGSizeMake(FACE_INDEXER_HISTOGRAM_BIN_COUNT * FACE_INDEXER_GRID_WIDTH_IN_BLOCKS, FACE_INDEXER_GRID_HEIGHT_IN_BLOCKS);
-    
-    CIImage * image = [CIImage imageWithBitmapData:histoImageData
-                                       bytesPerRow:(histoBlockSizeInBytes * FACE_INDEXER_GRID_WIDTH_IN_BLOCKS)
-                                              size:histoImageSize
-                                            format:kCIFormatRf
-                                        colorSpace:nil];
-    
-    return image;
+    std::vector<float> embedding(cbir::kEmbeddingLength);
+    cbir::embedCoarseDescriptor(m_probeCoarseDescriptor.data(), embedding.data());
+    
+    return [[CBIRDatabaseEngine sharedEngine] faceIvfIndex]->search(gallery, embedding.data(), self.probeCount, rows);
 }
 
+// The rows of the candidates nearest to the probe by coarse distance, among the rows from the given one on.
+-(std::vector<size_t>)coarseCandidates:(size_t)count ofGallery:(const cbir::FaceGallerySnapshot &)gallery fromRow:(size_t)firstRow
+{
+    const float * probe = m_probeCoarseDescriptor.data();
+    cbir::TopKCollector nearest(count);
+    std::mutex nearestMutex;
+    
+    cbir::parallelFor(*[[CBIRDatabaseEngine sharedEngine] scheduler], firstRow, gallery.size(), FACE_QUERY_COARSE_SCORING_GRAIN, [&](size_t begin, size_t end) {
+        cbir::TopKCollector chunkNearest(count);
+        
+        for ( size_t row = begin; row < end; row++ ) {
+            if ( [self shouldStop] ) {
+                return;
+            }
+            if ( !gallery.isRemoved(row) ) {
+                chunkNearest.add(cbir::coarseFaceDistance(probe, gallery.coarseDescriptor(row)), row);
+            }
+        }
+        
+        std::lock_guard<std::mutex> lock(nearestMutex);
+        nearest.merge(chunkNearest);
+    });
+    
+    std::vector<cbir::ScoredRow> scored = nearest.sorted();
+    std::vector<size_t> rows(scored.size());
+    for ( size_t i = 0; i < scored.size(); i++ ) {
+        rows[i] = scored[i].row;
+    }
+    
+    return rows;
+}
+
+-(NSArray *)resultsForRows:(const std::vector<cbir::ScoredRow> &)rows ofGallery:(const cbir::FaceGallerySnapshot &)gallery limit:(NSUInteger)limit
+{
+    NSMutableArray * results = [NSMutableArray arrayWithCapacity:MIN(rows.size(), limit)];
+    for ( size_t i = 0; i < rows.size() && i < limit; i++ ) {
+        [results addObject:[self resultForRow:rows[i].row ofGallery:gallery distance:rows[i].distance]];
+    }
+    return results;
+}
+
+-(FaceDataResult *)resultForRow:(size_t)row ofGallery:(const cbir::FaceGallerySnapshot &)gallery distance:(float)distance
+{
+    const cbir::FaceRecord & record = gallery.record(row);
+    
+    FaceDataResult * result = [[FaceDataResult alloc] init];
+    result.differenceSum = distance;
+    result.imageDocumentID = [NSString stringWithUTF8String:record.imageDocumentID.c_str()];
+    result.faceUUID = [NSString stringWithUTF8String:record.faceID.c_str()];
+    
+    // Only keep the name of the face crop.  The JPEG is loaded on demand by the result.
+    result.faceJPEGAttachmentName = [NSString stringWithUTF8String:record.thumbnailName.c_str()];
+    result.faceRect = CGRectMake(record.rect[0], record.rect[1], record.rect[2], record.rect[3]);
+    
+    return result;
+}
+
+
 
 
 
@@ -0,0 +1,24 @@
+//
+//  FaceQuery_Private.h
+//  CBIRDatabase
+//
+//  Created by Joseph Carson on 10/19/16.
+//  Copyright © 2016 Joseph Carson. All rights reserved.
+//
+
+#import "FaceQuery.h"
+
+#include <memory>
+#include "FaceGallery.hpp"
+
+// FaceQuery internals for the tests.  Objective-C++ only.
+@interface FaceQuery ()
+
+// The gallery to search instead of the engine's.  Only set by initWithDescriptor:gallery:andDelegate:.
+@property (nonatomic) std::shared_ptr<const cbir::FaceGallerySnapshot> searchGallery;
+
+// A query for a face that's already been described, see FaceDescriptor.hpp, against the given gallery.  Skips
+// face detection and feature extraction, so the search can be tested on its own.
+-(instancetype)initWithDescriptor:(const float *)descriptor gallery:(std::shared_ptr<const cbir::FaceGallerySnapshot>)gallery andDelegate:(id<CBIRQueryDelegate>)delegate;
+
+@end
@@ -0,0 +1,111 @@
+//
+//  FaceSearchCache.cpp
+//  CBIRDatabase
+//
+//  Created by Joseph Carson on 10/19/16.
+//  Copyright © 2016 Joseph Carson. All rights reserved.
+//
+
+#include "FaceSearchCache.hpp"
+
+#include <math.h>
+
+namespace cbir {
+
+// 64 bit FNV-1a.
+static const uint64_t kFNVOffsetBasis = 14695981039346656037ULL;
+static const uint64_t kFNVPrime = 1099511628211ULL;
+
+const int SearchFingerprint::kQuantisationSteps;
+const size_t FaceSearchCache::kDefaultCapacity;
+
+SearchFingerprint::SearchFingerprint()
+    : m_hash(kFNVOffsetBasis)
+{
+}
+
+void SearchFingerprint::add(uint64_t value)
+{
+    for ( size_t i = 0; i < sizeof(value); i++ ) {
+        m_hash ^= (value >> (i * 8)) & 0xff;
+        m_hash *= kFNVPrime;
+    }
+}
+
+void SearchFingerprint::addQuantised(const float * values, size_t count)
+{
+    for ( size_t i = 0; i < count; i++ ) {
+        add((uint64_t)(int64_t)lrintf(values[i] * kQuantisationSteps));
+    }
+}
+
+FaceSearchCache::FaceSearchCache(size_t capacity)
+    : m_capacity(capacity)
+{
+}
+
+std::shared_ptr<const CachedFaceSearch> FaceSearchCache::find(uint64_t key, int64_t sequence)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    std::unordered_map<uint64_t, EntryList::iterator>::iterator it = m_index.find(key);
+    if ( it == m_index.end() ) {
+        return NULL;
+    }
+
+    EntryList::iterator entry = it->second;
+    if ( entry->second->gallery->sequence() != sequence ) {
+        erase(entry);
+        return NULL;
+    }
+
+    m_entries.splice(m_entries.begin(), m_entries, entry);
+    return entry->second;
+}
+
+void FaceSearchCache::insert(uint64_t key, const std::shared_ptr<const CachedFaceSearch> & search)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    if ( m_capacity == 0 ) {
+        return;
+    }
+
+    std::unordered_map<uint64_t, EntryList::iterator>::iterator it = m_index.find(key);
+    if ( it != m_index.end() ) {
+        erase(it->second);
+    }
+
+    // Searches of older snapshots can never be handed out again.
+    int64_t sequence = search->gallery->sequence();
+    for ( EntryList::iterator entry = m_entries.begin(); entry != m_entries.end(); ) {
+        EntryList::iterator next = entry;
+        ++next;
+        if ( entry->second->gallery->sequence() < sequence ) {
+            erase(entry);
+        }
+        entry = next;
+    }
+
+    while ( m_entries.size() >= m_capacity ) {
+        erase(--m_entries.end());
+    }
+
+    m_entries.push_front(std::make_pair(key, search));
+    m_index[key] = m_entries.begin();
+}
+
+void FaceSearchCache::clear()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_entries.clear();
+    m_index.clear();
+}
+
+void FaceSearchCache::erase(EntryList::iterator entry)
+{
+    m_index.erase(entry->first);
+    m_entries.erase(entry);
+}
+
+}
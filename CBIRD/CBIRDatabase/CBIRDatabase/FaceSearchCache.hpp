@@ -0,0 +1,102 @@
+//
+//  FaceSearchCache.hpp
+//  CBIRDatabase
+//
+//  Created by Joseph Carson on 10/19/16.
+//  Copyright © 2016 Joseph Carson. All rights reserved.
+//
+
+#ifndef FaceSearchCache_hpp
+#define FaceSearchCache_hpp
+
+#include <stdint.h>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "FaceGallery.hpp"
+#include "TopKCollector.hpp"
+
+namespace cbir {
+
+// Everything a face search leaves behind, enough for a repeat of the search to page through its results
+// without scoring anything.
+struct CachedFaceSearch
+{
+    // The snapshot that was searched.  Its sequence number is what the cached search is valid for.
+    std::shared_ptr<const FaceGallerySnapshot> gallery;
+
+    // Per gallery row, INFINITY for rows that weren't scored.
+    std::vector<float> distances;
+
+    // The nearest rows, nearest first.
+    std::vector<ScoredRow> ranked;
+
+    size_t resultCount;
+};
+
+// Builds the 64 bit key that a search is cached under.  Descriptors are quantised before they're hashed, so
+// that probes which differ only by rounding noise, like the same face detected twice, share a key.
+class SearchFingerprint
+{
+public:
+
+    SearchFingerprint();
+
+    void add(uint64_t value);
+
+    // Adds the values rounded to the nearest 1/kQuantisationSteps.
+    void addQuantised(const float * values, size_t count);
+
+    uint64_t value() const { return m_hash; }
+
+    static const int kQuantisationSteps = 16;
+
+private:
+
+    uint64_t m_hash;
+};
+
+// A least recently used cache of face searches, keyed by SearchFingerprint.  A cached search is only handed
+// out while the gallery is still at the sequence number it was searched at.  Stale searches are dropped
+// as soon as they're noticed, so that they don't hold on to old gallery snapshots.  Thread safe.
+class FaceSearchCache
+{
+public:
+
+    static const size_t kDefaultCapacity = 8;
+
+    explicit FaceSearchCache(size_t capacity = kDefaultCapacity);
+
+    // The search cached under the key, as long as it was made at the given gallery sequence.  NULL otherwise.
+    std::shared_ptr<const CachedFaceSearch> find(uint64_t key, int64_t sequence);
+
+    // Caches the search under the key, evicting the least recently used search if the cache is full, and
+    // any searches of older snapshots.
+    void insert(uint64_t key, const std::shared_ptr<const CachedFaceSearch> & search);
+
+    void clear();
+
+private:
+
+    FaceSearchCache(const FaceSearchCache &);
+    FaceSearchCache & operator=(const FaceSearchCache &);
+
+    typedef std::list<std::pair<uint64_t, std::shared_ptr<const CachedFaceSearch>>> EntryList;
+
+    void erase(EntryList::iterator entry);
+
+    std::mutex m_mutex;
+    size_t m_capacity;
+
+    // Most recently used first.
+    EntryList m_entries;
+    std::unordered_map<uint64_t, EntryList::iterator> m_index;
+};
+
+}
+
+#endif /* FaceSearchCache_hpp */
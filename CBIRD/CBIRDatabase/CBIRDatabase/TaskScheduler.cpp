@@ -0,0 +1,285 @@
+//
+//  TaskScheduler.cpp
+//  CBIRDatabase
+//
+//  Created by Joseph Carson on 10/19/16.
+//  Copyright © 2016 Joseph Carson. All rights reserved.
+//
+
+#include "TaskScheduler.hpp"
+
+namespace cbir {
+
+TaskScheduler::PriorityScope::PriorityScope(TaskScheduler & scheduler, TaskPriority priority)
+    : m_scheduler(scheduler), m_previous(scheduler.currentPriority())
+{
+    m_scheduler.setCurrentPriority(priority);
+}
+
+TaskScheduler::PriorityScope::~PriorityScope()
+{
+    m_scheduler.setCurrentPriority(m_previous);
+}
+
+TaskScheduler::TaskScheduler(size_t workerCount)
+    : m_nextWorker(0), m_stopping(false)
+{
+    if ( workerCount == 0 ) {
+        workerCount = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+    }
+    m_runningWorkers = workerCount;
+
+    for ( size_t p = 0; p < kPriorityCount; p++ ) {
+        m_pending[p] = 0;
+    }
+
+    pthread_key_create(&m_workerKey, NULL);
+    pthread_key_create(&m_priorityKey, NULL);
+
+    // Create all of the deques before starting any thread, workers steal from each other right away.
+    for ( size_t i = 0; i < workerCount; i++ ) {
+        m_workers.push_back(std::unique_ptr<Worker>(new Worker()));
+    }
+    for ( size_t i = 0; i < workerCount; i++ ) {
+        m_workers[i]->thread = std::thread(&TaskScheduler::workerLoop, this, i);
+    }
+}
+
+TaskScheduler::~TaskScheduler()
+{
+    shutdown();
+    pthread_key_delete(m_workerKey);
+    pthread_key_delete(m_priorityKey);
+}
+
+void TaskScheduler::shutdown()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_sleepMutex);
+        if ( m_stopping ) {
+            return;
+        }
+        m_stopping = true;
+    }
+    m_wake.notify_all();
+
+    for ( size_t i = 0; i < m_workers.size(); i++ ) {
+        if ( m_workers[i]->thread.joinable() ) {
+            m_workers[i]->thread.join();
+        }
+    }
+}
+
+long TaskScheduler::currentWorkerIndex() const
+{
+    // The key holds index + 1, so that NULL means not a worker.
+    return (long)(intptr_t)pthread_getspecific(m_workerKey) - 1;
+}
+
+TaskPriority TaskScheduler::currentPriority() const
+{
+    // The key holds priority + 1, so that NULL means it was never set.
+    intptr_t value = (intptr_t)pthread_getspecific(m_priorityKey);
+    return (value == 0) ? kPriorityNormal : (TaskPriority)(value - 1);
+}
+
+void TaskScheduler::setCurrentPriority(TaskPriority priority)
+{
+    pthread_setspecific(m_priorityKey, (void *)(intptr_t)(priority + 1));
+}
+
+bool TaskScheduler::hasPending(TaskPriority minPriority) const
+{
+    for ( size_t p = minPriority; p < kPriorityCount; p++ ) {
+        if ( m_pending[p].load() > 0 ) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void TaskScheduler::submit(const Task & task)
+{
+    submit(task, currentPriority());
+}
+
+void TaskScheduler::submit(const Task & task, TaskPriority priority)
+{
+    // Count the task before queueing it, so that the workers can't all leave in between.  Once they have, there's
+    // nobody to run it but the caller.
+    bool running = false;
+    {
+        std::lock_guard<std::mutex> lock(m_sleepMutex);
+        running = m_runningWorkers > 0;
+        if ( running ) {
+            m_pending[priority]++;
+        }
+    }
+    if ( !running ) {
+        runTask(task, priority);
+        return;
+    }
+
+    // Workers keep their own tasks local, everybody else deals them out.
+    long current = currentWorkerIndex();
+    size_t index = (current >= 0) ? (size_t)current : (m_nextWorker++ % m_workers.size());
+
+    {
+        std::lock_guard<std::mutex> lock(m_workers[index]->mutex);
+        m_workers[index]->tasks[priority].push_back(task);
+    }
+    m_wake.notify_one();
+}
+
+bool TaskScheduler::takeTask(size_t preferredWorker, TaskPriority minPriority, Task & task, TaskPriority & priority)
+{
+    size_t count = m_workers.size();
+
+    for ( int p = kPriorityCount - 1; p >= (int)minPriority; p-- ) {
+        if ( m_pending[p].load() == 0 ) {
+            continue;
+        }
+
+        for ( size_t i = 0; i < count; i++ ) {
+            size_t index = (preferredWorker + i) % count;
+            Worker & worker = *m_workers[index];
+
+            std::lock_guard<std::mutex> lock(worker.mutex);
+            std::deque<Task> & tasks = worker.tasks[p];
+            if ( tasks.empty() ) {
+                continue;
+            }
+
+            // Our own work comes off the back, stolen work comes off the front.
+            if ( i == 0 ) {
+                task = tasks.back();
+                tasks.pop_back();
+            } else {
+                task = tasks.front();
+                tasks.pop_front();
+            }
+            priority = (TaskPriority)p;
+
+            {
+                std::lock_guard<std::mutex> sleepLock(m_sleepMutex);
+                m_pending[p]--;
+            }
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void TaskScheduler::runTask(const Task & task, TaskPriority priority)
+{
+    PriorityScope scope(*this, priority);
+    task();
+}
+
+bool TaskScheduler::runPendingTask()
+{
+    long current = currentWorkerIndex();
+    size_t preferred = (current >= 0) ? (size_t)current : (m_nextWorker.load() % m_workers.size());
+
+    Task task;
+    TaskPriority priority = kPriorityNormal;
+    if ( !takeTask(preferred, currentPriority(), task, priority) ) {
+        return false;
+    }
+    runTask(task, priority);
+    return true;
+}
+
+void TaskScheduler::checkpoint()
+{
+    TaskPriority current = currentPriority();
+    if ( current + 1 >= kPriorityCount || !hasPending((TaskPriority)(current + 1)) ) {
+        return;
+    }
+
+    long worker = currentWorkerIndex();
+    size_t preferred = (worker >= 0) ? (size_t)worker : (m_nextWorker.load() % m_workers.size());
+
+    Task task;
+    TaskPriority priority = kPriorityNormal;
+    while ( takeTask(preferred, (TaskPriority)(current + 1), task, priority) ) {
+        runTask(task, priority);
+    }
+}
+
+void TaskScheduler::workerLoop(size_t index)
+{
+    pthread_setspecific(m_workerKey, (void *)(intptr_t)(index + 1));
+
+    while ( true ) {
+        Task task;
+        TaskPriority priority = kPriorityNormal;
+        if ( takeTask(index, kPriorityBackground, task, priority) ) {
+            runTask(task, priority);
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(m_sleepMutex);
+        if ( !hasPending(kPriorityBackground) ) {
+            if ( m_stopping ) {
+                m_runningWorkers--;
+                break;
+            }
+            m_wake.wait(lock);
+        }
+    }
+}
+
+TaskGroup::TaskGroup(TaskScheduler & scheduler)
+    : m_scheduler(scheduler), m_outstanding(0)
+{
+}
+
+TaskGroup::~TaskGroup()
+{
+    wait();
+}
+
+void TaskGroup::run(const TaskScheduler::Task & task)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_outstanding++;
+    }
+
+    m_scheduler.submit([this, task]() {
+        task();
+        taskDone();
+    });
+}
+
+void TaskGroup::taskDone()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if ( --m_outstanding == 0 ) {
+        m_done.notify_all();
+    }
+}
+
+void TaskGroup::wait()
+{
+    while ( true ) {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if ( m_outstanding == 0 ) {
+                return;
+            }
+        }
+
+        // Help out while our tasks are still queued.  They run at our priority, so runPendingTask() can
+        // always get at them.  Once nothing is left to take, the rest of our tasks are running on other
+        // threads and all that's left is to wait for them.
+        if ( !m_scheduler.runPendingTask() ) {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_done.wait_for(lock, std::chrono::milliseconds(1), [this]() { return m_outstanding == 0; });
+        }
+    }
+}
+
+}
@@ -0,0 +1,196 @@
+//
+//  TaskScheduler.hpp
+//  CBIRDatabase
+//
+//  Created by Joseph Carson on 10/19/16.
+//  Copyright © 2016 Joseph Carson. All rights reserved.
+//
+
+#ifndef TaskScheduler_hpp
+#define TaskScheduler_hpp
+
+#include <pthread.h>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace cbir {
+
+// Higher priorities are always taken first, by idle workers and by threads helping out alike.
+enum TaskPriority
+{
+    kPriorityBackground = 0,
+    kPriorityNormal,
+    kPriorityInteractive,
+    kPriorityCount
+};
+
+// A work stealing thread pool.  Each worker owns a deque of tasks.  Workers push and pop their own tasks
+// at the back (most recent first, which keeps caches warm for recursively split work), and steal from the
+// front of other workers' deques when they run dry.  Tasks submitted from outside the pool are dealt out
+// to the workers round robin.  Idle workers sleep on a condition variable, so an idle pool costs nothing.
+//
+// Every task has a priority.  Tasks queued from inside a task inherit its priority unless they say
+// otherwise, so a whole tree of work runs at the priority of its root.  Threads outside the pool run at
+// normal priority, see PriorityScope.  Nothing preempts a running task, so long running work should call
+// checkpoint() every so often to let more urgent work past.
+//
+// Tasks that call into Objective-C must bring their own autorelease pool, workers are plain threads.
+class TaskScheduler
+{
+public:
+
+    typedef std::function<void()> Task;
+
+    // Sets the priority of the calling thread for as long as the scope lives.  Tasks it queues, and the
+    // tasks it helps with while waiting, follow suit.
+    class PriorityScope
+    {
+    public:
+        PriorityScope(TaskScheduler & scheduler, TaskPriority priority);
+        ~PriorityScope();
+
+    private:
+        PriorityScope(const PriorityScope &);
+        PriorityScope & operator=(const PriorityScope &);
+
+        TaskScheduler & m_scheduler;
+        TaskPriority m_previous;
+    };
+
+    // Zero workers means one per core.
+    explicit TaskScheduler(size_t workerCount = 0);
+
+    // Runs any tasks that are still queued, then joins the workers.
+    ~TaskScheduler();
+
+    size_t workerCount() const { return m_workers.size(); }
+
+    // Queues a task at the calling thread's priority.  Never blocks, unless the scheduler has been shut down, see
+    // shutdown().
+    void submit(const Task & task);
+
+    void submit(const Task & task, TaskPriority priority);
+
+    // Runs one queued task of at least the calling thread's priority on the calling thread, if there is one.
+    // Lets a thread that waits on other tasks help out instead of blocking a core, without getting stuck
+    // in less urgent work.
+    bool runPendingTask();
+
+    // Runs any queued tasks of a higher priority than the calling thread's, right here.  Cheap when there
+    // are none.  Long running tasks call this at convenient points so that they can't hold up urgent work.
+    void checkpoint();
+
+    // The priority of the calling thread.
+    TaskPriority currentPriority() const;
+
+    // Runs whatever is queued, including anything those tasks queue in turn, and joins the workers.  Tasks
+    // submitted after that run right away on the submitting thread, so that nothing is dropped on the way out.
+    // Called by the destructor.
+    void shutdown();
+
+private:
+
+    struct Worker
+    {
+        std::mutex mutex;
+        std::deque<Task> tasks[kPriorityCount];
+        std::thread thread;
+    };
+
+    TaskScheduler(const TaskScheduler &);
+    TaskScheduler & operator=(const TaskScheduler &);
+
+    void workerLoop(size_t index);
+
+    // Pops from the given worker's own deques, or steals from the others.  Takes the most urgent task
+    // of at least the minimum priority.
+    bool takeTask(size_t preferredWorker, TaskPriority minPriority, Task & task, TaskPriority & priority);
+
+    // Runs the task at its priority.
+    void runTask(const Task & task, TaskPriority priority);
+
+    void setCurrentPriority(TaskPriority priority);
+
+    bool hasPending(TaskPriority minPriority) const;
+
+    // The index of the worker running on the calling thread, or -1 for threads outside the pool.
+    long currentWorkerIndex() const;
+
+    std::vector<std::unique_ptr<Worker>> m_workers;
+    pthread_key_t m_workerKey;
+    pthread_key_t m_priorityKey;
+    std::atomic<size_t> m_nextWorker;
+
+    // Number of queued tasks of each priority across all workers.  Guarded by m_sleepMutex for writes,
+    // so that workers can't miss a wake up between checking them and going to sleep.
+    std::atomic<size_t> m_pending[kPriorityCount];
+    std::mutex m_sleepMutex;
+    std::condition_variable m_wake;
+    bool m_stopping;
+
+    // Workers that haven't left yet.  Guarded by m_sleepMutex.
+    size_t m_runningWorkers;
+};
+
+// A set of tasks that can be waited on as a whole.  Waiting helps run queued tasks rather than
+// just blocking, so groups can be waited on from inside the pool without starving it.
+class TaskGroup
+{
+public:
+
+    explicit TaskGroup(TaskScheduler & scheduler);
+
+    // Waits for any outstanding tasks.
+    ~TaskGroup();
+
+    void run(const TaskScheduler::Task & task);
+
+    void wait();
+
+private:
+
+    TaskGroup(const TaskGroup &);
+    TaskGroup & operator=(const TaskGroup &);
+
+    void taskDone();
+
+    TaskScheduler & m_scheduler;
+    size_t m_outstanding;
+    std::mutex m_mutex;
+    std::condition_variable m_done;
+};
+
+// Splits [begin, end) into chunks of at most grain indices and calls body(chunkBegin, chunkEnd) for
+// each across the scheduler.  Returns once all chunks are done.  The calling thread takes part.
+template <class Body>
+void parallelFor(TaskScheduler & scheduler, size_t begin, size_t end, size_t grain, const Body & body)
+{
+    if ( begin >= end ) {
+        return;
+    }
+
+    grain = std::max<size_t>(grain, 1);
+    if ( end - begin <= grain ) {
+        body(begin, end);
+        return;
+    }
+
+    TaskGroup group(scheduler);
+    for ( size_t chunk = begin; chunk < end; chunk += grain ) {
+        size_t chunkEnd = std::min(chunk + grain, end);
+        group.run([&body, chunk, chunkEnd]() { body(chunk, chunkEnd); });
+    }
+    group.wait();
+}
+
+}
+
+#endif /* TaskScheduler_hpp */
@@ -0,0 +1,125 @@
+//
+//  TopKCollector.cpp
+//  CBIRDatabase
+//
+//  Created by Joseph Carson on 10/19/16.
+//  Copyright © 2016 Joseph Carson. All rights reserved.
+//
+
+#include "TopKCollector.hpp"
+
+#include <math.h>
+#include <algorithm>
+
+namespace cbir {
+
+const size_t TopKCollector::kSmallCapacity;
+
+TopKCollector::TopKCollector(size_t capacity, const TieBreak & tieBreak, const GroupKey & groupKey)
+    : m_capacity(capacity), m_tieBreak(tieBreak), m_groupKey(groupKey)
+{
+    // Small collectors never reallocate.  Big ones grow as needed, k may well exceed the gallery.
+    m_entries.reserve(std::min<size_t>(m_capacity, 1024));
+}
+
+float TopKCollector::worstDistance() const
+{
+    return m_entries.empty() ? INFINITY : worst().distance;
+}
+
+void TopKCollector::insertSorted(const ScoredRow & entry)
+{
+    // The position is the number of entries that beat the new one.  Summing the comparisons, joined with
+    // & and | rather than && and ||, instead of searching keeps the loop free of branches.  A tie break
+    // is a call per entry whatever we do, so that goes through less().
+    size_t count = m_entries.size();
+    size_t position = 0;
+    if ( m_tieBreak ) {
+        for ( size_t i = 0; i < count; i++ ) {
+            position += less(m_entries[i], entry);
+        }
+    } else {
+        float d = entry.distance;
+        size_t r = entry.row;
+        for ( size_t i = 0; i < count; i++ ) {
+            const ScoredRow & e = m_entries[i];
+            position += (e.distance < d) | ((e.distance == d) & (e.row < r));
+        }
+    }
+
+    if ( count < m_capacity ) {
+        m_entries.push_back(entry);
+    }
+    std::copy_backward(m_entries.begin() + position, m_entries.end() - 1, m_entries.end());
+    m_entries[position] = entry;
+}
+
+void TopKCollector::insertGrouped(const ScoredRow & entry)
+{
+    const std::string & key = m_groupKey(entry.row);
+    std::unordered_map<std::string, ScoredRow>::iterator group = m_groups.find(key);
+
+    if ( group != m_groups.end() ) {
+        // Only the nearest row of the group stays.  The one it replaces makes room for it.
+        if ( !less(entry, group->second) ) {
+            return;
+        }
+        for ( size_t i = 0; i < m_entries.size(); i++ ) {
+            if ( m_entries[i].row == group->second.row ) {
+                m_entries.erase(m_entries.begin() + i);
+                break;
+            }
+        }
+        group->second = entry;
+
+    } else {
+        // A new group pushes out the worst one, which is forgotten along with its entry.
+        if ( isFull() ) {
+            m_groups.erase(m_groupKey(m_entries.back().row));
+            m_entries.pop_back();
+        }
+        m_groups.insert(std::make_pair(key, entry));
+    }
+
+    insertSorted(entry);
+}
+
+void TopKCollector::insert(const ScoredRow & entry)
+{
+    if ( m_groupKey ) {
+        insertGrouped(entry);
+        return;
+    }
+
+    if ( isSorted() ) {
+        insertSorted(entry);
+        return;
+    }
+
+    Order order(*this);
+    if ( isFull() ) {
+        std::pop_heap(m_entries.begin(), m_entries.end(), order);
+        m_entries.back() = entry;
+    } else {
+        m_entries.push_back(entry);
+    }
+    std::push_heap(m_entries.begin(), m_entries.end(), order);
+}
+
+void TopKCollector::merge(const TopKCollector & other)
+{
+    for ( size_t i = 0; i < other.m_entries.size(); i++ ) {
+        add(other.m_entries[i].distance, other.m_entries[i].row);
+    }
+}
+
+std::vector<ScoredRow> TopKCollector::sorted() const
+{
+    std::vector<ScoredRow> entries(m_entries);
+    if ( !isSorted() ) {
+        std::sort_heap(entries.begin(), entries.end(), Order(*this));
+    }
+    return entries;
+}
+
+}
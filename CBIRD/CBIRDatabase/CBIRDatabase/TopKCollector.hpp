@@ -0,0 +1,120 @@
+//
+//  TopKCollector.hpp
+//  CBIRDatabase
+//
+//  Created by Joseph Carson on 10/19/16.
+//  Copyright © 2016 Joseph Carson. All rights reserved.
+//
+
+#ifndef TopKCollector_hpp
+#define TopKCollector_hpp
+
+#include <stddef.h>
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace cbir {
+
+// A gallery row and its distance from the probe.
+struct ScoredRow
+{
+    float distance;
+    size_t row;
+};
+
+// Keeps the k nearest rows seen so far, and nothing else, so a scan needs O(k) memory however big the
+// gallery is.  Most rows lose to the current worst and are rejected with a single compare.
+//
+// Small collectors (up to kSmallCapacity) keep a sorted array, and find the insertion point by counting
+// the entries that beat the new one, which has no data dependent branches.  Bigger ones use a max-heap
+// with the worst entry on top.
+//
+// Entries order by distance, then by the tie break, so that results are the same no matter how the scan was
+// split up.  The default tie break is the row.
+//
+// Given a group key, the collector keeps only the nearest row of each group, and k distinct groups.  A row
+// that beats its group's current entry replaces it, and evicting a group's entry forgets the group, so it
+// all happens in the one pass with O(k) memory.  Grouped collectors always keep a sorted array.
+//
+// Not thread safe.  Give each thread its own collector and merge() them afterwards.
+class TopKCollector
+{
+public:
+
+    static const size_t kSmallCapacity = 16;
+
+    // Whether row a goes before row b when their distances are equal.
+    typedef std::function<bool(size_t a, size_t b)> TieBreak;
+
+    // The group a row belongs to.  The reference must stay valid for the life of the collector.
+    typedef std::function<const std::string &(size_t row)> GroupKey;
+
+    explicit TopKCollector(size_t capacity, const TieBreak & tieBreak = TieBreak(), const GroupKey & groupKey = GroupKey());
+
+    size_t capacity() const { return m_capacity; }
+    size_t size() const { return m_entries.size(); }
+    bool isFull() const { return m_entries.size() >= m_capacity; }
+
+    // Rows that aren't nearer than this can't make it in.  Only meaningful once the collector is full.
+    float worstDistance() const;
+
+    void add(float distance, size_t row)
+    {
+        ScoredRow entry = { distance, row };
+        if ( isFull() && (m_capacity == 0 || !less(entry, worst())) ) {
+            return;
+        }
+        insert(entry);
+    }
+
+    // The order the collector keeps its entries in.
+    bool less(const ScoredRow & a, const ScoredRow & b) const
+    {
+        if ( a.distance != b.distance ) {
+            return a.distance < b.distance;
+        }
+        return m_tieBreak ? m_tieBreak(a.row, b.row) : a.row < b.row;
+    }
+
+    // Adds every entry of the other collector, which must group rows the same way.
+    void merge(const TopKCollector & other);
+
+    void clear() { m_entries.clear(); m_groups.clear(); }
+
+    // The entries, nearest first.
+    std::vector<ScoredRow> sorted() const;
+
+private:
+
+    // less() as a functor, for the heap algorithms.
+    struct Order
+    {
+        explicit Order(const TopKCollector & collector) : m_collector(collector) {}
+        bool operator()(const ScoredRow & a, const ScoredRow & b) const { return m_collector.less(a, b); }
+        const TopKCollector & m_collector;
+    };
+
+    const ScoredRow & worst() const { return isSorted() ? m_entries.back() : m_entries.front(); }
+
+    bool isSorted() const { return m_capacity <= kSmallCapacity || m_groupKey; }
+
+    void insert(const ScoredRow & entry);
+    void insertGrouped(const ScoredRow & entry);
+    void insertSorted(const ScoredRow & entry);
+
+    size_t m_capacity;
+    TieBreak m_tieBreak;
+    GroupKey m_groupKey;
+
+    // Sorted nearest first when small or grouped, a max-heap otherwise.
+    std::vector<ScoredRow> m_entries;
+
+    // The entry of each group that's in the collector.  Only used when grouped.
+    std::unordered_map<std::string, ScoredRow> m_groups;
+};
+
+}
+
+#endif /* TopKCollector_hpp */
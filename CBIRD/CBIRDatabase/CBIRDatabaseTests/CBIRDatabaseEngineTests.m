@@ -0,0 +1,130 @@
+//
+//  CBIRDatabaseEngineTests.m
+//  CBIRDatabaseTests
+//
+//  Created by Joseph Carson on 10/19/16.
+//  Copyright © 2016 Joseph Carson. All rights reserved.
+//
+
+#import <XCTest/XCTest.h>
+#import <CBIRDatabase/CBIRDatabase.h>
+#import <CouchbaseLite/CouchbaseLite.h>
+
+// A document with a small blank image, so no faces, under an ID that's never been used before.
+static CBIRDocument * blankDocument()
+{
+    CIImage * image = [[CIImage imageWithColor:[CIColor colorWithRed:0.5 green:0.5 blue:0.5]] imageByCroppingToRect:CGRectMake(0, 0, 64, 64)];
+    return [[CBIRDocument alloc] initWithCIImage:image persistentID:[NSUUID UUID].UUIDString type:UNKNOWN];
+}
+
+// The revisions that TestAttachmentIndexers have written into, by document ID.  Guarded by @synchronized on it.
+static NSMutableDictionary<NSString *, NSMutableArray *> * s_revisionsWritten;
+
+// Saves the document's ID as an attachment named after the indexer, and notes the revision it went into.
+@interface TestAttachmentIndexer : CBIRIndexer
+
+@end
+
+@implementation TestAttachmentIndexer
+
+-(id)extractFeaturesFromDocument:(CBIRDocument *)document
+{
+    return document.persistentID;
+}
+
+-(void)writeFeatures:(id)features toRevision:(CBLUnsavedRevision *)revision
+{
+    NSString * persistentID = features;
+    [revision setAttachmentNamed:NSStringFromClass([self class]) withContentType:@"text/plain" content:[persistentID dataUsingEncoding:NSUTF8StringEncoding]];
+    
+    @synchronized(s_revisionsWritten) {
+        if ( !s_revisionsWritten[persistentID] ) {
+            s_revisionsWritten[persistentID] = [[NSMutableArray alloc] init];
+        }
+        [s_revisionsWritten[persistentID] addObject:revision];
+    }
+}
+
+@end
+
+@interface FirstTestIndexer : TestAttachmentIndexer
+
+@end
+
+@implementation FirstTestIndexer
+
+@end
+
+@interface SecondTestIndexer : TestAttachmentIndexer
+
+@end
+
+@implementation SecondTestIndexer
+
+@end
+
+@interface CBIRDatabaseEngineTests : XCTestCase
+
+@end
+
+@implementation CBIRDatabaseEngineTests
+
++ (void)setUp {
+    [super setUp];
+    
+    s_revisionsWritten = [[NSMutableDictionary alloc] init];
+    CBIRDatabaseEngine * engine = [CBIRDatabaseEngine sharedEngine];
+    if ( ![engine getIndexer:NSStringFromClass([FirstTestIndexer class])] ) {
+        [engine registerIndexer:[[FirstTestIndexer alloc] init]];
+        [engine registerIndexer:[[SecondTestIndexer alloc] init]];
+    }
+}
+
+- (void)testGetDocumentsLooksUpManyAtOnce {
+    CBIRDatabaseEngine * engine = [CBIRDatabaseEngine sharedEngine];
+    
+    NSMutableArray<NSString *> * persistentIDs = [[NSMutableArray alloc] init];
+    for ( int i = 0; i < 3; i++ ) {
+        CBIRDocument * document = blankDocument();
+        XCTAssertTrue([engine indexImage:document].indexResult);
+        [persistentIDs addObject:document.persistentID];
+    }
+    NSString * missingID = [NSUUID UUID].UUIDString;
+    NSArray<NSString *> * lookup = [persistentIDs arrayByAddingObject:missingID];
+    
+    // Documents that don't exist are left out.
+    NSDictionary * documents = [engine getDocuments:lookup];
+    XCTAssertEqualObjects([NSSet setWithArray:documents.allKeys], [NSSet setWithArray:persistentIDs]);
+    XCTAssertNil(documents[missingID]);
+    XCTAssertEqual([engine getDocuments:@[]].count, (NSUInteger)0);
+    
+    // The asynchronous variant finds the same ones.
+    XCTestExpectation * found = [self expectationWithDescription:@"documents found"];
+    [engine getDocuments:lookup completion:^(NSDictionary * asyncDocuments) {
+        XCTAssertEqualObjects([NSSet setWithArray:asyncDocuments.allKeys], [NSSet setWithArray:persistentIDs]);
+        [found fulfill];
+    }];
+    [self waitForExpectationsWithTimeout:10 handler:nil];
+}
+
+- (void)testIndexersShareOneRevision {
+    CBIRDatabaseEngine * engine = [CBIRDatabaseEngine sharedEngine];
+    CBIRDocument * document = blankDocument();
+    NSData * expected = [document.persistentID dataUsingEncoding:NSUTF8StringEncoding];
+    
+    // Indexing again goes into a new revision on top of the first, which again holds every indexer's features.
+    for ( NSUInteger pass = 1; pass <= 2; pass++ ) {
+        XCTAssertTrue([engine indexImage:document].indexResult);
+        XCTAssertEqualObjects([engine getAttachment:NSStringFromClass([FirstTestIndexer class]) forDocument:document.persistentID], expected);
+        XCTAssertEqualObjects([engine getAttachment:NSStringFromClass([SecondTestIndexer class]) forDocument:document.persistentID], expected);
+        
+        NSArray * revisions = nil;
+        @synchronized(s_revisionsWritten) {
+            revisions = [s_revisionsWritten[document.persistentID] copy];
+        }
+        XCTAssertEqual(revisions.count, pass * 2);
+        XCTAssertTrue(revisions.lastObject == revisions[revisions.count - 2]);
+    }
+}
+
+@end
@@ -0,0 +1,164 @@
+//
+//  CBIRIngestQueueTests.m
+//  CBIRDatabaseTests
+//
+//  Created by Joseph Carson on 10/19/16.
+//  Copyright © 2016 Joseph Carson. All rights reserved.
+//
+
+#import <XCTest/XCTest.h>
+#import <CBIRDatabase/CBIRDatabase.h>
+
+// How long to give a producer to get past a full queue before deciding that it's blocked.
+static const int64_t kBlockedWaitNanoseconds = 200 * NSEC_PER_MSEC;
+
+// The gates that GatedTestIndexer holds documents at, by document ID.  Guarded by @synchronized on it.
+static NSMutableDictionary<NSString *, dispatch_semaphore_t> * s_gates;
+
+// Holds up the extraction of every gated document until it's released, which keeps it in the ingest queue.
+@interface GatedTestIndexer : CBIRIndexer
+
+@end
+
+@implementation GatedTestIndexer
+
+-(id)extractFeaturesFromDocument:(CBIRDocument *)document
+{
+    dispatch_semaphore_t gate = nil;
+    @synchronized(s_gates) {
+        gate = s_gates[document.persistentID];
+    }
+    if ( gate ) {
+        dispatch_semaphore_wait(gate, DISPATCH_TIME_FOREVER);
+    }
+    return nil;
+}
+
+-(void)writeFeatures:(id)features toRevision:(CBLUnsavedRevision *)revision
+{
+}
+
+@end
+
+// A document with a small blank image that's held up in the queue until releaseDocument is called on it.
+static CBIRDocument * gatedDocument()
+{
+    CIImage * image = [[CIImage imageWithColor:[CIColor colorWithRed:0.5 green:0.5 blue:0.5]] imageByCroppingToRect:CGRectMake(0, 0, 64, 64)];
+    CBIRDocument * document = [[CBIRDocument alloc] initWithCIImage:image persistentID:[NSUUID UUID].UUIDString type:UNKNOWN];
+    @synchronized(s_gates) {
+        s_gates[document.persistentID] = dispatch_semaphore_create(0);
+    }
+    return document;
+}
+
+static void releaseDocument(CBIRDocument * document)
+{
+    @synchronized(s_gates) {
+        dispatch_semaphore_signal(s_gates[document.persistentID]);
+    }
+}
+
+// Adds the document from another thread, since it may block.  The returned semaphore is signalled once it's in.
+static dispatch_semaphore_t addInBackground(CBIRIngestQueue * queue, CBIRDocument * document, NSUInteger cost)
+{
+    dispatch_semaphore_t added = dispatch_semaphore_create(0);
+    dispatch_async(dispatch_get_global_queue(QOS_CLASS_DEFAULT, 0), ^{
+        [queue addDocument:document cost:cost completion:nil];
+        dispatch_semaphore_signal(added);
+    });
+    return added;
+}
+
+static BOOL isBlocked(dispatch_semaphore_t added)
+{
+    return dispatch_semaphore_wait(added, dispatch_time(DISPATCH_TIME_NOW, kBlockedWaitNanoseconds)) != 0;
+}
+
+static BOOL getsIn(dispatch_semaphore_t added)
+{
+    return dispatch_semaphore_wait(added, dispatch_time(DISPATCH_TIME_NOW, 10 * NSEC_PER_SEC)) == 0;
+}
+
+@interface CBIRIngestQueueTests : XCTestCase
+
+@end
+
+@implementation CBIRIngestQueueTests
+
++ (void)setUp {
+    [super setUp];
+
+    s_gates = [[NSMutableDictionary alloc] init];
+    CBIRDatabaseEngine * engine = [CBIRDatabaseEngine sharedEngine];
+    if ( ![engine getIndexer:NSStringFromClass([GatedTestIndexer class])] ) {
+        [engine registerIndexer:[[GatedTestIndexer alloc] init]];
+    }
+}
+
+- (void)testFullQueueBlocksProducers {
+    CBIRIngestQueue * queue = [[CBIRIngestQueue alloc] initWithMaxDepth:2 byteBudget:1000];
+    CBIRDocument * first = gatedDocument();
+    CBIRDocument * second = gatedDocument();
+    CBIRDocument * third = gatedDocument();
+
+    [queue addDocument:first cost:1 completion:nil];
+    [queue addDocument:second cost:1 completion:nil];
+    XCTAssertEqual(queue.depth, (NSUInteger)2);
+    XCTAssertEqual(queue.bytesInFlight, (NSUInteger)2);
+
+    // The third has to wait for one of the others to be indexed.
+    dispatch_semaphore_t thirdAdded = addInBackground(queue, third, 1);
+    XCTAssertTrue(isBlocked(thirdAdded));
+    XCTAssertEqual(queue.depth, (NSUInteger)2);
+
+    releaseDocument(first);
+    XCTAssertTrue(getsIn(thirdAdded));
+
+    releaseDocument(second);
+    releaseDocument(third);
+    [queue waitUntilEmpty];
+    XCTAssertEqual(queue.depth, (NSUInteger)0);
+    XCTAssertEqual(queue.bytesInFlight, (NSUInteger)0);
+}
+
+- (void)testByteBudgetBlocksProducers {
+    CBIRIngestQueue * queue = [[CBIRIngestQueue alloc] initWithMaxDepth:8 byteBudget:100];
+    CBIRDocument * first = gatedDocument();
+    CBIRDocument * second = gatedDocument();
+
+    // There's room for another document, but not for its bytes.
+    [queue addDocument:first cost:60 completion:nil];
+    dispatch_semaphore_t secondAdded = addInBackground(queue, second, 60);
+    XCTAssertTrue(isBlocked(secondAdded));
+    XCTAssertEqual(queue.depth, (NSUInteger)1);
+    XCTAssertEqual(queue.bytesInFlight, (NSUInteger)60);
+
+    releaseDocument(first);
+    XCTAssertTrue(getsIn(secondAdded));
+
+    releaseDocument(second);
+    [queue waitUntilEmpty];
+    XCTAssertEqual(queue.bytesInFlight, (NSUInteger)0);
+}
+
+- (void)testOversizedDocumentGetsInAlone {
+    CBIRIngestQueue * queue = [[CBIRIngestQueue alloc] initWithMaxDepth:8 byteBudget:100];
+    CBIRDocument * oversized = gatedDocument();
+    CBIRDocument * small = gatedDocument();
+
+    // An empty queue lets in a document bigger than the whole budget, and nothing else until it's done.
+    [queue addDocument:oversized cost:500 completion:nil];
+    XCTAssertEqual(queue.bytesInFlight, (NSUInteger)500);
+
+    dispatch_semaphore_t smallAdded = addInBackground(queue, small, 1);
+    XCTAssertTrue(isBlocked(smallAdded));
+
+    releaseDocument(oversized);
+    XCTAssertTrue(getsIn(smallAdded));
+
+    releaseDocument(small);
+    [queue waitUntilEmpty];
+    XCTAssertEqual(queue.depth, (NSUInteger)0);
+}
+
+@end
@@ -0,0 +1,184 @@
+//
+//  CBIRQueryTests.m
+//  CBIRDatabaseTests
+//
+//  Created by Joseph Carson on 10/19/16.
+//  Copyright © 2016 Joseph Carson. All rights reserved.
+//
+
+#import <XCTest/XCTest.h>
+#import <CBIRDatabase/CBIRDatabase.h>
+
+// Reports progress as fast as it can, from several threads at once, until its run time is up.
+@interface ProgressTestQuery : CBIRQuery
+
+@property (nonatomic) NSTimeInterval runTime;
+
+// How many times the results for an update were built.
+@property (nonatomic, readonly) NSUInteger resultsBuilt;
+
+@end
+
+@implementation ProgressTestQuery
+
+@synthesize resultsBuilt = _resultsBuilt;
+
+-(void)run
+{
+    CFAbsoluteTime end = CFAbsoluteTimeGetCurrent() + self.runTime;
+    dispatch_apply(4, dispatch_get_global_queue(QOS_CLASS_DEFAULT, 0), ^(size_t thread) {
+        while ( CFAbsoluteTimeGetCurrent() < end ) {
+            [self reportProgress:0.5f results:^NSArray *(NSUInteger count) {
+                @synchronized(self) {
+                    _resultsBuilt++;
+                }
+                return @[@(count)];
+            }];
+        }
+    });
+}
+
+@end
+
+// Runs out of time before reporting progress once, then asks whether to stop if told to.
+@interface DeadlineTestQuery : CBIRQuery
+
+@property (nonatomic) BOOL checksAfterwards;
+
+@end
+
+@implementation DeadlineTestQuery
+
+-(void)run
+{
+    [NSThread sleepForTimeInterval:self.timeout * 2];
+    [self reportProgress:1.0f results:^NSArray *(NSUInteger count) {
+        return @[];
+    }];
+    if ( self.checksAfterwards ) {
+        [self shouldStop];
+    }
+}
+
+@end
+
+// Records the updates it gets, taking its time over each one.
+@interface ProgressTestDelegate : NSObject <CBIRQueryDelegate>
+
+@property (nonatomic) NSTimeInterval updateDelay;
+
+// When each update started and finished, and the results it came with.
+@property (nonatomic, readonly) NSMutableArray<NSNumber *> * startTimes;
+@property (nonatomic, readonly) NSMutableArray<NSNumber *> * endTimes;
+@property (nonatomic, readonly) NSMutableArray<NSArray *> * results;
+
+// Whether two updates were ever in progress at once.
+@property (nonatomic, readonly) BOOL overlapped;
+
+@end
+
+@implementation ProgressTestDelegate
+{
+    BOOL m_updating;
+}
+
+-(instancetype)init
+{
+    self = [super init];
+    if ( self ) {
+        _startTimes = [[NSMutableArray alloc] init];
+        _endTimes = [[NSMutableArray alloc] init];
+        _results = [[NSMutableArray alloc] init];
+    }
+    return self;
+}
+
+-(void)resultsUpdated:(NSArray *)results progress:(float)progress
+{
+    @synchronized(self) {
+        _overlapped = _overlapped || m_updating;
+        m_updating = YES;
+        [_startTimes addObject:@(CFAbsoluteTimeGetCurrent())];
+        [_results addObject:results];
+    }
+
+    [NSThread sleepForTimeInterval:self.updateDelay];
+
+    @synchronized(self) {
+        m_updating = NO;
+        [_endTimes addObject:@(CFAbsoluteTimeGetCurrent())];
+    }
+}
+
+@end
+
+@interface CBIRQueryTests : XCTestCase
+
+@end
+
+@implementation CBIRQueryTests
+
+- (void)testProgressUpdatesAreCoalesced {
+    ProgressTestDelegate * delegate = [[ProgressTestDelegate alloc] init];
+    delegate.updateDelay = 0.05;
+    ProgressTestQuery * query = [[ProgressTestQuery alloc] initWithDelegate:delegate];
+    query.runTime = 0.5;
+    query.progressInterval = 0.1;
+    query.progressResultCount = 3;
+    [query evaluate];
+
+    // Thousands of calls make a handful of updates, one at a time, and results are only built for those.
+    NSUInteger updates = delegate.startTimes.count;
+    XCTAssertGreaterThanOrEqual(updates, (NSUInteger)2);
+    XCTAssertLessThanOrEqual(updates, (NSUInteger)4);
+    XCTAssertFalse(delegate.overlapped);
+    XCTAssertEqual(query.resultsBuilt, updates);
+    for ( NSArray * results in delegate.results ) {
+        XCTAssertEqualObjects(results, @[@3]);
+    }
+
+    // The interval counts from when the delegate finished with the previous update.
+    for ( NSUInteger i = 1; i < updates; i++ ) {
+        XCTAssertGreaterThanOrEqual(delegate.startTimes[i].doubleValue, delegate.endTimes[i - 1].doubleValue + query.progressInterval);
+    }
+}
+
+- (void)testNoProgressWhenTurnedOffOrCanceled {
+    ProgressTestDelegate * delegate = [[ProgressTestDelegate alloc] init];
+
+    ProgressTestQuery * quiet = [[ProgressTestQuery alloc] initWithDelegate:delegate];
+    quiet.runTime = 0.05;
+    quiet.progressInterval = 0;
+    [quiet evaluate];
+
+    ProgressTestQuery * canceled = [[ProgressTestQuery alloc] initWithDelegate:delegate];
+    canceled.runTime = 0.05;
+    [canceled cancel];
+    [canceled evaluate];
+    XCTAssertEqual(canceled.state, QUERY_CANCEL);
+
+    XCTAssertEqual(delegate.startTimes.count, (NSUInteger)0);
+    XCTAssertEqual(quiet.resultsBuilt + canceled.resultsBuilt, (NSUInteger)0);
+}
+
+- (void)testProgressPastTheDeadlineDoesntMakeTheQueryPartial {
+    ProgressTestDelegate * delegate = [[ProgressTestDelegate alloc] init];
+
+    // Work that was done when time ran out only gets its update dropped.
+    DeadlineTestQuery * finished = [[DeadlineTestQuery alloc] initWithDelegate:delegate];
+    finished.timeout = 0.05;
+    [finished evaluate];
+    XCTAssertEqual(delegate.startTimes.count, (NSUInteger)0);
+    XCTAssertFalse(finished.isPartial);
+    XCTAssertEqual(finished.state, QUERY_COMPLETE);
+
+    // Work that stops on account of the time is partial.
+    DeadlineTestQuery * stopped = [[DeadlineTestQuery alloc] initWithDelegate:delegate];
+    stopped.timeout = 0.05;
+    stopped.checksAfterwards = YES;
+    [stopped evaluate];
+    XCTAssertTrue(stopped.isPartial);
+    XCTAssertEqual(stopped.state, QUERY_COMPLETE);
+}
+
+@end
@@ -0,0 +1,151 @@
+//
+//  FaceClustersTests.mm
+//  CBIRDatabaseTests
+//
+//  Created by Joseph Carson on 10/19/16.
+//  Copyright © 2016 Joseph Carson. All rights reserved.
+//
+
+#import <XCTest/XCTest.h>
+
+#include <stdio.h>
+
+#include <utility>
+#include <vector>
+
+#include "FaceClusters.hpp"
+#include "FaceTestData.hpp"
+
+using namespace cbir;
+
+static std::string temporaryPath(NSString * name)
+{
+    return [NSTemporaryDirectory() stringByAppendingPathComponent:name].UTF8String;
+}
+
+static uint64_t label(const FaceClusters & clusters, size_t face)
+{
+    return clusters.label(FaceTestData::faceID(face));
+}
+
+@interface FaceClustersTests : XCTestCase
+
+@end
+
+@implementation FaceClustersTests
+
+- (void)testLinkedFacesShareALabel {
+    FaceTestData data(2, 1);
+    FaceGallery gallery;
+    data.append(gallery, 0, 6);
+    gallery.setSequence(3);
+    gallery.publish();
+
+    std::vector<std::pair<size_t, size_t>> edges;
+    edges.push_back(std::make_pair(0, 1));
+    edges.push_back(std::make_pair(2, 1));
+    edges.push_back(std::make_pair(3, 4));
+
+    FaceClusters clusters;
+    XCTAssertEqual(label(clusters, 0), (uint64_t)0);
+    clusters.update(*gallery.snapshot(), edges);
+    XCTAssertEqual(clusters.sequence(), (int64_t)3);
+
+    XCTAssertNotEqual(label(clusters, 0), (uint64_t)0);
+    XCTAssertEqual(label(clusters, 0), label(clusters, 1));
+    XCTAssertEqual(label(clusters, 0), label(clusters, 2));
+    XCTAssertEqual(label(clusters, 3), label(clusters, 4));
+    XCTAssertNotEqual(label(clusters, 0), label(clusters, 3));
+    XCTAssertNotEqual(label(clusters, 5), label(clusters, 0));
+    XCTAssertNotEqual(label(clusters, 5), label(clusters, 3));
+    XCTAssertEqual(clusters.clusters().size(), (size_t)3);
+    XCTAssertEqual(clusters.clusters()[label(clusters, 0)].size(), (size_t)3);
+}
+
+- (void)testLabelsSurviveUpdates {
+    FaceTestData data(2, 2);
+    FaceGallery gallery;
+    data.append(gallery, 0, 6);
+    gallery.publish();
+
+    std::vector<std::pair<size_t, size_t>> edges;
+    edges.push_back(std::make_pair(0, 1));
+    edges.push_back(std::make_pair(2, 3));
+
+    FaceClusters clusters;
+    clusters.update(*gallery.snapshot(), edges);
+    uint64_t first = label(clusters, 0);
+    uint64_t second = label(clusters, 2);
+
+    // A new face linked to a cluster joins it.
+    data.append(gallery, 6, 7);
+    gallery.publish();
+    edges.push_back(std::make_pair(6, 2));
+    clusters.update(*gallery.snapshot(), edges);
+    XCTAssertEqual(label(clusters, 0), first);
+    XCTAssertEqual(label(clusters, 2), second);
+    XCTAssertEqual(label(clusters, 6), second);
+
+    // Merged clusters keep the bigger one's label.
+    edges.push_back(std::make_pair(1, 3));
+    clusters.update(*gallery.snapshot(), edges);
+    XCTAssertEqual(label(clusters, 0), second);
+    XCTAssertEqual(label(clusters, 1), second);
+
+    // Removed faces lose their label.
+    gallery.removeImage(FaceTestData::imageID(4));
+    gallery.publish();
+    clusters.update(*gallery.snapshot(), edges);
+    XCTAssertEqual(label(clusters, 4), (uint64_t)0);
+    XCTAssertEqual(label(clusters, 5), (uint64_t)0);
+    XCTAssertEqual(label(clusters, 6), second);
+}
+
+- (void)testSaveAndLoad {
+    FaceTestData data(2, 3);
+    FaceGallery gallery;
+    data.append(gallery, 0, 10);
+    gallery.setSequence(9);
+    gallery.publish();
+
+    std::vector<std::pair<size_t, size_t>> edges;
+    edges.push_back(std::make_pair(0, 9));
+    edges.push_back(std::make_pair(4, 5));
+
+    FaceClusters clusters;
+    clusters.update(*gallery.snapshot(), edges);
+
+    std::string path = temporaryPath(@"FaceClustersTests.labels");
+    XCTAssertTrue(clusters.save(path));
+
+    FaceClusters loaded;
+    XCTAssertTrue(loaded.load(path));
+    XCTAssertEqual(loaded.sequence(), (int64_t)9);
+    for ( size_t i = 0; i < 10; i++ ) {
+        XCTAssertEqual(label(loaded, i), label(clusters, i));
+    }
+
+    // New clusters get labels that weren't handed out before the save.
+    data.append(gallery, 10, 11);
+    gallery.publish();
+    loaded.update(*gallery.snapshot(), edges);
+    for ( size_t i = 0; i < 10; i++ ) {
+        XCTAssertNotEqual(label(loaded, 10), label(clusters, i));
+    }
+
+    // A label changed on disk is caught, rather than moving a face to another identity.
+    FILE * file = fopen(path.c_str(), "r+b");
+    XCTAssertTrue(file != NULL);
+    fseek(file, -1, SEEK_END);
+    int last = fgetc(file);
+    fseek(file, -1, SEEK_END);
+    fputc(last ^ 0x01, file);
+    fclose(file);
+
+    XCTAssertFalse(loaded.load(path));
+    XCTAssertEqual(label(loaded, 0), (uint64_t)0);
+
+    remove(path.c_str());
+}
+
+@end
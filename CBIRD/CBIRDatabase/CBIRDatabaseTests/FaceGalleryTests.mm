@@ -0,0 +1,200 @@
+//
+//  FaceGalleryTests.mm
+//  CBIRDatabaseTests
+//
+//  Created by Joseph Carson on 10/19/16.
+//  Copyright © 2016 Joseph Carson. All rights reserved.
+//
+
+#import <XCTest/XCTest.h>
+
+#include <stdio.h>
+#include <string.h>
+
+#include "FaceGallery.hpp"
+#include "FaceTestData.hpp"
+
+using namespace cbir;
+
+static std::string temporaryPath(NSString * name)
+{
+    return [NSTemporaryDirectory() stringByAppendingPathComponent:name].UTF8String;
+}
+
+// Whether row a of one snapshot holds the same face as row b of another, descriptors and all.
+static bool sameFace(const FaceGallerySnapshot & x, size_t a, const FaceGallerySnapshot & y, size_t b)
+{
+    const FaceRecord & r = x.record(a);
+    const FaceRecord & s = y.record(b);
+    return r.faceID == s.faceID && r.imageDocumentID == s.imageDocumentID && r.thumbnailName == s.thumbnailName &&
+           memcmp(r.rect, s.rect, sizeof(r.rect)) == 0 &&
+           memcmp(x.descriptor(a), y.descriptor(b), kDescriptorLength * sizeof(float)) == 0 &&
+           memcmp(x.coarseDescriptor(a), y.coarseDescriptor(b), kCoarseDescriptorLength * sizeof(float)) == 0;
+}
+
+@interface FaceGalleryTests : XCTestCase
+
+@end
+
+@implementation FaceGalleryTests
+
+- (void)testSnapshotRoundTripAfterRemovals {
+    FaceTestData data(8, 1);
+    FaceGallery gallery;
+    data.append(gallery, 0, 300);
+    gallery.publish();
+    data.append(gallery, 300, 400);
+    size_t removed = FaceTestData::removeEveryOtherImage(gallery, 100, 400);
+    gallery.setSequence(42);
+    gallery.publish();
+
+    std::shared_ptr<const FaceGallerySnapshot> saved = gallery.snapshot();
+    XCTAssertEqual(saved->size(), (size_t)400);
+    XCTAssertEqual(saved->liveCount(), (size_t)400 - removed);
+
+    std::string path = temporaryPath(@"FaceGalleryTests.snapshot");
+    XCTAssertTrue(saved->save(path));
+
+    FaceGallery loaded;
+    XCTAssertTrue(loaded.load(path));
+    std::shared_ptr<const FaceGallerySnapshot> snapshot = loaded.snapshot();
+    XCTAssertEqual(snapshot->sequence(), (int64_t)42);
+
+    // Only the live rows come back, in the same order.
+    XCTAssertEqual(snapshot->size(), saved->liveCount());
+    XCTAssertEqual(snapshot->liveCount(), saved->liveCount());
+    size_t row = 0;
+    for ( size_t i = 0; i < saved->size(); i++ ) {
+        if ( !saved->isRemoved(i) ) {
+            XCTAssertTrue(sameFace(*saved, i, *snapshot, row));
+            row++;
+        }
+    }
+
+    // Faces appended after the load go after the mapped ones, and both make it into the next snapshot.
+    data.append(loaded, 400, 420);
+    XCTAssertEqual(loaded.removeImage(FaceTestData::imageID(0)), (size_t)2);
+    loaded.publish();
+    XCTAssertTrue(loaded.snapshot()->save(path));
+
+    FaceGallery reloaded;
+    XCTAssertTrue(reloaded.load(path));
+    XCTAssertEqual(reloaded.snapshot()->size(), loaded.snapshot()->liveCount());
+    row = 0;
+    for ( size_t i = 0; i < loaded.snapshot()->size(); i++ ) {
+        if ( !loaded.snapshot()->isRemoved(i) ) {
+            XCTAssertTrue(sameFace(*loaded.snapshot(), i, *reloaded.snapshot(), row));
+            row++;
+        }
+    }
+
+    remove(path.c_str());
+}
+
+- (void)testSnapshotsDontChange {
+    FaceTestData data(4, 2);
+    FaceGallery gallery;
+    data.append(gallery, 0, 50);
+    gallery.publish();
+    std::shared_ptr<const FaceGallerySnapshot> before = gallery.snapshot();
+
+    data.append(gallery, 50, 60);
+    gallery.removeImage(FaceTestData::imageID(0));
+    gallery.publish();
+    std::shared_ptr<const FaceGallerySnapshot> after = gallery.snapshot();
+
+    XCTAssertEqual(before->size(), (size_t)50);
+    XCTAssertFalse(before->isRemoved(0));
+    XCTAssertEqual(after->size(), (size_t)60);
+    XCTAssertTrue(after->isRemoved(0));
+
+    // Within a generation, rows keep their faces.
+    XCTAssertEqual(before->generation(), after->generation());
+    for ( size_t i = 0; i < before->size(); i++ ) {
+        XCTAssertTrue(sameFace(*before, i, *after, i));
+    }
+}
+
+- (void)testLoadAndClearStartNewGenerations {
+    FaceTestData data(4, 3);
+    FaceGallery gallery;
+    data.append(gallery, 0, 20);
+    gallery.publish();
+    uint64_t generation = gallery.snapshot()->generation();
+
+    std::string path = temporaryPath(@"FaceGalleryTests.generation");
+    XCTAssertTrue(gallery.snapshot()->save(path));
+
+    FaceGallery loaded;
+    XCTAssertTrue(loaded.load(path));
+    XCTAssertTrue(loaded.snapshot()->generation() > generation);
+
+    gallery.clear();
+    gallery.publish();
+    XCTAssertTrue(gallery.snapshot()->generation() > loaded.snapshot()->generation());
+    XCTAssertEqual(gallery.snapshot()->size(), (size_t)0);
+
+    remove(path.c_str());
+}
+
+- (void)testCorruptSnapshotIsRejected {
+    FaceTestData data(4, 4);
+    FaceGallery gallery;
+    data.append(gallery, 0, 20);
+    gallery.publish();
+
+    std::string path = temporaryPath(@"FaceGalleryTests.corrupt");
+    XCTAssertTrue(gallery.snapshot()->save(path));
+
+    // Flip a byte of the last record.
+    FILE * file = fopen(path.c_str(), "r+b");
+    XCTAssertTrue(file != NULL);
+    fseek(file, -8, SEEK_END);
+    int byte = fgetc(file);
+    fseek(file, -8, SEEK_END);
+    fputc(byte ^ 0xff, file);
+    fclose(file);
+
+    FaceGallery loaded;
+    data.append(loaded, 0, 4);
+    XCTAssertFalse(loaded.load(path));
+    XCTAssertEqual(loaded.size(), (size_t)0);
+    XCTAssertEqual(loaded.snapshot()->size(), (size_t)0);
+
+    XCTAssertFalse(loaded.load(temporaryPath(@"FaceGalleryTests.missing")));
+
+    remove(path.c_str());
+}
+
+- (void)testCorruptDescriptorIsCaughtByVerifying {
+    FaceTestData data(4, 4);
+    FaceGallery gallery;
+    data.append(gallery, 0, 20);
+    gallery.publish();
+    XCTAssertTrue(gallery.snapshot()->verifyDescriptors());
+
+    std::string path = temporaryPath(@"FaceGalleryTests.descriptors");
+    XCTAssertTrue(gallery.snapshot()->save(path));
+
+    FaceGallery loaded;
+    XCTAssertTrue(loaded.load(path));
+    XCTAssertTrue(loaded.snapshot()->verifyDescriptors());
+
+    // Flip a byte of the first coarse descriptor.  The mapping doesn't read it, so only verifying finds out.
+    FILE * file = fopen(path.c_str(), "r+b");
+    XCTAssertTrue(file != NULL);
+    long offset = 64 + (long)(20 * kDescriptorLength * sizeof(float));
+    fseek(file, offset, SEEK_SET);
+    int byte = fgetc(file);
+    fseek(file, offset, SEEK_SET);
+    fputc(byte ^ 0xff, file);
+    fclose(file);
+
+    XCTAssertTrue(loaded.load(path));
+    XCTAssertEqual(loaded.size(), (size_t)20);
+    XCTAssertFalse(loaded.snapshot()->verifyDescriptors());
+
+    remove(path.c_str());
+}
+
+@end
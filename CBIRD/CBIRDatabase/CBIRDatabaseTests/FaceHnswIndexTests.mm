@@ -0,0 +1,295 @@
+//
+//  FaceHnswIndexTests.mm
+//  CBIRDatabaseTests
+//
+//  Created by Joseph Carson on 10/19/16.
+//  Copyright © 2016 Joseph Carson. All rights reserved.
+//
+
+#import <XCTest/XCTest.h>
+
+#include <stdio.h>
+
+#include <algorithm>
+#include <atomic>
+#include <set>
+#include <thread>
+#include <vector>
+
+#include "FaceHnswIndex.hpp"
+#include "FaceTestData.hpp"
+
+using namespace cbir;
+
+static std::string temporaryPath(NSString * name)
+{
+    return [NSTemporaryDirectory() stringByAppendingPathComponent:name].UTF8String;
+}
+
+static std::vector<float> embedding(const FaceGallerySnapshot & gallery, size_t row)
+{
+    std::vector<float> embedding(kEmbeddingLength);
+    embedCoarseDescriptor(gallery.coarseDescriptor(row), embedding.data());
+    return embedding;
+}
+
+// The share of the true 10 nearest live faces that searches for every 10th face find, searching with ef
+// candidates.  Fails outright if a search does, or comes back with a removed face.
+static double recall(const FaceHnswIndex & index, const FaceGallerySnapshot & gallery, size_t ef)
+{
+    const size_t count = 10;
+    size_t found = 0;
+    size_t total = 0;
+
+    for ( size_t probe = 0; probe < gallery.size(); probe += 10 ) {
+        std::vector<float> probeEmbedding = embedding(gallery, probe);
+
+        std::vector<ScoredRow> nearest;
+        size_t indexedRows = 0;
+        if ( !index.search(gallery, probeEmbedding.data(), count, ef, nearest, indexedRows) ) {
+            return 0.0;
+        }
+
+        std::set<size_t> rows;
+        for ( size_t i = 0; i < nearest.size(); i++ ) {
+            if ( gallery.isRemoved(nearest[i].row) ) {
+                return 0.0;
+            }
+            rows.insert(nearest[i].row);
+        }
+
+        std::vector<std::pair<float, size_t>> all;
+        for ( size_t row = 0; row < gallery.size(); row++ ) {
+            if ( !gallery.isRemoved(row) ) {
+                all.push_back(std::make_pair(embeddingDistance(probeEmbedding.data(), embedding(gallery, row).data()), row));
+            }
+        }
+        std::sort(all.begin(), all.end());
+
+        for ( size_t i = 0; i < count && i < all.size(); i++ ) {
+            found += rows.count(all[i].second);
+            total++;
+        }
+    }
+
+    return total == 0 ? 0.0 : (double)found / total;
+}
+
+@interface FaceHnswIndexTests : XCTestCase
+
+@end
+
+@implementation FaceHnswIndexTests
+
+- (void)testRecall {
+    FaceTestData data(30, 1);
+    FaceGallery gallery;
+    data.append(gallery, 0, 1500);
+    gallery.setSequence(1);
+    gallery.publish();
+
+    FaceHnswIndex index;
+    XCTAssertTrue(index.update(*gallery.snapshot()));
+    XCTAssertEqual(index.size(), (size_t)1500);
+    XCTAssertEqual(index.sequence(), (int64_t)1);
+    XCTAssertGreaterThanOrEqual(recall(index, *gallery.snapshot(), index.params().efSearch), 0.9);
+
+    // Removed faces are left out of results, and new ones are found.
+    FaceTestData::removeEveryOtherImage(gallery, 0, 1000);
+    data.append(gallery, 1500, 1600);
+    gallery.setSequence(2);
+    gallery.publish();
+    XCTAssertTrue(index.update(*gallery.snapshot()));
+    XCTAssertEqual(index.size(), (size_t)1600);
+    XCTAssertGreaterThanOrEqual(recall(index, *gallery.snapshot(), index.params().efSearch), 0.9);
+}
+
+- (void)testRoundTripAfterRemovals {
+    FaceTestData data(30, 2);
+    FaceGallery gallery;
+    data.append(gallery, 0, 1000);
+    gallery.publish();
+
+    FaceHnswIndex index;
+    XCTAssertTrue(index.update(*gallery.snapshot()));
+
+    FaceTestData::removeEveryOtherImage(gallery, 0, 1000);
+    data.append(gallery, 1000, 1100);
+    gallery.setSequence(7);
+    gallery.publish();
+    std::shared_ptr<const FaceGallerySnapshot> saved = gallery.snapshot();
+    XCTAssertTrue(index.update(*saved));
+
+    std::string galleryPath = temporaryPath(@"FaceHnswIndexTests.snapshot");
+    std::string indexPath = temporaryPath(@"FaceHnswIndexTests.hnsw");
+    XCTAssertTrue(saved->save(galleryPath));
+    XCTAssertTrue(index.save(indexPath, *saved));
+
+    FaceGallery loadedGallery;
+    XCTAssertTrue(loadedGallery.load(galleryPath));
+    std::shared_ptr<const FaceGallerySnapshot> snapshot = loadedGallery.snapshot();
+
+    // The index only loads against the rows it was saved from.
+    FaceHnswIndex loaded;
+    XCTAssertFalse(loaded.load(indexPath, *saved));
+    XCTAssertTrue(loaded.load(indexPath, *snapshot));
+    XCTAssertEqual(loaded.size(), saved->liveCount());
+    XCTAssertEqual(loaded.sequence(), (int64_t)7);
+    XCTAssertGreaterThanOrEqual(recall(loaded, *snapshot, loaded.params().efSearch), 0.9);
+
+    // The index from before the load is of the old generation, so it can't search the new one.
+    std::vector<float> probe = embedding(*snapshot, 0);
+    std::vector<ScoredRow> nearest;
+    size_t indexedRows = 0;
+    XCTAssertFalse(index.search(*snapshot, probe.data(), 10, 64, nearest, indexedRows));
+    XCTAssertTrue(loaded.search(*snapshot, probe.data(), 10, 64, nearest, indexedRows));
+    XCTAssertEqual(indexedRows, snapshot->size());
+
+    // Carrying on only inserts the new faces, and an update with the old generation is ignored.
+    data.append(loadedGallery, 2000, 2050);
+    loadedGallery.setSequence(8);
+    loadedGallery.publish();
+    XCTAssertTrue(loaded.update(*loadedGallery.snapshot()));
+    XCTAssertEqual(loaded.size(), loadedGallery.snapshot()->size());
+    XCTAssertTrue(loaded.update(*saved));
+    XCTAssertEqual(loaded.size(), loadedGallery.snapshot()->size());
+    XCTAssertGreaterThanOrEqual(recall(loaded, *loadedGallery.snapshot(), loaded.params().efSearch), 0.9);
+
+    remove(galleryPath.c_str());
+    remove(indexPath.c_str());
+}
+
+- (void)testPartialIndexSavesWhatItCovers {
+    FaceTestData data(4, 3);
+    FaceGallery gallery;
+    data.append(gallery, 0, 50);
+    gallery.publish();
+
+    FaceHnswIndex index;
+    XCTAssertTrue(index.update(*gallery.snapshot()));
+
+    // Ten faces the index hasn't caught up with, and two removed ones it has.
+    data.append(gallery, 50, 60);
+    gallery.removeImage(FaceTestData::imageID(6));
+    gallery.setSequence(4);
+    gallery.publish();
+
+    std::string galleryPath = temporaryPath(@"FaceHnswIndexTests.partial.snapshot");
+    std::string indexPath = temporaryPath(@"FaceHnswIndexTests.partial.hnsw");
+    XCTAssertTrue(gallery.snapshot()->save(galleryPath));
+    XCTAssertTrue(index.save(indexPath, *gallery.snapshot()));
+
+    FaceGallery loadedGallery;
+    XCTAssertTrue(loadedGallery.load(galleryPath));
+    FaceHnswIndex loaded;
+    XCTAssertTrue(loaded.load(indexPath, *loadedGallery.snapshot()));
+    XCTAssertEqual(loaded.size(), (size_t)48);
+
+    // Not caught up, so it doesn't claim the gallery's sequence.
+    XCTAssertEqual(loaded.sequence(), (int64_t)0);
+    XCTAssertTrue(loaded.update(*loadedGallery.snapshot()));
+    XCTAssertEqual(loaded.size(), (size_t)58);
+
+    remove(galleryPath.c_str());
+    remove(indexPath.c_str());
+}
+
+- (void)testIndexSavedWithOtherParamsIsRejected {
+    FaceTestData data(4, 5);
+    FaceGallery gallery;
+    data.append(gallery, 0, 100);
+    gallery.publish();
+
+    FaceHnswIndex index;
+    XCTAssertTrue(index.update(*gallery.snapshot()));
+
+    std::string path = temporaryPath(@"FaceHnswIndexTests.params.hnsw");
+    XCTAssertTrue(index.save(path, *gallery.snapshot()));
+
+    // Its nodes would have the wrong number of links for the other params.
+    HnswParams params;
+    params.m = 8;
+    FaceHnswIndex other(params);
+    XCTAssertFalse(other.load(path, *gallery.snapshot()));
+    XCTAssertEqual(other.size(), (size_t)0);
+    XCTAssertFalse(other.load(temporaryPath(@"FaceHnswIndexTests.missing"), *gallery.snapshot()));
+
+    remove(path.c_str());
+}
+
+- (void)testWiderSearchesFindMore {
+    FaceTestData data(30, 2);
+    FaceGallery gallery;
+    data.append(gallery, 0, 1500);
+    gallery.publish();
+
+    // A sparse graph, so that a narrow search misses some of the nearest faces.
+    HnswParams params;
+    params.m = 4;
+    params.efConstruction = 20;
+    FaceHnswIndex index(params);
+    XCTAssertTrue(index.update(*gallery.snapshot()));
+
+    double narrow = recall(index, *gallery.snapshot(), 10);
+    double wide = recall(index, *gallery.snapshot(), 200);
+    XCTAssertLessThan(narrow, wide);
+    XCTAssertGreaterThanOrEqual(wide, 0.95);
+}
+
+- (void)testStoppedUpdateGivesUp {
+    FaceTestData data(4, 3);
+    FaceGallery gallery;
+    data.append(gallery, 0, 100);
+    gallery.setSequence(2);
+    gallery.publish();
+
+    FaceHnswIndex index;
+    index.stop();
+    XCTAssertFalse(index.update(*gallery.snapshot()));
+    XCTAssertLessThan(index.size(), (size_t)100);
+    XCTAssertEqual(index.sequence(), (int64_t)0);
+}
+
+- (void)testSearchesRunAlongsideInserts {
+    FaceTestData data(30, 4);
+    FaceGallery gallery;
+    data.append(gallery, 0, 500);
+    gallery.publish();
+
+    FaceHnswIndex index;
+    XCTAssertTrue(index.update(*gallery.snapshot()));
+
+    data.append(gallery, 500, 1500);
+    gallery.publish();
+    std::shared_ptr<const FaceGallerySnapshot> snapshot = gallery.snapshot();
+
+    // Several searches at once, while the new faces go in, all find what they're asked for.
+    std::atomic<size_t> failures(0);
+    std::thread updater([&index, &snapshot]() {
+        index.update(*snapshot);
+    });
+    std::vector<std::thread> searchers;
+    for ( size_t t = 0; t < 4; t++ ) {
+        searchers.push_back(std::thread([&index, &snapshot, &failures, t]() {
+            for ( size_t probe = t; probe < 500; probe += 4 ) {
+                std::vector<float> probeEmbedding = embedding(*snapshot, probe);
+                std::vector<ScoredRow> nearest;
+                size_t indexedRows = 0;
+                if ( !index.search(*snapshot, probeEmbedding.data(), 10, 64, nearest, indexedRows) ||
+                     nearest.size() != 10 ) {
+                    failures++;
+                }
+            }
+        }));
+    }
+    for ( size_t t = 0; t < searchers.size(); t++ ) {
+        searchers[t].join();
+    }
+    updater.join();
+
+    XCTAssertEqual(failures.load(), (size_t)0);
+    XCTAssertEqual(index.size(), (size_t)1500);
+    XCTAssertGreaterThanOrEqual(recall(index, *snapshot, index.params().efSearch), 0.9);
+}
+
+@end
@@ -0,0 +1,255 @@
+//
+//  FaceIvfIndexTests.mm
+//  CBIRDatabaseTests
+//
+//  Created by Joseph Carson on 10/19/16.
+//  Copyright © 2016 Joseph Carson. All rights reserved.
+//
+
+#import <XCTest/XCTest.h>
+
+#include <stdio.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "FaceIvfIndex.hpp"
+#include "FaceTestData.hpp"
+
+using namespace cbir;
+
+static std::string temporaryPath(NSString * name)
+{
+    return [NSTemporaryDirectory() stringByAppendingPathComponent:name].UTF8String;
+}
+
+static std::vector<float> embedding(const FaceGallerySnapshot & gallery, size_t row)
+{
+    std::vector<float> embedding(kEmbeddingLength);
+    embedCoarseDescriptor(gallery.coarseDescriptor(row), embedding.data());
+    return embedding;
+}
+
+// Appends the rows of the snapshot that the index doesn't have yet, as the engine does while indexing.
+static void catchUp(FaceIvfIndex & index, const FaceGallerySnapshot & gallery)
+{
+    for ( size_t row = index.size(); row < gallery.size(); row++ ) {
+        index.append(gallery.record(row).faceID, gallery.coarseDescriptor(row));
+    }
+}
+
+static bool train(FaceIvfIndex & index, const FaceGallerySnapshot & gallery, TaskScheduler & scheduler)
+{
+    std::shared_ptr<const IvfTraining> training = index.train(gallery, FaceIvfIndex::listCountFor(gallery.liveCount()), scheduler);
+    if ( !training ) {
+        return false;
+    }
+    index.install(*training, gallery);
+    return true;
+}
+
+// The share of the true 10 nearest live faces that probing a few lists for every 10th face turns up.
+static double recall(const FaceIvfIndex & index, const FaceGallerySnapshot & gallery, size_t probeCount)
+{
+    const size_t count = 10;
+    size_t found = 0;
+    size_t total = 0;
+
+    for ( size_t probe = 0; probe < gallery.size(); probe += 10 ) {
+        std::vector<float> probeEmbedding = embedding(gallery, probe);
+
+        std::vector<size_t> rows;
+        if ( !index.search(gallery, probeEmbedding.data(), probeCount, rows) ) {
+            return 0.0;
+        }
+
+        std::vector<std::pair<float, size_t>> all;
+        for ( size_t row = 0; row < gallery.size(); row++ ) {
+            if ( !gallery.isRemoved(row) ) {
+                all.push_back(std::make_pair(embeddingDistance(probeEmbedding.data(), embedding(gallery, row).data()), row));
+            }
+        }
+        std::sort(all.begin(), all.end());
+
+        for ( size_t i = 0; i < count && i < all.size(); i++ ) {
+            found += std::binary_search(rows.begin(), rows.end(), all[i].second) ? 1 : 0;
+            total++;
+        }
+    }
+
+    return total == 0 ? 0.0 : (double)found / total;
+}
+
+@interface FaceIvfIndexTests : XCTestCase
+
+@end
+
+@implementation FaceIvfIndexTests
+
+- (void)testSearchesLiveRowsOnceTrained {
+    TaskScheduler scheduler(4);
+    FaceTestData data(20, 1);
+    FaceGallery gallery;
+    FaceIvfIndex index;
+
+    data.append(gallery, 0, 1000);
+    gallery.publish();
+    catchUp(index, *gallery.snapshot());
+
+    std::vector<float> probe = embedding(*gallery.snapshot(), 0);
+    std::vector<size_t> rows;
+    XCTAssertFalse(index.isTrained());
+    XCTAssertFalse(index.search(*gallery.snapshot(), probe.data(), 4, rows));
+
+    std::shared_ptr<const IvfTraining> training = index.train(*gallery.snapshot(), FaceIvfIndex::listCountFor(1000), scheduler);
+    XCTAssertTrue(training != NULL);
+
+    // Faces indexed and removed while training go in the right lists.
+    data.append(gallery, 1000, 1200);
+    size_t removed = FaceTestData::removeEveryOtherImage(gallery, 0, 1200);
+    gallery.publish();
+    std::shared_ptr<const FaceGallerySnapshot> snapshot = gallery.snapshot();
+    catchUp(index, *snapshot);
+    index.install(*training, *snapshot);
+    XCTAssertTrue(index.isTrained());
+    XCTAssertEqual(index.trainedSize(), (size_t)1200 - removed);
+
+    // Probing every list finds every live row, in row order.
+    XCTAssertTrue(index.search(*snapshot, probe.data(), training->listCount, rows));
+    XCTAssertEqual(rows.size(), snapshot->liveCount());
+    XCTAssertTrue(std::is_sorted(rows.begin(), rows.end()));
+    for ( size_t i = 0; i < rows.size(); i++ ) {
+        XCTAssertFalse(snapshot->isRemoved(rows[i]));
+    }
+
+    XCTAssertGreaterThanOrEqual(recall(index, *snapshot, 4), 0.8);
+}
+
+- (void)testMoreProbesFindMore {
+    TaskScheduler scheduler(4);
+    FaceTestData data(5, 2);
+    FaceGallery gallery;
+    FaceIvfIndex index;
+
+    data.append(gallery, 0, 1600);
+    gallery.publish();
+    std::shared_ptr<const FaceGallerySnapshot> snapshot = gallery.snapshot();
+    catchUp(index, *snapshot);
+    XCTAssertTrue(train(index, *snapshot, scheduler));
+
+    // Few identities, so each spreads over several lists.  Recall goes up with the lists probed, and probing them
+    // all is a full scan.
+    size_t listCount = FaceIvfIndex::listCountFor(snapshot->liveCount());
+    double one = recall(index, *snapshot, 1);
+    double few = recall(index, *snapshot, 4);
+    double all = recall(index, *snapshot, listCount);
+    XCTAssertLessThan(one, few);
+    XCTAssertLessThan(few, all);
+    XCTAssertEqual(all, 1.0);
+}
+
+- (void)testRoundTripAfterRemovals {
+    TaskScheduler scheduler(4);
+    FaceTestData data(20, 2);
+    FaceGallery gallery;
+    FaceIvfIndex index;
+
+    data.append(gallery, 0, 800);
+    gallery.publish();
+    catchUp(index, *gallery.snapshot());
+    XCTAssertTrue(train(index, *gallery.snapshot(), scheduler));
+
+    FaceTestData::removeEveryOtherImage(gallery, 0, 800);
+    data.append(gallery, 800, 900);
+    gallery.setSequence(5);
+    gallery.publish();
+    std::shared_ptr<const FaceGallerySnapshot> saved = gallery.snapshot();
+    catchUp(index, *saved);
+
+    std::string galleryPath = temporaryPath(@"FaceIvfIndexTests.snapshot");
+    std::string indexPath = temporaryPath(@"FaceIvfIndexTests.ivf");
+    XCTAssertTrue(saved->save(galleryPath));
+    XCTAssertTrue(index.save(indexPath, *saved));
+
+    FaceGallery loadedGallery;
+    XCTAssertTrue(loadedGallery.load(galleryPath));
+    std::shared_ptr<const FaceGallerySnapshot> snapshot = loadedGallery.snapshot();
+
+    // The index only loads against the rows it was saved from.
+    FaceIvfIndex loaded;
+    XCTAssertFalse(loaded.load(indexPath, *saved));
+    XCTAssertTrue(loaded.load(indexPath, *snapshot));
+    XCTAssertTrue(loaded.isTrained());
+    XCTAssertEqual(loaded.size(), saved->liveCount());
+
+    // Both find the same faces.
+    for ( size_t probe = 0; probe < snapshot->size(); probe += 50 ) {
+        std::vector<float> probeEmbedding = embedding(*snapshot, probe);
+        std::vector<size_t> before, after;
+        XCTAssertTrue(index.search(*saved, probeEmbedding.data(), 3, before));
+        XCTAssertTrue(loaded.search(*snapshot, probeEmbedding.data(), 3, after));
+        XCTAssertEqual(before.size(), after.size());
+        for ( size_t i = 0; i < before.size() && i < after.size(); i++ ) {
+            XCTAssertTrue(saved->record(before[i]).faceID == snapshot->record(after[i]).faceID);
+        }
+    }
+
+    // The loaded index carries on with the new gallery.
+    data.append(loadedGallery, 2000, 2050);
+    loadedGallery.publish();
+    catchUp(loaded, *loadedGallery.snapshot());
+    XCTAssertEqual(loaded.size(), loadedGallery.snapshot()->size());
+    XCTAssertGreaterThanOrEqual(recall(loaded, *loadedGallery.snapshot(), 4), 0.8);
+
+    remove(galleryPath.c_str());
+    remove(indexPath.c_str());
+}
+
+- (void)testImpossibleListCountIsRejected {
+    TaskScheduler scheduler(2);
+    FaceTestData data(4, 3);
+    FaceGallery gallery;
+    FaceIvfIndex index;
+
+    data.append(gallery, 0, 100);
+    gallery.publish();
+    catchUp(index, *gallery.snapshot());
+    XCTAssertTrue(train(index, *gallery.snapshot(), scheduler));
+
+    std::string path = temporaryPath(@"FaceIvfIndexTests.lists.ivf");
+    XCTAssertTrue(index.save(path, *gallery.snapshot()));
+
+    // A header claiming far more centroids than the file holds fails to load, rather than allocating for them.
+    // The list count follows the magic, version, checksum and face count.
+    FILE * file = fopen(path.c_str(), "r+b");
+    XCTAssertTrue(file != NULL);
+    uint64_t listCount = (uint64_t)1 << 40;
+    fseek(file, 24, SEEK_SET);
+    fwrite(&listCount, sizeof(listCount), 1, file);
+    fclose(file);
+
+    FaceIvfIndex loaded;
+    XCTAssertFalse(loaded.load(path, *gallery.snapshot()));
+    XCTAssertEqual(loaded.size(), (size_t)0);
+    XCTAssertFalse(loaded.isTrained());
+    XCTAssertFalse(loaded.load(temporaryPath(@"FaceIvfIndexTests.missing"), *gallery.snapshot()));
+
+    remove(path.c_str());
+}
+
+- (void)testStoppedTrainingGivesUp {
+    TaskScheduler scheduler(2);
+    FaceTestData data(4, 4);
+    FaceGallery gallery;
+    FaceIvfIndex index;
+
+    data.append(gallery, 0, 100);
+    gallery.publish();
+    catchUp(index, *gallery.snapshot());
+
+    index.stop();
+    XCTAssertFalse(train(index, *gallery.snapshot(), scheduler));
+    XCTAssertFalse(index.isTrained());
+}
+
+@end
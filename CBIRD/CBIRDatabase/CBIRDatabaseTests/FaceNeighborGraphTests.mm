@@ -0,0 +1,353 @@
+//
+//  FaceNeighborGraphTests.mm
+//  CBIRDatabaseTests
+//
+//  Created by Joseph Carson on 10/19/16.
+//  Copyright © 2016 Joseph Carson. All rights reserved.
+//
+
+#import <XCTest/XCTest.h>
+
+#include <stdio.h>
+
+#include <algorithm>
+#include <chrono>
+#include <set>
+#include <thread>
+#include <vector>
+
+#include "FaceNeighborGraph.hpp"
+#include "FaceTestData.hpp"
+
+using namespace cbir;
+
+static std::string temporaryPath(NSString * name)
+{
+    return [NSTemporaryDirectory() stringByAppendingPathComponent:name].UTF8String;
+}
+
+// The face IDs of the face's neighbours.
+static std::set<std::string> neighborIDs(const FaceNeighborGraph & graph, const std::string & faceID)
+{
+    std::set<std::string> ids;
+    std::vector<ScoredRow> neighbors;
+    std::shared_ptr<const FaceGallerySnapshot> gallery;
+    if ( graph.neighbors(faceID, neighbors, gallery) ) {
+        for ( size_t i = 0; i < neighbors.size(); i++ ) {
+            ids.insert(gallery->record(neighbors[i].row).faceID);
+        }
+    }
+    return ids;
+}
+
+// The face IDs of the face's nearest live faces, the slow way.
+static std::set<std::string> nearestIDs(const FaceGallerySnapshot & gallery, size_t row)
+{
+    TopKCollector nearest(FaceNeighborGraph::kNeighborCount);
+    for ( size_t other = 0; other < gallery.size(); other++ ) {
+        if ( other != row && !gallery.isRemoved(other) ) {
+            nearest.add(faceDistance(gallery.descriptor(row), gallery.descriptor(other)), other);
+        }
+    }
+
+    std::set<std::string> ids;
+    std::vector<ScoredRow> sorted = nearest.sorted();
+    for ( size_t i = 0; i < sorted.size(); i++ ) {
+        ids.insert(gallery.record(sorted[i].row).faceID);
+    }
+    return ids;
+}
+
+// The fraction of every live face's true nearest faces that the graph has as its neighbours.
+static double recall(const FaceNeighborGraph & graph, const FaceGallerySnapshot & gallery)
+{
+    size_t found = 0;
+    size_t total = 0;
+    for ( size_t row = 0; row < gallery.size(); row++ ) {
+        if ( gallery.isRemoved(row) ) {
+            continue;
+        }
+        std::set<std::string> expected = nearestIDs(gallery, row);
+        std::set<std::string> neighbors = neighborIDs(graph, gallery.record(row).faceID);
+        for ( std::set<std::string>::const_iterator it = expected.begin(); it != expected.end(); ++it ) {
+            found += neighbors.count(*it);
+            total++;
+        }
+    }
+    return (double)found / total;
+}
+
+// Whether the other row is among the first rank neighbours of the row.
+static bool isAmongFirst(const FaceNeighborGraph & graph, const FaceGallerySnapshot & gallery, size_t row,
+                         size_t rank, size_t other)
+{
+    std::vector<ScoredRow> neighbors;
+    std::shared_ptr<const FaceGallerySnapshot> neighborGallery;
+    graph.neighbors(gallery.record(row).faceID, neighbors, neighborGallery);
+    for ( size_t i = 0; i < neighbors.size() && i < rank; i++ ) {
+        if ( neighbors[i].row == other ) {
+            return true;
+        }
+    }
+    return false;
+}
+
+@interface FaceNeighborGraphTests : XCTestCase
+
+@end
+
+@implementation FaceNeighborGraphTests
+
+- (void)testFindsNearestFaces {
+    TaskScheduler scheduler(4);
+    FaceTestData data(20, 1);
+    FaceGallery gallery;
+    data.append(gallery, 0, 600);
+    gallery.publish();
+    std::shared_ptr<const FaceGallerySnapshot> snapshot = gallery.snapshot();
+
+    FaceNeighborGraph graph;
+    XCTAssertTrue(graph.update(snapshot, scheduler, NULL));
+
+    for ( size_t row = 0; row < snapshot->size(); row++ ) {
+        std::vector<ScoredRow> neighbors;
+        std::shared_ptr<const FaceGallerySnapshot> neighborGallery;
+        XCTAssertTrue(graph.neighbors(snapshot->record(row).faceID, neighbors, neighborGallery));
+        XCTAssertEqual(neighbors.size(), FaceNeighborGraph::kNeighborCount);
+        XCTAssertTrue(neighborGallery == snapshot);
+        for ( size_t i = 1; i < neighbors.size(); i++ ) {
+            XCTAssertLessThanOrEqual(neighbors[i - 1].distance, neighbors[i].distance);
+        }
+    }
+
+    // The coarse pass makes it approximate, like a query.
+    XCTAssertGreaterThanOrEqual(recall(graph, *snapshot), 0.95);
+}
+
+- (void)testUpdatesCatchUpWithNewFaces {
+    TaskScheduler scheduler(4);
+    FaceTestData data(20, 2);
+    FaceGallery gallery;
+    data.append(gallery, 0, 400);
+    gallery.setSequence(3);
+    gallery.publish();
+
+    FaceNeighborGraph graph;
+    XCTAssertEqual(graph.sequence(), (int64_t)0);
+    XCTAssertTrue(graph.update(gallery.snapshot(), scheduler, NULL));
+    XCTAssertEqual(graph.sequence(), (int64_t)3);
+
+    // Until the next update the graph is stale, and doesn't know the new faces.
+    data.append(gallery, 400, 600);
+    gallery.setSequence(4);
+    gallery.publish();
+    std::shared_ptr<const FaceGallerySnapshot> snapshot = gallery.snapshot();
+    XCTAssertLessThan(graph.sequence(), snapshot->sequence());
+    XCTAssertTrue(neighborIDs(graph, FaceTestData::faceID(500)).empty());
+
+    // Catching up finds the new faces' neighbours and offers them to the old faces, nearly as well as starting over.
+    XCTAssertTrue(graph.update(snapshot, scheduler, NULL));
+    XCTAssertEqual(graph.sequence(), snapshot->sequence());
+    XCTAssertFalse(neighborIDs(graph, FaceTestData::faceID(500)).empty());
+    XCTAssertGreaterThanOrEqual(recall(graph, *snapshot), 0.85);
+
+    // A stopped update leaves the graph where it was.
+    data.append(gallery, 600, 650);
+    gallery.setSequence(5);
+    gallery.publish();
+    graph.stop();
+    XCTAssertFalse(graph.update(gallery.snapshot(), scheduler, NULL));
+    XCTAssertEqual(graph.sequence(), (int64_t)4);
+}
+
+- (void)testRemovedFacesLeaveTheGraph {
+    TaskScheduler scheduler(4);
+    FaceTestData data(10, 3);
+    FaceGallery gallery;
+    data.append(gallery, 0, 300);
+    gallery.publish();
+
+    FaceNeighborGraph graph;
+    XCTAssertTrue(graph.update(gallery.snapshot(), scheduler, NULL));
+
+    FaceTestData::removeEveryOtherImage(gallery, 0, 300);
+    gallery.publish();
+    std::shared_ptr<const FaceGallerySnapshot> snapshot = gallery.snapshot();
+    XCTAssertTrue(graph.update(snapshot, scheduler, NULL));
+
+    // Removed faces are gone, and nobody has them as a neighbour any more.
+    for ( size_t row = 0; row < snapshot->size(); row++ ) {
+        std::vector<ScoredRow> neighbors;
+        std::shared_ptr<const FaceGallerySnapshot> neighborGallery;
+        bool found = graph.neighbors(snapshot->record(row).faceID, neighbors, neighborGallery);
+        XCTAssertTrue(found != snapshot->isRemoved(row));
+        for ( size_t i = 0; i < neighbors.size(); i++ ) {
+            XCTAssertFalse(neighborGallery->isRemoved(neighbors[i].row));
+        }
+    }
+}
+
+- (void)testRoundTripAfterRemovals {
+    TaskScheduler scheduler(4);
+    FaceTestData data(10, 3);
+    FaceGallery gallery;
+    data.append(gallery, 0, 400);
+    gallery.publish();
+
+    FaceNeighborGraph graph;
+    XCTAssertTrue(graph.update(gallery.snapshot(), scheduler, NULL));
+
+    FaceTestData::removeEveryOtherImage(gallery, 0, 400);
+    data.append(gallery, 400, 450);
+    gallery.setSequence(6);
+    gallery.publish();
+    std::shared_ptr<const FaceGallerySnapshot> saved = gallery.snapshot();
+    XCTAssertTrue(graph.update(saved, scheduler, NULL));
+
+    std::string galleryPath = temporaryPath(@"FaceNeighborGraphTests.snapshot");
+    std::string graphPath = temporaryPath(@"FaceNeighborGraphTests.graph");
+    XCTAssertTrue(saved->save(galleryPath));
+    XCTAssertTrue(graph.save(graphPath, *saved));
+
+    FaceGallery loadedGallery;
+    XCTAssertTrue(loadedGallery.load(galleryPath));
+    std::shared_ptr<const FaceGallerySnapshot> snapshot = loadedGallery.snapshot();
+
+    // The graph only loads against the rows it was saved from, and keeps every face's neighbours.
+    FaceNeighborGraph loaded;
+    XCTAssertFalse(loaded.load(graphPath, saved));
+    XCTAssertTrue(loaded.load(graphPath, snapshot));
+    XCTAssertEqual(loaded.sequence(), (int64_t)6);
+    for ( size_t row = 0; row < snapshot->size(); row++ ) {
+        const std::string & faceID = snapshot->record(row).faceID;
+        XCTAssertTrue(neighborIDs(loaded, faceID) == neighborIDs(graph, faceID));
+    }
+
+    // Carrying on finds the neighbours of new faces, and an update with the old generation is ignored.
+    data.append(loadedGallery, 1000, 1010);
+    loadedGallery.setSequence(7);
+    loadedGallery.publish();
+    XCTAssertTrue(loaded.update(loadedGallery.snapshot(), scheduler, NULL));
+    XCTAssertEqual(loaded.sequence(), (int64_t)7);
+    XCTAssertFalse(neighborIDs(loaded, FaceTestData::faceID(1005)).empty());
+    XCTAssertTrue(loaded.update(saved, scheduler, NULL));
+    XCTAssertEqual(loaded.sequence(), (int64_t)7);
+
+    // The graph from before the load is of the old generation, so it has nothing to save for the new one.  What it
+    // saves loads as an empty graph that isn't caught up with anything, so the next update starts over.
+    std::string stalePath = temporaryPath(@"FaceNeighborGraphTests.stale.graph");
+    XCTAssertTrue(graph.save(stalePath, *snapshot));
+    FaceNeighborGraph stale;
+    XCTAssertTrue(stale.load(stalePath, snapshot));
+    XCTAssertEqual(stale.sequence(), (int64_t)0);
+    XCTAssertTrue(neighborIDs(stale, snapshot->record(0).faceID).empty());
+
+    remove(galleryPath.c_str());
+    remove(graphPath.c_str());
+    remove(stalePath.c_str());
+}
+
+- (void)testLoadDuringAnUpdate {
+    TaskScheduler scheduler(4);
+    FaceTestData data(10, 6);
+    FaceGallery gallery;
+    data.append(gallery, 0, 200);
+    gallery.setSequence(2);
+    gallery.publish();
+    std::shared_ptr<const FaceGallerySnapshot> small = gallery.snapshot();
+
+    FaceNeighborGraph saved;
+    XCTAssertTrue(saved.update(small, scheduler, NULL));
+    std::string galleryPath = temporaryPath(@"FaceNeighborGraphTests.reload.snapshot");
+    std::string graphPath = temporaryPath(@"FaceNeighborGraphTests.reload.graph");
+    XCTAssertTrue(small->save(galleryPath));
+    XCTAssertTrue(saved.save(graphPath, *small));
+    FaceGallery loadedGallery;
+    XCTAssertTrue(loadedGallery.load(galleryPath));
+    std::shared_ptr<const FaceGallerySnapshot> snapshot = loadedGallery.snapshot();
+
+    // A long update of another gallery is under way when the graph is loaded.  Whichever way they overlap, the
+    // loaded graph is what's left.
+    data.append(gallery, 200, 2000);
+    gallery.setSequence(3);
+    gallery.publish();
+    FaceNeighborGraph graph;
+    std::thread updater([&graph, &gallery, &scheduler]() {
+        graph.update(gallery.snapshot(), scheduler, NULL);
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    XCTAssertTrue(graph.load(graphPath, snapshot));
+    updater.join();
+
+    XCTAssertEqual(graph.sequence(), (int64_t)2);
+    for ( size_t row = 0; row < snapshot->size(); row++ ) {
+        const std::string & faceID = snapshot->record(row).faceID;
+        XCTAssertTrue(neighborIDs(graph, faceID) == neighborIDs(saved, faceID));
+    }
+    XCTAssertTrue(neighborIDs(graph, FaceTestData::faceID(1000)).empty());
+
+    remove(galleryPath.c_str());
+    remove(graphPath.c_str());
+}
+
+- (void)testIndexSeedsTheCandidates {
+    TaskScheduler scheduler(4);
+    FaceTestData data(20, 5);
+    FaceGallery gallery;
+    data.append(gallery, 0, 600);
+    gallery.publish();
+    std::shared_ptr<const FaceGallerySnapshot> snapshot = gallery.snapshot();
+
+    // Candidates from the index rather than a scan find about as many of the nearest faces.
+    FaceHnswIndex index;
+    XCTAssertTrue(index.update(*snapshot));
+    FaceNeighborGraph graph;
+    XCTAssertTrue(graph.update(snapshot, scheduler, &index));
+    XCTAssertGreaterThanOrEqual(recall(graph, *snapshot), 0.9);
+
+    // Faces the index hasn't caught up with are scanned instead.
+    data.append(gallery, 600, 700);
+    gallery.publish();
+    snapshot = gallery.snapshot();
+    XCTAssertTrue(graph.update(snapshot, scheduler, &index));
+    XCTAssertFalse(neighborIDs(graph, FaceTestData::faceID(650)).empty());
+    XCTAssertGreaterThanOrEqual(recall(graph, *snapshot), 0.85);
+}
+
+- (void)testMutualEdges {
+    TaskScheduler scheduler(4);
+    FaceTestData data(10, 4);
+    FaceGallery gallery;
+    data.append(gallery, 0, 300);
+    gallery.publish();
+
+    FaceNeighborGraph graph;
+    XCTAssertTrue(graph.update(gallery.snapshot(), scheduler, NULL));
+
+    // Each edge joins two faces that are among each other's nearest few, and comes up once.
+    std::vector<std::pair<size_t, size_t>> edges;
+    std::shared_ptr<const FaceGallerySnapshot> snapshot = graph.mutualEdges(4, 1.0e9f, edges);
+    XCTAssertFalse(edges.empty());
+    std::set<std::pair<size_t, size_t>> seen;
+    float longest = 0.0f;
+    for ( size_t i = 0; i < edges.size(); i++ ) {
+        XCTAssertLessThan(edges[i].first, edges[i].second);
+        XCTAssertTrue(seen.insert(edges[i]).second);
+        XCTAssertTrue(isAmongFirst(graph, *snapshot, edges[i].first, 4, edges[i].second));
+        XCTAssertTrue(isAmongFirst(graph, *snapshot, edges[i].second, 4, edges[i].first));
+        longest = std::max(longest, faceDistance(snapshot->descriptor(edges[i].first),
+                                                 snapshot->descriptor(edges[i].second)));
+    }
+
+    // A distance limit keeps only the shorter edges.
+    std::vector<std::pair<size_t, size_t>> shorter;
+    graph.mutualEdges(4, longest / 2, shorter);
+    XCTAssertLessThan(shorter.size(), edges.size());
+    for ( size_t i = 0; i < shorter.size(); i++ ) {
+        XCTAssertTrue(seen.count(shorter[i]) == 1);
+        XCTAssertLessThanOrEqual(faceDistance(snapshot->descriptor(shorter[i].first),
+                                              snapshot->descriptor(shorter[i].second)), longest / 2);
+    }
+}
+
+@end
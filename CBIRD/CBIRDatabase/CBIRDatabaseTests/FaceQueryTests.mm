@@ -0,0 +1,466 @@
+//
+//  FaceQueryTests.mm
+//  CBIRDatabaseTests
+//
+//  Created by Joseph Carson on 10/19/16.
+//  Copyright © 2016 Joseph Carson. All rights reserved.
+//
+
+#import <XCTest/XCTest.h>
+
+#include <algorithm>
+#include <atomic>
+#include <set>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#import "FaceQuery_Private.h"
+#include "FaceDescriptor.hpp"
+#include "FaceTestData.hpp"
+
+using namespace cbir;
+
+static const size_t kGallerySize = 4096;
+
+// Every gallery gets a sequence of its own, as the engine's would after any change, so that a search of one is
+// never served from the search cache for another.
+static int64_t s_nextSequence = 1;
+
+static std::shared_ptr<const FaceGallerySnapshot> testGallery()
+{
+    FaceTestData data(8, 1);
+    FaceGallery gallery;
+    data.append(gallery, 0, kGallerySize);
+    gallery.setSequence(s_nextSequence++);
+    gallery.publish();
+    return gallery.snapshot();
+}
+
+// Faces that all have the same descriptor, so that every distance ties.
+static std::shared_ptr<const FaceGallerySnapshot> tiedGallery(size_t faceCount)
+{
+    std::vector<float> descriptor(kDescriptorLength, 1.0f);
+    FaceGallery gallery;
+    for ( size_t i = 0; i < faceCount; i++ ) {
+        FaceRecord record = FaceRecord();
+        record.faceID = FaceTestData::faceID(i);
+        record.imageDocumentID = FaceTestData::imageID(i);
+        record.thumbnailName = "thumbnail";
+        gallery.append(record, descriptor.data());
+    }
+    gallery.setSequence(s_nextSequence++);
+    gallery.publish();
+    return gallery.snapshot();
+}
+
+// The gallery row of a result.  The test data names face i face<i>, and appends it as row i.
+static size_t resultRow(FaceDataResult * result)
+{
+    return std::stoul(result.faceUUID.UTF8String + 4);
+}
+
+// Lets the search check shouldStop a given number of times, then either cancels or waits out the timeout, so
+// that it always stops at the same point however fast the device is.
+@interface StoppingFaceQuery : FaceQuery
+
+@property (nonatomic) NSUInteger checksBeforeStop;
+@property (nonatomic) BOOL cancelsAtStop;
+
+// How many times shouldStop has been called.
+@property (nonatomic, readonly) NSUInteger checks;
+
+@end
+
+@implementation StoppingFaceQuery
+{
+    std::atomic<NSUInteger> m_checks;
+}
+
+-(BOOL)shouldStop
+{
+    if ( ++m_checks <= self.checksBeforeStop ) {
+        return NO;
+    }
+
+    if ( self.cancelsAtStop ) {
+        [self cancel];
+    }
+    while ( ![super shouldStop] ) {
+        std::this_thread::yield();
+    }
+    return YES;
+}
+
+-(NSUInteger)checks
+{
+    return m_checks.load();
+}
+
+@end
+
+// Collects the results that a range search streams.
+@interface MatchCollector : NSObject <CBIRQueryDelegate>
+
+@property (nonatomic, readonly) NSMutableArray<FaceDataResult *> * matches;
+
+@end
+
+@implementation MatchCollector
+
+-(instancetype)init
+{
+    self = [super init];
+    if ( self ) {
+        _matches = [[NSMutableArray alloc] init];
+    }
+    return self;
+}
+
+-(void)resultFound:(id)result
+{
+    @synchronized(self) {
+        [_matches addObject:result];
+    }
+}
+
+@end
+
+@interface FaceQueryTests : XCTestCase
+
+@end
+
+@implementation FaceQueryTests
+
+// Dequeues all of the query's results, checking that they come out nearest first and with the right distances.
+- (NSUInteger)dequeueResults:(FaceQuery *)query gallery:(const FaceGallerySnapshot &)gallery probe:(const float *)probe {
+    NSUInteger count = 0;
+    CGFloat previous = -1.0;
+    FaceDataResult * result = nil;
+    while ( (result = [query dequeueResult]) ) {
+        size_t row = resultRow(result);
+        XCTAssertLessThan(row, gallery.size());
+        XCTAssertEqualWithAccuracy(result.differenceSum, faceDistance(probe, gallery.descriptor(row)), 1e-3);
+        XCTAssertGreaterThanOrEqual(result.differenceSum, previous);
+        previous = result.differenceSum;
+        count++;
+    }
+    return count;
+}
+
+- (void)testSearchKeepsNearestFaces {
+    std::shared_ptr<const FaceGallerySnapshot> gallery = testGallery();
+    const float * probe = gallery->descriptor(7);
+
+    FaceQuery * query = [[FaceQuery alloc] initWithDescriptor:probe gallery:gallery andDelegate:nil];
+    query.maxResults = 50;
+    query.exhaustive = YES;
+    [query evaluate];
+    XCTAssertEqual(query.state, QUERY_COMPLETE);
+    XCTAssertFalse(query.isPartial);
+
+    // The slow way.
+    std::vector<std::pair<float, size_t>> all;
+    for ( size_t row = 0; row < gallery->size(); row++ ) {
+        all.push_back(std::make_pair(faceDistance(probe, gallery->descriptor(row)), row));
+    }
+    std::sort(all.begin(), all.end());
+
+    FaceDataResult * result = nil;
+    size_t rank = 0;
+    while ( (result = [query dequeueResult]) ) {
+        XCTAssertLessThan(rank, (size_t)50);
+        XCTAssertEqual(resultRow(result), all[rank].second);
+        XCTAssertEqualWithAccuracy(result.differenceSum, all[rank].first, 1e-3);
+        rank++;
+    }
+    XCTAssertEqual(rank, (size_t)50);
+}
+
+- (void)testPagesContinueTheRanking {
+    std::shared_ptr<const FaceGallerySnapshot> gallery = testGallery();
+    const float * probe = gallery->descriptor(7);
+
+    FaceQuery * query = [[FaceQuery alloc] initWithDescriptor:probe gallery:gallery andDelegate:nil];
+    query.maxResults = 20;
+    query.exhaustive = YES;
+    [query evaluate];
+    XCTAssertEqual(query.resultCount, (NSUInteger)kGallerySize);
+
+    std::vector<std::pair<float, size_t>> all;
+    for ( size_t row = 0; row < gallery->size(); row++ ) {
+        all.push_back(std::make_pair(faceDistance(probe, gallery->descriptor(row)), row));
+    }
+    std::sort(all.begin(), all.end());
+
+    // Pages well past the faces the search ranked itself, in odd sizes, pick up where the last one left off.
+    NSUInteger offset = 0;
+    for ( NSUInteger limit = 7; offset < 300; limit += 11 ) {
+        NSArray * page = [query resultsAtOffset:offset limit:limit];
+        XCTAssertEqual(page.count, limit);
+        for ( NSUInteger i = 0; i < page.count; i++ ) {
+            XCTAssertEqual(resultRow(page[i]), all[offset + i].second);
+        }
+        offset += limit;
+    }
+
+    // Going back gives the same page, and dequeueing walks the same ranking.
+    NSArray * again = [query resultsAtOffset:30 limit:5];
+    for ( NSUInteger i = 0; i < again.count; i++ ) {
+        XCTAssertEqual(resultRow(again[i]), all[30 + i].second);
+    }
+    XCTAssertEqual(resultRow([query dequeueResult]), all[0].second);
+    XCTAssertEqual(resultRow([query dequeueResult]), all[1].second);
+
+    // The last page is short, and there's nothing past it.
+    XCTAssertEqual([query resultsAtOffset:kGallerySize - 3 limit:10].count, (NSUInteger)3);
+    XCTAssertEqual([query resultsAtOffset:kGallerySize limit:10].count, (NSUInteger)0);
+}
+
+- (void)testTiesAreOrderedByFaceID {
+    std::shared_ptr<const FaceGallerySnapshot> gallery = tiedGallery(50);
+    std::vector<std::string> faceIDs;
+    for ( size_t i = 0; i < 50; i++ ) {
+        faceIDs.push_back(FaceTestData::faceID(i));
+    }
+    std::sort(faceIDs.begin(), faceIDs.end());
+
+    // Every run pages through the faces in the same order, past the faces the search ranked itself too.
+    for ( int run = 0; run < 3; run++ ) {
+        FaceQuery * query = [[FaceQuery alloc] initWithDescriptor:gallery->descriptor(0) gallery:gallery andDelegate:nil];
+        query.maxResults = 7;
+        [query evaluate];
+
+        for ( NSUInteger offset = 0; offset < 50; offset += 7 ) {
+            NSArray * page = [query resultsAtOffset:offset limit:7];
+            XCTAssertEqual(page.count, MIN((NSUInteger)7, 50 - offset));
+            for ( NSUInteger i = 0; i < page.count; i++ ) {
+                XCTAssertEqualObjects([page[i] faceUUID], @(faceIDs[offset + i].c_str()));
+            }
+        }
+    }
+}
+
+- (void)testDistinctImagesKeepsNearestFaceOfEach {
+    std::shared_ptr<const FaceGallerySnapshot> gallery = testGallery();
+    const float * probe = gallery->descriptor(7);
+
+    FaceQuery * query = [[FaceQuery alloc] initWithDescriptor:probe gallery:gallery andDelegate:nil];
+    query.maxResults = 20;
+    query.distinctImages = YES;
+    query.exhaustive = YES;
+    [query evaluate];
+    XCTAssertEqual(query.resultCount, (NSUInteger)kGallerySize / 2);
+
+    // The slow way.  The test data puts faces 2i and 2i + 1 in the same image.
+    std::vector<std::pair<float, size_t>> nearestOfEachImage;
+    for ( size_t row = 0; row < gallery->size(); row += 2 ) {
+        float a = faceDistance(probe, gallery->descriptor(row));
+        float b = faceDistance(probe, gallery->descriptor(row + 1));
+        nearestOfEachImage.push_back(a <= b ? std::make_pair(a, row) : std::make_pair(b, row + 1));
+    }
+    std::sort(nearestOfEachImage.begin(), nearestOfEachImage.end());
+
+    // Past the images the search ranked itself too, without any image coming up twice.
+    NSArray * results = [query resultsAtOffset:0 limit:100];
+    XCTAssertEqual(results.count, (NSUInteger)100);
+    for ( NSUInteger i = 0; i < results.count; i++ ) {
+        XCTAssertEqual(resultRow(results[i]), nearestOfEachImage[i].second);
+    }
+}
+
+- (void)testCoarseStagePicksCandidates {
+    std::shared_ptr<const FaceGallerySnapshot> gallery = testGallery();
+    const float * probe = gallery->descriptor(7);
+
+    // Twenty results make for five hundred candidates, the fewest there ever are.
+    FaceQuery * query = [[FaceQuery alloc] initWithDescriptor:probe gallery:gallery andDelegate:nil];
+    query.maxResults = 20;
+    [query evaluate];
+    XCTAssertEqual(query.resultCount, (NSUInteger)500);
+
+    // The slow way.  The candidates are the nearest by coarse distance, then they're ranked by full distance.
+    std::vector<float> coarseProbe(kCoarseDescriptorLength);
+    coarsenDescriptor(probe, coarseProbe.data());
+    std::vector<std::pair<float, size_t>> coarse;
+    for ( size_t row = 0; row < gallery->size(); row++ ) {
+        coarse.push_back(std::make_pair(coarseFaceDistance(coarseProbe.data(), gallery->coarseDescriptor(row)), row));
+    }
+    std::sort(coarse.begin(), coarse.end());
+
+    std::vector<std::pair<float, size_t>> candidates;
+    for ( size_t i = 0; i < 500; i++ ) {
+        size_t row = coarse[i].second;
+        candidates.push_back(std::make_pair(faceDistance(probe, gallery->descriptor(row)), row));
+    }
+    std::sort(candidates.begin(), candidates.end());
+
+    NSArray * results = [query resultsAtOffset:0 limit:500];
+    XCTAssertEqual(results.count, (NSUInteger)500);
+    for ( NSUInteger i = 0; i < results.count; i++ ) {
+        XCTAssertEqual(resultRow(results[i]), candidates[i].second);
+        XCTAssertEqualWithAccuracy([results[i] differenceSum], candidates[i].first, 1e-3);
+    }
+
+    // On faces like these the coarse stage doesn't lose any of the nearest, so a full scan agrees on the first page.
+    FaceQuery * exhaustive = [[FaceQuery alloc] initWithDescriptor:probe gallery:gallery andDelegate:nil];
+    exhaustive.maxResults = 20;
+    exhaustive.exhaustive = YES;
+    [exhaustive evaluate];
+    XCTAssertEqual(exhaustive.resultCount, (NSUInteger)kGallerySize);
+    NSArray * expected = [exhaustive resultsAtOffset:0 limit:20];
+    for ( NSUInteger i = 0; i < expected.count; i++ ) {
+        XCTAssertEqualObjects([results[i] faceUUID], [expected[i] faceUUID]);
+    }
+}
+
+- (void)testRepeatSearchesAreCached {
+    std::shared_ptr<const FaceGallerySnapshot> gallery = testGallery();
+    const float * probe = gallery->descriptor(7);
+
+    FaceQuery * first = [[FaceQuery alloc] initWithDescriptor:probe gallery:gallery andDelegate:nil];
+    [first evaluate];
+    NSArray * expected = [first resultsAtOffset:0 limit:150];
+
+    // The same search of the same gallery doesn't score a single face, and pages through the same results.
+    StoppingFaceQuery * repeat = [[StoppingFaceQuery alloc] initWithDescriptor:probe gallery:gallery andDelegate:nil];
+    repeat.checksBeforeStop = NSUIntegerMax;
+    [repeat evaluate];
+    XCTAssertEqual(repeat.checks, (NSUInteger)0);
+    XCTAssertEqual(repeat.resultCount, first.resultCount);
+    NSArray * results = [repeat resultsAtOffset:0 limit:150];
+    XCTAssertEqual(results.count, expected.count);
+    for ( NSUInteger i = 0; i < results.count; i++ ) {
+        XCTAssertEqualObjects([results[i] faceUUID], [expected[i] faceUUID]);
+    }
+
+    // Different options, or a gallery that's moved on, make for a new search.
+    StoppingFaceQuery * distinct = [[StoppingFaceQuery alloc] initWithDescriptor:probe gallery:gallery andDelegate:nil];
+    distinct.checksBeforeStop = NSUIntegerMax;
+    distinct.distinctImages = YES;
+    [distinct evaluate];
+    XCTAssertGreaterThan(distinct.checks, (NSUInteger)0);
+
+    StoppingFaceQuery * changed = [[StoppingFaceQuery alloc] initWithDescriptor:probe gallery:testGallery() andDelegate:nil];
+    changed.checksBeforeStop = NSUIntegerMax;
+    [changed evaluate];
+    XCTAssertGreaterThan(changed.checks, (NSUInteger)0);
+}
+
+- (void)testRangeSearchFindsEveryFaceWithinThreshold {
+    std::shared_ptr<const FaceGallerySnapshot> gallery = testGallery();
+    const float * probe = gallery->descriptor(7);
+
+    std::vector<std::pair<float, size_t>> all;
+    for ( size_t row = 0; row < gallery->size(); row++ ) {
+        all.push_back(std::make_pair(faceDistance(probe, gallery->descriptor(row)), row));
+    }
+    std::sort(all.begin(), all.end());
+
+    // Halfway between the 200th and 201st nearest, so that exactly 200 faces are in range.
+    MatchCollector * collector = [[MatchCollector alloc] init];
+    FaceQuery * query = [[FaceQuery alloc] initWithDescriptor:probe gallery:gallery andDelegate:collector];
+    query.distanceThreshold = (all[199].first + all[200].first) / 2;
+    [query evaluate];
+
+    XCTAssertEqual(query.state, QUERY_COMPLETE);
+    XCTAssertEqual(collector.matches.count, (NSUInteger)200);
+    XCTAssertEqual(query.resultCount, (NSUInteger)200);
+
+    // Streamed in any order, but ranked once complete, with the full distances.
+    std::set<size_t> streamed;
+    for ( FaceDataResult * match in collector.matches ) {
+        streamed.insert(resultRow(match));
+    }
+    NSArray * results = [query resultsAtOffset:0 limit:500];
+    XCTAssertEqual(results.count, (NSUInteger)200);
+    for ( NSUInteger i = 0; i < results.count; i++ ) {
+        XCTAssertEqual(resultRow(results[i]), all[i].second);
+        XCTAssertEqualWithAccuracy([results[i] differenceSum], all[i].first, 1e-3);
+        XCTAssertEqual(streamed.count(all[i].second), (size_t)1);
+    }
+}
+
+- (void)testMatchLimitStopsTheScan {
+    std::shared_ptr<const FaceGallerySnapshot> gallery = testGallery();
+    const float * probe = gallery->descriptor(7);
+
+    std::vector<float> distances;
+    for ( size_t row = 0; row < gallery->size(); row++ ) {
+        distances.push_back(faceDistance(probe, gallery->descriptor(row)));
+    }
+    std::sort(distances.begin(), distances.end());
+
+    // A quarter of the faces are in range, but the first one found is enough.
+    MatchCollector * collector = [[MatchCollector alloc] init];
+    StoppingFaceQuery * query = [[StoppingFaceQuery alloc] initWithDescriptor:probe gallery:gallery andDelegate:collector];
+    query.checksBeforeStop = NSUIntegerMax;
+    query.distanceThreshold = distances[kGallerySize / 4];
+    query.matchLimit = 1;
+    [query evaluate];
+
+    XCTAssertEqual(query.state, QUERY_COMPLETE);
+    XCTAssertEqual(collector.matches.count, (NSUInteger)1);
+    XCTAssertEqual(query.resultCount, (NSUInteger)1);
+    XCTAssertLessThanOrEqual([[query resultsAtOffset:0 limit:10].firstObject differenceSum], query.distanceThreshold);
+
+    // Every chunk gives up as soon as the match turns up, rather than scanning the rest of the gallery.
+    XCTAssertLessThan(query.checks, kGallerySize / 4);
+}
+
+- (void)testDeadlineGivesPartialResults {
+    std::shared_ptr<const FaceGallerySnapshot> gallery = testGallery();
+    const float * probe = gallery->descriptor(7);
+
+    StoppingFaceQuery * query = [[StoppingFaceQuery alloc] initWithDescriptor:probe gallery:gallery andDelegate:nil];
+    query.checksBeforeStop = 300;
+    query.timeout = 0.05;
+    query.exhaustive = YES;
+    [query evaluate];
+
+    // Running out of time still completes, with whatever was scored by then.
+    XCTAssertEqual(query.state, QUERY_COMPLETE);
+    XCTAssertTrue(query.isPartial);
+    NSUInteger count = [self dequeueResults:query gallery:*gallery probe:probe];
+    XCTAssertGreaterThan(count, (NSUInteger)0);
+    XCTAssertLessThanOrEqual(count, query.checksBeforeStop);
+}
+
+- (void)testDeadlineDuringCoarseStageGivesNoResults {
+    std::shared_ptr<const FaceGallerySnapshot> gallery = testGallery();
+    const float * probe = gallery->descriptor(7);
+
+    // The coarse stage looks at every face, so it's the one that runs out of time.
+    StoppingFaceQuery * query = [[StoppingFaceQuery alloc] initWithDescriptor:probe gallery:gallery andDelegate:nil];
+    query.checksBeforeStop = 300;
+    query.timeout = 0.05;
+    [query evaluate];
+
+    // Nothing was fully scored, so there's nothing to return, but the query still completes.
+    XCTAssertEqual(query.state, QUERY_COMPLETE);
+    XCTAssertTrue(query.isPartial);
+    XCTAssertEqual(query.resultCount, (NSUInteger)0);
+    XCTAssertNil([query dequeueResult]);
+    XCTAssertLessThan(query.checks, (NSUInteger)kGallerySize);
+}
+
+- (void)testCancelStopsScoringRightAway {
+    std::shared_ptr<const FaceGallerySnapshot> gallery = testGallery();
+    const float * probe = gallery->descriptor(7);
+
+    StoppingFaceQuery * query = [[StoppingFaceQuery alloc] initWithDescriptor:probe gallery:gallery andDelegate:nil];
+    query.checksBeforeStop = 300;
+    query.cancelsAtStop = YES;
+    query.exhaustive = YES;
+    [query evaluate];
+
+    XCTAssertEqual(query.state, QUERY_CANCEL);
+    XCTAssertFalse(query.isPartial);
+    XCTAssertNil([query dequeueResult]);
+
+    // Each chunk of work gives up at its next check rather than scoring the rest of its faces.
+    XCTAssertLessThan(query.checks, query.checksBeforeStop + kGallerySize / 16);
+}
+
+@end
@@ -0,0 +1,101 @@
+//
+//  FaceSearchCacheTests.mm
+//  CBIRDatabaseTests
+//
+//  Created by Joseph Carson on 10/19/16.
+//  Copyright © 2016 Joseph Carson. All rights reserved.
+//
+
+#import <XCTest/XCTest.h>
+
+#include <vector>
+
+#include "FaceSearchCache.hpp"
+
+using namespace cbir;
+
+// A search of an empty snapshot at the given sequence.
+static std::shared_ptr<const CachedFaceSearch> searchAt(int64_t sequence)
+{
+    std::shared_ptr<CachedFaceSearch> search = std::make_shared<CachedFaceSearch>();
+    search->gallery = std::make_shared<FaceGallerySnapshot>(std::vector<std::shared_ptr<const FaceGallerySegment>>(),
+                                                            std::vector<bool>(), 0, sequence, 0);
+    search->resultCount = 0;
+    return search;
+}
+
+@interface FaceSearchCacheTests : XCTestCase
+
+@end
+
+@implementation FaceSearchCacheTests
+
+- (void)testFindsSearchesAtTheirSequence {
+    FaceSearchCache cache;
+    std::shared_ptr<const CachedFaceSearch> search = searchAt(5);
+    cache.insert(1, search);
+
+    XCTAssertTrue(cache.find(1, 5) == search);
+    XCTAssertTrue(cache.find(2, 5) == NULL);
+
+    // Once the gallery has moved on, the search is dropped for good.
+    XCTAssertTrue(cache.find(1, 6) == NULL);
+    XCTAssertTrue(cache.find(1, 5) == NULL);
+}
+
+- (void)testNewerSearchesDropOlderOnes {
+    FaceSearchCache cache;
+    cache.insert(1, searchAt(5));
+    cache.insert(2, searchAt(5));
+    cache.insert(3, searchAt(6));
+
+    XCTAssertTrue(cache.find(1, 5) == NULL);
+    XCTAssertTrue(cache.find(2, 5) == NULL);
+    XCTAssertTrue(cache.find(3, 6) != NULL);
+}
+
+- (void)testEvictsLeastRecentlyUsed {
+    FaceSearchCache cache(2);
+    cache.insert(1, searchAt(5));
+    cache.insert(2, searchAt(5));
+
+    // Using 1 makes 2 the least recently used.
+    XCTAssertTrue(cache.find(1, 5) != NULL);
+    cache.insert(3, searchAt(5));
+
+    XCTAssertTrue(cache.find(1, 5) != NULL);
+    XCTAssertTrue(cache.find(2, 5) == NULL);
+    XCTAssertTrue(cache.find(3, 5) != NULL);
+
+    cache.clear();
+    XCTAssertTrue(cache.find(1, 5) == NULL);
+}
+
+- (void)testFingerprintIgnoresRoundingNoise {
+    std::vector<float> descriptor;
+    for ( int i = 0; i < 64; i++ ) {
+        descriptor.push_back(i * 0.37f + 0.01f);
+    }
+    std::vector<float> noisy = descriptor;
+    for ( size_t i = 0; i < noisy.size(); i++ ) {
+        noisy[i] += (i % 2) ? 0.001f : -0.001f;
+    }
+    std::vector<float> different = descriptor;
+    different[10] += 0.5f;
+
+    SearchFingerprint a, b, c, d;
+    a.add(7);
+    a.addQuantised(descriptor.data(), descriptor.size());
+    b.add(7);
+    b.addQuantised(noisy.data(), noisy.size());
+    c.add(7);
+    c.addQuantised(different.data(), different.size());
+    d.add(8);
+    d.addQuantised(descriptor.data(), descriptor.size());
+
+    XCTAssertEqual(a.value(), b.value());
+    XCTAssertNotEqual(a.value(), c.value());
+    XCTAssertNotEqual(a.value(), d.value());
+}
+
+@end
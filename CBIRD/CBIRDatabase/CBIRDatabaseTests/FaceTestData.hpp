@@ -0,0 +1,88 @@
+//
+//  FaceTestData.hpp
+//  CBIRDatabaseTests
+//
+//  Created by Joseph Carson on 10/19/16.
+//  Copyright © 2016 Joseph Carson. All rights reserved.
+//
+
+#ifndef FaceTestData_hpp
+#define FaceTestData_hpp
+
+#include <algorithm>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "FaceDescriptor.hpp"
+#include "FaceGallery.hpp"
+
+namespace cbir {
+
+// Made up faces for the tests.  Descriptors are scattered around a handful of identities, so that a face's
+// nearest neighbours are mostly faces of the same identity, as they would be with real faces.  The same seed
+// always makes the same faces.
+class FaceTestData
+{
+public:
+
+    FaceTestData(size_t identityCount, unsigned seed)
+        : m_random(seed)
+        , m_identities(identityCount, std::vector<float>(kDescriptorLength))
+    {
+        std::uniform_real_distribution<float> bin(0.0f, 10.0f);
+        for ( size_t i = 0; i < m_identities.size(); i++ ) {
+            for ( size_t j = 0; j < kDescriptorLength; j++ ) {
+                m_identities[i][j] = bin(m_random);
+            }
+        }
+    }
+
+    // Face i is in image i / 2, so that removing an image removes two faces.
+    static std::string faceID(size_t i) { return "face" + std::to_string(i); }
+    static std::string imageID(size_t i) { return "image" + std::to_string(i / 2); }
+
+    // Appends faces from through to - 1.
+    void append(FaceGallery & gallery, size_t from, size_t to)
+    {
+        std::uniform_int_distribution<size_t> identity(0, m_identities.size() - 1);
+        std::uniform_real_distribution<float> noise(-2.0f, 2.0f);
+        std::vector<float> descriptor(kDescriptorLength);
+
+        for ( size_t i = from; i < to; i++ ) {
+            const std::vector<float> & centre = m_identities[identity(m_random)];
+            for ( size_t j = 0; j < kDescriptorLength; j++ ) {
+                descriptor[j] = std::max(0.0f, centre[j] + noise(m_random));
+            }
+
+            FaceRecord record;
+            record.faceID = faceID(i);
+            record.imageDocumentID = imageID(i);
+            record.thumbnailName = "thumbnail";
+            record.rect[0] = (float)i;
+            record.rect[1] = 0.0f;
+            record.rect[2] = 64.0f;
+            record.rect[3] = 64.0f;
+            gallery.append(record, descriptor.data());
+        }
+    }
+
+    // Removes every other image of faces from through to - 1, and returns how many faces went.
+    static size_t removeEveryOtherImage(FaceGallery & gallery, size_t from, size_t to)
+    {
+        size_t removed = 0;
+        for ( size_t i = from; i < to; i += 4 ) {
+            removed += gallery.removeImage(imageID(i));
+        }
+        return removed;
+    }
+
+private:
+
+    std::mt19937 m_random;
+    std::vector<std::vector<float>> m_identities;
+};
+
+}
+
+#endif /* FaceTestData_hpp */
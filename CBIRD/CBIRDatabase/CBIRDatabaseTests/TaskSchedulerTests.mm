@@ -0,0 +1,145 @@
+//
+//  TaskSchedulerTests.mm
+//  CBIRDatabaseTests
+//
+//  Created by Joseph Carson on 10/19/16.
+//  Copyright © 2016 Joseph Carson. All rights reserved.
+//
+
+#import <XCTest/XCTest.h>
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "TaskScheduler.hpp"
+
+using namespace cbir;
+
+@interface TaskSchedulerTests : XCTestCase
+
+@end
+
+@implementation TaskSchedulerTests
+
+- (void)testParallelForCoversRangeOnce {
+    TaskScheduler scheduler(4);
+
+    std::vector<std::atomic<int>> counts(10000);
+    for ( size_t i = 0; i < counts.size(); i++ ) {
+        counts[i] = 0;
+    }
+
+    parallelFor(scheduler, 10, counts.size(), 37, [&counts](size_t begin, size_t end) {
+        for ( size_t i = begin; i < end; i++ ) {
+            counts[i]++;
+        }
+    });
+
+    for ( size_t i = 0; i < counts.size(); i++ ) {
+        XCTAssertEqual(counts[i].load(), i < 10 ? 0 : 1);
+    }
+}
+
+- (void)testNestedParallelForFinishes {
+    // Fewer workers than outer tasks, so that waiting workers have to help with the inner ones.
+    TaskScheduler scheduler(2);
+    std::atomic<size_t> total(0);
+
+    parallelFor(scheduler, 0, 16, 1, [&scheduler, &total](size_t, size_t) {
+        parallelFor(scheduler, 0, 1000, 10, [&total](size_t begin, size_t end) {
+            total += end - begin;
+        });
+    });
+
+    XCTAssertEqual(total.load(), (size_t)16000);
+}
+
+- (void)testTasksInheritPriority {
+    TaskScheduler scheduler(2);
+    XCTAssertEqual(scheduler.currentPriority(), kPriorityNormal);
+
+    std::atomic<int> outer(-1);
+    std::atomic<int> inner(-1);
+    std::atomic<bool> done(false);
+
+    scheduler.submit([&]() {
+        outer = scheduler.currentPriority();
+        TaskGroup group(scheduler);
+        group.run([&]() {
+            inner = scheduler.currentPriority();
+        });
+        group.wait();
+        done = true;
+    }, kPriorityInteractive);
+
+    while ( !done ) {
+        scheduler.runPendingTask();
+    }
+
+    XCTAssertEqual(outer.load(), (int)kPriorityInteractive);
+    XCTAssertEqual(inner.load(), (int)kPriorityInteractive);
+}
+
+- (void)testHelpingSkipsLessUrgentTasks {
+    TaskScheduler scheduler(1);
+    std::atomic<bool> started(false);
+    std::atomic<bool> release(false);
+    std::atomic<int> count(0);
+
+    // Keep the only worker busy so that the background task stays queued.
+    scheduler.submit([&]() {
+        started = true;
+        while ( !release ) {
+            std::this_thread::yield();
+        }
+    });
+    while ( !started ) {
+        std::this_thread::yield();
+    }
+
+    scheduler.submit([&count]() {
+        count++;
+    }, kPriorityBackground);
+
+    XCTAssertFalse(scheduler.runPendingTask());
+    {
+        TaskScheduler::PriorityScope scope(scheduler, kPriorityInteractive);
+        XCTAssertEqual(scheduler.currentPriority(), kPriorityInteractive);
+        XCTAssertFalse(scheduler.runPendingTask());
+    }
+    {
+        TaskScheduler::PriorityScope scope(scheduler, kPriorityBackground);
+        XCTAssertTrue(scheduler.runPendingTask());
+    }
+    XCTAssertEqual(scheduler.currentPriority(), kPriorityNormal);
+    XCTAssertEqual(count.load(), 1);
+
+    release = true;
+}
+
+- (void)testShutdownRunsQueuedTasks {
+    TaskScheduler scheduler(2);
+    std::atomic<int> count(0);
+
+    for ( int i = 0; i < 100; i++ ) {
+        scheduler.submit([&count]() {
+            count++;
+        }, kPriorityBackground);
+    }
+    scheduler.shutdown();
+    XCTAssertEqual(count.load(), 100);
+}
+
+- (void)testTasksSubmittedAfterShutdownRunOnTheCaller {
+    TaskScheduler scheduler(2);
+    scheduler.shutdown();
+
+    std::thread::id ranOn;
+    scheduler.submit([&ranOn]() {
+        ranOn = std::this_thread::get_id();
+    }, kPriorityBackground);
+    XCTAssertTrue(ranOn == std::this_thread::get_id());
+}
+
+@end
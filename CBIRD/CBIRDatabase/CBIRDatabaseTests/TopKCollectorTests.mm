@@ -0,0 +1,149 @@
+//
+//  TopKCollectorTests.mm
+//  CBIRDatabaseTests
+//
+//  Created by Joseph Carson on 10/19/16.
+//  Copyright © 2016 Joseph Carson. All rights reserved.
+//
+
+#import <XCTest/XCTest.h>
+
+#include <math.h>
+
+#include <algorithm>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "TopKCollector.hpp"
+
+using namespace cbir;
+
+// Distances with plenty of ties, so that the tie break matters.
+static std::vector<float> randomDistances(size_t count, unsigned seed)
+{
+    std::mt19937 random(seed);
+    std::uniform_int_distribution<int> distance(0, 200);
+    std::vector<float> distances(count);
+    for ( size_t i = 0; i < count; i++ ) {
+        distances[i] = (float)distance(random);
+    }
+    return distances;
+}
+
+// The k nearest rows the slow way.
+static std::vector<ScoredRow> nearest(const std::vector<float> & distances, size_t k)
+{
+    std::vector<ScoredRow> all;
+    for ( size_t i = 0; i < distances.size(); i++ ) {
+        ScoredRow entry = { distances[i], i };
+        all.push_back(entry);
+    }
+    std::sort(all.begin(), all.end(), [](const ScoredRow & a, const ScoredRow & b) {
+        return a.distance < b.distance || (a.distance == b.distance && a.row < b.row);
+    });
+    all.resize(std::min(k, all.size()));
+    return all;
+}
+
+static bool sameRows(const std::vector<ScoredRow> & a, const std::vector<ScoredRow> & b)
+{
+    if ( a.size() != b.size() ) {
+        return false;
+    }
+    for ( size_t i = 0; i < a.size(); i++ ) {
+        if ( a[i].row != b[i].row || a[i].distance != b[i].distance ) {
+            return false;
+        }
+    }
+    return true;
+}
+
+@interface TopKCollectorTests : XCTestCase
+
+@end
+
+@implementation TopKCollectorTests
+
+- (void)testKeepsNearestRows {
+    std::vector<float> distances = randomDistances(5000, 1);
+
+    // Sorted array and heap.
+    const size_t capacities[] = { 1, 5, TopKCollector::kSmallCapacity, 100, 6000 };
+    for ( size_t c = 0; c < sizeof(capacities) / sizeof(capacities[0]); c++ ) {
+        TopKCollector collector(capacities[c]);
+        for ( size_t i = 0; i < distances.size(); i++ ) {
+            collector.add(distances[i], i);
+        }
+
+        std::vector<ScoredRow> expected = nearest(distances, capacities[c]);
+        XCTAssertTrue(sameRows(collector.sorted(), expected));
+        if ( collector.isFull() ) {
+            XCTAssertEqual(collector.worstDistance(), expected.back().distance);
+        }
+    }
+}
+
+- (void)testMergeMatchesOneCollector {
+    std::vector<float> distances = randomDistances(3000, 2);
+
+    const size_t capacities[] = { 10, 50 };
+    for ( size_t c = 0; c < sizeof(capacities) / sizeof(capacities[0]); c++ ) {
+        // Split the rows up unevenly, as a parallel scan would.
+        std::vector<TopKCollector> parts(3, TopKCollector(capacities[c]));
+        for ( size_t i = 0; i < distances.size(); i++ ) {
+            parts[i < 100 ? 0 : (i < 2000 ? 1 : 2)].add(distances[i], i);
+        }
+
+        TopKCollector merged(capacities[c]);
+        for ( size_t p = parts.size(); p-- > 0; ) {
+            merged.merge(parts[p]);
+        }
+        XCTAssertTrue(sameRows(merged.sorted(), nearest(distances, capacities[c])));
+    }
+}
+
+- (void)testTieBreak {
+    // Later rows win ties.
+    TopKCollector collector(3, [](size_t a, size_t b) { return a > b; });
+    for ( size_t i = 0; i < 10; i++ ) {
+        collector.add(1.0f, i);
+    }
+
+    std::vector<ScoredRow> sorted = collector.sorted();
+    XCTAssertEqual(sorted.size(), (size_t)3);
+    XCTAssertEqual(sorted[0].row, (size_t)9);
+    XCTAssertEqual(sorted[1].row, (size_t)8);
+    XCTAssertEqual(sorted[2].row, (size_t)7);
+}
+
+- (void)testGroupsKeepTheirNearestRow {
+    std::vector<float> distances = randomDistances(2000, 3);
+
+    // Five rows to a group.
+    std::vector<std::string> groups;
+    for ( size_t i = 0; i < distances.size(); i++ ) {
+        groups.push_back("group" + std::to_string(i / 5));
+    }
+    TopKCollector::GroupKey groupKey = [&groups](size_t row) -> const std::string & { return groups[row]; };
+
+    TopKCollector collector(20, TopKCollector::TieBreak(), groupKey);
+    for ( size_t i = 0; i < distances.size(); i++ ) {
+        collector.add(distances[i], i);
+    }
+
+    // The slow way: the nearest row of each group, then the nearest groups.
+    std::vector<float> groupDistances(distances.size(), INFINITY);
+    for ( size_t group = 0; group < distances.size() / 5; group++ ) {
+        size_t best = group * 5;
+        for ( size_t i = group * 5 + 1; i < group * 5 + 5; i++ ) {
+            if ( distances[i] < distances[best] ) {
+                best = i;
+            }
+        }
+        groupDistances[best] = distances[best];
+    }
+    XCTAssertTrue(sameRows(collector.sorted(), nearest(groupDistances, 20)));
+}
+
+@end